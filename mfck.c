@@ -4,6 +4,10 @@
 **  Copyright (c) 2008-2019 by Lennart Lovstrand <mfck@lenlolabs.com>
 */
 
+#ifdef __linux__
+#  define _GNU_SOURCE		// For syncfs
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -22,7 +26,30 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <limits.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#ifdef __linux__
+#  include <malloc.h>		// For malloc_usable_size
+#  include <linux/fs.h>		// For FICLONE
+#  if defined(__GLIBC__) && __GLIBC_PREREQ(2, 27)
+#    define HAVE_COPY_FILE_RANGE
+#  endif
+#  include <sys/inotify.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#endif
+
+#ifdef USE_THREADS
+#  include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
 #ifdef USE_READLINE
 #  include <readline/readline.h>
@@ -30,6 +57,7 @@
 #endif
 
 #include "md5.h"
+#include "mfck.h"
 
 #ifdef USE_GC
 #  ifdef DEBUG
@@ -41,12 +69,39 @@
 #  define free					GC_FREE
 #endif
 
+// How much memory an allocated block really takes up (or 0 if we
+// can't tell, which leaves --max-memory with nothing to go on)
+//
+#if defined(USE_GC)
+#  define Memory_BlockSize(mem)			0
+#elif defined(__linux__)
+#  define Memory_BlockSize(mem)			malloc_usable_size(mem)
+#elif defined(__APPLE__)
+#  include <malloc/malloc.h>
+#  define Memory_BlockSize(mem)			malloc_size(mem)
+#else
+#  define Memory_BlockSize(mem)			0
+#endif
+
 #include "vers.h"
 
+// When built as a library (or loading mailboxes in the background),
+// anything that changes while parsing or checking is kept per thread
+//
+#if defined(MFCK_LIBRARY) || defined(USE_THREADS)
+#  define ThreadLocal				_Thread_local
+#else
+#  define ThreadLocal
+#endif
+
 #define OPT_FUZZY_NEWLINE
 #define OPT_LOCK_FILE
 
 #define kCheck_MaxWarnCount			5
+#define kMessage_DecodedHeaders			3 // From:, Subject: & To:
+#define kMIME_MaxDepth				32 // nested multiparts
+#define kMIME_MaxBoundaryLength			70
+#define kMIME_MaxLineLength			76
 #define kContext_LineCount			2 // before & after
 
 #define kArray_InitialSize			32
@@ -68,6 +123,51 @@
 
 #define kDefaultLockTimeout			5	// sec
 
+#define kUndo_Magic				"mfck-undo"
+#define kDefaultSyncBatchSize			256
+#define kSalvage_BlockSize			64
+#define kSalvage_MaxBinary			4 // per block of text
+#define kDefaultWatchInterval			2 // seconds
+#define kWatch_MaxChecksPerRound		32
+#define kWatch_MarkLength			512
+#define kWatch_SocketTimeout			1000 // msecs
+#define kFilter_BufferSize			65536
+#define kLoad_MinBackgroundSize			(1024*1024)
+#define kLoad_BatchSize				256 // messages
+#define kMemory_ParseOverhead			1.2 // per byte of small messages
+#define kMemory_WindowSize			(1024*1024)
+#define kDiff_ContextLines			3
+#define kDiff_MaxEdits				1000
+#define kPager_BufferSize			(64*1024)
+#define kRun_MaxJobs				256
+#define kRun_ReapInterval			10 // msecs
+#define kWindow_DefaultSize			(8*1024*1024)
+#define kStats_InitialTableSize			256
+#define kStats_SizeBuckets			16 // 1KB, 2KB, ... 16MB, more
+#define kStats_TopCount				10 // largest messages
+#define kStats_TopEntries			20 // senders, lists & types
+#define kMerge_InitialFingerprints		1024
+#define kExpire_MaxLineLength			1024
+#define kStrip_MaxDepth				32 // nested multiparts
+#define kBurst_MaxThreads			8
+#define kBurst_BatchSize			64 // messages per turn
+#define kBurst_FilesPerDir			1000
+#define kScrub_MaxThreads			8
+#define kScrub_MinThreadBytes			(256*1024) // per thread
+#define kScrub_InitialRecords			1024
+#define kScrub_HeaderSize			16
+#define kScrub_RecordSize			32
+#define kScrub_Magic				"mfck-scrub 1\n\0\0\0"
+#define kExport_MaxThreads			8
+#define kExport_InitialRows			1024
+#define kExport_InitialStrings			1024
+#define kExport_InitialBytes			(64*1024)
+#define kExport_HeaderSize			64
+#define kExport_EntrySize			32 // per column
+#define kExport_Magic				"mfck-export 1\n\0"
+#define kProgress_Interval			1 // secs
+#define kProgress_NameLength			64
+
 #define kString_ExcerptLength			50
 
 #define kSyntheticMessageIDSuffix		"@synthesized-by-mfck"
@@ -95,6 +195,7 @@ typedef struct {
     //String *body;		// not owned by the parser
     const char *start;
     String rest;
+    int offset;			// Position of start in the whole file
 } Parser;
 
 typedef struct _Header {
@@ -128,12 +229,73 @@ typedef struct _Message {
     Headers *headers;
     String *body;
     String *cachedID;		// Cached from headers; do not free
+    String *decoded[kMessage_DecodedHeaders]; // See Message_DecodedHeader
     bool deleted;
     bool dirty;
     DovecotFromSpaceBugType dovecotFromSpaceBug;
     struct _Message *next;
 } Message;
 
+typedef enum {
+    kSnapshot_None = 0,		// Opened while locked (or not locking at all)
+    kSnapshot_Valid,		// Opened unlocked, can be merged when saving
+    kSnapshot_Stale,		// Already merged once, can't be merged again
+} SnapshotState;
+
+typedef enum {
+    kSync_None = 0,		// Leave it to the OS to write things out
+    kSync_Each,			// Sync each mailbox as it's saved
+    kSync_Batch,		// Sync batches of saved mailboxes together
+} SyncMode;
+
+typedef enum {
+    kShard_None = 0,		// Leave the mailbox in one piece
+    kShard_Year,		// One mailbox per year of envelope dates
+    kShard_Month,		// ... or per month
+    kShard_Size,		// At most gShardLimit bytes per mailbox
+    kShard_Count,		// At most gShardLimit messages per mailbox
+} ShardMode;
+
+typedef enum {
+    kMerge_None = 0,		// Concatenate the mailboxes given -o
+    kMerge_Date,		// Merge them in chronological order
+    kMerge_Unique,		// ... dropping any duplicates
+} MergeMode;
+
+typedef enum {
+    kStats_None = 0,
+    kStats_Text,
+    kStats_JSON,
+} StatsMode;
+
+typedef enum {
+    kBurst_Number = 0,		// Name the files by message number
+    kBurst_ID,			// ... or by a hash of the Message-ID
+} BurstNames;
+
+// What a warning is about, for those that keep track (see kProblemNames)
+//
+typedef enum {
+    kProblem_Other = 0,
+    kProblem_BadHeader,
+    kProblem_BadEnvelope,
+    kProblem_IllegalCharacter,
+    kProblem_Truncated,
+    kProblem_Oversized,
+    kProblem_ContentLength,
+    kProblem_MissingMessageID,
+    kProblem_MissingFrom,
+    kProblem_MissingDate,
+    kProblem_InvalidDate,
+    kProblem_DovecotBug,
+    kProblem_BadMultipart,
+    kProblem_BadEncoding,
+    kProblem_ExtraNewlines,
+    kProblem_DamagedData,
+    kProblem_TrailingGarbage,
+    kProblem_KindCount
+} ProblemKind;
+
 typedef struct _Mailbox {
     String *source;
     String *name;
@@ -141,6 +303,12 @@ typedef struct _Mailbox {
     Message *root;
     int count;
     bool dirty;
+    int salvaged;			// # damaged bytes skipped when parsing
+    SnapshotState snapshot;
+    md5_byte_t snapshotDigest[16];	// Digest of data when opened
+    off_t snapshotLength;		// ... or of what we last saved
+    bool rewritten;			// The file no longer matches data
+    struct _Loader *loader;		// Still parsing in the background
 } Mailbox;
 
 typedef struct {
@@ -157,7 +325,19 @@ typedef struct {
     bool deleteFileWhenFreed;
 } Stream;
 
-#define New(T)			((T *) calloc(1, sizeof(T)))
+struct _MfckContext {
+    bool strict;
+    bool expectEnvelope;
+    bool checkMIME;
+    Array *problems;		// Warnings from the last check
+    Array *kinds;		// ... and their ProblemKinds (if wanted)
+    Array *messages;		// ... and the messages they're about
+    String *error;		// Why the last check failed
+    bool holding;		// Only holding back warnings for outer,
+    MfckContext *outer;		// ... which gets any errors (NULL: print)
+};
+
+#define New(T)			((T *) xcalloc(sizeof(T)))
 
 /*
 **  String Constants
@@ -166,12 +346,14 @@ typedef struct {
 // General Strings
 String_Define(Str_Empty, "");
 String_Define(Str_Newline, "\n");
+String_Define(Str_ColonSpace, ": ");
 String_Define(Str_Space, " ");
 String_Define(Str_TwoDashes, "--");
 
 // Header Keys
 String_Define(Str_Bcc, "bcc");
 String_Define(Str_Cc, "cc");
+String_Define(Str_ContentDisposition, "Content-Disposition");
 String_Define(Str_ContentLength, "Content-Length");
 String_Define(Str_ContentTransferEncoding, "Content-Transfer-Encoding");
 String_Define(Str_ContentType, "Content-Type");
@@ -179,6 +361,7 @@ String_Define(Str_Date, "Date");
 String_Define(Str_From, "From");
 String_Define(Str_FromSpace, "From ");
 String_Define(Str_GTFromSpace, ">From ");
+String_Define(Str_ListId, "List-Id");
 String_Define(Str_MessageID, "Message-ID");
 String_Define(Str_Received, "Received");
 String_Define(Str_ResentBcc, "Resent-bcc");
@@ -201,6 +384,7 @@ String_Define(Str_XIMAP, "X-IMAP");
 String_Define(Str_XIMAPBase, "X-IMAPBase");
 String_Define(Str_XKeywords, "X-Keywords");
 String_Define(Str_XMessageID, "X-Message-ID");
+String_Define(Str_XStatus, "X-Status");
 String_Define(Str_XSubject, "X-Subject");
 String_Define(Str_XTo, "X-To");
 String_Define(Str_XUID, "X-UID");
@@ -210,10 +394,17 @@ String_Define(Str_Body, "Body");
 // Content-Transfer-Encodings
 String_Define(Str_Binary, "binary");
 String_Define(Str_8Bit, "8bit");
+String_Define(Str_Base64, "base64");
+String_Define(Str_QuotedPrintable, "quoted-printable");
 
 // Content-Types (and parameters)
 String_Define(Str_Multipart, "multipart");
 String_Define(Str_Boundary, "boundary");
+String_Define(Str_Filename, "filename");
+String_Define(Str_Name, "name");
+String_Define(Str_Charset, "charset");
+String_Define(Str_UTF8, "utf-8");
+String_Define(Str_UTF8Short, "utf8");
 
 // Other Strings
 String_Define(Str_All, "all");
@@ -227,6 +418,7 @@ String_Define(Str_EnvelopeSender, "envelope sender");
 
 String_Define(Str_Plus, "+");
 String_Define(Str_Minus, "-");
+String_Define(Str_DashJ, "-j");
 String_Define(Str_Colon, ":");
 String_Define(Str_Dollar, "$");
 
@@ -234,6 +426,9 @@ String_Define(Str_True, "true");
 String_Define(Str_Strict, "strict");
 
 String_Define(Str_DotLock, ".lock");
+String_Define(Str_UndoSuffix, ".mfck-undo");
+String_Define(Str_DotScrub, ".mfck-scrub");
+String_Define(Str_MemoryStream, "(memory)");
 
 /*
 **  Global Variables
@@ -246,18 +441,49 @@ bool gCheck = false;
 bool gDebug = false;
 #endif
 bool gDryRun = false;
+bool gExternalDiff = false;
+bool gFilter = false;
+bool gInPlace = true;
 bool gInteractive = false;
+bool gLateLock = false;
 bool gLock = false;
 bool gMap = true;
 bool gShowContext = false;
-bool gStrict = false;
-bool gQuiet = false;
+ThreadLocal bool gStrict = false;
+ThreadLocal bool gCheckMIME = false;
+ThreadLocal bool gQuiet = false;
+bool gSalvage = false;
+bool gScrub = false;
 bool gUnique = false;
 bool gVerbose = false;
+bool gWatch = false;
 //bool gWantContentLength = false;
 
-int gWarnings = 0;
-int gMessageCounter = 0;
+SyncMode gSync = kSync_None;
+int gSyncBatchSize = kDefaultSyncBatchSize;
+int gWatchInterval = kDefaultWatchInterval;
+ShardMode gShard = kShard_None;
+off_t gShardLimit = 0;
+MergeMode gMerge = kMerge_None;
+int64_t gOlderThan = 0;			// --older-than cutoff, if any
+int gKeepLast = 0;
+StatsMode gStats = kStats_None;
+int64_t gStripSize = 0;			// --strip-attachments size, if any
+String *gBurstDir = NULL;		// --burst directory, if any
+BurstNames gBurstNames = kBurst_Number;
+bool gBurstUnescape = false;
+String *gExportDir = NULL;		// --export directory, if any
+String *gWatchSocket = NULL;
+
+ThreadLocal int gWarnings = 0;
+ThreadLocal int gMessageCounter = 0;
+ThreadLocal bool gExpectEnvelope = true;
+ThreadLocal MfckContext *gContext = NULL;	// Library caller, if any
+ThreadLocal int gProblemMessage = 0;	// What problems are about (if any)
+ThreadLocal jmp_buf *gFatalReentry = NULL;
+size_t gMaxMemory = 0;			// --max-memory budget, if any
+ssize_t gMemoryUsed = 0;		// Updated atomically
+ThreadLocal jmp_buf *gMemoryReentry = NULL;	// Where to go when over budget
 String *gPager = NULL;
 Stream *gStdOut;
 int gPageWidth = kDefaultPageWidth;
@@ -275,6 +501,9 @@ const char gCopyright[] =
 */
 
 void Exit(int ret);
+String *String_FromCString(const char *chars, bool copy);
+void String_Free(String *str);
+void Array_Append(Array *array, const void *item);
 
 /*
 **  Math Functions
@@ -292,7 +521,7 @@ static inline bool Char_IsDigit(int ch) {return isdigit(ch);}
 
 const char *Char_QuotedCString(char ch)
 {
-    static char buf[10];
+    static ThreadLocal char buf[10];
 
     if (ch < ' ' || ch > '~') {
 	switch (ch) {
@@ -332,31 +561,399 @@ double NormalizeSize(size_t size, char *pSuffix)
     return fsize;
 }
 
+/*
+**  Progress Reporting
+**
+**  With --progress, how far we've gotten reading or writing the current
+**  mailbox is shown once a second on the terminal (or written to a
+**  status file with --progress=FILE), along with the throughput and how
+**  long it's likely to take.  Starts nest, so that what's done for each
+**  window of a mailbox read a window at a time (parsing and checking it)
+**  adds up to the progress through the whole file rather than starting
+**  over each time.  The parsing and writing loops only ever
+**  update gProgress; everything else is done by the SIGALRM handler,
+**  which sticks to async-signal-safe calls (no stdio or malloc).
+*/
+
+typedef struct {
+    volatile int64_t done;	// Bytes read or written so far
+    volatile int64_t total;	// ... out of this many (or 0 if unknown)
+    volatile int messages;
+    volatile bool active;
+    int depth;			// How many starts we're within
+    const char *doing;
+    char name[kProgress_NameLength];
+    struct timespec start;
+    int fd;			// Where to report (or -1 if not at all)
+    bool isTTY;
+    bool shown;			// Is there a line to clear on the terminal?
+} Progress;
+
+Progress gProgress = {.fd = -1};
+
+// Another message done, having gotten this far in all
+//
+static inline void Progress_Tick(int64_t done)
+{
+    if (gProgress.active && gProgress.depth == 1) {
+	gProgress.done = done;
+	gProgress.messages++;
+    }
+}
+
+// So many messages done, having gotten this far in all
+//
+static inline void Progress_Reached(int64_t done, int messages)
+{
+    if (gProgress.active && gProgress.depth == 1) {
+	gProgress.done = done;
+	gProgress.messages = messages;
+    }
+}
+
+// Another message done, of this length
+//
+static inline void Progress_Advance(int64_t length)
+{
+    if (gProgress.active && gProgress.depth == 1) {
+	gProgress.done += length;
+	gProgress.messages++;
+    }
+}
+
+static char *Progress_PutString(char *p, const char *str)
+{
+    while (*str != '\0')
+	*p++ = *str++;
+
+    return p;
+}
+
+static char *Progress_PutNumber(char *p, int64_t num, int minDigits)
+{
+    char digits[24];
+    int n = 0;
+
+    do {
+	digits[n++] = '0' + num % 10;
+	num /= 10;
+    } while (num > 0 || n < minDigits);
+
+    while (n > 0)
+	*p++ = digits[--n];
+
+    return p;
+}
+
+// Put a byte count as "123.4MB" (etc)
+//
+static char *Progress_PutBytes(char *p, int64_t bytes)
+{
+    static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int64_t tenths = bytes * 10;
+    int unit = 0;
+
+    while (tenths >= 10240 && unit < 4) {
+	tenths /= 1024;
+	unit++;
+    }
+
+    p = Progress_PutNumber(p, tenths / 10, 1);
+    if (unit > 0) {
+	*p++ = '.';
+	p = Progress_PutNumber(p, tenths % 10, 1);
+    }
+
+    return Progress_PutString(p, units[unit]);
+}
+
+static void Progress_Show(int sig)
+{
+    char line[kProgress_NameLength + 128];
+    char *p = line;
+    struct timespec now;
+    int64_t done = gProgress.done, total = gProgress.total;
+    int messages = gProgress.messages;
+    int saved = errno;
+
+    if (!gProgress.active || gProgress.fd == -1) {
+	errno = saved;
+	return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t msecs = (now.tv_sec - gProgress.start.tv_sec) * 1000 +
+	(now.tv_nsec - gProgress.start.tv_nsec) / 1000000;
+
+    if (msecs <= 0)
+	msecs = 1;
+    if (total > 0 && done > total)
+	done = total;
+
+    if (gProgress.isTTY)
+	p = Progress_PutString(p, "\r");
+    p = Progress_PutString(p, "[");
+    p = Progress_PutString(p, gProgress.name);
+    p = Progress_PutString(p, ": ");
+    p = Progress_PutString(p, gProgress.doing);
+    p = Progress_PutString(p, " ");
+    if (total > 0) {
+	p = Progress_PutNumber(p, done * 100 / total, 1);
+	p = Progress_PutString(p, "% (");
+    }
+    p = Progress_PutBytes(p, done);
+    if (total > 0) {
+	p = Progress_PutString(p, " of ");
+	p = Progress_PutBytes(p, total);
+	p = Progress_PutString(p, ")");
+    }
+    p = Progress_PutString(p, ", ");
+    p = Progress_PutBytes(p, done * 1000 / msecs);
+    p = Progress_PutString(p, "/s, ");
+    p = Progress_PutNumber(p, (int64_t) messages * 1000 / msecs, 1);
+    p = Progress_PutString(p, " msgs/s");
+
+    if (total > 0 && done > 0) {
+	int64_t eta = (total - done) * msecs / done / 1000;
+
+	p = Progress_PutString(p, ", ETA ");
+	if (eta >= 3600) {
+	    p = Progress_PutNumber(p, eta / 3600, 1);
+	    p = Progress_PutString(p, ":");
+	}
+	p = Progress_PutNumber(p, eta / 60 % 60, eta >= 3600 ? 2 : 1);
+	p = Progress_PutString(p, ":");
+	p = Progress_PutNumber(p, eta % 60, 2);
+    }
+    p = Progress_PutString(p, gProgress.isTTY ? "]\033[K" : "]\n");
+
+    if (gProgress.isTTY) {
+	if (write(gProgress.fd, line, p - line) > 0)
+	    gProgress.shown = true;
+    } else if (pwrite(gProgress.fd, line, p - line, 0) > 0) {
+	(void) ftruncate(gProgress.fd, p - line);
+    }
+
+    errno = saved;
+}
+
+// Don't leave a half line for the next note to end up after
+//
+static void Progress_Clear(void)
+{
+    if (gProgress.shown) {
+	if (write(gProgress.fd, "\r\033[K", 4) < 0)
+	    ;
+	gProgress.shown = false;
+    }
+}
+
+// Report progress to the file (or the terminal if NULL) from now on
+//
+bool Progress_Init(const char *file)
+{
+    struct sigaction action;
+    struct itimerval timer = {{kProgress_Interval, 0}, {kProgress_Interval, 0}};
+
+    if (file == NULL) {
+	// Only on a terminal (there's no point otherwise)
+	if (!isatty(STDERR_FILENO))
+	    return true;
+	gProgress.fd = STDERR_FILENO;
+	gProgress.isTTY = true;
+    } else if ((gProgress.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC,
+				    0666)) == -1) {
+	return false;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Progress_Show;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    return sigaction(SIGALRM, &action, NULL) == 0 &&
+	setitimer(ITIMER_REAL, &timer, NULL) == 0;
+}
+
+// Start reporting on reading or writing (total bytes of) the named file,
+// unless we're already reporting on something this is just a part of.
+// (Work done for someone else's context, possibly in a thread of its
+// own, is theirs to report on.)
+//
+void Progress_Start(const char *doing, const char *name, int64_t total)
+{
+    int len = strlen(name);
+
+    if (gProgress.fd == -1 || gContext != NULL || gProgress.depth++ > 0)
+	return;
+
+    // Keep the handler out while we're changing things
+    gProgress.active = false;
+
+    // Keep the end of long paths
+    if (len >= kProgress_NameLength) {
+	name += len - (kProgress_NameLength - 1);
+	len = kProgress_NameLength - 1;
+    }
+    memcpy(gProgress.name, name, len);
+    gProgress.name[len] = '\0';
+    gProgress.doing = doing;
+    gProgress.done = 0;
+    gProgress.total = total;
+    gProgress.messages = 0;
+    clock_gettime(CLOCK_MONOTONIC, &gProgress.start);
+
+    gProgress.active = true;
+}
+
+// Stop reporting, whatever we're within
+//
+void Progress_End(void)
+{
+    gProgress.depth = 0;
+
+    if (!gProgress.active)
+	return;
+
+    // Leave the status file saying where we ended up
+    if (!gProgress.isTTY)
+	Progress_Show(SIGALRM);
+
+    gProgress.active = false;
+
+    Progress_Clear();
+}
+
+void Progress_Stop(void)
+{
+    if (gContext == NULL && gProgress.depth > 0 && --gProgress.depth == 0)
+	Progress_End();
+}
+
+// Keep the progress line out of the way while printing something else
+//
+void Progress_Hold(sigset_t *pOld)
+{
+    sigset_t alarm;
+
+    if (gProgress.fd == -1)
+	return;
+
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alarm, pOld);
+    Progress_Clear();
+}
+
+void Progress_Release(sigset_t *pOld)
+{
+    if (gProgress.fd == -1)
+	return;
+
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, pOld, NULL);
+}
+
 /*
 **  Error & Notification Functions
 **
 **  Note that calling Error will exit the program.
+**
+**  Problems found in mailboxes are reported with Problem (or
+**  Parser_Warn), which tells what kind of problem it is as well.  The
+**  kinds have names that stay the same whatever the wording of the
+**  warnings, for those that keep count of them (like --export), which
+**  also get the number of the message being parsed or checked at the
+**  time (gProblemMessage), if any.
 */
 
+static const char *const kProblemNames[kProblem_KindCount] = {
+    "other",
+    "bad-header",
+    "bad-envelope",
+    "illegal-character",
+    "truncated",
+    "oversized",
+    "content-length",
+    "missing-message-id",
+    "missing-from",
+    "missing-date",
+    "invalid-date",
+    "dovecot-from-bug",
+    "bad-multipart",
+    "bad-encoding",
+    "extra-newlines",
+    "damaged-data",
+    "trailing-garbage",
+};
+
+// Keep the message for the library caller
+//
+static void Context_Report(String **pError, const char *prefix,
+			   const char *fmt, va_list args)
+{
+    char buf[kString_MaxPrintFLength];
+    int len = strlen(prefix);
+
+    strcpy(buf, prefix);
+    vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+
+    if (pError != NULL) {
+	String_Free(*pError);
+	*pError = String_FromCString(buf, true);
+    } else {
+	Array_Append(gContext->problems, String_FromCString(buf, true));
+    }
+}
+
+// Where errors go (or NULL if they're to be printed), skipping any
+// contexts that are just holding back warnings
+//
+static MfckContext *Context_ForErrors(void)
+{
+    MfckContext *ctx = gContext;
+
+    while (ctx != NULL && ctx->holding)
+	ctx = ctx->outer;
+
+    return ctx;
+}
+
 void Note(const char *fmt, ...)
 {
     va_list args;
 
     va_start(args, fmt);
-    if (!gQuiet) {
+    if (!gQuiet && gContext == NULL) {
+	sigset_t mask;
+
+	Progress_Hold(&mask);
 	fprintf(stdout, "[");
 	vfprintf(stdout, fmt, args);
 	fprintf(stdout, "]\n");
+	Progress_Release(&mask);
     }
     va_end(args);
 }
 
-void WarnV(const char *fmt, va_list args)
+void WarnV(ProblemKind kind, const char *fmt, va_list args)
 {
-    if (!gQuiet) {
+    if (gContext != NULL) {
+	Context_Report(NULL, "", fmt, args);
+	if (gContext->kinds != NULL) {
+	    Array_Append(gContext->kinds, (void *) (intptr_t) kind);
+	    Array_Append(gContext->messages,
+			 (void *) (intptr_t) gProblemMessage);
+	}
+    } else if (!gQuiet) {
+	sigset_t mask;
+
+	Progress_Hold(&mask);
 	fprintf(stdout, "%%");
 	vfprintf(stdout, fmt, args);
 	fprintf(stdout, "\n");
+	Progress_Release(&mask);
     }
 
     gWarnings++;
@@ -367,29 +964,53 @@ void Warn(const char *fmt, ...)
     va_list args;
 
     va_start(args, fmt);
-    WarnV(fmt, args);
+    WarnV(kProblem_Other, fmt, args);
+    va_end(args);
+}
+
+void Problem(ProblemKind kind, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    WarnV(kind, fmt, args);
     va_end(args);
 }
 
 void Error(const char *fmt, ...)
 {
+    MfckContext *ctx = Context_ForErrors();
     va_list args;
 
     va_start(args, fmt);
-    fprintf(stderr, "?");
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    if (ctx != NULL) {
+	Context_Report(&ctx->error, "", fmt, args);
+    } else {
+	sigset_t mask;
+
+	Progress_Hold(&mask);
+	fprintf(stderr, "?");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	Progress_Release(&mask);
+    }
     va_end(args);
 }
 
 void Fatal(int err, const char *fmt, ...)
 {
+    MfckContext *ctx = Context_ForErrors();
     va_list args;
 
     va_start(args, fmt);
-    fprintf(stderr, "?Fatal Error: ");
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    if (ctx != NULL) {
+	Context_Report(&ctx->error, "Fatal Error: ", fmt, args);
+    } else {
+	Progress_End();
+	fprintf(stderr, "?Fatal Error: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+    }
     va_end(args);
 
     if (err != EX_OK)
@@ -398,7 +1019,7 @@ void Fatal(int err, const char *fmt, ...)
 
 /* Show n lines of context around the given position.
  */
-void ShowContext(const char *text, int length, int pos)
+void ShowContext(FILE *file, const char *text, int length, int pos)
 {
     int b, e, i, count;
 
@@ -420,12 +1041,12 @@ void ShowContext(const char *text, int length, int pos)
 
     for (i = b; i < e; i++) {
 	if (i == b || text[i-1] == '\n')
-	    fputs("] ", stderr);
+	    fputs("] ", file);
 	/*
 	if (i == pos)
-	    fputs("<here>", stderr);
+	    fputs("<here>", file);
 	*/
-	putc(text[i], stderr);
+	putc(text[i], file);
     }
 }
 
@@ -437,16 +1058,59 @@ void ShowContext(const char *text, int length, int pos)
 **
 **  Also note that it's OK to (re)alloc and free a NULL memory
 **  pointer.  (The right thing will happen.)
+**
+**  All memory is accounted for, so that it can be kept within the
+**  --max-memory budget.  Going over it while gMemoryReentry is set
+**  (i.e. while loading a mailbox) will longjmp there rather than
+**  allocate more.
 **/
 
-void xfree(void *mem)
+static inline void Memory_Account(ssize_t delta)
+{
+    __atomic_add_fetch(&gMemoryUsed, delta, __ATOMIC_RELAXED);
+}
+
+static inline size_t Memory_Used(void)
+{
+    ssize_t used = __atomic_load_n(&gMemoryUsed, __ATOMIC_RELAXED);
+
+    // Others may have freed what we alloced
+    return used > 0 ? used : 0;
+}
+
+// Would another size bytes still fit within the budget?
+//
+static inline bool Memory_Fits(size_t size)
+{
+    return gMaxMemory == 0 || Memory_Used() + size <= gMaxMemory;
+}
+
+// Take over a block that libc allocated for us (e.g. an open_memstream
+// buffer) so that freeing it with xfree keeps the books balanced
+//
+static inline void *Memory_Adopt(void *mem)
 {
     if (mem != NULL)
+	Memory_Account(Memory_BlockSize(mem));
+    return mem;
+}
+
+void xfree(void *mem)
+{
+    if (mem != NULL) {
+	Memory_Account(-(ssize_t) Memory_BlockSize(mem));
 	free(mem);
+    }
 }
 
 void *xalloc(void *mem, size_t size)
 {
+    size_t oldSize = mem != NULL ? Memory_BlockSize(mem) : 0;
+
+    if (gMemoryReentry != NULL && size > oldSize &&
+	!Memory_Fits(size - oldSize))
+	longjmp(*gMemoryReentry, 1);
+
     if (mem == NULL)
 	mem = malloc(size);
     else
@@ -462,6 +1126,17 @@ void *xalloc(void *mem, size_t size)
 	Fatal(EX_UNAVAILABLE, "Out of memory when trying to allocate %u bytes",
 	      size);
 
+    Memory_Account(Memory_BlockSize(mem) - oldSize);
+
+    return mem;
+}
+
+void *xcalloc(size_t size)
+{
+    void *mem = xalloc(NULL, size);
+
+    memset(mem, 0, size);
+
     return mem;
 }
 
@@ -496,12 +1171,10 @@ static inline int String_Length(const String *str)
     return str == NULL ? 0 : str->len;
 }
 
-#ifdef NOT_CURRENTLY_USED
 static inline const char *String_End(const String *str)
 {
     return str == NULL ? NULL : str->buf + str->len;
 }
-#endif
 
 static inline const String *String_Safe(String *str)
 {
@@ -848,8 +1521,8 @@ void String_TrimSpaces(String *str)
 // shared storage (will be overwritten on every nth call).
 char **String_NextCStringPoolSlot(void)
 {
-    static char *pool[kString_CStringPoolSize] = {0};
-    static int counter = -1;
+    static ThreadLocal char *pool[kString_CStringPoolSize] = {0};
+    static ThreadLocal int counter = -1;
 
     counter = (counter + 1) % kString_CStringPoolSize;
 
@@ -1123,6 +1796,7 @@ void Parser_Set(Parser *par, const String *str)
 	par->start = String_Chars(str);
 	par->rest = *str;
     }
+    par->offset = 0;
 }
 
 int Parser_Position(Parser *par)
@@ -1130,6 +1804,13 @@ int Parser_Position(Parser *par)
     return String_Chars(&par->rest) - par->start;
 }
 
+// Position in the whole file (when parsing only part of it)
+//
+int Parser_Offset(Parser *par)
+{
+    return par->offset + Parser_Position(par);
+}
+
 bool Parser_AtEnd(Parser *par)
 {
     return String_Length(&par->rest) == 0;
@@ -1153,24 +1834,46 @@ bool Parser_Move(Parser *par, int count)
     return Parser_MoveTo(par, Parser_Position(par) + count);
 }
 
-void Parser_ShowContext(Parser *par)
+void Parser_ShowContext(Parser *par, FILE *file)
 {
-    ShowContext(par->start,
+    ShowContext(file, par->start,
 		String_Chars(&par->rest) - par->start +
 		String_Length(&par->rest),
 		Parser_Position(par));
 }
 
-void Parser_Warn(Parser *par, const char *fmt, ...)
+void Parser_Warn(Parser *par, ProblemKind kind, const char *fmt, ...)
 {
     va_list args;
 
     va_start(args, fmt);
-    WarnV(fmt, args);
+    if (gShowContext && gContext != NULL) {
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file;
+
+	// The warning is being held back (by the background loader, a
+	// window reader or an export thread), so the context has to go
+	// along with it rather than turn up on its own right away
+	//
+	if ((file = open_memstream(&buf, &size)) == NULL)
+	    Fatal(EX_OSERR, "Could not open memory stream: %s",
+		  strerror(errno));
+	vfprintf(file, fmt, args);
+	putc('\n', file);
+	Parser_ShowContext(par, file);
+	fclose(file);
+
+	if (size > 0 && buf[size - 1] == '\n')
+	    buf[size - 1] = '\0';
+	Problem(kind, "%s", buf);
+	free(buf);
+    } else {
+	WarnV(kind, fmt, args);
+	if (gShowContext)
+	    Parser_ShowContext(par, stderr);
+    }
     va_end(args);
-    
-    if (gShowContext)
-	Parser_ShowContext(par);
 }
 
 int Parse_Peek(Parser *par)
@@ -1428,6 +2131,36 @@ int String_ToInteger(const String *str, int defValue)
     return defValue;
 }
 
+// Convert sizes like "512", "64K", "1.5G" or "2GB" into bytes
+//
+size_t String_ToByteSize(const String *str, size_t defValue)
+{
+    const char *cstr = String_CString(str);
+    const char *suffix = "KMGT";
+    const char *sp;
+    char *end;
+    double size;
+
+    if (cstr == NULL)
+	return defValue;
+
+    size = strtod(cstr, &end);
+    if (end == cstr || size < 0)
+	return defValue;
+
+    if (*end != '\0' && (sp = strchr(suffix, toupper(*end))) != NULL) {
+	for (; sp >= suffix; sp--)
+	    size *= 1024;
+	end++;
+	if (toupper(*end) == 'B')
+	    end++;
+    } else if (toupper(*end) == 'B') {
+	end++;
+    }
+
+    return *end == '\0' ? (size_t) size : defValue;
+}
+
 /*
 **  Stream Functions
 **
@@ -1549,14 +2282,21 @@ bool Stream_ReadContents(Stream *input, String **pContents)
     StringType type = kString_Shared;
     size_t size = -1;
 
-    // See if we can find out how big it's going to be
+    // See if we can find out how big it's going to be (pipes will
+    // claim to be empty)
     //
-    if (fstat(fd, &sbuf) == 0)
+    if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode))
 	size = sbuf.st_size;
 
-    // Try mapping the file if it's reasonably large
+    // Try mapping the file if it's reasonably large (or if reading and
+    // parsing it would take us over the memory budget -- mapped pages
+    // can always be dropped and read back again)
     //
-    if (gMap && size >= 8192) {
+    if (size != -1 && size >= 8192 &&
+	(gMap || !Memory_Fits(size * (1 + kMemory_ParseOverhead)))) {
+	if (!gMap && gVerbose)
+	    Note("Mapping %s to stay within the memory budget",
+		 String_CString(input->name));
 	data = mmap(NULL, size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
 	type = kString_Mapped;
 
@@ -1574,12 +2314,22 @@ bool Stream_ReadContents(Stream *input, String **pContents)
 	if (size == -1)
 	    size = kRead_InitialSize;
 
+	if (!Memory_Fits(size + 1)) {
+	    errno = ENOMEM;
+	    return false;
+	}
+
 	data = xalloc(NULL, size);
 	type = kString_Alloced;
 
 	while ((count = read(fd, data + offset, size - offset)) > 0) {
 	    offset += count;
 	    if (offset == size) {
+		if (!Memory_Fits(size * (kRead_GrowthFactor - 1) + 1)) {
+		    xfree(data);
+		    errno = ENOMEM;
+		    return false;
+		}
 		size *= kRead_GrowthFactor;
 		data = xalloc(data, size);
 	    }
@@ -1714,6 +2464,31 @@ Array *String_Split(const String *str, char separator, bool trim)
  **  Time Support
  **/
 
+// Current time in seconds, for timing things
+//
+double Time_Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Seconds since the epoch for a UTC date (with months 1-12), without
+// involving the C library and its local time zone
+//
+int64_t Time_FromDate(int year, int mon, int day, int hour, int min, int sec)
+{
+    int64_t y = year - (mon <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
 // Weekdays
 //
 String_Define(Str_Sun, "Sun");
@@ -2164,6 +2939,16 @@ void Message_SetDirty(Message *msg, bool flag)
 	Mailbox_SetDirty(msg->mbox, flag);
 }
 
+// Forget any decoded headers (when the headers change)
+//
+void Message_ForgetDecoded(Message *msg)
+{
+    int i;
+
+    for (i = 0; i < kMessage_DecodedHeaders; i++)
+	String_FreeP(&msg->decoded[i]);
+}
+
 /**
  **  Header Functions
  **
@@ -2291,6 +3076,7 @@ void Header_Set(Headers *headers, const String *key, String *value)
 	(*pHead)->value = value;
     }
 
+    Message_ForgetDecoded(headers->msg);
     Message_SetDirty(headers->msg, true);
 }
 
@@ -2304,6 +3090,7 @@ void Header_Append(Headers *headers, String *key, String *value)
     (*pHead)->key = key;
     (*pHead)->value = value;
 
+    Message_ForgetDecoded(headers->msg);
     Message_SetDirty(headers->msg, true);
 }
 
@@ -2316,6 +3103,7 @@ void Header_Delete(Headers *headers, const String *key, bool all)
 	Header_Free(*pHead, false);
 	*pHead = next;
 
+	Message_ForgetDecoded(headers->msg);
 	Message_SetDirty(headers->msg, true);
 
 	if (!all)
@@ -2334,7 +3122,8 @@ bool Parse_Header(Parser *par, Header **phead)
 	//
 	ch = Parse_Peek(par);
 	if ((ch >= '\0' && ch <= ' ') || ch == ':') {
-	    Parser_Warn(par, "Header starts with illegal character %s",
+	    Parser_Warn(par, kProblem_BadHeader,
+			"Header starts with illegal character %s",
 			Char_QuotedCString(ch));
 	}
     }
@@ -2352,7 +3141,8 @@ bool Parse_Header(Parser *par, Header **phead)
 	    if (String_IsEqual(head->key, &Str_FromSpace, true)) {
 		// Yup, complain & back up.
 		Parser_MoveTo(par, pos);
-		Parser_Warn(par, "Encountered unexpected \"From \" line in "
+		Parser_Warn(par, kProblem_BadHeader,
+			    "Encountered unexpected \"From \" line in "
 			    "headers {@%d}", Parser_Position(par));
 		Header_Free(head, false);
 		return false;
@@ -2361,7 +3151,8 @@ bool Parse_Header(Parser *par, Header **phead)
 	     */
 	    if (String_IsEqual(head->key, &Str_GTFromSpace, true)) {
 		// Yup, complain & accept it.
-		Parser_Warn(par, "Encountered unexpected \"%s\" line in "
+		Parser_Warn(par, kProblem_BadHeader,
+			    "Encountered unexpected \"%s\" line in "
 			    "headers {@%d}", 
 			    String_CString(head->key), Parser_Position(par));
 		break;
@@ -2369,7 +3160,8 @@ bool Parse_Header(Parser *par, Header **phead)
 	}
 	if (gCheck && ch >= '\0' && ch <= ' ') {
 	    if (++warnCount < kCheck_MaxWarnCount)
-		Parser_Warn(par, "Illegal character %s in message "
+		Parser_Warn(par, kProblem_IllegalCharacter,
+			    "Illegal character %s in message "
 			    "headers%s {@%d}", Char_QuotedCString(ch), 
 			    warnCount == kCheck_MaxWarnCount ?
 				" (and more)" : "",
@@ -2419,7 +3211,8 @@ bool Parse_Headers(Parser *par, Message *msg, Headers **pHeaders)
 
     while (!Parse_Newline(par, NULL)) {
 	if (Parser_AtEnd(par) || !Parse_Header(par, pHead)) {
-	    Parser_Warn(par, "Message %s: Header parsing ended prematurely",
+	    Parser_Warn(par, kProblem_BadHeader,
+			"Message %s: Header parsing ended prematurely",
 			String_CString(msg->tag));
 	    // Should fail here, but it's arguably better to keep what we got
 	    break;
@@ -2511,7 +3304,8 @@ String *MIME_GetParameter(String *str, const String *key)
 
     while (Parse_UntilChar(&parser, ';', false, NULL)) {
 	(void) Parse_ConstChar(&parser, ';', false, NULL);
-	(void) Parse_Spaces(&parser, NULL);
+	// Parameters are often folded onto lines of their own
+	while (Parse_Spaces(&parser, NULL) || Parse_Newline(&parser, NULL));
 	if (Parse_ConstString(&parser, key, false, NULL)) {
 	    (void) Parse_Spaces(&parser, NULL);
 	    if (Parse_ConstChar(&parser, '=', false, NULL)) {
@@ -2535,22 +3329,388 @@ String *MIME_GetParameter(String *str, const String *key)
     return NULL;
 }
 
-/**
- **  Message Functions
- **/
-
-Message *Message_New(Mailbox *mbox, int num)
+// Get the value of a header among the part headers in [p, end), or NULL
+//
+String *MIME_GetPartHeader(const char *p, const char *end, const String *key)
 {
-    Message *msg = New(Message);
+    int len = String_Length(key);
 
-    msg->mbox = mbox;
-    msg->num = num;
+    while (p < end) {
+	const char *eol = memchr(p, '\n', end - p);
 
-    return msg;
-}
+	if (eol == NULL)
+	    eol = end;
 
-void Message_Free(Message *msg, bool all)
-{
+	if (eol - p > len && p[len] == ':' &&
+	    strncasecmp(p, String_Chars(key), len) == 0) {
+	    const char *start = p + len + 1;
+
+	    // Include any continuation lines
+	    while (eol + 1 < end && (eol[1] == ' ' || eol[1] == '\t')) {
+		const char *next = memchr(eol + 1, '\n', end - eol - 1);
+		eol = next != NULL ? next : end;
+	    }
+
+	    String *value = String_New(kString_Shared, start, eol - start);
+	    String_TrimSpaces(value);
+	    return value;
+	}
+
+	p = eol + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ **  Header Decoding
+ **
+ **  Encoded words (RFC 2047) like "=?UTF-8?B?...?=" in From:, Subject:
+ **  and To: are decoded into UTF-8 (and unfolded) the first time they're
+ **  needed for listing or searching a message, and the result is kept
+ **  with the message until its headers change.  UTF-8, US-ASCII,
+ **  ISO-8859-1, ISO-8859-15 and Windows-1252 words are decoded; words in
+ **  any other charset are left as they are.
+ **/
+
+typedef enum {
+    kCharset_Unknown = 0,
+    kCharset_UTF8,		// Also US-ASCII
+    kCharset_Latin1,
+    kCharset_Latin9,
+    kCharset_CP1252,
+} Charset;
+
+// Windows-1252 0x80-0x9F (the rest is the same as ISO-8859-1)
+//
+static const uint16_t kCP1252_High[32] = {
+    0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178,
+};
+
+static const char *kDecoded_Keys[kMessage_DecodedHeaders] = {
+    "From", "Subject", "To"
+};
+
+static Charset Charset_FromName(const char *name, int len)
+{
+    static const struct {const char *name; Charset charset;} charsets[] = {
+	{"utf-8", kCharset_UTF8}, {"utf8", kCharset_UTF8},
+	{"us-ascii", kCharset_UTF8}, {"ascii", kCharset_UTF8},
+	{"iso-8859-1", kCharset_Latin1}, {"latin1", kCharset_Latin1},
+	{"iso-8859-15", kCharset_Latin9}, {"latin9", kCharset_Latin9},
+	{"windows-1252", kCharset_CP1252}, {"cp1252", kCharset_CP1252},
+	{NULL, kCharset_Unknown}
+    };
+    const char *star = memchr(name, '*', len);	// RFC 2231 language
+    int i;
+
+    if (star != NULL)
+	len = star - name;
+
+    for (i = 0; charsets[i].name != NULL; i++) {
+	if (strlen(charsets[i].name) == len &&
+	    strncasecmp(name, charsets[i].name, len) == 0)
+	    return charsets[i].charset;
+    }
+
+    return kCharset_Unknown;
+}
+
+static inline int UTF8_Put(char *p, unsigned int cp)
+{
+    if (cp < 0x80) {
+	p[0] = cp;
+	return 1;
+    } else if (cp < 0x800) {
+	p[0] = 0xC0 | (cp >> 6);
+	p[1] = 0x80 | (cp & 0x3F);
+	return 2;
+    } else {
+	p[0] = 0xE0 | (cp >> 12);
+	p[1] = 0x80 | ((cp >> 6) & 0x3F);
+	p[2] = 0x80 | (cp & 0x3F);
+	return 3;
+    }
+}
+
+// Convert the chars to UTF-8 at out (which has room for 3 bytes per
+// char).  Returns the number of bytes put there.
+//
+static int Charset_ToUTF8(Charset charset, const unsigned char *chars,
+			  int len, char *out)
+{
+    char *p = out;
+    int i;
+
+    if (charset == kCharset_UTF8) {
+	memcpy(out, chars, len);
+	return len;
+    }
+
+    for (i = 0; i < len; i++) {
+	unsigned int cp = chars[i];
+
+	if (charset == kCharset_CP1252 && cp >= 0x80 && cp < 0xA0) {
+	    cp = kCP1252_High[cp - 0x80];
+	} else if (charset == kCharset_Latin9) {
+	    switch (cp) {
+	      case 0xA4: cp = 0x20AC; break;
+	      case 0xA6: cp = 0x0160; break;
+	      case 0xA8: cp = 0x0161; break;
+	      case 0xB4: cp = 0x017D; break;
+	      case 0xB8: cp = 0x017E; break;
+	      case 0xBC: cp = 0x0152; break;
+	      case 0xBD: cp = 0x0153; break;
+	      case 0xBE: cp = 0x0178; break;
+	    }
+	}
+	p += UTF8_Put(p, cp);
+    }
+
+    return p - out;
+}
+
+static inline bool Char_IsHex(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') ||
+	(c >= 'a' && c <= 'f');
+}
+
+static inline int Char_HexValue(char c)
+{
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+// Decode the B or Q encoded text in place.  Returns the decoded length
+// (or -1 if it isn't valid).
+//
+static int MIME_DecodeText(char encoding, unsigned char *text, int len)
+{
+    unsigned char *out = text;
+    int i;
+
+    if (encoding == 'Q' || encoding == 'q') {
+	for (i = 0; i < len; i++) {
+	    if (text[i] == '_') {
+		*out++ = ' ';
+	    } else if (text[i] == '=') {
+		if (i + 2 >= len || !Char_IsHex(text[i + 1]) ||
+		    !Char_IsHex(text[i + 2]))
+		    return -1;
+		*out++ = Char_HexValue(text[i + 1]) << 4 |
+		    Char_HexValue(text[i + 2]);
+		i += 2;
+	    } else {
+		*out++ = text[i];
+	    }
+	}
+    } else {
+	unsigned int bits = 0;
+	int nbits = 0;
+
+	for (i = 0; i < len && text[i] != '='; i++) {
+	    unsigned char c = text[i];
+	    int v = c >= 'A' && c <= 'Z' ? c - 'A' :
+		c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+		c >= '0' && c <= '9' ? c - '0' + 52 :
+		c == '+' ? 62 : c == '/' ? 63 : -1;
+
+	    if (v < 0)
+		return -1;
+	    bits = bits << 6 | v;
+	    if ((nbits += 6) >= 8) {
+		nbits -= 8;
+		*out++ = (bits >> nbits) & 0xFF;
+	    }
+	}
+    }
+
+    return out - text;
+}
+
+// Decode the encoded word at p (if that's what it is) and add it to out.
+// Returns where the word ends, or NULL if it isn't one we can decode.
+//
+static const char *MIME_DecodeWord(const char *p, const char *end,
+				   char **pOut)
+{
+    const char *charset = p + 2;
+    const char *q = memchr(charset, '?', end - charset);
+
+    if (q == NULL || q + 3 >= end || q[2] != '?' ||
+	strchr("BbQq", q[1]) == NULL || q[1] == '\0')
+	return NULL;
+
+    const char *text = q + 3;
+    const char *close = text;
+
+    // The text can't contain any spaces (or '?')
+    //
+    while (close < end && *close != '?' && *close > ' ')
+	close++;
+    if (close + 1 >= end || close[0] != '?' || close[1] != '=')
+	return NULL;
+
+    Charset cs = Charset_FromName(charset, q - charset);
+    int len = close - text;
+    unsigned char buf[len + 1];
+
+    if (cs == kCharset_Unknown)
+	return NULL;
+
+    memcpy(buf, text, len);
+    if ((len = MIME_DecodeText(q[1], buf, len)) < 0)
+	return NULL;
+
+    *pOut += Charset_ToUTF8(cs, buf, len, *pOut);
+
+    return close + 2;
+}
+
+// Decode any encoded words in the header value and unfold it.  Returns
+// NULL if there's nothing to decode or unfold.
+//
+String *MIME_DecodeWords(const String *value)
+{
+    const char *p = String_Chars(value);
+    const char *end = String_End(value);
+    int len = String_Length(value);
+
+    if (memmem(p, len, "=?", 2) == NULL && memchr(p, '\n', len) == NULL)
+	return NULL;
+
+    String *result = String_Alloc(3 * len);
+    char *start = (char *) String_Chars(result);
+    char *out = start;
+    char *afterWord = NULL;	// Where the last word ended, if only
+				// whitespace has followed it
+
+    while (p < end) {
+	if (p[0] == '=' && p + 1 < end && p[1] == '?') {
+	    char *wordStart = afterWord != NULL ? afterWord : out;
+	    char *wordOut = wordStart;
+	    const char *next = MIME_DecodeWord(p, end, &wordOut);
+
+	    // Whitespace between encoded words is dropped.  Don't let the
+	    // decoding bring in any control characters (which the header
+	    // couldn't have had as is) to mess with the terminal.
+	    //
+	    if (next != NULL) {
+		char *q;
+
+		for (q = wordStart; q < wordOut; q++) {
+		    if (*q == '\r' || *q == '\n' || *q == '\t')
+			*q = ' ';
+		    else if ((*q >= '\0' && *q < ' ') || *q == '\177')
+			*q = '?';
+		}
+		out = afterWord = wordOut;
+		p = next;
+		continue;
+	    }
+	}
+
+	if (*p == '\r' || *p == '\n') {
+	    p++;
+	} else if (*p == ' ' || *p == '\t') {
+	    *out++ = ' ';
+	    p++;
+	} else {
+	    *out++ = *p++;
+	    afterWord = NULL;
+	}
+    }
+
+    *out = '\0';
+    String_SetLength(result, out - start);
+
+    return result;
+}
+
+// Does the header value have any encoded words (or folding) to decode?
+//
+static inline bool MIME_HasEncodedWords(const String *value)
+{
+    return memmem(String_Chars(value), String_Length(value), "=?", 2) !=
+	NULL || String_FindChar(value, '\n', true) != kString_NotFound;
+}
+
+static int Message_DecodedSlot(const String *key)
+{
+    int i;
+
+    for (i = 0; i < kMessage_DecodedHeaders; i++) {
+	if (strlen(kDecoded_Keys[i]) == String_Length(key) &&
+	    strncasecmp(kDecoded_Keys[i], String_Chars(key),
+			String_Length(key)) == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+// Get the decoded value of the From:, Subject: or To: header (or NULL
+// if the message doesn't have one)
+//
+const String *Message_DecodedHeader(Message *msg, const String *key)
+{
+    int slot = Message_DecodedSlot(key);
+    String *value = Header_Get(msg->headers, key);
+
+    if (value == NULL || slot < 0)
+	return value;
+
+    if (msg->decoded[slot] == NULL) {
+	msg->decoded[slot] = MIME_DecodeWords(value);
+	if (msg->decoded[slot] == NULL)
+	    msg->decoded[slot] = String_Clone(value);
+    }
+
+    return msg->decoded[slot];
+}
+
+// Does the header's value contain the string, either as is or decoded?
+//
+static bool Message_HeaderContains(Message *msg, Header *head,
+				   const String *string)
+{
+    if (String_FoundString(head->value, string, false))
+	return true;
+    if (!MIME_HasEncodedWords(head->value))
+	return false;
+
+    if (Message_DecodedSlot(head->key) >= 0 &&
+	Header_Find(msg->headers, head->key) == head)
+	return String_FoundString(Message_DecodedHeader(msg, head->key),
+				  string, false);
+
+    String *decoded = MIME_DecodeWords(head->value);
+    bool found = String_FoundString(decoded, string, false);
+
+    String_Free(decoded);
+
+    return found;
+}
+
+/**
+ **  Message Functions
+ **/
+
+Message *Message_New(Mailbox *mbox, int num)
+{
+    Message *msg = New(Message);
+
+    msg->mbox = mbox;
+    msg->num = num;
+
+    return msg;
+}
+
+void Message_Free(Message *msg, bool all)
+{
     Message *next;
 
     for (; msg != NULL; msg = next) {
@@ -2563,6 +3723,7 @@ void Message_Free(Message *msg, bool all)
 	Headers_Free(msg->headers);
 	String_Free(msg->body);
 	// Don't free msg->cachedID -- it is "owned" by the headers
+	Message_ForgetDecoded(msg);
 	xfree(msg);
 
 	if (!all)
@@ -2760,16 +3921,17 @@ void WarnContentLength(Message *msg, int contLen, int bodyLen)
     int delta = abs(contLen - bodyLen);
 
     if (delta > 1 && contLen > bodyLen) {
-	Warn("Message %s: Truncated, %d bytes missing",
-	     String_CString(msg->tag), contLen - bodyLen);
+	Problem(kProblem_Truncated, "Message %s: Truncated, %d bytes missing",
+		String_CString(msg->tag), contLen - bodyLen);
 
     } else if (delta > 1 && contLen < bodyLen) {
-	Warn("Message %s: Oversized, %d bytes too many",
-	     String_CString(msg->tag), bodyLen - contLen);
+	Problem(kProblem_Oversized, "Message %s: Oversized, %d bytes too many",
+		String_CString(msg->tag), bodyLen - contLen);
 
     } else if (gStrict) {
-	Warn("Message %s: Incorrect Content-Length: %d; using %d",
-	     String_CString(msg->tag), contLen, bodyLen);
+	Problem(kProblem_ContentLength,
+		"Message %s: Incorrect Content-Length: %d; using %d",
+		String_CString(msg->tag), contLen, bodyLen);
     }
 }
 
@@ -3042,7 +4204,8 @@ void MoveToEndOfMessage(Parser *par, Message *msg)
 		// up messages, adding extranoues headers.
 		//
 #ifdef IMMEDIATE_WARNINGS
-		Parser_Warn(par, "Message %s: Corrupted by Dovecot "
+		Parser_Warn(par, kProblem_DovecotBug,
+			    "Message %s: Corrupted by Dovecot "
 			    "\"From \" bug", String_CString(msg->tag));
 #endif
 		return;
@@ -3224,7 +4387,9 @@ bool Parse_Message(Parser *par, Mailbox *mbox, bool useAllData, Message **pMsg)
 {
     // Skip over possible newslines (should not be here, but...)
     if (Parse_Newline(par, NULL)) {
-	Warn("Unexpected newline(s) after message %d", mbox->count);
+	gProblemMessage = mbox->count;
+	Problem(kProblem_ExtraNewlines,
+		"Unexpected newline(s) after message %d", mbox->count);
 	while (Parse_Newline(par, NULL));
     }
 
@@ -3237,7 +4402,8 @@ bool Parse_Message(Parser *par, Mailbox *mbox, bool useAllData, Message **pMsg)
 
     msg->mbox = mbox;
     msg->num = ++mbox->count;
-    msg->tag = String_PrintF("#%d {@%d}", msg->num, Parser_Position(par));
+    msg->tag = String_PrintF("#%d {@%d}", msg->num, Parser_Offset(par));
+    gProblemMessage = msg->num;
 
     Parse_StringStart(par, &msg->data);
 
@@ -3245,19 +4411,24 @@ bool Parse_Message(Parser *par, Mailbox *mbox, bool useAllData, Message **pMsg)
     //
     if (!Parse_FromSpaceLine(par, &msg->envelope, &msg->envSender,
 			     &msg->envDate)) {
-	Parser_Warn(par, "Could not find a valid \"From \" line for message %s",
-		    String_CString(msg->tag));
+	if (gExpectEnvelope)
+	    Parser_Warn(par, kProblem_BadEnvelope,
+			"Could not find a valid \"From \" line for "
+			"message %s", String_CString(msg->tag));
     } else if (String_IsEmpty(msg->envSender)) {
-	Parser_Warn(par, "Empty envelope sender for message %s",
+	Parser_Warn(par, kProblem_BadEnvelope,
+		    "Empty envelope sender for message %s",
 		    String_CString(msg->tag));
     }
 
     // Parse headers (until & including empty line)
     //
     if (!Parse_Headers(par, msg, &msg->headers)) {
-	Parser_Warn(par, "Message %s: Could not parse headers",
+	Parser_Warn(par, kProblem_BadHeader,
+		    "Message %s: Could not parse headers",
 		    String_CString(msg->tag));
 	Parser_MoveTo(par, savedPos);
+	mbox->count--;
 	return false;
     }
 
@@ -3297,14 +4468,39 @@ void Stream_WriteMessage(Stream *output, Message *msg)
     Stream_WriteString(output, Message_Body(msg));
 }
 
+// Render the message as it would be written to a mailbox file
+//
+String *Message_Render(Message *msg)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *file = open_memstream(&buf, &size);
+
+    if (file == NULL)
+	Fatal(EX_OSERR, "Could not open memory stream: %s", strerror(errno));
+
+    Stream *stream = Stream_New(file, &Str_MemoryStream, false);
+
+    Stream_WriteMessage(stream, msg);
+    Stream_Free(stream, true);
+    xfree(stream);
+
+    return String_New(kString_Alloced, Memory_Adopt(buf), size);
+}
+
 /**
  **  Mailbox Functions
  **/
 
 extern void Mailbox_Unlock(const String *source);
+extern bool Mailbox_RollBack(const String *source);
+extern bool Mailbox_IsSavePending(const String *destination);
+extern bool Mailbox_CommitSaves(bool all);
+extern void Mailbox_StopLoading(Mailbox *mbox);
 
 void Mailbox_Free(Mailbox *mbox)
 {
+    Mailbox_StopLoading(mbox);
     Mailbox_Unlock(mbox->source);
     Message_Free(mbox->root, true);
     String_Free(mbox->data);
@@ -3366,2374 +4562,9674 @@ void Mailbox_Append(Mailbox *mbox, Message *msg)
     Mailbox_SetDirty(mbox, true);
 }
 
-bool Parse_Messages(Parser *par, Mailbox *mbox)
-{
-    Message **pMsg = &mbox->root;
-
-    if (gVerbose)
-	Note("Parsing mailbox %s", String_CString(Mailbox_Name(mbox)));
+/**
+ **  Salvaging
+ **
+ **  Normally, we stop parsing a mailbox at the first thing that doesn't
+ **  look like a message.  When salvaging (--salvage), we'll instead skip
+ **  over anything that looks damaged -- typically runs of NULs or other
+ **  binary junk left behind by a crash -- and pick up again at the next
+ **  good "From " line.
+ **/
 
-    // Append at the end
-    while (*pMsg != NULL)
-	pMsg = &(*pMsg)->next;
+#define kSWAR_Ones	0x0101010101010101ULL
+#define kSWAR_Highs	0x8080808080808080ULL
 
-    while (Parse_Message(par, mbox, false, pMsg)) {
-	Parse_Newline(par, NULL);
-	pMsg = &(*pMsg)->next;
-    }
+// Return w with the high bit set in each byte that's a control char
+//
+static inline uint64_t SWAR_Controls(uint64_t w)
+{
+    return ~(((w & ~kSWAR_Highs) + 0x60 * kSWAR_Ones) | w) & kSWAR_Highs;
+}
 
-    if (!Parser_AtEnd(par))
-	Parser_Warn(par, "Unparsable garbage at end of mailbox (@%d):\n %s",
-		    Parser_Position(par), String_QuotedCString(&par->rest, 72));
+// Return w with the high bit set in each byte that equals ch
+//
+static inline uint64_t SWAR_Equals(uint64_t w, int ch)
+{
+    uint64_t x = w ^ (ch * kSWAR_Ones);
 
-    return true;
+    return ~(((x & ~kSWAR_Highs) + ~kSWAR_Highs) | x) & kSWAR_Highs;
 }
 
-int readint(int fd)
+// Count the bytes with their high bit set
+//
+static inline int SWAR_Count(uint64_t highs)
 {
-    char buf[16];
-    int nc = read(fd, buf, sizeof(buf) - 1);
-    if (nc < 0)
-	return -1;
-    buf[nc] = '\0';
-    return atoi(buf);
+    return ((highs >> 7) * kSWAR_Ones) >> 56;
 }
 
-bool writeint(int fd, int k)
+// Return true if ch shouldn't be found in any kind of text
+//
+static inline bool Char_IsBinary(int ch)
 {
-    char buf[16];
-    sprintf(buf, "%d", k);
-    int len = strlen(buf);
-    return write(fd, buf, len) == len;
+    ch &= 0xFF;
+    return ch < 0x20 && ch != '\n' && ch != '\t' && ch != '\r' &&
+	ch != '\f' && ch != '\033';
 }
 
-static Array *gLockedMailboxes;
+static int CountBinaryChars(const char *chars, int length)
+{
+    int count = 0;
+    int i;
 
-bool Mailbox_Lock(const String *source, int timeout)
+    for (i = 0; i + 8 <= length; i += 8) {
+	uint64_t w, controls;
+
+	memcpy(&w, chars + i, sizeof(w));
+	controls = SWAR_Controls(w);
+
+	// The common case -- nothing to see here
+	if (controls == 0)
+	    continue;
+
+	controls &= ~(SWAR_Equals(w, '\n') | SWAR_Equals(w, '\t') |
+		      SWAR_Equals(w, '\r') | SWAR_Equals(w, '\f') |
+		      SWAR_Equals(w, '\033'));
+	count += SWAR_Count(controls);
+    }
+
+    for (; i < length; i++) {
+	if (Char_IsBinary(chars[i]))
+	    count++;
+    }
+
+    return count;
+}
+
+static bool IsDamagedBlock(const char *chars, int length, int pos)
 {
-    //String *tmpFile;
-    //String *lockFile;
+    return CountBinaryChars(chars + pos,
+			    iMin(kSalvage_BlockSize, length - pos)) >
+	kSalvage_MaxBinary;
+}
 
-    if (gDryRun || !gLock)
-	return true;
+// Find the next damaged stretch at or after pos.  Returns false if
+// there is none.
+//
+bool FindDamage(const char *chars, int length, int pos,
+		int *pStart, int *pEnd)
+{
+    int start, end;
 
-#ifdef OPT_CCLIENT_LOCK
-    ...
-#endif
+    for (start = pos; start < length; start += kSalvage_BlockSize) {
+	if (IsDamagedBlock(chars, length, start))
+	    break;
+    }
 
-#ifdef OPT_LOCK_FILE
-    String *lockFile = String_Append(source, &Str_DotLock, NULL);
-    const char *cLockFile = String_CString(lockFile);
-    time_t start, end;
-    int fd;
+    if (start >= length)
+	return false;
 
-    time(&start);
+    for (end = start; end < length; end += kSalvage_BlockSize) {
+	if (!IsDamagedBlock(chars, length, end))
+	    break;
+    }
+    end = iMin(end, length);
 
-    // Try to create a .lock file, but only if one doesn't already exist
+    // Trim the stretch down to its outermost binary chars, and then
+    // extend it to include any neighboring ones
     //
-    while ((fd = open(cLockFile, O_WRONLY|O_EXCL|O_CREAT, 0444)) == -1) {
-	int err = errno;
-	
-	// Give up if we've been waiting too long
-	//
-	time(&end);
+    while (!Char_IsBinary(chars[start]))
+	start++;
+    while (start > pos && Char_IsBinary(chars[start - 1]))
+	start--;
+    while (!Char_IsBinary(chars[end - 1]))
+	end--;
+    while (end < length && Char_IsBinary(chars[end]))
+	end++;
+
+    *pStart = start;
+    *pEnd = end;
 
-	if (end - start > timeout) {
-	    // Fake a more meaningful error if needed
-	    errno = (err == EEXIST) ? ENOLCK : err;
-	    String_Free(lockFile);
-	    return false;
-	}
-	
-	// Check if 1) the file already exists, 2) if it contains a pid of
-	// the owner, and 3) if the owner process still exists.
-	//
-	if (errno == EEXIST) {
-	    fd = open(cLockFile, O_RDONLY);
-	    if (fd != -1) {
-		int pid = readint(fd);
-		close(fd);
-
-		if (pid > 0 && kill(pid, 0) == -1) {
-		    // Process is gone, nuke the lock
-		    Note("Removing lock %s from defunct process %d",
-			 cLockFile, pid);
-		    if (unlink(cLockFile) != 0) {
-			// Ugh!
-			String_Free(lockFile);
-			return false;
-		    }
+    return true;
+}
 
-		    // Try locking it again
-		    continue;
-		}
-	    }
-	}
+// Move to the start of the next line that is a valid "From " line
+// (counting anything right after binary junk as a new line).  Returns
+// false (without moving) if there is none.
+//
+bool Parse_UntilValidFromSpace(Parser *par)
+{
+    int savedPos = Parser_Position(par);
 
-	sleep(1);
-    }
+    while (Parse_UntilString(par, &Str_FromSpace, true, NULL)) {
+	int pos = Parser_Position(par);
 
-    String_Free(lockFile);
+	if (pos == 0 || par->start[pos - 1] == '\n' ||
+	    Char_IsBinary(par->start[pos - 1])) {
+	    Parser probe = *par;
+	    String *sender = NULL;
+	    struct tm date;
+	    bool valid = Parse_FromSpaceLine(&probe, NULL, &sender, &date);
 
-    // Great, got the .lock file!  Now record our pid in it
-    //
-    if (!writeint(fd, getpid())) {
-	int err = errno;
-	close(fd);
-	errno = err;
-	return false;
-    }
+	    String_FreeP(&sender);
+	    if (valid)
+		return true;
+	}
 
-    if (close(fd) != 0) {
-	return false;
+	Parser_MoveTo(par, pos + 1);
     }
-#endif
 
-    // Remember that we've locked this mailbox
-    Array_Append(gLockedMailboxes, String_Clone(source));
+    Parser_MoveTo(par, savedPos);
 
-    return true;
+    return false;
 }
 
-void Mailbox_Unlock(const String *source)
+// Parse all messages we can find, skipping over any damaged parts
+//
+void Parse_SalvageMessages(Parser *par, Mailbox *mbox, Message **pMsg)
 {
-    if (gDryRun || !gLock)
-	return;
-
-#ifdef OPT_LOCK_FILE
-    String *lockFile = String_Append(source, &Str_DotLock, NULL);
-    const char *cLockFile = String_CString(lockFile);
-    int fd;
-
-    // Make sure we still own the lock
-    fd = open(cLockFile, O_RDONLY);
-    if (fd == -1) {
-	Warn("Could not open lock file %s: %s", cLockFile, strerror(errno));
-	String_Free(lockFile);
-	return;
-    }
+    const char *chars = par->start;
+    int length = Parser_Position(par) + String_Length(&par->rest);
 
-    int pid = readint(fd);
-    close(fd);
-
-    if (pid != getpid()) {
-	// Not ours
-	if (pid < 0)
-	    Warn("Could not read lock file %s: %s", cLockFile, strerror(errno));
-	else if (pid == 0)
-	    Warn("Someone stole lock file %s", cLockFile);
-	else
-	    Warn("Someone with pid %d stole lock file %s", pid, cLockFile);
-	String_Free(lockFile);
-	return;
-    }
+    while (!Parser_AtEnd(par)) {
+	int pos = Parser_Position(par);
+	int damageStart, damageEnd;
+	Parser good = *par;
 
-    if (unlink(cLockFile) != 0) {
-	Error("Could not remove lock file %s: %s", cLockFile, strerror(errno));
-	String_Free(lockFile);
-	return;
-    }
+	if (!FindDamage(chars, length, pos, &damageStart, &damageEnd))
+	    damageStart = damageEnd = length;
 
-    String_Free(lockFile);
-#endif
+	// Parse what we can up to the damage
+	//
+	String_Set(&good.rest, chars + pos, damageStart - pos);
+	while (Parse_Message(&good, mbox, false, pMsg)) {
+	    Parse_Newline(&good, NULL);
+	    pMsg = &(*pMsg)->next;
+	}
 
-    int i;
+	int skipStart = Parser_Position(&good);
 
-    for (i = 0; i < Array_Count(gLockedMailboxes); i++) {
-	const String *oldLock = Array_GetAt(gLockedMailboxes, i);
-	if (String_IsEqual(oldLock, source, true)) {
-	    Array_DeleteAt(gLockedMailboxes, i);
+	if (skipStart == length)
 	    break;
-	}
-    }
-}
 
-void Mailbox_UnlockAll(void)
-{
-    int i;
+	// Pick up again at the next valid "From " line, past the damage
+	// (if we actually made it that far)
+	//
+	Parser_MoveTo(par, skipStart < damageStart ? skipStart + 1 :
+		      damageEnd);
+	if (!Parse_UntilValidFromSpace(par))
+	    Parser_MoveTo(par, length);
 
-    for (i = Array_Count(gLockedMailboxes) - 1; i >= 0; i--) {
-	Mailbox_Unlock(Array_GetAt(gLockedMailboxes, i));
+	int skipEnd = Parser_Position(par);
+
+	Parser_Warn(par, kProblem_DamagedData,
+		    "Skipped %d byte%s of damaged data (@%d-%d)",
+		    skipEnd - skipStart, skipEnd - skipStart == 1 ? "" : "s",
+		    par->offset + skipStart, par->offset + skipEnd);
+	mbox->salvaged += skipEnd - skipStart;
     }
 }
 
-Mailbox *Mailbox_OpenQuietly(const String *source, bool create)
+bool Parse_Messages(Parser *par, Mailbox *mbox)
 {
-    // We only support mbox files for now
-    //
-    Stream *input = Stream_Open(source, false, false);
-    String *data = NULL;
-    Mailbox *mbox;
+    Message **pMsg = &mbox->root;
 
-    if (input != NULL) {
-	if (!Stream_ReadContents(input, &data)) {
-	    // Save the errno for our caller
-	    //
-	    int err = errno;
-	    Stream_Free(input, true);
-	    errno = err;
-	    return NULL;
-	}
+    if (gVerbose)
+	Note("Parsing mailbox %s", String_CString(Mailbox_Name(mbox)));
 
-	Stream_Free(input, true);
+    // Append at the end
+    while (*pMsg != NULL)
+	pMsg = &(*pMsg)->next;
 
-    } else if (!create) {
-	return NULL;
+    if (gSalvage) {
+	Parse_SalvageMessages(par, mbox, pMsg);
+	return true;
     }
 
-    Parser parser;
+    Progress_Start("reading", String_CString(Mailbox_Name(mbox)),
+		   Parser_Position(par) + String_Length(&par->rest));
 
-    mbox = New(Mailbox);
+    while (Parse_Message(par, mbox, false, pMsg)) {
+	Parse_Newline(par, NULL);
+	pMsg = &(*pMsg)->next;
+	Progress_Tick(Parser_Position(par));
+    }
 
-    mbox->source = String_Clone(source);
-    mbox->data = data;
+    Progress_Stop();
 
-    if (data != NULL) {
-	Parser_Set(&parser, data);
-	Parse_Messages(&parser, mbox);
-    }
+    if (!Parser_AtEnd(par))
+	Parser_Warn(par, kProblem_TrailingGarbage,
+		    "Unparsable garbage at end of mailbox (@%d):\n %s",
+		    Parser_Offset(par), String_QuotedCString(&par->rest, 72));
 
-    return mbox;
+    return true;
 }
 
-Mailbox *Mailbox_Open(const String *source, bool create)
-{
-    if (gVerbose)
-	Note("Locking mailbox %s", String_CString(source));
-
-    if (!Mailbox_Lock(source, kDefaultLockTimeout)) {
-	Error("Could not lock %s: %s",
-	      String_CString(source), strerror(errno));
-	return NULL;
-    }
+/**
+ **  Background Loading
+ **
+ **  In interactive mode, big mailboxes are parsed by a thread of their
+ **  own so that the first messages can be looked at while the rest are
+ **  still being loaded.  The loader parses into a mailbox of its own
+ **  and hands over batches of messages (and any warnings) which the
+ **  main thread links into the real mailbox whenever it looks.  Nothing
+ **  that has been handed over is touched by the loader again.
+ **/
 
-    if (gVerbose)
-	Note("Opening mailbox %s", String_CString(source));
+#ifdef USE_THREADS
 
-    Mailbox *mbox = Mailbox_OpenQuietly(source, create);
+typedef struct _Loader {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;	// Signaled whenever there's more to sync
+    Parser parser;
+    Mailbox shadow;		// What the loader parses into
+    bool strict;
+    // Shared (under lock)
+    Message *pending;		// Handed over but not yet linked in
+    Message *pendingTail;
+    int pendingCount;
+    Array *warnings;		// Handed over but not yet printed
+    int position;		// How far the loader has gotten
+    bool done;
+    bool cancel;
+    // Main thread only
+    Message *tail;		// Last message linked into the mailbox
+} Loader;
+
+// Don't let ^C (and the longjmp that comes with it) catch the main
+// thread while holding the lock
+//
+static void Loader_Lock(Loader *loader, sigset_t *pSaved)
+{
+    sigset_t blocked;
 
-    if (mbox == NULL) {
-	Mailbox_Unlock(source);
-	Error("Could not open %s: %s",
-	      String_CString(source), strerror(errno));
-	return NULL;
-    }
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, pSaved);
+    pthread_mutex_lock(&loader->lock);
+}
 
-    return mbox;
+static void Loader_Unlock(Loader *loader, sigset_t *pSaved)
+{
+    pthread_mutex_unlock(&loader->lock);
+    pthread_sigmask(SIG_SETMASK, pSaved, NULL);
 }
-void Stream_WriteMailbox(Stream *output, Mailbox *mbox, bool sanitize)
+
+static void *Loader_Run(void *arg)
 {
-    // Dovecot and C-Client based IMAP implementations store internal
-    // IMAP information in an X-IMAP or X-IMAPbase header that must
-    // be in the first message in the mailbox.  If we're deleting this
-    // message, we need to move the value to an X-IMAPbase header in the
-    // new first message.  (X-IMAP is only used when the first message
-    // is a pseudo-message.)
-    // 
-    if (sanitize) {
-	Message *first, *msg;
-	String *imap = NULL;
+    Loader *loader = arg;
+    Parser *par = &loader->parser;
+    MfckContext context = {0};
+    Message *first = NULL, *last = NULL;
+    Message **pMsg = &first;
+    int count = 0;
+    bool more = true;
+    int i;
 
-	// Find first non-deleted message
-	//
-	for (first = Mailbox_Root(mbox); first != NULL; first = first->next) {
-	    if (!Message_IsDeleted(first))
-		break;
-	}
+    // Collect our warnings rather than printing them (they're passed
+    // on as they are, so don't let the array free them)
+    //
+    context.problems = Array_New(0, NULL);
+    gContext = &context;
+    gStrict = loader->strict;
 
-	for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
-	    imap = Header_Get(msg->headers, &Str_XIMAPBase);
-	    if (imap == NULL)
-		imap = Header_Get(msg->headers, &Str_XIMAP);
-	    if (imap != NULL)
-		break;
+    while (more) {
+	if (Parse_Message(par, &loader->shadow, false, pMsg)) {
+	    Parse_Newline(par, NULL);
+	    last = *pMsg;
+	    pMsg = &last->next;
+	    if (++count < kLoad_BatchSize)
+		continue;
+	} else {
+	    if (!Parser_AtEnd(par))
+		Parser_Warn(par, kProblem_TrailingGarbage,
+			    "Unparsable garbage at end of mailbox "
+			    "(@%d):\n %s", Parser_Offset(par),
+			    String_QuotedCString(&par->rest, 72));
+	    more = false;
 	}
 
-	if (msg != NULL && msg != first) {
-	    // Move X-IMAPBase header to first message
-	    Header_Set(first->headers, &Str_XIMAPBase, String_Clone(imap));
-	    Header_Delete(msg->headers, &Str_XIMAP, false);
-	    Header_Delete(msg->headers, &Str_XIMAPBase, false);
+	pthread_mutex_lock(&loader->lock);
+
+	if (first != NULL) {
+	    if (loader->pending == NULL)
+		loader->pending = first;
+	    else
+		loader->pendingTail->next = first;
+	    loader->pendingTail = last;
+	    loader->pendingCount += count;
 	}
-    }
+	for (i = 0; i < Array_Count(context.problems); i++)
+	    Array_Append(loader->warnings, Array_GetAt(context.problems, i));
+	loader->position = Parser_Position(par);
+	if (loader->cancel)
+	    more = false;
+	loader->done = !more;
 
-    Message *msg;
+	pthread_cond_broadcast(&loader->ready);
+	pthread_mutex_unlock(&loader->lock);
 
-    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
-	if (!Message_IsDeleted(msg)) {
-	    Stream_WriteMessage(output, msg);
-	    Stream_WriteNewline(output);
-	}
+	Array_Reset(context.problems);
+	first = last = NULL;
+	pMsg = &first;
+	count = 0;
     }
+
+    gContext = NULL;
+    Array_Free(context.problems);
+    String_Free(context.error);
+
+    return NULL;
 }
 
-bool Mailbox_Write(Mailbox *mbox, const String *destination, bool fatal)
+static void Loader_Free(Loader *loader)
 {
-    if (gVerbose) {
-	if (String_IsEqual(Mailbox_Source(mbox), destination, false))
-	    Note("Saving mailbox %s", String_CString(Mailbox_Name(mbox)));
-	else
-	    Note("Saving mailbox %s to %s",
-		 String_CString(Mailbox_Name(mbox)),
-		 String_CString(destination));
-    }
+    int i;
 
-    // Only mbox file destinations supported for now
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->ready);
+    Message_Free(loader->pending, true);
+    for (i = 0; i < Array_Count(loader->warnings); i++)
+	String_Free(Array_GetAt(loader->warnings, i));
+    Array_Free(loader->warnings);
+    xfree(loader);
+}
+
+// Start parsing the mailbox in the background.  Returns false if we
+// couldn't, in which case it's up to the caller to parse it.
+//
+bool Mailbox_LoadInBackground(Mailbox *mbox)
+{
+    Loader *loader = New(Loader);
+    sigset_t all, saved;
+    int err;
+
+    Parser_Set(&loader->parser, mbox->data);
+    loader->strict = gStrict;
+    loader->warnings = Array_New(0, NULL);
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+
+    // Leave all signals to the main thread
     //
-    const String *file = destination;
-    Stream *tmp = Stream_OpenTemp(file, true, true);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    err = pthread_create(&loader->thread, NULL, Loader_Run, loader);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (err != 0) {
+	if (gVerbose)
+	    Note("Could not start loader thread: %s", strerror(err));
+	Loader_Free(loader);
+	return false;
+    }
 
-    Stream_WriteMailbox(tmp, mbox, true);
-    Stream_Close(tmp);
+    mbox->loader = loader;
 
-    const char *cFile = String_CString(destination);
+    return true;
+}
 
-    if (gBackup) {
-	int len = String_Length(file);
-	char bakPath[len + 1 + 1];
+// Link in whatever the loader has handed over since last time and
+// print any warnings that came with it.  Returns true while the
+// mailbox is still being loaded.
+//
+bool Mailbox_Sync(Mailbox *mbox)
+{
+    Loader *loader = mbox->loader;
+    Message *msg;
+    Array *warnings;
+    sigset_t saved;
+    int count, i;
+    bool done;
 
-	memcpy(bakPath, cFile, len);
-	strcpy(&bakPath[len], "~");
+    if (loader == NULL)
+	return false;
 
-	if (rename(cFile, bakPath) != 0) {
-	    Fatal(fatal ? EX_CANTCREAT : EX_OK,
-		  "Could not rename %s to %s: %s",
-		  cFile, bakPath, strerror(errno));
-	    return false;
+    Loader_Lock(loader, &saved);
+    msg = loader->pending;
+    count = loader->pendingCount;
+    loader->pending = loader->pendingTail = NULL;
+    loader->pendingCount = 0;
+    warnings = loader->warnings;
+    loader->warnings = Array_New(0, NULL);
+    done = loader->done;
+    Loader_Unlock(loader, &saved);
+
+    if (msg != NULL) {
+	if (loader->tail == NULL)
+	    mbox->root = msg;
+	else
+	    loader->tail->next = msg;
+	for (; msg != NULL; msg = msg->next) {
+	    msg->mbox = mbox;
+	    loader->tail = msg;
 	}
+	mbox->count += count;
     }
 
-    if (rename(String_CString(tmp->name), cFile) != 0) {
-	Fatal(fatal ? EX_CANTCREAT : EX_OK, "Could not rename %s to %s: %s",
-	      String_CString(tmp->name), cFile, strerror(errno));
-	return false;
+    for (i = 0; i < Array_Count(warnings); i++) {
+	String *warning = Array_GetAt(warnings, i);
+	Warn("%s", String_CString(warning));
+	String_Free(warning);
     }
+    Array_Free(warnings);
 
-    Stream_Free(tmp, false);
+    if (!done)
+	return true;
 
-    Mailbox_SetDirty(mbox, false);
+    pthread_join(loader->thread, NULL);
+    Loader_Free(loader);
+    mbox->loader = NULL;
 
-    return true;
+    return false;
 }
 
-bool Mailbox_Save(Mailbox *mbox, bool force, bool fatal)
+// Wait until at least count messages have been loaded (or all there
+// are, if fewer).  Returns the number of messages loaded.
+//
+int Mailbox_WaitFor(Mailbox *mbox, int count)
 {
-    if (!Mailbox_IsDirty(mbox) && !force) {
-	Note("Leaving mailbox %s unchanged",
-	     String_CString(Mailbox_Name(mbox)));
-	return true;
+    bool noted = false;
+    sigset_t saved;
 
-    } else {
-	return Mailbox_Write(mbox, mbox->source, fatal);
+    while (Mailbox_Sync(mbox) && mbox->count < count) {
+	Loader *loader = mbox->loader;
+
+	if (count == INT_MAX && !noted) {
+	    Note("Waiting for the rest of the mailbox to load");
+	    noted = true;
+	}
+
+	Loader_Lock(loader, &saved);
+	while (loader->pending == NULL && !loader->done)
+	    pthread_cond_wait(&loader->ready, &loader->lock);
+	Loader_Unlock(loader, &saved);
     }
-}
 
-/**
- **  Interaction Functions
- **/
+    return Mailbox_Count(mbox);
+}
 
-// Note: Return pointer to static storage.  Will be overwritten
-// on succeeding calls. Must not be freed or saved by caller.
+// How much of the mailbox has been loaded (in percent)
 //
-bool User_AskLine(const char *prompt, const String **pLine, bool trim)
+int Mailbox_LoadProgress(Mailbox *mbox)
 {
-    static String line = {NULL, 0, kString_Const};
-#ifdef USE_READLINE
-    static char *buf = NULL;
-
-    xfree(buf);
-
-    buf = readline(prompt);
-
-    if (buf == NULL)
-	return false;
-    
-    add_history(buf);
-#else
-    static char buf[1024];
+    Loader *loader = mbox->loader;
+    sigset_t saved;
+    int position;
 
-    fprintf(stdout, "%s", prompt);
-    if (fgets(buf, sizeof(buf), stdin) == NULL)
-	return false;
-#endif
+    if (!Mailbox_Sync(mbox))
+	return 100;
 
-    if (pLine != NULL) {
-	int len = strlen(buf);
-	if (len > 0 && buf[len-1] == '\n')
-	    len--;
-	buf[len] = '\0';
-	String_Set(&line, buf, len);
-	if (trim)
-	    String_TrimSpaces(&line);
-	*pLine = &line;
-    }
+    Loader_Lock(loader, &saved);
+    position = loader->position;
+    Loader_Unlock(loader, &saved);
 
-    return true;
+    return (int) (100.0 * position / iMax(1, String_Length(mbox->data)));
 }
 
-// Ask the user a question that requires a single character answer
-// (lowercase only, please)
-//
-int User_AskChoice(const char *question, const char *choices, char def)
+void Mailbox_StopLoading(Mailbox *mbox)
 {
-    int answer = EOF;
-
-    do {
-	int ch;
-
-#if 0
-	// Present the question and the options
-	//
-	fprintf(stdout, "%s [", question);
-	for (p = choices; *p != '\0'; p++) {
-	    putc((*p == def) ? toupper(*p) : *p, stdout);
-	}
-	fprintf(stdout, "] ");
-#else
-	fprintf(stdout, "%s %c\010", question, def);
-#endif
+    Loader *loader = mbox->loader;
+    sigset_t saved;
 
-	// Get an answer
-	//
-	while ((ch = getchar()) != EOF && ch == ' ');
-	if (ch == EOF)
-	    break;
-
-	// Validate the answer
-	//
-	if (ch == '\n')
-	    break;
+    if (loader == NULL)
+	return;
 
-	if (strchr(choices, ch) != NULL)
-	    answer = ch;
+    Loader_Lock(loader, &saved);
+    loader->cancel = true;
+    Loader_Unlock(loader, &saved);
 
-	// Eat rest of line
-	while (ch != '\n' && (ch = getchar()) != EOF);
-	if (ch == EOF)
-	    break;
+    pthread_join(loader->thread, NULL);
+    Loader_Free(loader);
+    mbox->loader = NULL;
+}
 
-    } while (answer == EOF);
+#else
 
-    return answer != EOF ? answer : def;
+bool Mailbox_LoadInBackground(Mailbox *mbox)
+{
+    return false;
 }
 
-bool User_AskYesOrNo(const char *question, bool def)
+bool Mailbox_Sync(Mailbox *mbox)
 {
-    return User_AskChoice(question, "yn", def ? 'y' : 'n') == 'y';
+    return false;
 }
 
-/*
-** Message Sets
-*/
+int Mailbox_WaitFor(Mailbox *mbox, int count)
+{
+    return Mailbox_Count(mbox);
+}
 
-typedef struct _MessageSet {
-    int min, max;
-    struct _MessageSet *link;
-} MessageSet;
+int Mailbox_LoadProgress(Mailbox *mbox)
+{
+    return 100;
+}
 
-MessageSet *MessageSet_Make(int min, int max, MessageSet *link)
+void Mailbox_StopLoading(Mailbox *mbox)
 {
-    MessageSet *set = New(MessageSet);
+}
 
-    set->min = min;
-    set->max = max;
-    set->link = link;
+#endif
 
-    return set;
+int readint(int fd)
+{
+    char buf[16];
+    int nc = read(fd, buf, sizeof(buf) - 1);
+    if (nc < 0)
+	return -1;
+    buf[nc] = '\0';
+    return atoi(buf);
 }
 
-void MessageSet_Free(MessageSet *set)
+bool writeint(int fd, int k)
 {
-    while (set != NULL) {
-	MessageSet *link = set->link;
-	free(set);
-	set = link;
-    }
+    char buf[16];
+    sprintf(buf, "%d", k);
+    int len = strlen(buf);
+    return write(fd, buf, len) == len;
 }
 
-// Parse a message set specification of the form:
-//   <min>['-'[<max>]][','...] | '*'
+static Array *gLockedMailboxes;
+
+// Take the lock whether we're locking mailboxes or not
 //
-bool Parse_MessageSet(Parser *par, MessageSet **pSet, int last)
+static bool Mailbox_TakeLock(const String *source, int timeout)
 {
-    int min, max;
-    MessageSet *link = NULL;
+    //String *tmpFile;
+    //String *lockFile;
 
-    if (Parse_ConstChar(par, '*', true, NULL)) {
-	min = 1;
-	max = last;
+#ifdef OPT_CCLIENT_LOCK
+    ...
+#endif
 
-    } else {
-	if (!Parse_Integer(par, &min))
-	return false;
-	if (Parse_ConstChar(par, '-', true, NULL)) {
-	    if (!Parse_Integer(par, &max))
-		max = last;
-	} else {
-	    max = min;
+#ifdef OPT_LOCK_FILE
+    String *lockFile = String_Append(source, &Str_DotLock, NULL);
+    const char *cLockFile = String_CString(lockFile);
+    time_t start, end;
+    int fd;
+
+    time(&start);
+
+    // Try to create a .lock file, but only if one doesn't already exist
+    //
+    while ((fd = open(cLockFile, O_WRONLY|O_EXCL|O_CREAT, 0444)) == -1) {
+	int err = errno;
+	
+	// Give up if we've been waiting too long
+	//
+	time(&end);
+
+	if (end - start > timeout) {
+	    // Fake a more meaningful error if needed
+	    errno = (err == EEXIST) ? ENOLCK : err;
+	    String_Free(lockFile);
+	    return false;
 	}
-	if (Parse_ConstChar(par, ',', true, NULL)) {
-	    (void) Parse_MessageSet(par, &link, last);
+	
+	// Check if 1) the file already exists, 2) if it contains a pid of
+	// the owner, and 3) if the owner process still exists.
+	//
+	if (errno == EEXIST) {
+	    fd = open(cLockFile, O_RDONLY);
+	    if (fd != -1) {
+		int pid = readint(fd);
+		close(fd);
+
+		if (pid > 0 && kill(pid, 0) == -1) {
+		    // Process is gone, nuke the lock
+		    Note("Removing lock %s from defunct process %d",
+			 cLockFile, pid);
+		    if (unlink(cLockFile) != 0) {
+			// Ugh!
+			String_Free(lockFile);
+			return false;
+		    }
+
+		    // Try locking it again
+		    continue;
+		}
+	    }
 	}
+
+	sleep(1);
     }
 
-    *pSet = MessageSet_Make(min, max, link);
-    return true;
-}
+    String_Free(lockFile);
 
-MessageSet* MessageSet_Append(MessageSet *a, MessageSet *b)
-{
-    MessageSet **pa;
+    // Great, got the .lock file!  Now record our pid in it
+    //
+    if (!writeint(fd, getpid())) {
+	int err = errno;
+	close(fd);
+	errno = err;
+	return false;
+    }
 
-    for (pa = &a; *pa != NULL; pa = &(*pa)->link);
-    *pa = b;
+    if (close(fd) != 0) {
+	return false;
+    }
+#endif
 
-    return a != NULL ? a : b;
+    // Remember that we've locked this mailbox
+    Array_Append(gLockedMailboxes, String_Clone(source));
+
+    return true;
 }
 
-int MessageSet_First(MessageSet *set)
+bool Mailbox_Lock(const String *source, int timeout)
 {
-    if (set == NULL)
-	return -1;
-    return set->min;
+    if (gDryRun || !gLock)
+	return true;
+
+    return Mailbox_TakeLock(source, timeout);
 }
 
-int MessageSet_Next(MessageSet *set, int cur)
+static int LockedMailboxIndex(const String *source)
 {
-    for (; set != NULL; set = set->link) {
-	if (cur < set->min)
-	    return set->min;
-	if (cur < set->max)
-	    return cur + 1;
+    int i;
+
+    for (i = 0; i < Array_Count(gLockedMailboxes); i++) {
+	const String *oldLock = Array_GetAt(gLockedMailboxes, i);
+	if (String_IsEqual(oldLock, source, true))
+	    return i;
     }
 
     return -1;
 }
 
-/*
-**  Application Functions
-*/
-
-void InterruptHandler(int signum)
+// Release the lock if we took it (whether we're locking mailboxes or not)
+//
+static void Mailbox_ReleaseLock(const String *source)
 {
-    putchar('\n');
+    // Nothing to do unless we're holding the lock (which we won't be
+    // if we're late locking and haven't gotten around to saving yet)
+    //
+    if (LockedMailboxIndex(source) == -1)
+	return;
 
-    if (gOpenPipe != NULL) {
-	pclose(gOpenPipe);
-	gOpenPipe = NULL;
-    }
+    // Keep it locked until the new version is in place
+    if (Mailbox_IsSavePending(source))
+	return;
 
-#if 0
-    // Kill all subprocesses in our process group
-    printf("# killpg\n");
-    sig_t oldHandler = signal(SIGTERM, SIG_IGN);
-    killpg(0, SIGTERM);
-    signal(SIGTERM, oldHandler);
-#endif
+#ifdef OPT_LOCK_FILE
+    String *lockFile = String_Append(source, &Str_DotLock, NULL);
+    const char *cLockFile = String_CString(lockFile);
+    int fd;
 
-    if (signum == SIGINT && gInterruptReentry != NULL)
-	longjmp(*gInterruptReentry, 0);
-
-    // Close all open mailboxes
-    Mailbox_UnlockAll();
-
-    // Resend signal (and hopefully die)
-    signal(signum, SIG_DFL);
-    kill(0, signum);
-
-    // Still here?
-    exit(EX_UNAVAILABLE);
-}
+    // Make sure we still own the lock
+    fd = open(cLockFile, O_RDONLY);
+    if (fd == -1) {
+	Warn("Could not open lock file %s: %s", cLockFile, strerror(errno));
+	String_Free(lockFile);
+	return;
+    }
 
-void WriteQuotedExcerpt(FILE *out, String *str, int pos, int lines,
-			const char *prefix)
-{
-    const char *chars = String_Chars(str);
-    int len = String_Length(str);
-    const char *b, *e, *p;
-    int counter;
+    int pid = readint(fd);
+    close(fd);
 
-    // Extract a context of four lines before & after
-    // the "From " line.
-    //
-    counter = lines / 2;
-    for (b = chars + pos; b > chars; b--) {
-	if (*b == '\n' && counter-- == 0)
-	    break;
+    if (pid != getpid()) {
+	// Not ours
+	if (pid < 0)
+	    Warn("Could not read lock file %s: %s", cLockFile, strerror(errno));
+	else if (pid == 0)
+	    Warn("Someone stole lock file %s", cLockFile);
+	else
+	    Warn("Someone with pid %d stole lock file %s", pid, cLockFile);
+	String_Free(lockFile);
+	return;
     }
 
-    counter = lines - lines / 2;
-    for (e = chars + pos; e < chars + len; e++) {
-	if (*e == '\n' && counter-- == 0)
-	    break;
+    if (unlink(cLockFile) != 0) {
+	Error("Could not remove lock file %s: %s", cLockFile, strerror(errno));
+	String_Free(lockFile);
+	return;
     }
 
+    String_Free(lockFile);
+#endif
 
-    for (p = b; p < e; p++) {
-	if (p == b || p[-1] == '\n')
-	    fprintf(out, "%s", prefix);
-	putc(*p, out);
-    }
-    if (e > b && p[-1] != '\n')
-	putc('\n', out);
+    Array_DeleteAt(gLockedMailboxes, LockedMailboxIndex(source));
 }
 
-
-/* Check the string for "illegal" characters such as control chars
- * or non-ASCII chars (unless eightBitOK is set).
- * Return offset to illegal char if found, or -1 if OK.
- */
-static int FindIllegalChar(String *str, bool controlOK, bool eightBitOK)
+void Mailbox_Unlock(const String *source)
 {
-    int i, len = String_Length(str);
-    const char *chars = String_Chars(str);
-
-    for (i = 0; i < len; i++, chars++) {
-	if (*chars == '\r' || *chars == '\n' || *chars == '\t')
-	    continue;
-	if (!controlOK && ((*chars >= '\0' && *chars < ' ') || *chars == '\177'))
-	    return i;
-	if (!eightBitOK && !isascii(*chars))
-	    return i;
-    }
+    if (gDryRun || !gLock)
+	return;
 
-    return kString_NotFound;
+    Mailbox_ReleaseLock(source);
 }
 
-typedef struct {
-    bool repair;		// Are we repairing?
-    char autoChoice;		// Should this choice apply without asking?
-    bool quit;			// Have the user told us to quit repairing?
-} RepairState;
-
-void InitRepairState(RepairState *state, bool repair)
+void Mailbox_UnlockAll(void)
 {
-    state->repair = repair;
-    state->autoChoice = gInteractive ? '\0' : 'y';
-    state->quit = false;
-}
+    int i;
 
-bool IsRepairingAll(RepairState *state)
-{
-    return state->repair && state->autoChoice == 'y';
+    for (i = Array_Count(gLockedMailboxes) - 1; i >= 0; i--) {
+	Mailbox_ReleaseLock(Array_GetAt(gLockedMailboxes, i));
+    }
 }
 
-bool ShouldRepair(RepairState *state)
+// Open the mailbox and parse it (or just start parsing it, if told to
+// load it in the background and it's big enough to bother)
+//
+Mailbox *Mailbox_OpenQuietly(const String *source, bool create,
+			     bool background)
 {
-    int choice = state->autoChoice;
+    // We only support mbox files for now
+    //
+    Stream *input = Stream_Open(source, false, false);
+    String *data = NULL;
+    Mailbox *mbox;
 
-    if (!state->repair)
-	return false;
+    if (input != NULL) {
+	if (!Stream_ReadContents(input, &data)) {
+	    // Save the errno for our caller
+	    //
+	    int err = errno;
+	    Stream_Free(input, true);
+	    errno = err;
+	    return NULL;
+	}
 
-    if (choice == '\0')
-	choice = User_AskChoice(" Repair [ynq]?", "ynYNq", 'y');
+	Stream_Free(input, true);
 
-    // An uppercase answer will apply to all remaining questions
-    if (isupper(choice))
-	choice = state->autoChoice = tolower(choice);
+    } else if (!create) {
+	return NULL;
+    }
 
-    state->quit = (choice == 'q');
+    Parser parser;
 
-    return choice == 'y';
-}
+    mbox = New(Mailbox);
 
-void CheckMailbox(Mailbox *mbox, bool strict, bool repair)
-{
-    Message *msg;
-    RepairState state;
+    mbox->source = String_Clone(source);
+    mbox->data = data;
 
-    InitRepairState(&state, repair);
+    // If we're going to work on the mailbox without holding the lock,
+    // remember what it looked like so we can tell if anyone but the
+    // local delivery agent has touched it before we save it again.
+    // (Must be done before parsing -- mapped data isn't a true snapshot.)
+    //
+    if (gLateLock) {
+	md5_state_t md5state;
 
-    for (msg = Mailbox_Root(mbox); msg != NULL && !state.quit;
-	 msg = msg->next) {
-	String *value;
-	const String *source = NULL;
-	int cllen;
+	md5_init(&md5state);
+	md5_append(&md5state, (md5_byte_t *) String_Chars(data),
+		   String_Length(data));
+	md5_finish(&md5state, mbox->snapshotDigest);
+	mbox->snapshot = kSnapshot_Valid;
+	mbox->snapshotLength = String_Length(data);
+    }
 
-	// Check Content-Length
-	//
-	value = Header_Get(msg->headers, &Str_ContentLength);
-	cllen = String_ToInteger(value, -1);
+    // (Can't keep a loader thread within the memory budget, though.)
+    //
+    if (background && !gSalvage && gMaxMemory == 0 &&
+	String_Length(data) >= kLoad_MinBackgroundSize &&
+	Mailbox_LoadInBackground(mbox))
+	return mbox;
 
-	int bodyLength = Message_BodyLength(msg);
+    if (data != NULL) {
+	jmp_buf *savedReentry = gMemoryReentry;
+	jmp_buf reentry;
 
-	// Always care about incorrect Content-Lengths, but only
-	// care about missing ones if we're being strict.
-	if (cllen != bodyLength && (value != NULL || strict)) {
-	    // Got the Dovecot "From " bug?
-	    //
-	    if (msg->dovecotFromSpaceBug != kDFSB_None) {
-		// Yup, remove bogus headers from the body
-		Warn("Message %s: Corrupted by Dovecot \"From \" bug%s",
-		     String_CString(msg->tag),
-		     IsRepairingAll(&state) ? " (repairing)" : "");
+	// Give up on the mailbox rather than go over the memory budget
+	//
+	if (gMaxMemory > 0) {
+	    if (setjmp(reentry) != 0) {
+		gMemoryReentry = savedReentry;
+		Progress_Stop();
+		Message_Free(mbox->root, true);
+		String_Free(mbox->data);
+		String_Free(mbox->source);
+		xfree(mbox);
+		errno = ENOMEM;
+		return NULL;
+	    }
+	    gMemoryReentry = &reentry;
+	}
 
-		if (ShouldRepair(&state)) {
-		    RepairDovecotFromSpaceBugBody(msg);
-		    // Repairing the message will change it's length
-		    bodyLength = Message_BodyLength(msg);
-		} else if (state.quit)
-		    break;
+	Parser_Set(&parser, data);
+	Parse_Messages(&parser, mbox);
 
-	    } else {
-		if (value == NULL)
-		    Warn("Message %s: Missing Content-Length:, should be %d%s",
-			 String_CString(msg->tag), bodyLength,
-			 IsRepairingAll(&state) ? " (repairing)" : "");
-		else
-		    Warn("Message %s: Incorrect Content-Length: %s, "
-			 "should be %d%s", String_CString(msg->tag),
-			 String_PrettyCString(value), bodyLength,
-			 IsRepairingAll(&state) ? " (repairing)" : "");
+	gMemoryReentry = savedReentry;
+    }
 
-		if (ShouldRepair(&state))
-		    Header_Set(msg->headers, &Str_ContentLength,
-			       String_PrintF("%d", bodyLength));
-		else if (state.quit)
-		    break;
-	    }
-	}
+    return mbox;
+}
 
-	// Got Message-ID?
-	//
-	value = Header_Get(msg->headers, &Str_MessageID);
-	if (value == NULL || String_IsEmpty(value)) {
-	    source = &Str_XMessageID;
-	    value = Header_Get(msg->headers, source);
+// Open the mailbox, rolling back any interrupted in-place repair of it
+// first if we're going to be changing it (see Mailbox_RollBack)
+//
+Mailbox *Mailbox_Open(const String *source, bool create, bool background,
+		      bool rollBack)
+{
+    // Get any new version we have in the works in place first
+    //
+    if (Mailbox_IsSavePending(source))
+	(void) Mailbox_CommitSaves(true);
 
-	    if (value == NULL || String_IsEmpty(value)) {
-		String *synthID = Message_SynthesizeMessageID(msg);
+    // When late locking, we won't take the lock until it's time to
+    // save (see Mailbox_LockSnapshot)
+    //
+    if (gVerbose && !gLateLock)
+	Note("Locking mailbox %s", String_CString(source));
 
-		Warn("Message %s: Missing Message-ID: header, %s with %s",
-		     String_CString(msg->tag),
-		     IsRepairingAll(&state) ? "replacing" : "could replace",
-		     String_CString(synthID));
+    if (!gLateLock && !Mailbox_Lock(source, kDefaultLockTimeout)) {
+	Error("Could not lock %s: %s",
+	      String_CString(source), strerror(errno));
+	return NULL;
+    }
 
-		if (ShouldRepair(&state))
-		    Header_Set(msg->headers, &Str_MessageID, synthID);
-		else if (state.quit)
-		    break;
-	    }
+    // Clean up after any interrupted in-place patching.  That's only
+    // ever done holding the lock (even when not locking otherwise), as
+    // the repair may well still be under way, and only if we're going to
+    // change the mailbox ourselves; otherwise we'll just say so.
+    //
+    String *undo = String_Append(source, &Str_UndoSuffix, NULL);
+    bool journal = access(String_CString(undo), F_OK) == 0;
+
+    if (journal && (!rollBack || gDryRun)) {
+	Warn("Found undo journal %s from an interrupted repair, not rolling "
+	     "back", String_CString(undo));
+    } else if (journal) {
+	bool held = gLock && !gLateLock;
+
+	if (!held && !Mailbox_TakeLock(source, kDefaultLockTimeout)) {
+	    Error("Could not lock %s: %s",
+		  String_CString(source), strerror(errno));
+	    String_Free(undo);
+	    return NULL;
 	}
 
-	// Only strict tests below
-	//
-	if (!strict)
-	    continue;
+	bool rolledBack = Mailbox_RollBack(source);
 
-	// Got ">From " in headers?
-	//
-	value = Header_Get(msg->headers, &Str_GTFromSpace);
-	if (value != NULL) {
-	    Warn("Message %s: Bogus \">From \" line in the the headers:\n"
-		 " \">From %s\"%s",
-		 String_CString(msg->tag), String_CString(value),
-		 IsRepairingAll(&state) ? " (removing)" : "");
+	if (!held)
+	    Mailbox_ReleaseLock(source);
 
-	    if (ShouldRepair(&state))
-		Header_Delete(msg->headers, &Str_GTFromSpace, false);
-	    else if (state.quit)
-		break;
+	if (!rolledBack) {
+	    Mailbox_Unlock(source);
+	    String_Free(undo);
+	    return NULL;
 	}
+    }
+    String_Free(undo);
 
-	// Got From?
-	//
-	value = Header_Get(msg->headers, &Str_From);
-	if (value == NULL) {
-	    source = &Str_XFrom;
-	    value = String_Clone(Header_Get(msg->headers, source));
+    if (gVerbose)
+	Note("Opening mailbox %s", String_CString(source));
 
-	    if (value == NULL) {
-		source = &Str_Sender;
-		value = String_Clone(Header_Get(msg->headers, source));
-	    }
+    Mailbox *mbox = Mailbox_OpenQuietly(source, create, background);
 
-	    if (value == NULL) {
-		source = &Str_ReturnPath;
-		value = String_Clone(Header_Get(msg->headers, source));
-	    }
+    if (mbox == NULL) {
+	Mailbox_Unlock(source);
+	if (errno == ENOMEM && gMaxMemory > 0) {
+	    String *sizstr = String_ByteSize(gMaxMemory);
+	    Error("Could not open %s within the memory budget of %s",
+		  String_CString(source), String_CString(sizstr));
+	    String_Free(sizstr);
+	} else {
+	    Error("Could not open %s: %s",
+		  String_CString(source), strerror(errno));
+	}
+	return NULL;
+    }
 
-	    if (value == NULL) {
-		source = &Str_EnvelopeSender;
-		value = String_Clone(msg->envSender);
-	    }
+    return mbox;
+}
 
-	    if (value == NULL) {
-		Warn("Message %s: Missing From: header",
-		     String_CString(msg->tag));
+// Compute the MD5 digest of the first length bytes of an open file.
+// Returns false if the file couldn't be read or is shorter than that.
+//
+static bool DigestFilePrefix(int fd, size_t length, md5_byte_t digest[16])
+{
+    static ThreadLocal char *buf = NULL;
+    md5_state_t md5state;
+    ssize_t count = 0;
 
-	    } else {
-		Warn("Message %s: Missing From: header, %s %s:\n"
-		     " \"%s\"", String_CString(msg->tag),
-		     IsRepairingAll(&state) ? "using" : "but could use",
-		     String_CString(source), String_CString(value));
-
-		if (ShouldRepair(&state)) {
-		    Header_Set(msg->headers, &Str_From, value);
-		    value = NULL;
-		} else if (state.quit)
-		    break;
-	    }
+    if (buf == NULL)
+	buf = xalloc(NULL, kRead_InitialSize);
 
-	    String_Free(value);
-	}
+    md5_init(&md5state);
 
-	// Got Date?
-	//
-	value = Header_Get(msg->headers, &Str_Date);
-	if (value != NULL) {
-	    // Check syntax
-	    struct tm tm;
+    while (length > 0 &&
+	   (count = read(fd, buf, length < kRead_InitialSize ?
+			 length : kRead_InitialSize)) > 0) {
+	md5_append(&md5state, (md5_byte_t *) buf, count);
+	length -= count;
+    }
 
-	    if (!Scan_RFC822Date(value, &tm)) {
-		if (Scan_FuzzyDate(value, &tm)) {
-		    String *newDate = String_RFC822Date(&tm, true);
+    md5_finish(&md5state, digest);
 
-		    Warn("Invalid Date: \"%s\", %s with %s",
-			 String_CString(value),
-			 IsRepairingAll(&state) ? "replacing" : "could replace",
-			 String_CString(newDate));
+    return length == 0;
+}
 
-		    if (ShouldRepair(&state)) {
-			Header_Set(msg->headers, &Str_Date, newDate);
-		    } else {
-			String_Free(newDate);
-			if (state.quit)
-			    break;
-		    }
-		} else {
-		    Warn("Invalid Date: \"%s\", cannot repair",
-			 String_CString(value));
-		}
-	    }
-	} else {
-	    // Look for "X-Date: <date>"
-	    //
-	    source = &Str_XDate;
-	    value = String_Clone(Header_Get(msg->headers, source));
+// Lock a mailbox that was opened as an unlocked snapshot and make sure
+// that nobody has changed the part of it that we've read in the meantime.
+// If so, return the mailbox file in *pFD (or -1 if there is no such file),
+// positioned at whatever has been appended since the snapshot was taken.
+// The caller must close it and unlock the mailbox when done.
+//
+bool Mailbox_LockSnapshot(Mailbox *mbox, int *pFD)
+{
+    const char *cSource = String_CString(Mailbox_Source(mbox));
+    md5_byte_t digest[16];
+    struct stat sbuf;
 
-	    // Look for "Received: <junk>; <date>"
-	    //
-	    if (value == NULL) {
-		source = &Str_Received;
+    *pFD = -1;
 
-		String *received = Header_GetLastValue(msg->headers, source);
-		if (received != NULL) {
-		    int pos = String_FindChar(received, ';', true);
-		    if (pos != kString_NotFound) {
-			Parser tmp;
-			Parser_Set(&tmp, received);
-			Parser_Move(&tmp, pos + 1);
-			Parse_Spaces(&tmp, NULL);
-			Parse_UntilEnd(&tmp, &value);
-		    }
-		}
-	    }
+    if (mbox->snapshot == kSnapshot_Stale) {
+	Error("Mailbox %s has already been saved once, can't merge it again",
+	      cSource);
+	return false;
+    }
 
-	    // Look for "From <sender> <cdate>"
-	    //
-	    if (value == NULL && msg->envSender != NULL) {
-		source = &Str_EnvelopeDate;
-		value = String_RFC822Date(&msg->envDate, false);
-	    }
+    if (gVerbose)
+	Note("Locking mailbox %s", cSource);
 
-	    if (value == NULL) {
-		Warn("Message %s: Missing Date: header",
-		     String_CString(msg->tag));
+    if (!Mailbox_Lock(Mailbox_Source(mbox), kDefaultLockTimeout)) {
+	Error("Could not lock %s: %s", cSource, strerror(errno));
+	return false;
+    }
 
-	    } else {
-		Warn("Message %s: Missing Date: header, %s %s:\n"
-		     " \"%s\"", String_CString(msg->tag),
-		     IsRepairingAll(&state) ? "using" : "but could use",
-		     String_CString(source), String_CString(value));
+    int fd = open(cSource, O_RDONLY);
+    off_t snapLen = mbox->snapshotLength;
 
-		if (ShouldRepair(&state)) {
-		    Header_Set(msg->headers, &Str_Date, value);
-		    value = NULL;
-		} else if (state.quit)
-		    break;
-	    }
+    if (fd == -1 && errno == ENOENT && snapLen == 0) {
+	// Didn't exist then, doesn't exist now
+	return true;
+    }
 
-	    String_Free(value);
-	}
+    if (fd == -1 || fstat(fd, &sbuf) != 0) {
+	Error("Could not reopen %s: %s", cSource, strerror(errno));
+	goto fail;
+    }
 
-	// Make sure there's no (undeclared) binary data in headers or body
-	//
-	Header *head;
+    if (sbuf.st_size < snapLen ||
+	!DigestFilePrefix(fd, snapLen, digest) ||
+	memcmp(digest, mbox->snapshotDigest, sizeof(digest)) != 0) {
+	Error("Mailbox %s was modified while unlocked, not saving", cSource);
+	goto fail;
+    }
 
-	for (head = msg->headers->root; head != NULL; head = head->next) {
-	    int pos = FindIllegalChar(head->line, false, false);
-	    if (pos >= 0) {
-		Warn("Message %s: Illegal character %s in header:\n"
-		     " %s", String_CString(msg->tag),
-		     Char_QuotedCString(String_CharAt(head->line, pos)),
-		     String_PrettyCString(head->line));
-	    }
-	}
+    if (gVerbose && sbuf.st_size > snapLen)
+	Note("Merging %ld bytes appended to %s while unlocked",
+	     (long) (sbuf.st_size - snapLen), cSource);
 
-#if 0 // Need to check multipart headers!
-	String *cte =
-	    Header_Get(msg->headers, &Str_ContentTransferEncoding);
-	if (cte == NULL || !String_HasPrefix(cte, &Str_Binary, false)) {
-	    String *body = Message_Body(msg);
-	    
-	    bool is8Bit = String_HasPrefix(cte, &Str_8Bit, false);
-	    int pos = FindIllegalChar(body, true, is8Bit);
-	    if (pos >= 0) {
-		int off = iMax(0, pos - kString_ExcerptLength / 2);
-		String *sub = String_Sub(body, off, String_Length(body));
+    *pFD = fd;
+    return true;
 
-		Warn("Message %s: Illegal character %s in body:\n %s%s",
-		     String_CString(msg->tag),
-		     Char_QuotedCString(String_CharAt(body, pos)),
-		     off == 0 ? "" : "...",
-		     String_QuotedCString(sub, kString_ExcerptLength));
-	    }
-	}
-#endif
-    }
+  fail:
+    if (fd != -1)
+	close(fd);
+    Mailbox_Unlock(Mailbox_Source(mbox));
+    return false;
 }
 
-void Message_Join(Message *a, Message *b)
+// Once saved, the first length bytes of the file are what we wrote, and
+// become the snapshot that the next save is checked against.  (Returns
+// false if the file can't be read back.)
+//
+static bool Mailbox_Resnapshot(Mailbox *mbox, off_t length)
 {
-    Message_SetBody(a, String_Append(Message_Body(a), &Str_Newline,
-				     b->data, NULL));
-    Message_SetDeleted(b, true);
+    int fd = open(String_CString(Mailbox_Source(mbox)), O_RDONLY);
+    bool success = fd != -1 &&
+	DigestFilePrefix(fd, length, mbox->snapshotDigest);
+
+    if (fd != -1)
+	close(fd);
+    mbox->snapshotLength = length;
+
+    return success;
 }
 
-bool Message_Split(Message *msg, bool interactively)
+// Copy the rest of the file to the stream
+//
+void Stream_WriteFile(Stream *output, int fd)
 {
-    // "\n\nFrom " line in body?
-    //
-    String *body = Message_Body(msg);
-    Parser parser;
+    char buf[8192];
+    ssize_t count;
 
-    Parser_Set(&parser, body);
+    while ((count = read(fd, buf, sizeof(buf))) > 0)
+	Stream_WriteChars(output, buf, count);
 
-    for (;;) {
-	String *line;
+    if (count < 0 && !output->ignoreErrors)
+	Fatal(EX_IOERR, "Could not read data to copy to %s: %s",
+	      String_CString(output->name), strerror(errno));
+}
 
-	if (!Parse_UntilFromSpace(&parser, 2))
+void Mailbox_Sanitize(Mailbox *mbox)
+{
+    // Dovecot and C-Client based IMAP implementations store internal
+    // IMAP information in an X-IMAP or X-IMAPbase header that must
+    // be in the first message in the mailbox.  If we're deleting this
+    // message, we need to move the value to an X-IMAPbase header in the
+    // new first message.  (X-IMAP is only used when the first message
+    // is a pseudo-message.)
+    // 
+    Message *first, *msg;
+    String *imap = NULL;
+
+    // Find first non-deleted message
+    //
+    for (first = Mailbox_Root(mbox); first != NULL; first = first->next) {
+	if (!Message_IsDeleted(first))
 	    break;
+    }
 
-	if (!Parse_Newline(&parser, NULL) || !Parse_Newline(&parser, NULL))
-	    Fatal(EX_SOFTWARE, "Internal error, couldn't parse double newline"
-		  "in Message_Split");
+    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
+	imap = Header_Get(msg->headers, &Str_XIMAPBase);
+	if (imap == NULL)
+	    imap = Header_Get(msg->headers, &Str_XIMAP);
+	if (imap != NULL)
+	    break;
+    }
 
-	int pos = Parser_Position(&parser);
+    if (msg != NULL && msg != first) {
+	// Move X-IMAPBase header to first message
+	Header_Set(first->headers, &Str_XIMAPBase, String_Clone(imap));
+	Header_Delete(msg->headers, &Str_XIMAP, false);
+	Header_Delete(msg->headers, &Str_XIMAPBase, false);
+    }
+}
 
-	if (Parse_FromSpaceLine(&parser, &line, NULL, NULL)) {
-	    bool split = true;
+// Write the message and all following ones
+//
+void Stream_WriteMessages(Stream *output, Message *msg)
+{
+    for (; msg != NULL; msg = msg->next) {
+	if (!Message_IsDeleted(msg)) {
+	    Stream_WriteMessage(output, msg);
+	    Stream_WriteNewline(output);
+	    Progress_Advance(String_Length(msg->data) + 1);
+	}
+    }
+}
 
-	    // Remove the newline from the string we parsed
-	    if (!String_IsEmpty(line))
-		String_SetLength(line, String_Length(line) - 1);
+void Stream_WriteMailbox(Stream *output, Mailbox *mbox, bool sanitize)
+{
+    if (sanitize)
+	Mailbox_Sanitize(mbox);
 
-	    Note("Message %s: Found \"From \" line in body:\n %s",
-		 String_CString(msg->tag), String_QuotedCString(line, -1));
+    Stream_WriteMessages(output, Mailbox_Root(mbox));
+}
 
-	    if (interactively) {
-		fprintf(stdout, "Message context:\n");
-		WriteQuotedExcerpt(stdout, body, pos, 15, "| ");
-		split = User_AskYesOrNo("Split message?", split);
-	    }
+// Return true if writing the message would reproduce its original data
+// exactly.  (It might not even if unchanged, e.g. if the header/body
+// separator was "\r\n".)
+//
+bool Message_IsVerbatim(Message *msg)
+{
+    const char *p = String_Chars(msg->data);
+    Header *head;
 
-	    String_Free(line);
+    if (msg->dirty || p == NULL)
+	return false;
 
-	    if (split) {
-		Message *newMsg = NULL;
+    if (msg->envelope != NULL) {
+	if (String_Chars(msg->envelope) != p)
+	    return false;
+	p += String_Length(msg->envelope);
+    } else if (msg->envSender != NULL) {
+	return false;
+    }
 
-		Parser_MoveTo(&parser, pos);
-		while (Parse_Message(&parser, msg->mbox, false, &newMsg)) {
-		    if (body != NULL) {
-			// Shorten the old body and link in the new msg
-			String_SetLength(body, pos - 1);
-			Message_SetDirty(msg, true);
-		    }
-		    newMsg->next = msg->next;
-		    msg->next = newMsg;
-		    Note("Created new message %s", String_CString(newMsg->tag));
+    for (head = msg->headers->root; head != NULL; head = head->next) {
+	if (head->line == NULL || String_Chars(head->line) != p)
+	    return false;
+	p += String_Length(head->line);
+    }
 
-		    Message_SetDirty(newMsg, true);
+    return *p == '\n' && p + 1 == String_Chars(msg->body) &&
+	p + 1 + String_Length(msg->body) ==
+	String_Chars(msg->data) + String_Length(msg->data);
+}
 
-		    msg = newMsg;
-		    body = NULL;
+// Figure out how much of the start of the mailbox file would be written
+// back unchanged.  Returns the length of that prefix and sets *pNext to
+// the first message that would need to be written after it.
+//
+int Mailbox_UnchangedPrefix(Mailbox *mbox, Message **pNext)
+{
+    const char *base = String_Chars(mbox->data);
+    int size = String_Length(mbox->data);
+    int prefix = 0;
+    Message *msg;
 
-		    Parse_Newline(&parser, NULL);
-		}
+    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
+	int len = String_Length(msg->data);
 
-		return newMsg != NULL;
-	    }
-	}
+	// Must be followed by a single newline, just as it would be written
+	if (Message_IsDeleted(msg) || !Message_IsVerbatim(msg) ||
+	    String_Chars(msg->data) != base + prefix ||
+	    prefix + len >= size || base[prefix + len] != '\n')
+	    break;
+
+	prefix += len + 1;
     }
 
-    return false;
+    *pNext = msg;
+
+    return prefix;
 }
 
-#if 0
-void CheckContentLengths(Message *msg, bool strict, bool repair)
-{
-    for (; msg != NULL; msg = msg->next) {
-	String *value = Header_Get(msg->headers, &Str_ContentLength);
-	int oldlen = String_ToInteger(value, -1);
-	int bodlen = Message_BodyLength(msg);
+/**
+ **  File Cloning
+ **
+ **  On file systems that support it (btrfs, XFS, ...), files can be
+ **  cloned instantly by sharing their data blocks until one of them
+ **  is changed.  Everywhere else, these functions fail and we'll do
+ **  things the old fashioned way.
+ **/
 
+bool File_Clone(int fromFD, int toFD)
+{
+#ifdef FICLONE
+    return ioctl(toFD, FICLONE, fromFD) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
 
-	if (oldlen != bodlen) {
-	    if (repair) {
-		if (value != NULL)
-		    Note("Message %s: Changing Content-Length: %s to %d",
-			 String_CString(msg->tag),
-			 String_PrettyCString(value), bodlen);
-			 
-		else
-		    Note("Message %s: Setting Content-Length: to %d",
-			 String_CString(msg->tag), bodlen);
+// Copy length bytes at offset in one file to the end of another without
+// passing them through user space (and sharing the blocks if possible).
+// Returns how much was copied, which might be less than asked for, or
+// -1 if the file system (or OS) can't do it at all.
+//
+ssize_t File_CopyRange(int fromFD, off_t offset, int toFD, size_t length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    ssize_t total = 0;
 
-		Header_Set(msg->headers, &Str_ContentLength, 
-			   String_PrintF("%d", bodlen));
+    while (total < length) {
+	ssize_t count = copy_file_range(fromFD, &offset, toFD, NULL,
+					length - total, 0);
 
-	    } else {
-		if (strict)
-		    Warn("Message %s: Missing Content-Length: header",
-			 String_CString(msg->tag));
-	    }
-	}
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count <= 0)
+	    return total > 0 ? total : -1;
+	total += count;
     }
+
+    return total;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
 }
 
-void RemoveContentLengths(Message *msg, bool escapeEscapedFromToo)
+// Append length bytes at offset in one file (which we also have at
+// chars) to the end of another, within the kernel if we can
+//
+bool File_AppendRange(int fromFD, off_t offset, const char *chars,
+		      size_t length, int toFD)
 {
-    Array *bodyParts = Array_New(0, (Free *) String_Free);
+    ssize_t count = File_CopyRange(fromFD, offset, toFD, length);
 
-    for (; msg != NULL; msg = msg->next) {
-	Header_Delete(msg->headers, &Str_ContentLength, true);
+    if (count > 0) {
+	chars += count;
+	length -= count;
+    }
 
-	Parser tmp;
-	int lastPos = 0;
-	String *body = Message_Body(msg);
+    while (length > 0) {
+	if ((count = write(toFD, chars, length)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	chars += count;
+	length -= count;
+    }
 
-	Parser_Set(&tmp, body);
+    return true;
+}
 
-	while (Parse_UntilString(&tmp, &Str_FromSpace, true, NULL)) {
-	    char ch;
+// Make a clone of the file under a new name (atomically)
+//
+bool File_CloneTo(const char *path, const char *newPath)
+{
+    int len = strlen(newPath);
+    char template[len + 1 + 6 + 1];
+    int fromFD, toFD = -1;
+    bool success = false;
+    struct stat sbuf;
 
-	    if (Parser_Move(&tmp, -1) &&
-		Parse_Char(&tmp, &ch)) {
+    memcpy(template, newPath, len);
+    strcpy(template + len, "-XXXXXX");
 
-		int pos = Parser_Position(&tmp);
+    if ((fromFD = open(path, O_RDONLY)) == -1 || fstat(fromFD, &sbuf) != 0 ||
+	(toFD = mkstemp(template)) == -1)
+	goto done;
 
-		if (escapeEscapedFromToo && ch == '>') {
-		    // Look for "\n>*From"
-		    const char *b, *bodyChars = String_Chars(body);
+    // Look just like the original, as a renamed backup would (though we
+    // may not be allowed to give it away)
+    //
+    (void) fchown(toFD, sbuf.st_uid, sbuf.st_gid);
 
-		    for (b = bodyChars + pos - 2; b > bodyChars && *b == '>';
-			 b--);
+    success = File_Clone(fromFD, toFD) &&
+	fchmod(toFD, sbuf.st_mode & 07777) == 0 &&
+	rename(template, newPath) == 0;
 
-		    ch = *b;
-		}
+    if (!success)
+	(void) unlink(template);
 
-		if (Char_IsNewline(ch)) {
-		    // This "From " marker needs quoting
-		    //
-		    Array_Append(bodyParts, String_Sub(body, lastPos, pos));
-		    lastPos = pos;
-		}
-	    }
-	}
+  done:
+    if (fromFD != -1)
+	close(fromFD);
+    if (toFD != -1)
+	close(toFD);
 
-	if (Array_Count(bodyParts) > 0) {
-	    String_Define(gtString, ">");
+    return success;
+}
 
-	    Parse_UntilEnd(&tmp, NULL);
-	    Array_Append(bodyParts,
-			 String_Sub(body, lastPos, Parser_Position(&tmp)));
+/**
+ **  In-place Patching
+ **
+ **  When every change made to a mailbox keeps each message the same size
+ **  (think a corrected Content-Length with as many digits as before), there
+ **  is no need to rewrite the whole file.  Instead, the modified bytes are
+ **  written straight into the original.  To make this safe, the original
+ **  bytes are first saved in an undo journal next to the mailbox, which is
+ **  removed once the patches have been written.  Should we crash halfway,
+ **  the journal will be used to roll back the changes the next time the
+ **  mailbox is opened.
+ **/
 
-	    String *newBody = Array_Join(bodyParts, &gtString);
-	    String_Free(body);
-	    Message_SetBody(msg, newBody);
-	}
-    }
+typedef struct {
+    off_t offset;
+    String *data;		// The new bytes
+} Patch;
 
-    Array_Free(bodyParts);
+void Patch_Free(Patch *patch)
+{
+    String_Free(patch->data);
+    xfree(patch);
 }
-#endif
 
-Array *SplitMessages(Mailbox *mbox, Array *mary)
+// Make sure that a newly created or renamed file will stick around
+//
+bool SyncParentDirectory(const char *path)
 {
-    Message *msg;
-
-    if (mary == NULL)
-	mary = Array_New(0, NULL);
+    const char *slash = strrchr(path, '/');
+    String *dir = slash == NULL ? String_FromCString(".", false) :
+	String_New(kString_Shared, path, iMax(1, slash - path));
+    int fd = open(String_CString(dir), O_RDONLY);
+    bool success = fd != -1 && fsync(fd) == 0;
 
-    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
-	Array_Append(mary, msg);
-    }
+    if (fd != -1)
+	close(fd);
+    String_Free(dir);
 
-    return mary;
+    return success;
 }
 
-void ShowMessage(Message *msg)
-{
-    // Disable SIGINT handling while running the pager
-    FILE *output = stdout;
+/**
+ **  Batched Saving
+ **
+ **  Syncing each saved mailbox to disk costs a couple of synchronous
+ **  flushes per file.  With --sync=batch, we instead leave the new
+ **  versions in their temp files, and every so often sync them all at
+ **  once, move them into place, and sync again.  The mailboxes stay
+ **  locked until then.
+ **/
 
-    signal(SIGINT, SIG_IGN);
+typedef struct {
+    String *temp;		// The new version
+    String *destination;	// Where it goes
+    bool backup;		// Rename the old version to destination~
+} PendingSave;
 
-    if (gPager != NULL)
-	gOpenPipe = output = popen(String_CString(gPager), "w");
+Array *gPendingSaves = NULL;
 
+void PendingSave_Free(PendingSave *save)
+{
+    String_Free(save->temp);
+    String_Free(save->destination);
+    xfree(save);
+}
 
-    Stream *stream = Stream_New(output, gPager, true);
-    stream->ignoreErrors = true;
+bool Mailbox_IsSavePending(const String *destination)
+{
+    int i;
 
-    Stream_PrintF(stream, "[Mailbox %s: Message %s]\n",
-		  String_CString(Mailbox_Name(msg->mbox)),
-		  String_CString(msg->tag));
-    Stream_WriteMessage(stream, msg);
+    for (i = 0; gPendingSaves != NULL && i < Array_Count(gPendingSaves); i++) {
+	PendingSave *save = Array_GetAt(gPendingSaves, i);
 
-    if (gPager != NULL) {
-	pclose(gOpenPipe);
-	gOpenPipe = NULL;
+	if (String_IsEqual(save->destination, destination, true))
+	    return true;
     }
-    Stream_Free(stream, false);
-    
-    // Restore our interrupt handler
-    signal(SIGINT, InterruptHandler);
+
+    return false;
 }
 
-bool EditFile(String *path)
+void Mailbox_DeferSave(const String *temp, const String *destination,
+		       bool backup)
 {
-    static String *editor = NULL;
-    const char *cPath = String_CString(path);
-    struct stat sbuf;
-    time_t oldmtime;
+    PendingSave *save = xalloc(NULL, sizeof(*save));
 
-    if (editor == NULL) {
-	const char *cEditor = getenv("EDITOR");
-	if (cEditor == NULL)
-	    cEditor = kDefaultEditor;
-	editor = String_FromCString(cEditor, false);
-    }
+    // Both will be long gone by the time we're done
+    save->temp = String_FromCString(String_CString(temp), true);
+    save->destination = String_FromCString(String_CString(destination), true);
+    save->backup = backup;
 
-    if (stat(cPath, &sbuf) != 0) {
-	perror(cPath);
-	return false;
-    }
+    if (gPendingSaves == NULL)
+	gPendingSaves = Array_New(0, (Free *) PendingSave_Free);
 
-    oldmtime = sbuf.st_mtime;
+    Array_Append(gPendingSaves, save);
+}
 
-    Note("Editing message file %s", cPath);
+// Flush the given files to disk, along with the directory entries
+// pointing to them.  Where possible, that's done with one syncfs per
+// file system rather than fsyncing each file and directory.
+//
+static bool SyncPendingFiles(bool temps)
+{
+    int count = Array_Count(gPendingSaves);
+    bool success = true;
+    int i;
+#ifdef __linux__
+    dev_t devices[count];
+    int nDevices = 0;
+#endif
 
-    String *cmd = String_Append(editor, &Str_Space, path, NULL);
-    int ret = system(String_CString(cmd));
-    if (ret == -1) {
-	Error("Could not execute %s: %s",
-	      String_CString(cmd), strerror(errno));
-    } else if (ret != 0) {
-	Error("%s signalled an error, discarding changes",
-	      String_CString(cmd));
-    }
-    String_Free(cmd);
+    for (i = 0; i < count; i++) {
+	PendingSave *save = Array_GetAt(gPendingSaves, i);
+	const char *cPath =
+	    String_CString(temps ? save->temp : save->destination);
+	int fd = open(cPath, O_RDONLY);
 
-    if (ret != 0 || stat(cPath, &sbuf) != 0 || sbuf.st_mtime == oldmtime) {
-	return false;
-    }
+	if (fd == -1) {
+	    success = false;
+	    continue;
+	}
 
-    return true;
-}
+#ifdef __linux__
+	struct stat sbuf;
+	int j;
 
-Stream *SaveTempMessage(Message *msg)
-{
-    String *tmpPath = String_FromCString("/tmp/mfck", false);
-    Stream *stream = Stream_OpenTemp(tmpPath, true, true);
+	if (fstat(fd, &sbuf) != 0) {
+	    success = false;
+	} else {
+	    for (j = 0; j < nDevices && devices[j] != sbuf.st_dev; j++)
+		continue;
 
-    Stream_WriteMessage(stream, msg);
-    Stream_Close(stream);
+	    if (j == nDevices) {
+		devices[nDevices++] = sbuf.st_dev;
+		if (syncfs(fd) != 0)
+		    success = false;
+	    }
+	}
+#else
+	if (temps ? fsync(fd) != 0 : !SyncParentDirectory(cPath))
+	    success = false;
+#endif
+	close(fd);
+    }
 
-    return stream;
+    return success;
 }
 
-void EditMessage(Message *msg)
+// Put all pending saves in place (or only when there are enough of them
+// to fill a batch, unless all is set).  Returns false if any failed.
+//
+bool Mailbox_CommitSaves(bool all)
 {
-    Stream *stream = SaveTempMessage(msg);
-    String *data = NULL;
+    int count = gPendingSaves == NULL ? 0 : Array_Count(gPendingSaves);
+    double start = Time_Now();
+    bool success = true;
+    bool synced;
+    int i;
 
-    if (!EditFile(stream->name)) {
-	Note("Message unchanged");
-	Stream_Free(stream, true);
-	return;
-    }
+    if (count == 0 || (!all && count < gSyncBatchSize))
+	return true;
 
-    if (!Stream_Reopen(stream, false, true) ||
-	!Stream_ReadContents(stream, &data)) {
-	perror(String_CString(stream->name));
-	Stream_Free(stream, true);
-	return;
+    bool committed[count];
+
+    // Make sure the new versions are on disk before they replace the old
+    //
+    if (!(synced = SyncPendingFiles(true))) {
+	Error("Could not sync %d saved mailbox%s: %s",
+	      count, count == 1 ? "" : "es", strerror(errno));
+	success = false;
     }
 
-    Stream_Free(stream, true);
+    for (i = 0; i < count; i++) {
+	PendingSave *save = Array_GetAt(gPendingSaves, i);
+	const char *cFile = String_CString(save->destination);
+	const char *cTemp = String_CString(save->temp);
 
-    Parser parser;
-    Message *newMsg;
+	// Leave the temp file be if we can't sync or rename it; it may be
+	// the only copy left of the mailbox
+	//
+	committed[i] = false;
+	if (!synced) {
+	    Error("Leaving new version of %s in %s", cFile, cTemp);
+	    continue;
+	}
 
-    Parser_Set(&parser, data);
-    if (!Parse_Message(&parser, msg->mbox, true, &newMsg)) {
-	Error(EX_OK, "Could not parse message");
-	String_Free(data);
-	return;
+	if (save->backup) {
+	    int len = String_Length(save->destination);
+	    char bakPath[len + 1 + 1];
+
+	    memcpy(bakPath, cFile, len);
+	    strcpy(&bakPath[len], "~");
+
+	    if (rename(cFile, bakPath) != 0) {
+		Error("Could not rename %s to %s: %s",
+		      cFile, bakPath, strerror(errno));
+		Error("Leaving new version of %s in %s", cFile, cTemp);
+		success = false;
+		continue;
+	    }
+	}
+
+	if (rename(cTemp, cFile) != 0) {
+	    Error("Could not rename %s to %s: %s",
+		  cTemp, cFile, strerror(errno));
+	    Error("Leaving new version of %s in %s", cFile, cTemp);
+	    success = false;
+	    continue;
+	}
+
+	committed[i] = true;
     }
 
-    // Make the message own the (orignal) file data so it will
-    // be freed when the message gets freed
+    // And make the renames stick
     //
-    if (String_Chars(data) != String_Chars(newMsg->data)) {
-	Warn("Internal error: Message data != parsed file data; leaking!");
-    } else {
-	String_Free(newMsg->data);
-	newMsg->data = data;
+    if (synced && !SyncPendingFiles(false)) {
+	Error("Could not sync %d saved mailbox%s: %s",
+	      count, count == 1 ? "" : "es", strerror(errno));
+	success = false;
     }
 
-    Message **pLink = &msg->mbox->root;
+    // Finally let go of the mailboxes (except those whose new version
+    // is yet to be put in place, so nothing's delivered to the old one)
+    //
+    Array *saves = gPendingSaves;
 
-    while (*pLink != NULL && *pLink != msg)
-	pLink = &(*pLink)->next;
+    gPendingSaves = NULL;
+    for (i = 0; i < count; i++) {
+	PendingSave *save = Array_GetAt(saves, i);
 
-    if (*pLink != msg) {
-	Warn("Internal error: Can't find message %s in mailbox %s",
-	     String_CString(msg->tag), String_CString(msg->mbox->source));
+	if (committed[i])
+	    Mailbox_Unlock(save->destination);
+    }
+    Array_Free(saves);
 
-	*pLink = newMsg;
+    if (gVerbose)
+	Note("Synced %d saved mailbox%s in %.3f sec",
+	     count, count == 1 ? "" : "es", Time_Now() - start);
 
-    } else {
-	*pLink = newMsg;
-	newMsg->next = msg->next;
-	Message_Free(msg, false);
+    return success;
+}
+
+// Throw away all pending saves (when interrupted)
+//
+void Mailbox_DiscardSaves(void)
+{
+    int i;
+
+    if (gPendingSaves == NULL)
+	return;
+
+    for (i = 0; i < Array_Count(gPendingSaves); i++) {
+	PendingSave *save = Array_GetAt(gPendingSaves, i);
+
+	(void) unlink(String_CString(save->temp));
     }
 
-    Message_SetDirty(newMsg, true);
+    Array_Free(gPendingSaves);
+    gPendingSaves = NULL;
 }
 
-// "[Mon,]  1 Jan 2000 00:00:00 +0000 (GMT)" => " 1 Jan 00:00"
+// Figure out if the changes made to the mailbox can be written back by
+// overwriting bytes in the original file, i.e. that no message has been
+// added, deleted, moved, or changed its size, and that the file is laid
+// out just as it would be written (each message followed by a single
+// newline, with nothing in between or after).  If so, return the patches
+// needed to do so; if not, return NULL.
 //
-void PrintShortDate(Stream *output, String *rfc822Date)
+Array *Mailbox_PlanPatches(Mailbox *mbox)
 {
-    const char *chars = String_Chars(rfc822Date);
-    int len = String_Length(rfc822Date);
-    Parser tmp;
-    int pos;
-    String *day, *mon, *year, *time;
+    const char *base = String_Chars(mbox->data);
+    int size = String_Length(mbox->data);
+    Array *patches = Array_New(0, (Free *) Patch_Free);
+    int lastEnd = 0;
+    Message *msg;
 
-    Parser_Set(&tmp, rfc822Date);
+    // Damaged parts need to be cut out
+    if (base == NULL || mbox->salvaged > 0)
+	goto fail;
 
-    Parse_Spaces(&tmp, NULL);
+    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
+	const char *chars = String_Chars(msg->data);
+	int len = String_Length(msg->data);
 
-    pos = Parser_Position(&tmp);
-    if (pos + 4 < len && chars[pos+3] == ',') {
-	// Skip weekday
-	Parse_UntilSpace(&tmp, NULL);
-	Parse_Spaces(&tmp, NULL);
-    }
+	// Must still be where we found it, right after the last one
+	if (Message_IsDeleted(msg) || chars != base + lastEnd ||
+	    lastEnd + len >= size || base[lastEnd + len] != '\n')
+	    goto fail;
 
-    // Should be pointing to the day now (which may be one or two digits)
-    //
-    Parse_UntilSpace(&tmp, &day);
-    Parse_Spaces(&tmp, NULL);
+	lastEnd += len + 1;
 
-    // Month
-    //
-    Parse_UntilSpace(&tmp, &mon);
-    Parse_Spaces(&tmp, NULL);
-    
-    // Year
-    //
-    Parse_UntilSpace(&tmp, &year);
-    Parse_Spaces(&tmp, NULL);
-    
-    // Time
-    //
-    Parse_UntilSpace(&tmp, &time);
-    Parse_Spaces(&tmp, NULL);
+	if (!msg->dirty)
+	    continue;
 
-    // OK,  let's do it!
-    //
-    Stream_PrintF(output, "%2.2s %-3.3s %-5.5s",
-		  String_CString(String_Safe(day)),
-		  String_CString(String_Safe(mon)),
-		  String_CString(String_Safe(time)));
+	String *text = Message_Render(msg);
+	const char *newChars = String_Chars(text);
+	int b, e;
 
-    String_Free(day);
-    String_Free(mon);
-    String_Free(year);
-    String_Free(time);
+	if (String_Length(text) != len) {
+	    String_Free(text);
+	    goto fail;
+	}
+
+	// Only patch the part that actually changed
+	for (b = 0; b < len && newChars[b] == chars[b]; b++);
+	for (e = len; e > b && newChars[e-1] == chars[e-1]; e--);
+
+	if (b < e) {
+	    Patch *patch = New(Patch);
+
+	    patch->offset = chars - base + b;
+	    patch->data = String_Alloc(e - b);
+	    memcpy((char *) String_Chars(patch->data), newChars + b, e - b);
+	    Array_Append(patches, patch);
+	}
+
+	String_Free(text);
+    }
+
+    // No garbage (or extra newlines) at the end either
+    if (lastEnd != size)
+	goto fail;
+
+    return patches;
+
+  fail:
+    Array_Free(patches);
+    return NULL;
 }
 
-int IntLength(int num)
+// Save the bytes about to be overwritten by the patches
+//
+static bool WriteUndoJournal(Mailbox *mbox, Array *patches,
+			     const String *path)
 {
-    int digits;
+    Stream *journal = Stream_Open(path, true, false);
+    int i;
 
-    if (num == 0)
-	return 1;
+    if (journal == NULL)
+	return false;
 
-    for (digits = 0; num > 0; num /= 10, digits++);
+    Stream_PrintF(journal, "%s %d\n", kUndo_Magic, Array_Count(patches));
 
-    return digits;
+    for (i = 0; i < Array_Count(patches); i++) {
+	Patch *patch = Array_GetAt(patches, i);
+	int len = String_Length(patch->data);
+
+	Stream_PrintF(journal, "%lld %d\n", (long long) patch->offset, len);
+	Stream_WriteChars(journal, String_Chars(mbox->data) + patch->offset,
+			  len);
+	Stream_WriteNewline(journal);
+    }
+
+    bool success = fflush(journal->file) == 0 &&
+	fsync(fileno(journal->file)) == 0 &&
+	SyncParentDirectory(String_CString(path));
+
+    Stream_Free(journal, true);
+    xfree(journal);
+
+    return success;
 }
 
-void ListMessage(Stream *output, int num, int numWidth, Message *msg,
-		 int previewLines, int cur)
+// Undo any in-place patching of the mailbox that was interrupted before
+// it had completed.  Returns false if there was a journal, but it couldn't
+// be applied.
+//
+bool Mailbox_RollBack(const String *source)
 {
-    // ' '<num:numWidth>': '<date:12>'  '<from>'  '<subject>'  '<size:6>
-    String *sizstr = String_ByteSize(String_Length(msg->data));
-    int fromSubjectWidth = gPageWidth - 27 - numWidth;
-    int fromWidth = fromSubjectWidth * 2 / 5;
-    int subjectWidth = fromSubjectWidth - fromWidth;
+    String *path = String_Append(source, &Str_UndoSuffix, NULL);
+    const char *cPath = String_CString(path);
+    FILE *journal = fopen(cPath, "r");
+    bool success = false;
+    int fd = -1;
 
-    Stream_PrintF(output, "%c%*d%c ",
-		  num == cur ? '>' : ' ', numWidth, num,
-		  Message_IsDeleted(msg) ? 'D' : ':');
-    PrintShortDate(output, Header_Get(msg->headers, &Str_Date));
-    Stream_PrintF(output, "  %-*.*s", fromWidth, fromWidth,
-		  String_CString(String_Safe(Header_Get(msg->headers, &Str_From))));
-    Stream_PrintF(output, "  %-*.*s",
-		  //33 - numWidth, 33 - numWidth,
-		  subjectWidth, subjectWidth,
-		  String_CString(String_Safe(Header_Get(msg->headers, &Str_Subject))));
-    Stream_PrintF(output, " %6s\n", String_CString(String_Safe(sizstr)));
+    if (journal == NULL) {
+	String_Free(path);
+	return errno == ENOENT;
+    }
 
-    String_Free(sizstr);
+    Warn("Found undo journal %s from an interrupted repair%s", cPath,
+	 gDryRun ? "" : ", rolling back");
 
-    Parser tmp;
-    String *line;
+    if (gDryRun)
+	goto done;
 
-    Parser_Set(&tmp, Message_Body(msg));
-    while (previewLines-- > 0) {
-	if (!Parse_UntilNewline(&tmp, &line))
+    // Only complete entries are applied -- if the journal itself is
+    // incomplete, the mailbox can't have been touched yet anyway
+    //
+    long long offset;
+    int i, count, len;
+
+    if (fscanf(journal, kUndo_Magic " %d\n", &count) != 1 ||
+	(fd = open(String_CString(source), O_WRONLY)) == -1)
+	goto done;
+
+    errno = 0;
+    for (i = 0; i < count && fscanf(journal, "%lld %d", &offset, &len) == 2 &&
+	     getc(journal) == '\n'; i++) {
+	char *buf = xalloc(NULL, len);
+	bool ok = fread(buf, 1, len, journal) == len &&
+	    pwrite(fd, buf, len, offset) == len;
+
+	xfree(buf);
+	if (!ok || getc(journal) != '\n')
 	    break;
-	Parse_Newline(&tmp, NULL);
-	Stream_PrintF(output, " %*s  |%.*s\n",
-		      numWidth, "",
-		      gPageWidth - numWidth - 3, String_CString(line));
-	String_Free(line);
     }
+
+    // Keep the journal unless every entry made it back into the mailbox
+    //
+    if (i < count) {
+	if (errno == 0)
+	    errno = EIO;
+	(void) fsync(fd);
+	goto done;
+    }
+
+    success = fsync(fd) == 0 && unlink(cPath) == 0;
+
+  done:
+    if (!success && !gDryRun)
+	Error("Could not roll back %s using %s: %s",
+	      String_CString(source), cPath, strerror(errno));
+    if (fd != -1)
+	close(fd);
+    fclose(journal);
+    String_Free(path);
+
+    return success;
 }
 
-void ListMailbox(Stream *output, Mailbox *mbox, int cur, int count)
+// Try to save the mailbox by patching its file in place.  Returns false
+// if that's not possible, in which case it should be written in full.
+//
+bool Mailbox_PatchInPlace(Mailbox *mbox)
 {
-    // A negative count means all messages
-    if (count < 0)
-	count = Mailbox_Count(mbox) - cur - 1;
+    const String *source = Mailbox_Source(mbox);
+    const char *cSource = String_CString(source);
+    struct stat sbuf;
+    int i, bytes = 0;
 
-    // Adjust to even page boundary with zero offset
-    //int start = ((cur - 1) / count) * count;
-    int start = cur;
-    int i = 1;
-    int digits = IntLength(start + count + 1 - 1);
-    Message *msg;
+    if (mbox->rewritten)
+	return false;
 
-    for (msg = Mailbox_Root(mbox); msg != NULL && i < start; msg = msg->next, i++);
+    Mailbox_Sanitize(mbox);
 
-    for (; msg != NULL && i < start + count; msg = msg->next, i++) {
-	ListMessage(output, i, digits, msg, 0, cur);
-    }
-}
+    Array *patches = Mailbox_PlanPatches(mbox);
 
-#define kSearchBody		((String *) -1)
+    if (patches == NULL)
+	return false;
 
-// Key can be NULL which will make us try to find the string everywhere
-void FindMessages(Stream *output, Mailbox *mbox, const String *key,
-		  const String *string)
-{
-    Message *msg;
-    int numWidth = IntLength(mbox->count);
+    // Journals are only rolled back by whoever holds the lock, so hold
+    // it for as long as there's one (even when not locking otherwise)
+    //
+    bool held = LockedMailboxIndex(source) != -1;
 
-    if (String_IsEqual(key, &Str_Body, false))
-	key = kSearchBody;
+    if (!held && !Mailbox_TakeLock(source, kDefaultLockTimeout)) {
+	Array_Free(patches);
+	return false;
+    }
 
-    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
-	bool found = false;
-	Header *head;
+    String *path = String_Append(source, &Str_UndoSuffix, NULL);
+    int fd = open(cSource, O_WRONLY);
 
-	if (key == NULL) {
-	    for (head = msg->headers->root; head != NULL; head = head->next) {
-		if (String_FoundString(head->value, string, false)) {
-		    found = true;
-		    break;
-		}
-	    }
-	} else if (key != kSearchBody) {
-	    const String *value = Header_Get(msg->headers, key);
-	    if (value != NULL)
-		found = String_FoundString(value, string, false);
-	}
+    // The file had better not have shrunk on us
+    if (fd == -1 || fstat(fd, &sbuf) != 0 ||
+	sbuf.st_size < String_Length(mbox->data) ||
+	!WriteUndoJournal(mbox, patches, path)) {
+	(void) unlink(String_CString(path));
+	goto fail;
+    }
 
-	if (!found && (key == NULL || key == kSearchBody)) {
-	    found = String_FoundString(msg->body, string, false);
-	}
+    for (i = 0; i < Array_Count(patches); i++) {
+	Patch *patch = Array_GetAt(patches, i);
+	int len = String_Length(patch->data);
 
-	if (found) {
-	    ListMessage(output, msg->num, numWidth, msg, 0, -1);
+	if (pwrite(fd, String_Chars(patch->data), len, patch->offset) != len) {
+	    Error("Could not patch %s: %s", cSource, strerror(errno));
+	    close(fd);
+	    fd = -1;
+	    Mailbox_RollBack(source);
+	    goto fail;
 	}
+	bytes += len;
     }
-}
 
-int CompareMessageIDs(const void *a, const void *b)
-{
-    Message *ma = *(Message **) a;
-    Message *mb = *(Message **) b;
+    if (fsync(fd) != 0 || unlink(String_CString(path)) != 0) {
+	// Leave the journal be; the patches may not have made it to disk
+	Fatal(EX_IOERR, "Could not sync %s: %s", cSource, strerror(errno));
+    }
 
-    return String_Compare(String_Safe(ma->cachedID),
-			  String_Safe(mb->cachedID), true);
-}
+    if (gVerbose)
+	Note("Patched %d byte%s in %d place%s in %s",
+	     bytes, bytes == 1 ? "" : "s",
+	     Array_Count(patches), Array_Count(patches) == 1 ? "" : "s",
+	     cSource);
 
-void SortMessages(Array *mary)
-{
-    int i;
+    close(fd);
+    String_Free(path);
+    Array_Free(patches);
+    if (!held)
+	Mailbox_ReleaseLock(source);
 
-    if (gVerbose)
-	Note("Sorting messages");
+    return true;
 
-    // First cache message IDs
-    for (i = 0; i < Array_Count(mary); i++) {
-	Message *msg = Array_GetAt(mary, i);
+  fail:
+    if (fd != -1)
+	close(fd);
+    String_Free(path);
+    Array_Free(patches);
+    if (!held)
+	Mailbox_ReleaseLock(source);
 
-	if (msg->cachedID == NULL)
-	    msg->cachedID = Header_Get(msg->headers, &Str_MessageID);
-    }
-    
-    qsort(Array_Items(mary), Array_Count(mary), sizeof(void *),
-	  CompareMessageIDs);
+    return false;
 }
 
-void DiffMessages(Message *a, Message *b)
+bool Mailbox_Write(Mailbox *mbox, const String *destination, bool fatal)
 {
-    Stream *tmpa = SaveTempMessage(a);
-    Stream *tmpb = SaveTempMessage(b);
-    String *cmd =
-	String_PrintF("diff -dc %s %s | %s",
-		      String_CString(tmpa->name), String_CString(tmpb->name),
-		      gPager != NULL ? String_CString(gPager) : kDefaultPager);
+    // Whatever the background loader hasn't parsed yet would otherwise
+    // be left out of what we write, and thereby lost
+    //
+    (void) Mailbox_WaitFor(mbox, INT_MAX);
 
-    if (system(String_CString(cmd)) == -1) {
-	Error("Could not execute \"%s\": %s",
-	      String_CString(cmd), strerror(errno));
+    if (gVerbose) {
+	if (String_IsEqual(Mailbox_Source(mbox), destination, false))
+	    Note("Saving mailbox %s", String_CString(Mailbox_Name(mbox)));
+	else
+	    Note("Saving mailbox %s to %s",
+		 String_CString(Mailbox_Name(mbox)),
+		 String_CString(destination));
     }
-    String_Free(cmd);
-
-    Stream_Free(tmpa, true);
-    Stream_Free(tmpb, true);
-}
 
-int ChooseMessageToDelete(Message *a, Message *b, char *autoChoice)
-{
-    Stream_PrintF(gStdOut, "\n");
+    // An unlocked snapshot must be locked and verified before we can
+    // replace it, and anything that's been delivered to it since must
+    // be carried over.
+    //
+    bool merge = mbox->snapshot != kSnapshot_None &&
+	String_IsEqual(Mailbox_Source(mbox), destination, true);
+    int tailFD = -1;
 
-    ListMessage(gStdOut, 1, 1, a, 4, -1);
-    ListMessage(gStdOut, 2, 1, b, 4, -1);
+    if (merge && !Mailbox_LockSnapshot(mbox, &tailFD))
+	return false;
 
-    Stream_WriteNewline(gStdOut);
+    // Only mbox file destinations supported for now
+    //
+    const String *file = destination;
+    const char *cFile = String_CString(destination);
+    bool isSource = String_IsEqual(Mailbox_Source(mbox), destination, true);
+    const char *how = "rewritten";
+    double start = Time_Now();
+    bool success = false;
+    bool cloned = false;
+    SyncMode sync = gSync;
+    Stream *tmp = NULL;
+    off_t written = mbox->snapshotLength;	// Ours, before any merged tail
+    int len = String_Length(file);
+    char bakPath[len + 1 + 1];
+
+    // Saves made interactively or elsewhere are best done right away
+    if (sync == kSync_Batch && (gInteractive || !isSource))
+	sync = kSync_Each;
+
+    memcpy(bakPath, cFile, len);
+    strcpy(&bakPath[len], "~");
+
+    // If we can make an instant (copy-on-write) backup, the original is
+    // ours to change just as if there was no backup
+    //
+    if (gBackup && isSource && mbox->data != NULL)
+	cloned = File_CloneTo(cFile, bakPath);
 
-    for (;;) {
-	char choice = *autoChoice;
+    // Same-sized changes can be patched straight into the original (which
+    // takes care of anything appended to a snapshot too), but a backup
+    // requires a separate copy
+    //
+    if (gInPlace && (!gBackup || cloned) && isSource &&
+	Mailbox_PatchInPlace(mbox)) {
+	how = "patched";
+	success = true;
+	goto done;
+    }
 
-	if (choice == '\0')
-	    choice = User_AskChoice("Please choose which message to delete "
-				    "(or b(oth), d(iff), or n(either)):",
-				    "12bnBNdq", 'n');
+    tmp = Stream_OpenTemp(file, true, true);
 
-	if (isupper(choice))
-	    choice = *autoChoice = tolower(choice);
+    // Try reusing the unchanged start of the mailbox by cloning it
+    //
+    Message *next = Mailbox_Root(mbox);
+    int prefix = 0;
 
-	switch (choice) {
-	  case '1':
-	    Note("Deleting the first message]");
-	    Message_SetDeleted(a, true);
-	    return 1;
+    if (isSource && mbox->data != NULL) {
+	Mailbox_Sanitize(mbox);
+	prefix = Mailbox_UnchangedPrefix(mbox, &next);
 
-	  case '2':
-	    Note("Deleting the second message]");
-	    Message_SetDeleted(b, true);
-	    return 1;
+	int fd = prefix > 0 ? open(cFile, O_RDONLY) : -1;
 
-	  case 'b':
-	    Note("Deleting both messages]");
-	    Message_SetDeleted(a, true);
-	    Message_SetDeleted(b, true);
-	    return 2;
+	if (fd != -1 && File_Clone(fd, fileno(tmp->file)) &&
+	    ftruncate(fileno(tmp->file), prefix) == 0 &&
+	    fseeko(tmp->file, prefix, SEEK_SET) == 0) {
+	    how = "cloned & rewritten";
+	} else {
+	    next = Mailbox_Root(mbox);
+	    prefix = 0;
+	}
 
-	  case 'd':
-	    DiffMessages(a, b);
-	    break;
+	if (fd != -1)
+	    close(fd);
+    }
 
-	  case 'n':
-	    Note("Deleting no messages]");
-	    return 0;
+    if (gProgress.fd != -1) {
+	int64_t total = 0;
+	Message *msg;
 
-	  case 'q':
-	    return -1;
+	for (msg = next; msg != NULL; msg = msg->next) {
+	    if (!Message_IsDeleted(msg))
+		total += String_Length(msg->data) + 1;
 	}
+	Progress_Start("writing", cFile, total);
     }
-}
 
-void UniqueMailbox(Mailbox *mbox)
-{
-    Array *mary = SplitMessages(mbox, NULL);
-    int i, count = Array_Count(mary);
-    int allDups = 0;
-    Message *m, *n;
-    char autoChoice = '\0';
+    Stream_WriteMessages(tmp, next);
+    Progress_Stop();
+    if (tailFD != -1) {
+	if (fflush(tmp->file) != 0 || (written = ftello(tmp->file)) < 0)
+	    written = -1;
+	Stream_WriteFile(tmp, tailFD);
+    }
 
-    SortMessages(mary);
+    if (sync == kSync_Each &&
+	(fflush(tmp->file) != 0 || fsync(fileno(tmp->file)) != 0)) {
+	Fatal(fatal ? EX_IOERR : EX_OK, "Could not sync %s: %s",
+	      String_CString(tmp->name), strerror(errno));
+	goto done;
+    }
+    Stream_Close(tmp);
 
-    m = Array_GetAt(mary, 0);
-    for (i = 1; i < count; i++, m = n) {
-	n = Array_GetAt(mary, i);
+    // Leave the temp file be if the renaming fails; it may be the only
+    // copy left of the mailbox at that point
+    //
+    tmp->deleteFileWhenFreed = false;
 
-	if (!Message_IsDeleted(m) && !Message_IsDeleted(n) &&
-	    m->cachedID != NULL && n->cachedID != NULL &&
-	    String_IsEqual(m->cachedID, n->cachedID, true)) {
-	    static String const *checkKeys[] = {
-		&Str_From, &Str_To, &Str_Cc, &Str_Bcc, &Str_Subject, &Str_Date,
-		&Str_ResentFrom, &Str_ResentTo, &Str_ResentCc, &Str_ResentBcc,
-		&Str_ResentSubject, &Str_ResentDate, &Str_ResentMessageID,
+    if (sync == kSync_Batch) {
+	Mailbox_DeferSave(tmp->name, destination, gBackup && !cloned);
+	how = "queued";
+	success = true;
+	goto done;
+    }
+
+    if (gBackup && !cloned) {
+	if (rename(cFile, bakPath) != 0) {
+	    Fatal(fatal ? EX_CANTCREAT : EX_OK,
+		  "Could not rename %s to %s: %s",
+		  cFile, bakPath, strerror(errno));
+	    goto done;
+	}
+    }
+
+    if (rename(String_CString(tmp->name), cFile) != 0) {
+	Fatal(fatal ? EX_CANTCREAT : EX_OK, "Could not rename %s to %s: %s",
+	      String_CString(tmp->name), cFile, strerror(errno));
+	goto done;
+    }
+
+    if (sync == kSync_Each && !SyncParentDirectory(cFile)) {
+	Error("Could not sync directory of %s: %s", cFile, strerror(errno));
+	goto done;
+    }
+
+    success = true;
+
+  done:
+    if (tmp != NULL)
+	Stream_Free(tmp, false);
+
+    if (tailFD != -1)
+	close(tailFD);
+
+    // The file's been laid out anew, so patching it in place according
+    // to where things were in the original won't do any more
+    //
+    if (success && strcmp(how, "patched") != 0)
+	mbox->rewritten = true;
+
+    if (merge) {
+	// What we wrote is the new snapshot, unless it's yet to be put in
+	// place (or couldn't be read back)
+	//
+	if (!success || strcmp(how, "queued") == 0 || written < 0 ||
+	    !Mailbox_Resnapshot(mbox, written))
+	    mbox->snapshot = kSnapshot_Stale;
+	Mailbox_Unlock(Mailbox_Source(mbox));
+    }
+
+    if (success) {
+	Mailbox_SetDirty(mbox, false);
+
+	if (gVerbose)
+	    Note("Mailbox %s %s%s in %.3f sec", cFile, how,
+		 !gBackup ? "" : cloned ? " with cloned backup" :
+		 " with renamed backup", Time_Now() - start);
+    }
+
+    return success;
+}
+
+bool Mailbox_Save(Mailbox *mbox, bool force, bool fatal)
+{
+    if (!Mailbox_IsDirty(mbox) && !force) {
+	Note("Leaving mailbox %s unchanged",
+	     String_CString(Mailbox_Name(mbox)));
+	return true;
+
+    } else {
+	return Mailbox_Write(mbox, mbox->source, fatal);
+    }
+}
+
+/**
+ **  Interaction Functions
+ **/
+
+// Note: Return pointer to static storage.  Will be overwritten
+// on succeeding calls. Must not be freed or saved by caller.
+//
+bool User_AskLine(const char *prompt, const String **pLine, bool trim)
+{
+    static String line = {NULL, 0, kString_Const};
+#ifdef USE_READLINE
+    static char *buf = NULL;
+
+    free(buf);				// Readline's, not ours
+
+    buf = readline(prompt);
+
+    if (buf == NULL)
+	return false;
+    
+    add_history(buf);
+#else
+    static char buf[1024];
+
+    fprintf(stdout, "%s", prompt);
+    if (fgets(buf, sizeof(buf), stdin) == NULL)
+	return false;
+#endif
+
+    if (pLine != NULL) {
+	int len = strlen(buf);
+	if (len > 0 && buf[len-1] == '\n')
+	    len--;
+	buf[len] = '\0';
+	String_Set(&line, buf, len);
+	if (trim)
+	    String_TrimSpaces(&line);
+	*pLine = &line;
+    }
+
+    return true;
+}
+
+// Ask the user a question that requires a single character answer
+// (lowercase only, please)
+//
+int User_AskChoice(const char *question, const char *choices, char def)
+{
+    int answer = EOF;
+
+    do {
+	int ch;
+
+#if 0
+	// Present the question and the options
+	//
+	fprintf(stdout, "%s [", question);
+	for (p = choices; *p != '\0'; p++) {
+	    putc((*p == def) ? toupper(*p) : *p, stdout);
+	}
+	fprintf(stdout, "] ");
+#else
+	fprintf(stdout, "%s %c\010", question, def);
+#endif
+
+	// Get an answer
+	//
+	while ((ch = getchar()) != EOF && ch == ' ');
+	if (ch == EOF)
+	    break;
+
+	// Validate the answer
+	//
+	if (ch == '\n')
+	    break;
+
+	if (strchr(choices, ch) != NULL)
+	    answer = ch;
+
+	// Eat rest of line
+	while (ch != '\n' && (ch = getchar()) != EOF);
+	if (ch == EOF)
+	    break;
+
+    } while (answer == EOF);
+
+    return answer != EOF ? answer : def;
+}
+
+bool User_AskYesOrNo(const char *question, bool def)
+{
+    return User_AskChoice(question, "yn", def ? 'y' : 'n') == 'y';
+}
+
+/*
+** Message Sets
+*/
+
+typedef struct _MessageSet {
+    int min, max;
+    struct _MessageSet *link;
+} MessageSet;
+
+MessageSet *MessageSet_Make(int min, int max, MessageSet *link)
+{
+    MessageSet *set = New(MessageSet);
+
+    set->min = min;
+    set->max = max;
+    set->link = link;
+
+    return set;
+}
+
+void MessageSet_Free(MessageSet *set)
+{
+    while (set != NULL) {
+	MessageSet *link = set->link;
+	xfree(set);
+	set = link;
+    }
+}
+
+// Parse a message set specification of the form:
+//   <min>['-'[<max>]][','...] | '*'
+//
+bool Parse_MessageSet(Parser *par, MessageSet **pSet, int last)
+{
+    int min, max;
+    MessageSet *link = NULL;
+
+    if (Parse_ConstChar(par, '*', true, NULL)) {
+	min = 1;
+	max = last;
+
+    } else {
+	if (!Parse_Integer(par, &min))
+	return false;
+	if (Parse_ConstChar(par, '-', true, NULL)) {
+	    if (!Parse_Integer(par, &max))
+		max = last;
+	} else {
+	    max = min;
+	}
+	if (Parse_ConstChar(par, ',', true, NULL)) {
+	    (void) Parse_MessageSet(par, &link, last);
+	}
+    }
+
+    *pSet = MessageSet_Make(min, max, link);
+    return true;
+}
+
+MessageSet* MessageSet_Append(MessageSet *a, MessageSet *b)
+{
+    MessageSet **pa;
+
+    for (pa = &a; *pa != NULL; pa = &(*pa)->link);
+    *pa = b;
+
+    return a != NULL ? a : b;
+}
+
+int MessageSet_First(MessageSet *set)
+{
+    if (set == NULL)
+	return -1;
+    return set->min;
+}
+
+int MessageSet_Next(MessageSet *set, int cur)
+{
+    for (; set != NULL; set = set->link) {
+	if (cur < set->min)
+	    return set->min;
+	if (cur < set->max)
+	    return cur + 1;
+    }
+
+    return -1;
+}
+
+/*
+**  Application Functions
+*/
+
+void InterruptHandler(int signum)
+{
+    putchar('\n');
+
+    if (gOpenPipe != NULL) {
+	pclose(gOpenPipe);
+	gOpenPipe = NULL;
+    }
+
+#if 0
+    // Kill all subprocesses in our process group
+    printf("# killpg\n");
+    sig_t oldHandler = signal(SIGTERM, SIG_IGN);
+    killpg(0, SIGTERM);
+    signal(SIGTERM, oldHandler);
+#endif
+
+    if (signum == SIGINT && gInterruptReentry != NULL)
+	longjmp(*gInterruptReentry, 0);
+
+    // Close all open mailboxes
+    Mailbox_DiscardSaves();
+    Mailbox_UnlockAll();
+
+    // Resend signal (and hopefully die)
+    signal(signum, SIG_DFL);
+    kill(0, signum);
+
+    // Still here?
+    exit(EX_UNAVAILABLE);
+}
+
+void WriteQuotedExcerpt(FILE *out, String *str, int pos, int lines,
+			const char *prefix)
+{
+    const char *chars = String_Chars(str);
+    int len = String_Length(str);
+    const char *b, *e, *p;
+    int counter;
+
+    // Extract a context of four lines before & after
+    // the "From " line.
+    //
+    counter = lines / 2;
+    for (b = chars + pos; b > chars; b--) {
+	if (*b == '\n' && counter-- == 0)
+	    break;
+    }
+
+    counter = lines - lines / 2;
+    for (e = chars + pos; e < chars + len; e++) {
+	if (*e == '\n' && counter-- == 0)
+	    break;
+    }
+
+
+    for (p = b; p < e; p++) {
+	if (p == b || p[-1] == '\n')
+	    fprintf(out, "%s", prefix);
+	putc(*p, out);
+    }
+    if (e > b && p[-1] != '\n')
+	putc('\n', out);
+}
+
+
+/**
+ **  Content Validation
+ **
+ **  Checks that base64 and quoted-printable content is validly encoded
+ **  and that UTF-8 text is well formed, without decoding any of it.
+ **  Each validator returns what's wrong (or NULL) and where.  Most of
+ **  the content will be long runs of ordinary characters, which are
+ **  skipped 16 bytes at a time with SSE2 where we have it.
+ **/
+
+typedef enum {
+    kContent_None = 0,
+    kContent_Base64,
+    kContent_QuotedPrintable,
+    kContent_UTF8,
+} ContentCheck;
+
+#ifdef __SSE2__
+// Which bytes are in [lo, hi]?  (Anything >= 0x80 counts as negative.)
+//
+static inline __m128i SSE_InRange(__m128i x, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+			 _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), x));
+}
+#endif
+
+static inline bool Base64_IsAlphabet(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	(c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+// How many base64 alphabet characters are there at p?
+//
+static inline int Base64_AlphabetRun(const unsigned char *p,
+				     const unsigned char *end)
+{
+    const unsigned char *q = p;
+
+#ifdef __SSE2__
+    for (; end - q >= 16; q += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) q);
+	__m128i ok = _mm_or_si128(
+	    _mm_or_si128(SSE_InRange(x, 'A', 'Z'), SSE_InRange(x, 'a', 'z')),
+	    _mm_or_si128(SSE_InRange(x, '/', '9'),	// "/0123456789"
+			 _mm_cmpeq_epi8(x, _mm_set1_epi8('+'))));
+	int bad = ~_mm_movemask_epi8(ok) & 0xFFFF;
+
+	if (bad != 0)
+	    return q - p + __builtin_ctz(bad);
+    }
+#endif
+
+    while (q < end && Base64_IsAlphabet(*q))
+	q++;
+
+    return q - p;
+}
+
+static const char *Validate_Base64(const char *chars, int length, int *pPos)
+{
+    const unsigned char *start = (const unsigned char *) chars;
+    const unsigned char *end = start + length;
+    const unsigned char *p = start;
+    int64_t count = 0;		// Alphabet and padding characters
+    int padding = 0;
+
+    while (p < end) {
+	const unsigned char *line = p;
+	int run = Base64_AlphabetRun(p, end);
+
+	if (padding > 0 && run > 0) {
+	    *pPos = p - start;
+	    return "data after the padding";
+	}
+	p += run;
+	count += run;
+
+	while (p < end && *p == '=') {
+	    if (count % 4 < 2 || ++padding > 2) {
+		*pPos = p - start;
+		return "misplaced padding";
+	    }
+	    p++;
+	    count++;
+	}
+
+	if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n')
+	    p++;
+	if (p < end && *p != '\n') {
+	    *pPos = p - start;
+	    return Base64_IsAlphabet(*p) ? "data after the padding" :
+		"invalid character";
+	}
+	if (p - line > kMIME_MaxLineLength + (p > line && p[-1] == '\r')) {
+	    *pPos = line - start;
+	    return "line longer than 76 characters";
+	}
+	p++;
+    }
+
+    if (count % 4 != 0) {
+	*pPos = length;
+	return "truncated final group";
+    }
+
+    return NULL;
+}
+
+static const char *Validate_QuotedPrintable(const char *chars, int length,
+					    int *pPos)
+{
+    const unsigned char *start = (const unsigned char *) chars;
+    const unsigned char *end = start + length;
+    const unsigned char *p = start;
+    const unsigned char *line = start;
+
+    while (p < end) {
+#ifdef __SSE2__
+	// Skip over the plain printable characters (other than '=')
+	//
+	for (; end - p >= 16; p += 16) {
+	    __m128i x = _mm_loadu_si128((const __m128i *) p);
+	    __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('=')),
+					  SSE_InRange(x, ' ', '~'));
+
+	    if (_mm_movemask_epi8(ok) != 0xFFFF)
+		break;
+	}
+#endif
+	while (p < end && *p >= ' ' && *p <= '~' && *p != '=')
+	    p++;
+	if (p == end)
+	    break;
+
+	if (*p == '\n') {
+	    if (p - line > kMIME_MaxLineLength + (p > line && p[-1] == '\r')) {
+		*pPos = line - start;
+		return "line longer than 76 characters";
+	    }
+	    line = ++p;
+	} else if (*p == '=') {
+	    const unsigned char *q = p + 1;
+
+	    if (end - q >= 2 && Char_IsHex(q[0]) && Char_IsHex(q[1])) {
+		p += 3;
+		continue;
+	    }
+
+	    // Soft line break (possibly with trailing whitespace)?
+	    while (q < end && (*q == ' ' || *q == '\t' || *q == '\r'))
+		q++;
+	    if (q < end && *q != '\n') {
+		*pPos = p - start;
+		return "invalid escape";
+	    }
+	    p = q;
+	} else if (*p == '\t' || *p == '\r') {
+	    p++;
+	} else {
+	    *pPos = p - start;
+	    return *p >= 0x80 ? "unencoded 8-bit character" :
+		"unencoded control character";
+	}
+    }
+
+    if (p - line > kMIME_MaxLineLength) {
+	*pPos = line - start;
+	return "line longer than 76 characters";
+    }
+
+    return NULL;
+}
+
+static const char *Validate_UTF8(const char *chars, int length, int *pPos)
+{
+    const unsigned char *s = (const unsigned char *) chars;
+    int i = 0;
+
+    while (i < length) {
+#ifdef __SSE2__
+	// Skip over ASCII
+	//
+	while (length - i >= 16 &&
+	       _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))) == 0)
+	    i += 16;
+#endif
+	while (i < length && s[i] < 0x80)
+	    i++;
+	if (i == length)
+	    break;
+
+	unsigned char c = s[i], lo = 0x80, hi = 0xBF;
+	int k, n;
+
+	if (c >= 0xC2 && c <= 0xDF)
+	    n = 1;
+	else if (c >= 0xE0 && c <= 0xEF)
+	    n = 2;
+	else if (c >= 0xF0 && c <= 0xF4)
+	    n = 3;
+	else {
+	    *pPos = i;
+	    return "invalid UTF-8 byte";
+	}
+
+	// No overlong forms, surrogates or anything past U+10FFFF
+	//
+	if (c == 0xE0)
+	    lo = 0xA0;
+	else if (c == 0xED)
+	    hi = 0x9F;
+	else if (c == 0xF0)
+	    lo = 0x90;
+	else if (c == 0xF4)
+	    hi = 0x8F;
+
+	if (length - i <= n) {
+	    *pPos = i;
+	    return "truncated UTF-8 sequence";
+	}
+	if (s[i + 1] < lo || s[i + 1] > hi) {
+	    *pPos = i;
+	    return "invalid UTF-8 sequence";
+	}
+	for (k = 2; k <= n; k++) {
+	    if ((s[i + k] & 0xC0) != 0x80) {
+		*pPos = i;
+		return "invalid UTF-8 sequence";
+	    }
+	}
+	i += n + 1;
+    }
+
+    return NULL;
+}
+
+// What should content of this type and transfer encoding be checked for?
+//
+static ContentCheck Content_CheckFor(const String *type, const String *cte)
+{
+    ContentCheck check = kContent_None;
+
+    if (cte != NULL && String_HasPrefix(cte, &Str_Base64, false))
+	return kContent_Base64;
+    if (cte != NULL && String_HasPrefix(cte, &Str_QuotedPrintable, false))
+	return kContent_QuotedPrintable;
+
+    if (type != NULL) {
+	String *charset = MIME_GetParameter((String *) type, &Str_Charset);
+
+	if (charset != NULL && (String_IsEqual(charset, &Str_UTF8, false) ||
+				String_IsEqual(charset, &Str_UTF8Short, false)))
+	    check = kContent_UTF8;
+	String_Free(charset);
+    }
+
+    return check;
+}
+
+static const char *Content_Validate(ContentCheck check, const char *chars,
+				    int length, int *pPos)
+{
+    switch (check) {
+      case kContent_Base64:
+	return Validate_Base64(chars, length, pPos);
+      case kContent_QuotedPrintable:
+	return Validate_QuotedPrintable(chars, length, pPos);
+      case kContent_UTF8:
+	return Validate_UTF8(chars, length, pPos);
+      default:
+	return NULL;
+    }
+}
+
+/**
+ **  MIME Checking
+ **
+ **  With --mime, CheckMailbox also makes sure that multipart messages are
+ **  well formed: that each multipart has a boundary, that its parts are
+ **  delimited by it and have proper headers, that nested multiparts are
+ **  closed before the ones they're in, and that the closing delimiters
+ **  are all there (if not, the message has most likely been truncated).
+ **  The content of each part (or of the body, if it's not a multipart)
+ **  is validated according to its transfer encoding or charset.
+ **  Since every delimiter line starts with "--", the body is scanned just
+ **  once for "\n--" (which memmem does at close to memory speed), and
+ **  each such line is then compared to the boundaries of all the
+ **  multiparts we're in at that point.
+ **/
+
+typedef struct {
+    String *boundary;
+    int parts;
+} MIMEFrame;
+
+typedef struct {
+    Message *msg;
+    MIMEFrame frames[kMIME_MaxDepth];
+    int depth;
+    int warnings;
+    const char *leaf;		// Start of the content to validate, if any
+    ContentCheck leafCheck;
+    int leafFrame;		// Multipart it's in (or -1 for the body)
+    int leafPart;
+} MIMEChecker;
+
+static void MIME_Warn(MIMEChecker *mc, const MIMEFrame *frame,
+		      const char *problem)
+{
+    if (++mc->warnings > kCheck_MaxWarnCount)
+	return;
+
+    Problem(kProblem_BadMultipart,
+	    "Message %s: Multipart boundary \"%s\" %s%s",
+	    String_CString(mc->msg->tag), String_CString(frame->boundary),
+	    problem, mc->warnings == kCheck_MaxWarnCount ? " (and more)" : "");
+}
+
+// Start checking a multipart of the given type (unless it's nested too
+// deep to care)
+//
+static void MIME_Push(MIMEChecker *mc, const String *type)
+{
+    MIMEFrame *frame = &mc->frames[mc->depth];
+    int i;
+
+    if (mc->depth == kMIME_MaxDepth)
+	return;
+
+    frame->boundary = MIME_GetParameter((String *) type, &Str_Boundary);
+    frame->parts = 0;
+
+    if (frame->boundary == NULL || String_IsEmpty(frame->boundary)) {
+	if (++mc->warnings <= kCheck_MaxWarnCount)
+	    Problem(kProblem_BadMultipart,
+		    "Message %s: Multipart without a boundary:\n %s",
+		    String_CString(mc->msg->tag), String_PrettyCString(type));
+	String_FreeP(&frame->boundary);
+	return;
+    }
+
+    if (String_Length(frame->boundary) > kMIME_MaxBoundaryLength)
+	MIME_Warn(mc, frame, "is longer than 70 characters");
+
+    for (i = 0; i < mc->depth; i++) {
+	if (String_IsEqual(mc->frames[i].boundary, frame->boundary, true)) {
+	    MIME_Warn(mc, frame, "is reused by a nested multipart");
+	    break;
+	}
+    }
+
+    mc->depth++;
+}
+
+// Validate the content from mc->leaf up to end (if there's any waiting)
+//
+static void MIME_ValidateLeaf(MIMEChecker *mc, const char *end)
+{
+    static const char *names[] = {NULL, "base64", "quoted-printable", "UTF-8"};
+    const char *leaf = mc->leaf;
+    const char *problem;
+    int pos;
+
+    mc->leaf = NULL;
+    if (leaf == NULL || end < leaf ||
+	(problem = Content_Validate(mc->leafCheck, leaf, end - leaf,
+				    &pos)) == NULL ||
+	++mc->warnings > kCheck_MaxWarnCount)
+	return;
+
+    int off = iMax(0, pos - kString_ExcerptLength / 2);
+    String excerpt = {leaf + off, end - leaf - off, kString_Shared};
+    String *where = mc->leafFrame < 0 ? String_FromCString("Body", false) :
+	String_PrintF("Part %d of multipart \"%s\"", mc->leafPart,
+		      String_CString(mc->frames[mc->leafFrame].boundary));
+
+    Problem(kProblem_BadEncoding,
+	    "Message %s: %s is not valid %s (%s):\n %s%s",
+	    String_CString(mc->msg->tag), String_CString(where),
+	    names[mc->leafCheck], problem, off == 0 ? "" : "...",
+	    String_QuotedCString(&excerpt, kString_ExcerptLength));
+
+    String_Free(where);
+}
+
+static void MIME_Pop(MIMEChecker *mc, const char *problem)
+{
+    MIMEFrame *frame = &mc->frames[--mc->depth];
+
+    if (problem != NULL)
+	MIME_Warn(mc, frame, problem);
+
+    String_Free(frame->boundary);
+}
+
+// Is the line in [line, eol) a delimiter for the boundary?
+//
+static bool MIME_IsDelimiter(const char *line, const char *eol,
+			     const String *boundary, bool *pClosing)
+{
+    int len = String_Length(boundary);
+    const char *p = line + 2 + len;
+
+    if (eol - line < 2 + len || memcmp(line + 2, String_Chars(boundary), len))
+	return false;
+
+    *pClosing = eol - p >= 2 && p[0] == '-' && p[1] == '-';
+    if (*pClosing)
+	p += 2;
+
+    // Allow for transport padding (and CRLFs)
+    while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+	p++;
+
+    return p == eol;
+}
+
+// Check the headers of the part starting at p, and start checking it
+// as a multipart if it is one
+//
+static void MIME_CheckPart(MIMEChecker *mc, const char *p, const char *end)
+{
+    const char *start = p;
+
+    while (p < end && *p != '\n' && !(*p == '\r' && p + 1 < end && p[1] == '\n')) {
+	const char *eol = memchr(p, '\n', end - p);
+	const char *colon;
+
+	if (eol == NULL)
+	    eol = end;
+
+	if (eol - p >= 2 && p[0] == '-' && p[1] == '-') {
+	    if (++mc->warnings <= kCheck_MaxWarnCount)
+		Problem(kProblem_BadMultipart,
+			"Message %s: Part %d of multipart \"%s\" has no empty "
+			"line after its headers", String_CString(mc->msg->tag),
+			mc->frames[mc->depth - 1].parts,
+			String_CString(mc->frames[mc->depth - 1].boundary));
+	    return;
+	}
+
+	// Every line is either a continuation or a "Key: value" line
+	//
+	if (*p != ' ' && *p != '\t' &&
+	    ((colon = memchr(p, ':', eol - p)) == NULL || colon == p ||
+	     memchr(p, ' ', colon - p) != NULL)) {
+	    String line = {p, eol - p, kString_Shared};
+
+	    if (++mc->warnings <= kCheck_MaxWarnCount)
+		Problem(kProblem_BadMultipart,
+			"Message %s: Malformed header in part %d of multipart "
+			"\"%s\":\n %s", String_CString(mc->msg->tag),
+			mc->frames[mc->depth - 1].parts,
+			String_CString(mc->frames[mc->depth - 1].boundary),
+			String_QuotedCString(&line, kString_ExcerptLength));
+	    return;
+	}
+
+	p = eol < end ? eol + 1 : end;
+    }
+
+    String *type = MIME_GetPartHeader(start, p, &Str_ContentType);
+
+    if (type != NULL && String_HasPrefix(type, &Str_Multipart, false)) {
+	MIME_Push(mc, type);
+    } else {
+	String *cte = MIME_GetPartHeader(start, p,
+					 &Str_ContentTransferEncoding);
+
+	mc->leafCheck = Content_CheckFor(type, cte);
+	if (mc->leafCheck != kContent_None) {
+	    mc->leaf = p < end ? p + (*p == '\r' ? 2 : 1) : end;
+	    mc->leafFrame = mc->depth - 1;
+	    mc->leafPart = mc->frames[mc->depth - 1].parts;
+	}
+	String_Free(cte);
+    }
+
+    String_Free(type);
+}
+
+// Find the next line in [p, end) starting with "--", or NULL
+//
+static inline const char *MIME_NextDashLine(const char *p, const char *end)
+{
+    const char *hit = memmem(p, end - p, "\n--", 3);
+
+    return hit != NULL ? hit + 1 : NULL;
+}
+
+void CheckMIME(Message *msg)
+{
+    String *type = Header_Get(msg->headers, &Str_ContentType);
+    String *body = Message_Body(msg);
+    MIMEChecker mc = {msg};
+    const char *start, *end, *line;
+
+    start = String_Chars(body);
+    end = start + String_Length(body);
+
+    if (type == NULL || !String_HasPrefix(type, &Str_Multipart, false)) {
+	mc.leafCheck = Content_CheckFor(type, Header_Get(msg->headers,
+						&Str_ContentTransferEncoding));
+	mc.leaf = start;
+	mc.leafFrame = -1;
+	MIME_ValidateLeaf(&mc, end);
+	return;
+    }
+
+    MIME_Push(&mc, type);
+    line = end - start >= 2 && start[0] == '-' && start[1] == '-' ?
+	start : MIME_NextDashLine(start, end);
+
+    // Stop at the outermost closing delimiter (the rest is epilogue)
+    //
+    for (; line != NULL && mc.depth > 0;
+	 line = MIME_NextDashLine(line + 2, end)) {
+	const char *eol = memchr(line, '\n', end - line);
+	bool closing = false;
+	int i;
+
+	if (eol == NULL)
+	    eol = end;
+
+	for (i = mc.depth - 1; i >= 0; i--) {
+	    if (MIME_IsDelimiter(line, eol, mc.frames[i].boundary, &closing))
+		break;
+	}
+	if (i < 0)
+	    continue;
+
+	// The newline before the delimiter belongs to it
+	//
+	MIME_ValidateLeaf(&mc, line > start ? line - 1 : line);
+
+	while (mc.depth - 1 > i)
+	    MIME_Pop(&mc, "is not closed before the multipart it's in");
+
+	if (closing) {
+	    MIME_Pop(&mc, mc.frames[i].parts == 0 ? "has no parts" : NULL);
+	} else {
+	    mc.frames[i].parts++;
+	    MIME_CheckPart(&mc, eol < end ? eol + 1 : end, end);
+	}
+    }
+
+    MIME_ValidateLeaf(&mc, end);
+
+    while (mc.depth > 0) {
+	MIME_Pop(&mc, mc.frames[mc.depth - 1].parts == 0 ?
+		 "is never used (no parts found)" :
+		 "is never closed (truncated message?)");
+    }
+}
+
+/* Check the string for "illegal" characters such as control chars
+ * or non-ASCII chars (unless eightBitOK is set).
+ * Return offset to illegal char if found, or -1 if OK.
+ */
+static int FindIllegalChar(String *str, bool controlOK, bool eightBitOK)
+{
+    int i, len = String_Length(str);
+    const char *chars = String_Chars(str);
+
+    for (i = 0; i < len; i++, chars++) {
+	if (*chars == '\r' || *chars == '\n' || *chars == '\t')
+	    continue;
+	if (!controlOK && ((*chars >= '\0' && *chars < ' ') || *chars == '\177'))
+	    return i;
+	if (!eightBitOK && !isascii(*chars))
+	    return i;
+    }
+
+    return kString_NotFound;
+}
+
+typedef struct {
+    bool repair;		// Are we repairing?
+    char autoChoice;		// Should this choice apply without asking?
+    bool quit;			// Have the user told us to quit repairing?
+} RepairState;
+
+void InitRepairState(RepairState *state, bool repair)
+{
+    state->repair = repair;
+    state->autoChoice = gInteractive ? '\0' : 'y';
+    state->quit = false;
+}
+
+bool IsRepairingAll(RepairState *state)
+{
+    return state->repair && state->autoChoice == 'y';
+}
+
+bool ShouldRepair(RepairState *state)
+{
+    int choice = state->autoChoice;
+
+    if (!state->repair)
+	return false;
+
+    if (choice == '\0')
+	choice = User_AskChoice(" Repair [ynq]?", "ynYNq", 'y');
+
+    // An uppercase answer will apply to all remaining questions
+    if (isupper(choice))
+	choice = state->autoChoice = tolower(choice);
+
+    state->quit = (choice == 'q');
+
+    return choice == 'y';
+}
+
+void CheckMailbox(Mailbox *mbox, bool strict, bool repair)
+{
+    Message *msg;
+    RepairState state;
+
+    InitRepairState(&state, repair);
+
+    // Anything skipped when salvaging only goes away if we rewrite it
+    //
+    gProblemMessage = 0;
+    if (mbox->salvaged > 0) {
+	Problem(kProblem_DamagedData, "Mailbox %s: Found %d damaged byte%s%s",
+		String_CString(Mailbox_Name(mbox)), mbox->salvaged,
+		mbox->salvaged == 1 ? "" : "s",
+		IsRepairingAll(&state) ? " (removing)" : "");
+
+	if (ShouldRepair(&state))
+	    Mailbox_SetDirty(mbox, true);
+    }
+
+    if (gProgress.fd != -1) {
+	int64_t total = 0;
+
+	for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next)
+	    total += String_Length(msg->data) + 1;
+	Progress_Start("checking", String_CString(Mailbox_Name(mbox)), total);
+    }
+
+    for (msg = Mailbox_Root(mbox); msg != NULL && !state.quit;
+	 msg = msg->next) {
+	String *value;
+	const String *source = NULL;
+	int cllen;
+
+	Progress_Advance(String_Length(msg->data) + 1);
+	gProblemMessage = msg->num;
+
+	// Check Content-Length
+	//
+	value = Header_Get(msg->headers, &Str_ContentLength);
+	cllen = String_ToInteger(value, -1);
+
+	int bodyLength = Message_BodyLength(msg);
+
+	// Always care about incorrect Content-Lengths, but only
+	// care about missing ones if we're being strict.
+	if (cllen != bodyLength && (value != NULL || strict)) {
+	    // Got the Dovecot "From " bug?
+	    //
+	    if (msg->dovecotFromSpaceBug != kDFSB_None) {
+		// Yup, remove bogus headers from the body
+		Problem(kProblem_DovecotBug,
+			"Message %s: Corrupted by Dovecot \"From \" bug%s",
+			String_CString(msg->tag),
+			IsRepairingAll(&state) ? " (repairing)" : "");
+
+		if (ShouldRepair(&state)) {
+		    RepairDovecotFromSpaceBugBody(msg);
+		    // Repairing the message will change it's length
+		    bodyLength = Message_BodyLength(msg);
+		} else if (state.quit)
+		    break;
+
+	    } else {
+		if (value == NULL)
+		    Problem(kProblem_ContentLength,
+			    "Message %s: Missing Content-Length:, "
+			    "should be %d%s",
+			    String_CString(msg->tag), bodyLength,
+			    IsRepairingAll(&state) ? " (repairing)" : "");
+		else
+		    Problem(kProblem_ContentLength,
+			    "Message %s: Incorrect Content-Length: %s, "
+			    "should be %d%s", String_CString(msg->tag),
+			    String_PrettyCString(value), bodyLength,
+			    IsRepairingAll(&state) ? " (repairing)" : "");
+
+		if (ShouldRepair(&state))
+		    Header_Set(msg->headers, &Str_ContentLength,
+			       String_PrintF("%d", bodyLength));
+		else if (state.quit)
+		    break;
+	    }
+	}
+
+	// Got Message-ID?
+	//
+	value = Header_Get(msg->headers, &Str_MessageID);
+	if (value == NULL || String_IsEmpty(value)) {
+	    source = &Str_XMessageID;
+	    value = Header_Get(msg->headers, source);
+
+	    if (value == NULL || String_IsEmpty(value)) {
+		String *synthID = Message_SynthesizeMessageID(msg);
+
+		Problem(kProblem_MissingMessageID,
+			"Message %s: Missing Message-ID: header, %s with %s",
+			String_CString(msg->tag),
+			IsRepairingAll(&state) ? "replacing" : "could replace",
+			String_CString(synthID));
+
+		if (ShouldRepair(&state))
+		    Header_Set(msg->headers, &Str_MessageID, synthID);
+		else if (state.quit)
+		    break;
+	    }
+	}
+
+	// Got well formed multiparts?
+	//
+	if (gCheckMIME)
+	    CheckMIME(msg);
+
+	// Only strict tests below
+	//
+	if (!strict)
+	    continue;
+
+	// Got ">From " in headers?
+	//
+	value = Header_Get(msg->headers, &Str_GTFromSpace);
+	if (value != NULL) {
+	    Problem(kProblem_BadHeader,
+		    "Message %s: Bogus \">From \" line in the the headers:\n"
+		    " \">From %s\"%s",
+		    String_CString(msg->tag), String_CString(value),
+		    IsRepairingAll(&state) ? " (removing)" : "");
+
+	    if (ShouldRepair(&state))
+		Header_Delete(msg->headers, &Str_GTFromSpace, false);
+	    else if (state.quit)
+		break;
+	}
+
+	// Got From?
+	//
+	value = Header_Get(msg->headers, &Str_From);
+	if (value == NULL) {
+	    source = &Str_XFrom;
+	    value = String_Clone(Header_Get(msg->headers, source));
+
+	    if (value == NULL) {
+		source = &Str_Sender;
+		value = String_Clone(Header_Get(msg->headers, source));
+	    }
+
+	    if (value == NULL) {
+		source = &Str_ReturnPath;
+		value = String_Clone(Header_Get(msg->headers, source));
+	    }
+
+	    if (value == NULL) {
+		source = &Str_EnvelopeSender;
+		value = String_Clone(msg->envSender);
+	    }
+
+	    if (value == NULL) {
+		Problem(kProblem_MissingFrom,
+			"Message %s: Missing From: header",
+			String_CString(msg->tag));
+
+	    } else {
+		Problem(kProblem_MissingFrom,
+			"Message %s: Missing From: header, %s %s:\n"
+			" \"%s\"", String_CString(msg->tag),
+			IsRepairingAll(&state) ? "using" : "but could use",
+			String_CString(source), String_CString(value));
+
+		if (ShouldRepair(&state)) {
+		    Header_Set(msg->headers, &Str_From, value);
+		    value = NULL;
+		} else if (state.quit)
+		    break;
+	    }
+
+	    String_Free(value);
+	}
+
+	// Got Date?
+	//
+	value = Header_Get(msg->headers, &Str_Date);
+	if (value != NULL) {
+	    // Check syntax
+	    struct tm tm;
+
+	    if (!Scan_RFC822Date(value, &tm)) {
+		if (Scan_FuzzyDate(value, &tm)) {
+		    String *newDate = String_RFC822Date(&tm, true);
+
+		    Problem(kProblem_InvalidDate,
+			    "Invalid Date: \"%s\", %s with %s",
+			    String_CString(value),
+			    IsRepairingAll(&state) ?
+				"replacing" : "could replace",
+			    String_CString(newDate));
+
+		    if (ShouldRepair(&state)) {
+			Header_Set(msg->headers, &Str_Date, newDate);
+		    } else {
+			String_Free(newDate);
+			if (state.quit)
+			    break;
+		    }
+		} else {
+		    Problem(kProblem_InvalidDate,
+			    "Invalid Date: \"%s\", cannot repair",
+			    String_CString(value));
+		}
+	    }
+	} else {
+	    // Look for "X-Date: <date>"
+	    //
+	    source = &Str_XDate;
+	    value = String_Clone(Header_Get(msg->headers, source));
+
+	    // Look for "Received: <junk>; <date>"
+	    //
+	    if (value == NULL) {
+		source = &Str_Received;
+
+		String *received = Header_GetLastValue(msg->headers, source);
+		if (received != NULL) {
+		    int pos = String_FindChar(received, ';', true);
+		    if (pos != kString_NotFound) {
+			Parser tmp;
+			Parser_Set(&tmp, received);
+			Parser_Move(&tmp, pos + 1);
+			Parse_Spaces(&tmp, NULL);
+			Parse_UntilEnd(&tmp, &value);
+		    }
+		}
+	    }
+
+	    // Look for "From <sender> <cdate>"
+	    //
+	    if (value == NULL && msg->envSender != NULL) {
+		source = &Str_EnvelopeDate;
+		value = String_RFC822Date(&msg->envDate, false);
+	    }
+
+	    if (value == NULL) {
+		Problem(kProblem_MissingDate,
+			"Message %s: Missing Date: header",
+			String_CString(msg->tag));
+
+	    } else {
+		Problem(kProblem_MissingDate,
+			"Message %s: Missing Date: header, %s %s:\n"
+			" \"%s\"", String_CString(msg->tag),
+			IsRepairingAll(&state) ? "using" : "but could use",
+			String_CString(source), String_CString(value));
+
+		if (ShouldRepair(&state)) {
+		    Header_Set(msg->headers, &Str_Date, value);
+		    value = NULL;
+		} else if (state.quit)
+		    break;
+	    }
+
+	    String_Free(value);
+	}
+
+	// Make sure there's no (undeclared) binary data in headers or body
+	//
+	Header *head;
+
+	for (head = msg->headers->root; head != NULL; head = head->next) {
+	    int pos = FindIllegalChar(head->line, false, false);
+	    if (pos >= 0) {
+		Problem(kProblem_IllegalCharacter,
+			"Message %s: Illegal character %s in header:\n"
+			" %s", String_CString(msg->tag),
+			Char_QuotedCString(String_CharAt(head->line, pos)),
+			String_PrettyCString(head->line));
+	    }
+	}
+
+#if 0 // Need to check multipart headers!
+	String *cte =
+	    Header_Get(msg->headers, &Str_ContentTransferEncoding);
+	if (cte == NULL || !String_HasPrefix(cte, &Str_Binary, false)) {
+	    String *body = Message_Body(msg);
+	    
+	    bool is8Bit = String_HasPrefix(cte, &Str_8Bit, false);
+	    int pos = FindIllegalChar(body, true, is8Bit);
+	    if (pos >= 0) {
+		int off = iMax(0, pos - kString_ExcerptLength / 2);
+		String *sub = String_Sub(body, off, String_Length(body));
+
+		Problem(kProblem_IllegalCharacter,
+			"Message %s: Illegal character %s in body:\n %s%s",
+			String_CString(msg->tag),
+			Char_QuotedCString(String_CharAt(body, pos)),
+			off == 0 ? "" : "...",
+			String_QuotedCString(sub, kString_ExcerptLength));
+	    }
+	}
+#endif
+    }
+
+    gProblemMessage = 0;
+    Progress_Stop();
+}
+
+void Message_Join(Message *a, Message *b)
+{
+    Message_SetBody(a, String_Append(Message_Body(a), &Str_Newline,
+				     b->data, NULL));
+    Message_SetDeleted(b, true);
+}
+
+bool Message_Split(Message *msg, bool interactively)
+{
+    // "\n\nFrom " line in body?
+    //
+    String *body = Message_Body(msg);
+    Parser parser;
+
+    Parser_Set(&parser, body);
+
+    for (;;) {
+	String *line;
+
+	if (!Parse_UntilFromSpace(&parser, 2))
+	    break;
+
+	if (!Parse_Newline(&parser, NULL) || !Parse_Newline(&parser, NULL))
+	    Fatal(EX_SOFTWARE, "Internal error, couldn't parse double newline"
+		  "in Message_Split");
+
+	int pos = Parser_Position(&parser);
+
+	if (Parse_FromSpaceLine(&parser, &line, NULL, NULL)) {
+	    bool split = true;
+
+	    // Remove the newline from the string we parsed
+	    if (!String_IsEmpty(line))
+		String_SetLength(line, String_Length(line) - 1);
+
+	    Note("Message %s: Found \"From \" line in body:\n %s",
+		 String_CString(msg->tag), String_QuotedCString(line, -1));
+
+	    if (interactively) {
+		fprintf(stdout, "Message context:\n");
+		WriteQuotedExcerpt(stdout, body, pos, 15, "| ");
+		split = User_AskYesOrNo("Split message?", split);
+	    }
+
+	    String_Free(line);
+
+	    if (split) {
+		Message *newMsg = NULL;
+
+		Parser_MoveTo(&parser, pos);
+		while (Parse_Message(&parser, msg->mbox, false, &newMsg)) {
+		    if (body != NULL) {
+			// Shorten the old body and link in the new msg
+			String_SetLength(body, pos - 1);
+			Message_SetDirty(msg, true);
+		    }
+		    newMsg->next = msg->next;
+		    msg->next = newMsg;
+		    Note("Created new message %s", String_CString(newMsg->tag));
+
+		    Message_SetDirty(newMsg, true);
+
+		    msg = newMsg;
+		    body = NULL;
+
+		    Parse_Newline(&parser, NULL);
+		}
+
+		return newMsg != NULL;
+	    }
+	}
+    }
+
+    return false;
+}
+
+#if 0
+void CheckContentLengths(Message *msg, bool strict, bool repair)
+{
+    for (; msg != NULL; msg = msg->next) {
+	String *value = Header_Get(msg->headers, &Str_ContentLength);
+	int oldlen = String_ToInteger(value, -1);
+	int bodlen = Message_BodyLength(msg);
+
+
+	if (oldlen != bodlen) {
+	    if (repair) {
+		if (value != NULL)
+		    Note("Message %s: Changing Content-Length: %s to %d",
+			 String_CString(msg->tag),
+			 String_PrettyCString(value), bodlen);
+			 
+		else
+		    Note("Message %s: Setting Content-Length: to %d",
+			 String_CString(msg->tag), bodlen);
+
+		Header_Set(msg->headers, &Str_ContentLength, 
+			   String_PrintF("%d", bodlen));
+
+	    } else {
+		if (strict)
+		    Problem(kProblem_ContentLength,
+			    "Message %s: Missing Content-Length: header",
+			    String_CString(msg->tag));
+	    }
+	}
+    }
+}
+
+void RemoveContentLengths(Message *msg, bool escapeEscapedFromToo)
+{
+    Array *bodyParts = Array_New(0, (Free *) String_Free);
+
+    for (; msg != NULL; msg = msg->next) {
+	Header_Delete(msg->headers, &Str_ContentLength, true);
+
+	Parser tmp;
+	int lastPos = 0;
+	String *body = Message_Body(msg);
+
+	Parser_Set(&tmp, body);
+
+	while (Parse_UntilString(&tmp, &Str_FromSpace, true, NULL)) {
+	    char ch;
+
+	    if (Parser_Move(&tmp, -1) &&
+		Parse_Char(&tmp, &ch)) {
+
+		int pos = Parser_Position(&tmp);
+
+		if (escapeEscapedFromToo && ch == '>') {
+		    // Look for "\n>*From"
+		    const char *b, *bodyChars = String_Chars(body);
+
+		    for (b = bodyChars + pos - 2; b > bodyChars && *b == '>';
+			 b--);
+
+		    ch = *b;
+		}
+
+		if (Char_IsNewline(ch)) {
+		    // This "From " marker needs quoting
+		    //
+		    Array_Append(bodyParts, String_Sub(body, lastPos, pos));
+		    lastPos = pos;
+		}
+	    }
+	}
+
+	if (Array_Count(bodyParts) > 0) {
+	    String_Define(gtString, ">");
+
+	    Parse_UntilEnd(&tmp, NULL);
+	    Array_Append(bodyParts,
+			 String_Sub(body, lastPos, Parser_Position(&tmp)));
+
+	    String *newBody = Array_Join(bodyParts, &gtString);
+	    String_Free(body);
+	    Message_SetBody(msg, newBody);
+	}
+    }
+
+    Array_Free(bodyParts);
+}
+#endif
+
+Array *SplitMessages(Mailbox *mbox, Array *mary)
+{
+    Message *msg;
+
+    if (mary == NULL)
+	mary = Array_New(0, NULL);
+
+    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
+	Array_Append(mary, msg);
+    }
+
+    return mary;
+}
+
+// Start up the pager (if any) to write to
+//
+Stream *Pager_Open(void)
+{
+    // Disable SIGINT handling while running the pager
+    FILE *output = stdout;
+
+    signal(SIGINT, SIG_IGN);
+
+    // Hand the pager big chunks at a time
+    //
+    if (gPager != NULL) {
+	gOpenPipe = output = popen(String_CString(gPager), "w");
+	setvbuf(output, NULL, _IOFBF, kPager_BufferSize);
+    }
+
+    Stream *stream = Stream_New(output, gPager, true);
+    stream->ignoreErrors = true;
+
+    return stream;
+}
+
+void Pager_Close(Stream *stream)
+{
+    if (gPager != NULL) {
+	pclose(gOpenPipe);
+	gOpenPipe = NULL;
+    }
+    Stream_Free(stream, false);
+    
+    // Restore our interrupt handler
+    signal(SIGINT, InterruptHandler);
+}
+
+static void Pager_WriteMessage(Stream *stream, Message *msg)
+{
+    Stream_PrintF(stream, "[Mailbox %s: Message %s]\n",
+		  String_CString(Mailbox_Name(msg->mbox)),
+		  String_CString(msg->tag));
+
+    // Unchanged messages can be written just as they are in the mailbox
+    //
+    if (Message_IsVerbatim(msg))
+	Stream_WriteString(stream, msg->data);
+    else
+	Stream_WriteMessage(stream, msg);
+}
+
+void ShowMessage(Message *msg)
+{
+    Stream *stream = Pager_Open();
+
+    Pager_WriteMessage(stream, msg);
+
+    Pager_Close(stream);
+}
+
+// Show all of the messages through the same pager
+//
+void ShowMessages(Array *msgs)
+{
+    Stream *stream = Pager_Open();
+    int i;
+
+    // (Stop if the pager's gone away)
+    for (i = 0; i < Array_Count(msgs) && !ferror(stream->file); i++)
+	Pager_WriteMessage(stream, Array_GetAt(msgs, i));
+
+    Pager_Close(stream);
+}
+
+bool EditFile(String *path)
+{
+    static String *editor = NULL;
+    const char *cPath = String_CString(path);
+    struct stat sbuf;
+    time_t oldmtime;
+
+    if (editor == NULL) {
+	const char *cEditor = getenv("EDITOR");
+	if (cEditor == NULL)
+	    cEditor = kDefaultEditor;
+	editor = String_FromCString(cEditor, false);
+    }
+
+    if (stat(cPath, &sbuf) != 0) {
+	perror(cPath);
+	return false;
+    }
+
+    oldmtime = sbuf.st_mtime;
+
+    Note("Editing message file %s", cPath);
+
+    String *cmd = String_Append(editor, &Str_Space, path, NULL);
+    int ret = system(String_CString(cmd));
+    if (ret == -1) {
+	Error("Could not execute %s: %s",
+	      String_CString(cmd), strerror(errno));
+    } else if (ret != 0) {
+	Error("%s signalled an error, discarding changes",
+	      String_CString(cmd));
+    }
+    String_Free(cmd);
+
+    if (ret != 0 || stat(cPath, &sbuf) != 0 || sbuf.st_mtime == oldmtime) {
+	return false;
+    }
+
+    return true;
+}
+
+Stream *SaveTempMessage(Message *msg)
+{
+    String *tmpPath = String_FromCString("/tmp/mfck", false);
+    Stream *stream = Stream_OpenTemp(tmpPath, true, true);
+
+    Stream_WriteMessage(stream, msg);
+    Stream_Close(stream);
+
+    return stream;
+}
+
+void EditMessage(Message *msg)
+{
+    Stream *stream = SaveTempMessage(msg);
+    String *data = NULL;
+
+    if (!EditFile(stream->name)) {
+	Note("Message unchanged");
+	Stream_Free(stream, true);
+	return;
+    }
+
+    if (!Stream_Reopen(stream, false, true) ||
+	!Stream_ReadContents(stream, &data)) {
+	perror(String_CString(stream->name));
+	Stream_Free(stream, true);
+	return;
+    }
+
+    Stream_Free(stream, true);
+
+    Parser parser;
+    Message *newMsg;
+
+    Parser_Set(&parser, data);
+    if (!Parse_Message(&parser, msg->mbox, true, &newMsg)) {
+	Error(EX_OK, "Could not parse message");
+	String_Free(data);
+	return;
+    }
+
+    // Make the message own the (orignal) file data so it will
+    // be freed when the message gets freed
+    //
+    if (String_Chars(data) != String_Chars(newMsg->data)) {
+	Warn("Internal error: Message data != parsed file data; leaking!");
+    } else {
+	String_Free(newMsg->data);
+	newMsg->data = data;
+    }
+
+    Message **pLink = &msg->mbox->root;
+
+    while (*pLink != NULL && *pLink != msg)
+	pLink = &(*pLink)->next;
+
+    if (*pLink != msg) {
+	Warn("Internal error: Can't find message %s in mailbox %s",
+	     String_CString(msg->tag), String_CString(msg->mbox->source));
+
+	*pLink = newMsg;
+
+    } else {
+	*pLink = newMsg;
+	newMsg->next = msg->next;
+	Message_Free(msg, false);
+    }
+
+    Message_SetDirty(newMsg, true);
+}
+
+// "[Mon,]  1 Jan 2000 00:00:00 +0000 (GMT)" => " 1 Jan 00:00"
+//
+void PrintShortDate(Stream *output, String *rfc822Date)
+{
+    const char *chars = String_Chars(rfc822Date);
+    int len = String_Length(rfc822Date);
+    Parser tmp;
+    int pos;
+    String *day, *mon, *year, *time;
+
+    Parser_Set(&tmp, rfc822Date);
+
+    Parse_Spaces(&tmp, NULL);
+
+    pos = Parser_Position(&tmp);
+    if (pos + 4 < len && chars[pos+3] == ',') {
+	// Skip weekday
+	Parse_UntilSpace(&tmp, NULL);
+	Parse_Spaces(&tmp, NULL);
+    }
+
+    // Should be pointing to the day now (which may be one or two digits)
+    //
+    Parse_UntilSpace(&tmp, &day);
+    Parse_Spaces(&tmp, NULL);
+
+    // Month
+    //
+    Parse_UntilSpace(&tmp, &mon);
+    Parse_Spaces(&tmp, NULL);
+    
+    // Year
+    //
+    Parse_UntilSpace(&tmp, &year);
+    Parse_Spaces(&tmp, NULL);
+    
+    // Time
+    //
+    Parse_UntilSpace(&tmp, &time);
+    Parse_Spaces(&tmp, NULL);
+
+    // OK,  let's do it!
+    //
+    Stream_PrintF(output, "%2.2s %-3.3s %-5.5s",
+		  String_CString(String_Safe(day)),
+		  String_CString(String_Safe(mon)),
+		  String_CString(String_Safe(time)));
+
+    String_Free(day);
+    String_Free(mon);
+    String_Free(year);
+    String_Free(time);
+}
+
+int IntLength(int num)
+{
+    int digits;
+
+    if (num == 0)
+	return 1;
+
+    for (digits = 0; num > 0; num /= 10, digits++);
+
+    return digits;
+}
+
+// How many columns does the character take up on a terminal?
+//
+static int Char_Width(unsigned int cp)
+{
+    if (cp >= 0x0300 && cp <= 0x036F)		// Combining marks
+	return 0;
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF) ||
+	(cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+	(cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+	(cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+	(cp >= 0x20000 && cp <= 0x3FFFD))
+	return 2;
+
+    return 1;
+}
+
+// Write the (UTF-8) string cut or padded to exactly width columns
+//
+void Stream_WriteColumn(Stream *output, const String *str, int width)
+{
+    const unsigned char *start = (const unsigned char *) String_Chars(str);
+    const unsigned char *end = start + String_Length(str);
+    const unsigned char *p = start;
+    int cols = 0;
+
+    while (p < end) {
+	unsigned int cp = *p;
+	int len = 1, i;
+
+	// Anything that isn't valid UTF-8 is taken a byte at a time
+	//
+	if (cp >= 0xC2 && cp <= 0xF4) {
+	    int n = cp < 0xE0 ? 1 : cp < 0xF0 ? 2 : 3;
+
+	    if (end - p > n) {
+		cp &= 0x3F >> n;
+		for (i = 1; i <= n && (p[i] & 0xC0) == 0x80; i++)
+		    cp = cp << 6 | (p[i] & 0x3F);
+		if (i > n)
+		    len = n + 1;
+		else
+		    cp = *p;
+	    }
+	}
+
+	int w = len == 1 && cp >= 0x80 ? 1 : Char_Width(cp);
+
+	if (cols + w > width)
+	    break;
+	cols += w;
+	p += len;
+    }
+
+    Stream_WriteChars(output, (const char *) start, p - start);
+    for (; cols < width; cols++)
+	Stream_WriteChar(output, ' ');
+}
+
+void ListMessage(Stream *output, int num, int numWidth, Message *msg,
+		 int previewLines, int cur)
+{
+    // ' '<num:numWidth>': '<date:12>'  '<from>'  '<subject>'  '<size:6>
+    String *sizstr = String_ByteSize(String_Length(msg->data));
+    int fromSubjectWidth = gPageWidth - 27 - numWidth;
+    int fromWidth = fromSubjectWidth * 2 / 5;
+    int subjectWidth = fromSubjectWidth - fromWidth;
+
+    Stream_PrintF(output, "%c%*d%c ",
+		  num == cur ? '>' : ' ', numWidth, num,
+		  Message_IsDeleted(msg) ? 'D' : ':');
+    PrintShortDate(output, Header_Get(msg->headers, &Str_Date));
+    Stream_WriteChars(output, "  ", 2);
+    Stream_WriteColumn(output, String_Safe((String *)
+		       Message_DecodedHeader(msg, &Str_From)), fromWidth);
+    Stream_WriteChars(output, "  ", 2);
+    Stream_WriteColumn(output, String_Safe((String *)
+		       Message_DecodedHeader(msg, &Str_Subject)), subjectWidth);
+    Stream_PrintF(output, " %6s\n", String_CString(String_Safe(sizstr)));
+
+    String_Free(sizstr);
+
+    Parser tmp;
+    String *line;
+
+    Parser_Set(&tmp, Message_Body(msg));
+    while (previewLines-- > 0) {
+	if (!Parse_UntilNewline(&tmp, &line))
+	    break;
+	Parse_Newline(&tmp, NULL);
+	Stream_PrintF(output, " %*s  |%.*s\n",
+		      numWidth, "",
+		      gPageWidth - numWidth - 3, String_CString(line));
+	String_Free(line);
+    }
+}
+
+void ListMailbox(Stream *output, Mailbox *mbox, int cur, int count)
+{
+    // A negative count means all messages
+    if (count < 0)
+	count = Mailbox_Count(mbox) - cur - 1;
+
+    // Adjust to even page boundary with zero offset
+    //int start = ((cur - 1) / count) * count;
+    int start = cur;
+    int i = 1;
+    int digits = IntLength(start + count + 1 - 1);
+    Message *msg;
+
+    for (msg = Mailbox_Root(mbox); msg != NULL && i < start; msg = msg->next, i++);
+
+    for (; msg != NULL && i < start + count; msg = msg->next, i++) {
+	ListMessage(output, i, digits, msg, 0, cur);
+    }
+}
+
+#define kSearchBody		((String *) -1)
+
+// Key can be NULL which will make us try to find the string everywhere
+void FindMessages(Stream *output, Mailbox *mbox, const String *key,
+		  const String *string)
+{
+    Message *msg;
+    int numWidth = IntLength(mbox->count);
+
+    if (String_IsEqual(key, &Str_Body, false))
+	key = kSearchBody;
+
+    for (msg = Mailbox_Root(mbox); msg != NULL; msg = msg->next) {
+	bool found = false;
+	Header *head;
+
+	if (key == NULL) {
+	    for (head = msg->headers->root; head != NULL; head = head->next) {
+		if (Message_HeaderContains(msg, head, string)) {
+		    found = true;
+		    break;
+		}
+	    }
+	} else if (key != kSearchBody) {
+	    head = Header_Find(msg->headers, key);
+	    if (head != NULL)
+		found = Message_HeaderContains(msg, head, string);
+	}
+
+	if (!found && (key == NULL || key == kSearchBody)) {
+	    found = String_FoundString(msg->body, string, false);
+	}
+
+	if (found) {
+	    ListMessage(output, msg->num, numWidth, msg, 0, -1);
+	}
+    }
+}
+
+int CompareMessageIDs(const void *a, const void *b)
+{
+    Message *ma = *(Message **) a;
+    Message *mb = *(Message **) b;
+
+    return String_Compare(String_Safe(ma->cachedID),
+			  String_Safe(mb->cachedID), true);
+}
+
+void SortMessages(Array *mary)
+{
+    int i;
+
+    if (gVerbose)
+	Note("Sorting messages");
+
+    // First cache message IDs
+    for (i = 0; i < Array_Count(mary); i++) {
+	Message *msg = Array_GetAt(mary, i);
+
+	if (msg->cachedID == NULL)
+	    msg->cachedID = Header_Get(msg->headers, &Str_MessageID);
+    }
+    
+    qsort(Array_Items(mary), Array_Count(mary), sizeof(void *),
+	  CompareMessageIDs);
+}
+
+/**
+ **  Message Diffing
+ **
+ **  Messages are compared in-process: headers by name (so that only the
+ **  ones that differ are shown) and bodies line by line, using Myers'
+ **  O(ND) algorithm on hashed lines.  The result is shown through the
+ **  pager in unified diff format.  With --extdiff, we'll save both
+ **  messages to temp files and leave it to diff(1) instead.
+ **/
+
+typedef struct {
+    const char *chars;
+    int length;
+    uint32_t hash;
+} DiffLine;
+
+typedef struct {
+    char type;			// ' ', '-' or '+'
+    int aIndex;			// Line in a (or where it would have been)
+    int bIndex;			// Line in b (ditto)
+} DiffOp;
+
+// Split the string into lines (with their newlines)
+//
+static DiffLine *Diff_IndexLines(const String *str, int *pCount)
+{
+    const char *chars = String_Chars(str);
+    const char *end = chars + String_Length(str);
+    DiffLine *lines = NULL;
+    int count = 0, size = 0;
+
+    while (chars < end) {
+	const char *nl = memchr(chars, '\n', end - chars);
+	int length = nl != NULL ? nl + 1 - chars : end - chars;
+	uint32_t hash = 2166136261u;	// FNV-1a
+	int i;
+
+	for (i = 0; i < length; i++)
+	    hash = (hash ^ (unsigned char) chars[i]) * 16777619u;
+
+	if (count == size) {
+	    size = iMax(kArray_InitialSize, size * 2);
+	    lines = xalloc(lines, size * sizeof(DiffLine));
+	}
+	lines[count].chars = chars;
+	lines[count].length = length;
+	lines[count].hash = hash;
+	count++;
+
+	chars += length;
+    }
+
+    *pCount = count;
+
+    return lines;
+}
+
+static inline bool DiffLine_IsEqual(const DiffLine *a, const DiffLine *b)
+{
+    return a->hash == b->hash && a->length == b->length &&
+	memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// Find the shortest edit script turning lines a into lines b.  Anything
+// needing more than kDiff_MaxEdits edits (after leaving out the common
+// head & tail) is simply taken to have been replaced altogether.
+//
+static DiffOp *Diff_Lines(const DiffLine *a, int n, const DiffLine *b, int m,
+			  int *pCount)
+{
+    DiffOp *ops = xalloc(NULL, (n + m + 1) * sizeof(DiffOp));
+    int head = 0, tail = 0;
+    int count = 0;
+    int i;
+
+    while (head < n && head < m && DiffLine_IsEqual(&a[head], &b[head]))
+	head++;
+    while (tail < n - head && tail < m - head &&
+	   DiffLine_IsEqual(&a[n - 1 - tail], &b[m - 1 - tail]))
+	tail++;
+
+    const DiffLine *a1 = a + head, *b1 = b + head;
+    int n1 = n - head - tail, m1 = m - head - tail;
+    int limit = iMin(n1 + m1, kDiff_MaxEdits);
+    int *v = xalloc(NULL, (2 * limit + 3) * sizeof(int));
+    int **trace = xalloc(NULL, (limit + 1) * sizeof(int *));
+    int x, y, d, k;
+    int edits = -1;
+    int traced;
+
+    // Forward pass, remembering how far each diagonal got for each d
+    //
+    v += limit + 1;
+    v[1] = 0;
+    for (d = 0; d <= limit && edits == -1; d++) {
+	for (k = -d; k <= d; k += 2) {
+	    if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+		x = v[k + 1];
+	    else
+		x = v[k - 1] + 1;
+	    y = x - k;
+	    while (x < n1 && y < m1 && DiffLine_IsEqual(&a1[x], &b1[y])) {
+		x++;
+		y++;
+	    }
+	    v[k] = x;
+	    if (x >= n1 && y >= m1) {
+		edits = d;
+		break;
+	    }
+	}
+	trace[d] = xalloc(NULL, (2 * d + 1) * sizeof(int));
+	memcpy(trace[d], v - d, (2 * d + 1) * sizeof(int));
+    }
+    traced = d;
+
+    // Then go back along the path we found (ops end up in reverse)
+    //
+    if (edits == -1) {
+	for (y = m1 - 1; y >= 0; y--)
+	    ops[count++] = (DiffOp) {'+', head + n1, head + y};
+	for (x = n1 - 1; x >= 0; x--)
+	    ops[count++] = (DiffOp) {'-', head + x, head};
+    } else {
+	x = n1;
+	y = m1;
+	for (d = edits; d > 0; d--) {
+	    int *prev = trace[d - 1] + (d - 1);
+	    int prevK, prevX, prevY;
+
+	    k = x - y;
+	    if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+		prevK = k + 1;
+	    else
+		prevK = k - 1;
+	    prevX = prev[prevK];
+	    prevY = prevX - prevK;
+
+	    while (x > prevX && y > prevY) {
+		x--;
+		y--;
+		ops[count++] = (DiffOp) {' ', head + x, head + y};
+	    }
+	    if (x == prevX)
+		ops[count++] = (DiffOp) {'+', head + x, head + --y};
+	    else
+		ops[count++] = (DiffOp) {'-', head + --x, head + y};
+	}
+	while (x > 0 && y > 0) {
+	    x--;
+	    y--;
+	    ops[count++] = (DiffOp) {' ', head + x, head + y};
+	}
+    }
+
+    for (i = 0; i < head; i++)
+	ops[count++] = (DiffOp) {' ', head - 1 - i, head - 1 - i};
+
+    // Put them in order, and add the common tail
+    //
+    for (i = 0; i < count / 2; i++) {
+	DiffOp op = ops[i];
+	ops[i] = ops[count - 1 - i];
+	ops[count - 1 - i] = op;
+    }
+    for (i = 0; i < tail; i++)
+	ops[count++] = (DiffOp) {' ', n - tail + i, m - tail + i};
+
+    for (d = 0; d < traced; d++)
+	xfree(trace[d]);
+    xfree(trace);
+    xfree(v - (limit + 1));
+
+    *pCount = count;
+
+    return ops;
+}
+
+// Write the chars with the prefix in front of each line
+//
+static void Diff_WriteLines(Stream *output, char prefix,
+			    const char *chars, int length)
+{
+    const char *end = chars + length;
+
+    while (chars < end) {
+	const char *nl = memchr(chars, '\n', end - chars);
+	int len = nl != NULL ? nl + 1 - chars : end - chars;
+
+	Stream_WriteChar(output, prefix);
+	Stream_WriteChars(output, chars, len);
+	if (nl == NULL)
+	    Stream_PrintF(output, "\n\\ No newline at end of message\n");
+	chars += len;
+    }
+}
+
+static void Diff_WriteHeader(Stream *output, char prefix, Header *head)
+{
+    if (head->line != NULL) {
+	Diff_WriteLines(output, prefix, String_Chars(head->line),
+			String_Length(head->line));
+    } else {
+	String *line = String_Append(head->key, &Str_ColonSpace, head->value,
+				     &Str_Newline, NULL);
+	Diff_WriteLines(output, prefix, String_Chars(line),
+			String_Length(line));
+	String_Free(line);
+    }
+}
+
+// Show the headers that differ, matching up each one with the header
+// of the same name (and occurrence) in the other message.  Returns the
+// number of differences.
+//
+static int Diff_WriteHeaders(Stream *output, Message *a, Message *b)
+{
+    Header *ha, *hb, *hp;
+    Array *matched = Array_New(0, NULL);
+    int same = 0, diffs = 0;
+
+    if (!String_IsEqual(a->envelope, b->envelope, true)) {
+	Stream_PrintF(output, "@@ headers @@\n");
+	if (a->envelope != NULL)
+	    Diff_WriteLines(output, '-', String_Chars(a->envelope),
+			    String_Length(a->envelope));
+	if (b->envelope != NULL)
+	    Diff_WriteLines(output, '+', String_Chars(b->envelope),
+			    String_Length(b->envelope));
+	diffs++;
+    }
+
+    for (ha = a->headers->root; ha != NULL; ha = ha->next) {
+	int nth = 0;
+
+	for (hp = a->headers->root; hp != ha; hp = hp->next) {
+	    if (String_IsEqual(hp->key, ha->key, false))
+		nth++;
+	}
+	for (hb = b->headers->root; hb != NULL; hb = hb->next) {
+	    if (String_IsEqual(hb->key, ha->key, false) && nth-- == 0)
+		break;
+	}
+
+	if (hb != NULL) {
+	    Array_Append(matched, hb);
+	    if (String_IsEqual(ha->value, hb->value, true)) {
+		same++;
+		continue;
+	    }
+	}
+
+	if (diffs++ == 0)
+	    Stream_PrintF(output, "@@ headers @@\n");
+	Diff_WriteHeader(output, '-', ha);
+	if (hb != NULL)
+	    Diff_WriteHeader(output, '+', hb);
+    }
+
+    for (hb = b->headers->root; hb != NULL; hb = hb->next) {
+	int i;
+
+	for (i = 0; i < Array_Count(matched); i++) {
+	    if (Array_GetAt(matched, i) == hb)
+		break;
+	}
+	if (i < Array_Count(matched))
+	    continue;
+
+	if (diffs++ == 0)
+	    Stream_PrintF(output, "@@ headers @@\n");
+	Diff_WriteHeader(output, '+', hb);
+    }
+
+    if (diffs > 0 && same > 0)
+	Stream_PrintF(output, " (%d other header%s identical)\n",
+		      same, same == 1 ? "" : "s");
+
+    Array_Free(matched);
+
+    return diffs;
+}
+
+// Show the bodies' differences as unified diff hunks.  Returns the
+// number of hunks.
+//
+static int Diff_WriteBodies(Stream *output, Message *a, Message *b)
+{
+    int n, m, count;
+    DiffLine *la = Diff_IndexLines(Message_Body(a), &n);
+    DiffLine *lb = Diff_IndexLines(Message_Body(b), &m);
+    DiffOp *ops = Diff_Lines(la, n, lb, m, &count);
+    int hunks = 0;
+    int i = 0;
+
+    while (i < count) {
+	int start, end, last, j;
+	int aLen = 0, bLen = 0;
+
+	// Find the next change and all the ones close enough to it to
+	// share the same hunk
+	//
+	while (i < count && ops[i].type == ' ')
+	    i++;
+	if (i == count)
+	    break;
+
+	start = iMax(0, i - kDiff_ContextLines);
+	for (last = j = i; j < count; j++) {
+	    if (ops[j].type != ' ')
+		last = j;
+	    else if (j - last > 2 * kDiff_ContextLines)
+		break;
+	}
+	end = iMin(count, last + kDiff_ContextLines + 1);
+
+	for (j = start; j < end; j++) {
+	    if (ops[j].type != '+')
+		aLen++;
+	    if (ops[j].type != '-')
+		bLen++;
+	}
+
+	Stream_PrintF(output, "@@ -%d,%d +%d,%d @@\n",
+		      ops[start].aIndex + (aLen > 0), aLen,
+		      ops[start].bIndex + (bLen > 0), bLen);
+
+	for (j = start; j < end; j++) {
+	    const DiffLine *line = ops[j].type == '+' ?
+		&lb[ops[j].bIndex] : &la[ops[j].aIndex];
+	    Diff_WriteLines(output, ops[j].type, line->chars, line->length);
+	}
+
+	hunks++;
+	i = end;
+    }
+
+    xfree(ops);
+    xfree(la);
+    xfree(lb);
+
+    return hunks;
+}
+
+void DiffMessagesExternally(Message *a, Message *b)
+{
+    Stream *tmpa = SaveTempMessage(a);
+    Stream *tmpb = SaveTempMessage(b);
+    String *cmd =
+	String_PrintF("diff -dc %s %s | %s",
+		      String_CString(tmpa->name), String_CString(tmpb->name),
+		      gPager != NULL ? String_CString(gPager) : kDefaultPager);
+
+    if (system(String_CString(cmd)) == -1) {
+	Error("Could not execute \"%s\": %s",
+	      String_CString(cmd), strerror(errno));
+    }
+    String_Free(cmd);
+
+    Stream_Free(tmpa, true);
+    Stream_Free(tmpb, true);
+}
+
+void DiffMessages(Message *a, Message *b)
+{
+    if (gExternalDiff) {
+	DiffMessagesExternally(a, b);
+	return;
+    }
+
+    Stream *output = Pager_Open();
+
+    Stream_PrintF(output, "--- Mailbox %s: Message %s\n",
+		  String_CString(Mailbox_Name(a->mbox)),
+		  String_CString(a->tag));
+    Stream_PrintF(output, "+++ Mailbox %s: Message %s\n",
+		  String_CString(Mailbox_Name(b->mbox)),
+		  String_CString(b->tag));
+
+    if (Diff_WriteHeaders(output, a, b) + Diff_WriteBodies(output, a, b) == 0)
+	Stream_PrintF(output, " (no differences)\n");
+
+    Pager_Close(output);
+}
+
+int ChooseMessageToDelete(Message *a, Message *b, char *autoChoice)
+{
+    Stream_PrintF(gStdOut, "\n");
+
+    ListMessage(gStdOut, 1, 1, a, 4, -1);
+    ListMessage(gStdOut, 2, 1, b, 4, -1);
+
+    Stream_WriteNewline(gStdOut);
+
+    for (;;) {
+	char choice = *autoChoice;
+
+	if (choice == '\0')
+	    choice = User_AskChoice("Please choose which message to delete "
+				    "(or b(oth), d(iff), or n(either)):",
+				    "12bnBNdq", 'n');
+
+	if (isupper(choice))
+	    choice = *autoChoice = tolower(choice);
+
+	switch (choice) {
+	  case '1':
+	    Note("Deleting the first message]");
+	    Message_SetDeleted(a, true);
+	    return 1;
+
+	  case '2':
+	    Note("Deleting the second message]");
+	    Message_SetDeleted(b, true);
+	    return 1;
+
+	  case 'b':
+	    Note("Deleting both messages]");
+	    Message_SetDeleted(a, true);
+	    Message_SetDeleted(b, true);
+	    return 2;
+
+	  case 'd':
+	    DiffMessages(a, b);
+	    break;
+
+	  case 'n':
+	    Note("Deleting no messages]");
+	    return 0;
+
+	  case 'q':
+	    return -1;
+	}
+    }
+}
+
+void UniqueMailbox(Mailbox *mbox)
+{
+    Array *mary = SplitMessages(mbox, NULL);
+    int i, count = Array_Count(mary);
+    int allDups = 0;
+    Message *m, *n;
+    char autoChoice = '\0';
+
+    SortMessages(mary);
+
+    m = Array_GetAt(mary, 0);
+    for (i = 1; i < count; i++, m = n) {
+	n = Array_GetAt(mary, i);
+
+	if (!Message_IsDeleted(m) && !Message_IsDeleted(n) &&
+	    m->cachedID != NULL && n->cachedID != NULL &&
+	    String_IsEqual(m->cachedID, n->cachedID, true)) {
+	    static String const *checkKeys[] = {
+		&Str_From, &Str_To, &Str_Cc, &Str_Bcc, &Str_Subject, &Str_Date,
+		&Str_ResentFrom, &Str_ResentTo, &Str_ResentCc, &Str_ResentBcc,
+		&Str_ResentSubject, &Str_ResentDate, &Str_ResentMessageID,
 		&Str_XFrom, &Str_XTo, &Str_Xcc, &Str_XSubject, &Str_XDate,
 		NULL
 	    };
 	    const String **ss;
 	    bool same = true;
 
-	    // They've got the same Message-IDs, what about other
-	    // salient details like the body and certain key headers.
-	    //
-	    for (ss = checkKeys; *ss != NULL; ss++) {
-		if (!String_IsEqual(Header_Get(m->headers, *ss),
-				    Header_Get(n->headers, *ss), true)) {
-		    Note("Messages %s and %s have the same Message-ID\n"
-			 " %s, but different %s lines",
-			 String_CString(m->tag),
-			 String_CString(n->tag),
-			 String_PrettyCString(m->cachedID),
-			 String_CString(*ss));
-		    same = false;
-		    break;
+	    // They've got the same Message-IDs, what about other
+	    // salient details like the body and certain key headers.
+	    //
+	    for (ss = checkKeys; *ss != NULL; ss++) {
+		if (!String_IsEqual(Header_Get(m->headers, *ss),
+				    Header_Get(n->headers, *ss), true)) {
+		    Note("Messages %s and %s have the same Message-ID\n"
+			 " %s, but different %s lines",
+			 String_CString(m->tag),
+			 String_CString(n->tag),
+			 String_PrettyCString(m->cachedID),
+			 String_CString(*ss));
+		    same = false;
+		    break;
+		}
+	    }
+
+	    if (same &&
+		!String_IsEqual(Message_Body(m), Message_Body(n), true)) {
+		Note("Messages %s and %s have the same Message-ID\n"
+		     "%s, but different bodies",
+		     String_CString(m->tag),
+		     String_CString(n->tag),
+		     String_PrettyCString(m->cachedID)); 
+		same = false;
+	    }
+
+	    if (same) {
+		Note("Messages %s and %s with Message-ID\n"
+		     " %s are the same, deleting the latter",
+		     String_CString(m->tag),
+		     String_CString(n->tag),
+		     String_PrettyCString(m->cachedID)); 
+		Message_SetDeleted(n, true);
+		allDups++;
+
+	    } else if (gInteractive) {
+		int dups = ChooseMessageToDelete(m, n, &autoChoice);
+		if (dups < 0)
+		    break;
+		allDups += dups;
+	    }
+	}
+    }
+
+    Note("%s %d duplicate%s",
+	 allDups == 0 ? "Found" : "Deleted",
+	 allDups, allDups == 1 ? "" : "s");
+
+    Array_Free(mary);
+}
+
+/**
+ **  Command Processing
+ **/
+
+typedef enum {
+    kCmd_None = 0,
+    kCmd_Check,
+    kCmd_Delete,
+    kCmd_DeleteAndShowNext,
+    kCmd_Diff,
+    kCmd_Edit,
+    kCmd_Exit,
+    kCmd_Find,
+    kCmd_Help,
+    kCmd_Join,
+    kCmd_List,
+    kCmd_ListNext,
+    kCmd_ListPrevious,
+    kCmd_Repair,
+    kCmd_Run,
+    kCmd_Save,
+    kCmd_Show,
+    kCmd_ShowPrevious,
+    kCmd_ShowNext,
+    kCmd_Split,
+    kCmd_Strict,
+    kCmd_Undelete,
+    kCmd_Unique,
+    kCmd_Write,
+    kCmd_WriteAndExit,
+} Command;
+
+typedef struct {
+    const char *cname;
+    const char *cargs;
+    Command type;
+    const char *cdesc;
+    String *name;
+} CommandTable;
+
+// Command specification syntax:
+//
+// <cmd> ::= <name>['|'<name>]... [<arg>...] ['#' <description>]
+// <arg> ::= 'm' | 'f'
+
+CommandTable kCommandTable[] = {
+    // Note: The order of the command table is significant.  If a prefix
+    // matches multiple commands, the first one found in this table will
+    // be selected.
+    //
+    // Don't make help strings be longer than this --------->
+    //
+    {"+",	NULL,		kCmd_ShowNext,
+     "go to the next message and display it"},
+    {"-",	NULL,		kCmd_ShowPrevious,
+     "go to the previous message and display it"},
+    {"check",	"[strict]",	kCmd_Check,
+     "check the mailbox' internal consistency"},
+    {"delete",	"[<msgs>]",	kCmd_Delete,
+     "mark one or more messages as deleted"},
+    {"diff",	"<msg1> <msg2>", kCmd_Diff,
+     "compare two messages and show the differences"},
+    {"dp",	NULL,		kCmd_DeleteAndShowNext,
+     "delete the current message, then show the next message"},
+    {"edit",	"[<msg>]",	kCmd_Edit,
+     "edit the specified message using a file-based editor"},
+    {"exit",	NULL,		kCmd_WriteAndExit,
+     "save any changes, then leave the mailbox"},
+    {"find",	"[<header>:] <string>",	kCmd_Find,
+     "find any messages containing the given string"},
+    {"headers",	"[<msg>]",	kCmd_List,
+     "list a page full of message descriptions"},
+    {"list",	"[<msg>]",	kCmd_List,
+     "list a page full of message descriptions"},
+    {"help",	"[<cmd>]",	kCmd_Help,
+     "get help on a specific command or all commands"},
+    {"join",	"<msgs>",	kCmd_Join,
+     "join messages by replacing them with a single message"},
+    {"more",	"[<msgs>]",	kCmd_Show,
+     "display the contents of the given message(s)"},
+    {"next",	NULL,		kCmd_ShowNext,
+     "go to the next message and display it"},
+    {"previous", NULL,		kCmd_ShowPrevious,
+     "go to the previous message and display it"},
+    {"print",	"[<msgs>]",	kCmd_Show,
+     "display the contents of the given message(s)"},
+    {"quit",	NULL,		kCmd_Exit,
+     "leave the mailbox without saving any changes"},
+    {"repair",	"[strict]",	kCmd_Repair,
+     "check the mailbox' internal state and repair if needed"},
+    {"run",	"[<msgs>] [-j <n>] <cmd> [<args>]", kCmd_Run,
+     "execute the command with each of the messages as input (n at once)"},
+    {"save",	"[<msgs>] <file>", kCmd_Save,
+     "save the messages to the given file"},
+    {"split",	"[<msgs>]",	kCmd_Split,
+     "look for 'From ' lines in the messages and split them"},
+    {"strict", "[<on/off>]", kCmd_Strict,
+     "set/show 'strict' mode when checking mailboxes"},
+    {"undelete", "[<msgs>]",	kCmd_Undelete,
+     "undelete one or more messages"},
+    {"unique",	NULL,		kCmd_Unique,
+     "unique the messages in the mailbox by removing dups"},
+#if 0
+    {"write",	"[<file>]",	kCmd_Write,
+     "write the mailbox back to its own file or the given file"},
+#endif
+    {"xit",	NULL,		kCmd_Exit,
+     "leave the mailbox without saving any changes"},
+    {"z",	NULL,		kCmd_ListNext,
+     "show the next page of message descriptions"},
+    {"z-",	NULL,		kCmd_ListPrevious,
+     "show the previous page of message descriptions"},
+    {"?",	NULL,		kCmd_Help,
+     "get help on a specific command or all commands"},
+    {NULL}
+};
+
+String *NextArg(int *pIndex, Array *args, bool required)
+{
+    if (*pIndex < Array_Count(args))
+	return Array_GetAt(args, (*pIndex)++);
+    if (required)
+	Error("Missing argument");
+    return NULL;
+}
+
+bool NoNextArg(int *pIndex, Array *args)
+{
+    if (*pIndex < Array_Count(args)) {
+	Error("Too many arguments");
+	return false;
+    }
+
+    return true;
+}
+
+int String_ToMessageNumber(const String *str, Mailbox *mbox)
+{
+    if (String_IsEqual(str, &Str_Dollar, true))
+	return Mailbox_Count(mbox);
+
+    return String_ToInteger(str, -1);
+}
+
+MessageSet *MessageSetArg(const String *arg, int last)
+{
+    Parser parser;
+    MessageSet *set = NULL;
+
+    if (arg == NULL)
+	return NULL;
+
+    Parser_Set(&parser, arg);
+    if (!Parse_MessageSet(&parser, &set, last) || !Parser_AtEnd(&parser)) {
+	Error("Malformed message set: %s", String_CString(arg));
+	MessageSet_Free(set);
+	return NULL;
+    }
+
+    return set;
+}
+
+MessageSet *NextMessageSetArgs(int *pIndex, Array *args, int leave,
+			       int defNum, int maxNum)
+{
+    MessageSet *set = NULL;
+    int count = Array_Count(args) - *pIndex - leave;
+
+    while (count-- > 0) {
+	MessageSet *set2 = MessageSetArg(NextArg(pIndex, args, true), maxNum);
+	if (set2 == NULL) {
+	    MessageSet_Free(set);
+	    return NULL;
+	}
+	set = MessageSet_Append(set, set2);
+    }
+
+    if (set == NULL)
+	set = MessageSet_Make(defNum, defNum, NULL);
+
+    return set;
+}
+
+#if 0
+int NextNumArg(int *pIndex, Array *args, bool required)
+{
+    String *arg = NextCmdArg(pIndex, args, required);
+    int num = -1;
+
+    if (arg != NULL) {
+	num = String_ToInteger(arg, -1);
+	if (num == -1)
+	    Error("Invalid message number");
+    }
+
+    return num;
+}
+#endif
+
+bool TrueString(const String *str, bool def)
+{
+    static const char *trueStrings[] = {
+	"y", "yes", "t", "true", "on", NULL
+    };
+    const char **tsp;
+    const char *cstr = String_CString(str);
+
+    if (cstr == NULL)
+	return def;
+
+    for (tsp = trueStrings; *tsp != NULL; tsp++) {
+	if (strcasecmp(*tsp, cstr) == 0)
+	    return true;
+    }
+
+    return false;
+}
+
+Message *GetMessageByNumber(Mailbox *mbox, int cur)
+{
+    Message *msg = NULL;
+    int i;
+
+    if (cur > 0)
+	for (msg = Mailbox_Root(mbox), i = 1; msg != NULL && i < cur;
+	     msg = msg->next, i++);
+
+    if (msg == NULL)
+	Error("Message %d does not exist", cur);
+
+    return msg;
+}
+
+void InitCommandTable(CommandTable *table)
+{
+    CommandTable *ct;
+
+    // Only do this once
+    if (table->name != NULL)
+	return;
+
+    for (ct = table; ct->cname != NULL; ct++) {
+	ct->name = String_FromCString(ct->cname, false);
+    }
+}
+
+void ShowHelp(Stream *output, String *cmd)
+{
+    CommandTable *ct;
+
+    if (cmd == NULL) {
+	// Non-specific help
+	//
+	int pos = 3;
+
+	Stream_PrintF(output, " Please enter one of the following commands:\n"
+		      "   ");
+	for (ct = kCommandTable; ct->name != NULL; ct++) {
+	    if (ct != kCommandTable) {
+		Stream_PrintF(output, ", ");
+		pos += 2;
+	    }
+	    if (pos + String_Length(ct->name) >= gPageWidth) {
+		Stream_PrintF(output, "\n   ");
+		pos = 3;
+	    }
+	    Stream_WriteString(output, ct->name);
+	    pos += String_Length(ct->name);
+	}
+	Stream_PrintF(output, "\n\n Enter \"help <cmd>\" for more "
+		      "information about a specific command or\n "
+		      "\"help all\" for all commands.\n");
+
+    } else {
+	bool isAll = String_IsEqual(cmd, &Str_All, false);
+	int leftWidth = 0;
+
+	Stream_PrintF(output, " These commands are available:\n");
+	for (ct = kCommandTable; ct->name != NULL; ct++) {
+	    int width = 1 + String_Length(ct->name) + 1 + 1;
+	    if (ct->cargs != NULL)
+		width += strlen(ct->cargs);
+	    if (leftWidth < width)
+		leftWidth = width;
+	}
+
+	for (ct = kCommandTable; ct->name != NULL; ct++) {
+	    if (isAll || String_IsEqual(cmd, ct->name, false)) {
+		int width = 1 + String_Length(ct->name) + 1 + 1;
+		if (ct->cargs != NULL)
+		    width += strlen(ct->cargs);
+
+		Stream_PrintF(output, " %s %s %*s-- %s\n",
+			      ct->cname, ct->cargs != NULL ? ct->cargs : "",
+			      leftWidth - width, "",
+			      ct->cdesc);
+	    }
+	}
+    }
+}
+
+#ifdef USE_READLINE
+char *CompleteCommand(const char *prefix, int state)
+{
+    static int curIndex;
+    int prelen = strlen(prefix);
+
+    if (state == 0)
+	curIndex = -1;
+
+    while (kCommandTable[++curIndex].cname != NULL) {
+	if (strncmp(prefix, kCommandTable[curIndex].cname, prelen) == 0)
+	    return strdup(kCommandTable[curIndex].cname);
+    }
+
+    return NULL;
+}
+#endif
+
+bool RunCommand(Message *msg, int index, Array *args)
+{
+    // XXX: Should be more efficient
+    String *command = Array_JoinTail(args, &Str_Space, index);
+
+    FILE *file = popen(String_CString(command), "w");
+
+    if (file == NULL) {
+	perror(String_CString(command));
+	String_Free(command);
+	return false;
+    }
+
+    Stream *stream =
+	Stream_New(file, String_Clone(Array_GetAt(args, index)), false);
+
+    Stream_WriteHeaders(stream, msg->headers);
+    Stream_WriteNewline(stream);
+    Stream_WriteString(stream, Message_Body(msg));
+
+    Stream_Free(stream, false);
+
+    if (pclose(file) != 0) {
+	perror(String_CString(command));
+	String_Free(command);
+	return false;
+    }
+
+    String_Free(command);
+    return true;
+}
+
+// A command being run (in parallel with others) on a message
+//
+typedef struct {
+    pid_t pid;			// 0 if not in use
+    int fd;			// Pipe to its stdin (or -1 when all written)
+    int index;			// Into the list of messages
+    String *headers;		// Rendered headers, unless written verbatim
+    const char *chars[2];	// What's left to write
+    int lengths[2];
+} RunJob;
+
+// Start running the command with the message as its input.  Returns
+// false (with errno set) if it couldn't be started.
+//
+static bool RunJob_Start(RunJob *job, Message *msg, const String *command)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+	return false;
+
+    // Keep the other jobs' pipes out of this one's hands (or they'd
+    // never see EOF)
+    //
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);
+
+    if ((job->pid = fork()) == -1) {
+	int err = errno;
+	close(fds[0]);
+	close(fds[1]);
+	job->pid = 0;
+	errno = err;
+	return false;
+    }
+
+    if (job->pid == 0) {
+	dup2(fds[0], STDIN_FILENO);
+	execl("/bin/sh", "sh", "-c", String_CString(command), (char *) NULL);
+	_exit(127);
+    }
+
+    close(fds[0]);
+    job->fd = fds[1];
+    fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) | O_NONBLOCK);
+
+    // Write straight from the mailbox if we can, or else render the
+    // headers first
+    //
+    if (Message_IsVerbatim(msg)) {
+	job->headers = NULL;
+	job->chars[0] = String_Chars(msg->data) +
+	    String_Length(msg->envelope);
+	job->lengths[0] = String_Length(msg->data) -
+	    String_Length(msg->envelope);
+	job->chars[1] = NULL;
+	job->lengths[1] = 0;
+    } else {
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file = open_memstream(&buf, &size);
+
+	if (file == NULL)
+	    Fatal(EX_OSERR, "Could not open memory stream: %s",
+		  strerror(errno));
+
+	Stream *stream = Stream_New(file, &Str_MemoryStream, false);
+
+	Stream_WriteHeaders(stream, msg->headers);
+	Stream_WriteNewline(stream);
+	Stream_Free(stream, true);
+	xfree(stream);
+
+	job->headers = String_New(kString_Alloced, Memory_Adopt(buf), size);
+	job->chars[0] = String_Chars(job->headers);
+	job->lengths[0] = String_Length(job->headers);
+	job->chars[1] = String_Chars(Message_Body(msg));
+	job->lengths[1] = String_Length(Message_Body(msg));
+    }
+
+    return true;
+}
+
+// Write as much as the command will take right now
+//
+static void RunJob_Write(RunJob *job)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	while (job->lengths[i] > 0) {
+	    ssize_t count = write(job->fd, job->chars[i], job->lengths[i]);
+
+	    if (count < 0 && errno == EAGAIN)
+		return;
+	    if (count < 0) {
+		// The command doesn't want any more (EPIPE) -- fine
+		job->lengths[0] = job->lengths[1] = 0;
+		break;
+	    }
+	    job->chars[i] += count;
+	    job->lengths[i] -= count;
+	}
+    }
+
+    close(job->fd);
+    job->fd = -1;
+}
+
+// Run the command on each of the messages, with up to jobs of them
+// going at once.  Failures are reported in message order.  Returns
+// false if any of them failed.
+//
+bool RunCommandInParallel(Array *msgs, int index, Array *args, int jobs)
+{
+    String *command = Array_JoinTail(args, &Str_Space, index);
+    int total = Array_Count(msgs);
+    RunJob *slots = xcalloc(jobs * sizeof(RunJob));
+    int *statuses = xalloc(NULL, total * sizeof(int));
+    struct pollfd *fds = xalloc(NULL, jobs * sizeof(struct pollfd));
+    int started = 0, finished = 0, reported = 0;
+    int failures = 0;
+    int i;
+
+    for (i = 0; i < total; i++)
+	statuses[i] = -1;
+
+    while (finished < total) {
+	bool reaping = false;
+	int nfds = 0;
+
+	// Keep all slots busy
+	//
+	for (i = 0; i < jobs && started < total; i++) {
+	    RunJob *job = &slots[i];
+
+	    if (job->pid != 0)
+		continue;
+
+	    job->index = started++;
+	    if (!RunJob_Start(job, Array_GetAt(msgs, job->index), command)) {
+		Error("Could not run \"%s\": %s",
+		      String_CString(command), strerror(errno));
+		statuses[job->index] = EX_OSERR << 8;
+		finished++;
+	    }
+	}
+
+	// Wait until there's room to write more or (if nothing's left
+	// to write for some) until it's time to check on them again
+	//
+	for (i = 0; i < jobs; i++) {
+	    if (slots[i].pid == 0)
+		continue;
+	    if (slots[i].fd == -1) {
+		reaping = true;
+		continue;
+	    }
+	    fds[nfds].fd = slots[i].fd;
+	    fds[nfds].events = POLLOUT;
+	    nfds++;
+	}
+
+	if (nfds > 0 || reaping)
+	    (void) poll(fds, nfds, reaping ? kRun_ReapInterval : -1);
+
+	for (i = 0; i < jobs; i++) {
+	    RunJob *job = &slots[i];
+	    int status;
+
+	    if (job->pid == 0)
+		continue;
+	    if (job->fd != -1)
+		RunJob_Write(job);
+	    if (job->fd != -1 || waitpid(job->pid, &status, WNOHANG) == 0)
+		continue;
+
+	    statuses[job->index] = status;
+	    String_FreeP(&job->headers);
+	    job->pid = 0;
+	    finished++;
+	}
+
+	// Report what we can, in order
+	//
+	for (; reported < total && statuses[reported] != -1; reported++) {
+	    int status = statuses[reported];
+	    Message *msg = Array_GetAt(msgs, reported);
+
+	    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		continue;
+
+	    failures++;
+	    if (WIFSIGNALED(status))
+		Error("Message %d: %s was killed by signal %d",
+		      msg->num, String_CString(command), WTERMSIG(status));
+	    else
+		Error("Message %d: %s exited with status %d",
+		      msg->num, String_CString(command), WEXITSTATUS(status));
+	}
+    }
+
+    xfree(fds);
+    xfree(statuses);
+    xfree(slots);
+    String_Free(command);
+
+    return failures == 0;
+}
+
+// Find the highest message number mentioned by the remaining args
+// (INT_MAX if they need the mailbox to be fully loaded to tell)
+//
+int HighestMessageArg(int argi, Array *args)
+{
+    int highest = 0;
+
+    for (; argi < Array_Count(args); argi++) {
+	const String *arg = Array_GetAt(args, argi);
+	const char *cp = String_Chars(arg);
+	const char *end = cp + String_Length(arg);
+	int num = 0;
+
+	for (; cp < end; cp++) {
+	    if (Char_IsDigit(*cp)) {
+		num = num * 10 + (*cp - '0');
+		highest = iMax(highest, num);
+	    } else if (*cp == ',' || (*cp == '-' && cp + 1 < end &&
+				      Char_IsDigit(cp[1]))) {
+		num = 0;
+	    } else {
+		// Open ranges, '*', '$' & whatever else we don't know
+		return INT_MAX;
+	    }
+	}
+    }
+
+    return highest;
+}
+
+// How many messages need to have been loaded before the command can
+// be run.  Only the ones that look at particular messages can start
+// before all of them are in.
+//
+int CommandNeeds(Command cmd, int argi, Array *args, int cur)
+{
+    int page = gPageHeight - 1;
+    const String *arg;
+
+    switch (cmd) {
+      case kCmd_None:
+      case kCmd_Help:
+      case kCmd_Strict:
+      case kCmd_Exit:
+	return 0;
+
+      case kCmd_ShowNext:
+      case kCmd_DeleteAndShowNext:
+	return cur + 1;
+
+      case kCmd_ShowPrevious:
+      case kCmd_ListPrevious:
+	return cur;
+
+      case kCmd_ListNext:
+	return cur + 2 * page;
+
+      case kCmd_List:
+	arg = argi < Array_Count(args) ? Array_GetAt(args, argi) : NULL;
+	if (String_IsEqual(arg, &Str_Minus, true))
+	    return cur;
+	if (String_IsEqual(arg, &Str_Plus, true))
+	    return cur + 2 * page;
+	if (arg == NULL)
+	    return cur + page;
+	return iMax(HighestMessageArg(argi, args), cur + page);
+
+      case kCmd_Show:
+      case kCmd_Delete:
+      case kCmd_Undelete:
+      case kCmd_Edit:
+      case kCmd_Diff:
+	return iMax(HighestMessageArg(argi, args), cur);
+
+      default:
+	return INT_MAX;
+    }
+}
+
+void RunLoop(Mailbox *mbox, Array *commands)
+{
+    jmp_buf reentry;
+    int msgCount;
+    int cmdCount = Array_Count(commands);
+    const String *cmdLine;
+    int cur = 1;
+    int ci = 0;
+    bool done = false;
+    bool success;
+
+    InitCommandTable(kCommandTable);
+#ifdef USE_READLINE
+    rl_completion_entry_function = CompleteCommand;
+#endif
+
+    while (!done) {
+	setjmp(reentry);
+	gInterruptReentry = &reentry;
+
+	if (ci < cmdCount) {
+	    cmdLine = Array_GetAt(commands, ci++);
+	} else if (!gInteractive) {
+	    break;
+	} else {
+	    // Show how far we've gotten if still loading
+	    //
+	    int progress = Mailbox_LoadProgress(mbox);
+	    char prompt[32];
+
+	    if (progress < 100)
+		snprintf(prompt, sizeof(prompt), "[%d%%] @", progress);
+	    else
+		strcpy(prompt, "@");
+
+	    if (!User_AskLine(prompt, &cmdLine, true))
+		break;
+	}
+
+	Array *args = String_Split(cmdLine, ' ', true);
+
+	// Find matching command
+	//
+	int argi = 0;
+	const String *arg;
+	String *str;
+	CommandTable *ct;
+	Command cmd = kCmd_None;
+	MessageSet *set = NULL;
+	Message *msg;
+	int count, num;
+
+	if (Array_Count(args) == 0) {
+	    // Default to kCmd_ShowNext
+	    cmd = kCmd_ShowNext;
+
+	} else {
+	    arg = Array_GetAt(args, argi++);
+
+	    for (ct = kCommandTable; ct->name != NULL; ct++) {
+		if (String_HasPrefix(ct->name, arg, false)) {
+		    cmd = ct->type;
+		    break;
+		}
+	    }
+
+	    // If we didn't find it, assume kCmd_Show if the
+	    // first arg is numeric.
+	    //
+	    if (cmd == kCmd_None) {
+		num = String_ToMessageNumber(arg, mbox);
+		if (num > 0) {
+		    cmd = kCmd_Show;
+		    argi--;
+		}
+	    }
+	}
+
+	// Make sure we've loaded enough of the mailbox for the command,
+	// and update message count each time around in case the mailbox
+	// has been modified
+	//
+	msgCount = Mailbox_WaitFor(mbox, CommandNeeds(cmd, argi, args, cur));
+
+	switch (cmd) {
+	  case kCmd_Show: {
+	      set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
+	      if (set == NULL)
+		  break;
+
+	      Array *msgs = Array_New(0, NULL);
+
+	      for (num = MessageSet_First(set); num != -1;
+		   num = MessageSet_Next(set, num)) {
+		  msg = GetMessageByNumber(mbox, num);
+		  if (msg == NULL)
+		      break;
+		  Array_Append(msgs, msg);
+		  cur = num;
+	      }
+	      ShowMessages(msgs);
+	      Array_Free(msgs);
+	      break;
+	  }
+
+	  case kCmd_ShowPrevious:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    if (cur <= 1) {
+		Error("No more messages");
+		break;
+	    }
+	    msg = GetMessageByNumber(mbox, --cur);
+	    if (msg != NULL)
+		ShowMessage(msg);
+	    break;
+
+	  case kCmd_ShowNext:
+	  show_next:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    if (cur >= msgCount) {
+		Error("No more messages");
+		break;
+	    }
+	    msg = GetMessageByNumber(mbox, ++cur);
+	    if (msg != NULL)
+		ShowMessage(msg);
+	    break;
+
+	  case kCmd_Delete:
+	  case kCmd_Undelete:
+	    set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
+	    if (set == NULL)
+		break;
+	    for (num = MessageSet_First(set); num != -1;
+		 num = MessageSet_Next(set, num)) {
+		msg = GetMessageByNumber(mbox, num);
+		if (msg == NULL)
+		    break;
+		Message_SetDeleted(msg, cmd == kCmd_Delete);
+		cur = num;
+	    }
+	    break;
+
+	  case kCmd_DeleteAndShowNext:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    msg = GetMessageByNumber(mbox, cur);
+	    if (msg != NULL) {
+		Message_SetDeleted(msg, true);
+		goto show_next;
+	    }
+	    break;
+
+	  case kCmd_Diff: {
+	      arg = NextArg(&argi, args, true);
+	      if (arg == NULL) break;
+	      Message *msg1 =
+		  GetMessageByNumber(mbox, String_ToMessageNumber(arg, mbox));
+	      if (msg1 == NULL) break;
+	      arg = NextArg(&argi, args, true);
+	      if (arg == NULL) break;
+	      Message *msg2 =
+		  GetMessageByNumber(mbox, String_ToMessageNumber(arg, mbox));
+	      if (msg2 == NULL) break;
+
+	      DiffMessages(msg1, msg2);
+	      break;
+	  }
+
+	  case kCmd_List:
+	    arg = NextArg(&argi, args, false);
+	    if (String_IsEqual(arg, &Str_Minus, true))
+		goto list_previous;
+	    if (String_IsEqual(arg, &Str_Plus, true))
+		goto list_next;
+	    if (arg != NULL)
+		cur = String_ToMessageNumber(arg, mbox);
+	    arg = NextArg(&argi, args, false);
+	    if (arg != NULL)
+		num = iMax(1, String_ToMessageNumber(arg, mbox) - cur);
+	    else
+		num = gPageHeight - 1;
+	    if (!NoNextArg(&argi, args))
+		break;
+	    ListMailbox(gStdOut, mbox, cur, num);
+	    break;
+
+	  case kCmd_ListNext:
+	  list_next:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    cur = iMin(iMax(1, cur) + (gPageHeight - 1), msgCount);
+	    ListMailbox(gStdOut, mbox, cur, gPageHeight - 1);
+	    break;
+
+	  case kCmd_ListPrevious:
+	  list_previous:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    cur = iMax(cur - (gPageHeight - 1), 1);
+	    ListMailbox(gStdOut, mbox, cur, gPageHeight - 1);
+	    break;
+
+	  case kCmd_Find:
+	    // Args are [<header>':'] <string>...
+	    arg = NextArg(&argi, args, true);
+	    if (String_HasSuffix(arg, &Str_Colon, true)) {
+		arg = String_Sub(arg, 0, String_Length(arg) - 1);
+	    } else {
+		arg = NULL;
+		argi--;
+	    }
+	    str = Array_JoinTail(args, &Str_Space, argi);
+	    FindMessages(gStdOut, mbox, arg, str);
+	    String_Free((String *) arg);
+	    String_Free(str);
+	    break;
+
+	  case kCmd_Strict:
+	    arg = NextArg(&argi, args, false);
+	    if (!NoNextArg(&argi, args))
+		break;
+	    gStrict = TrueString(arg, !gStrict);
+	    Note("Strict checking mode is turned %s",
+		 gStrict ? "on" : "off");
+	    break;
+
+	  case kCmd_Check:
+	    arg = NextArg(&argi, args, false);
+	    if (!NoNextArg(&argi, args))
+		break;
+	    if (arg != NULL && String_HasPrefix(&Str_Strict, arg, false))
+		arg = &Str_True;
+	    CheckMailbox(mbox, TrueString(arg, gStrict), false);
+	    break;
+
+	  case kCmd_Repair:
+	    arg = NextArg(&argi, args, false);
+	    if (!NoNextArg(&argi, args))
+		break;
+	    if (arg != NULL && String_HasPrefix(&Str_Strict, arg, false))
+		arg = &Str_True;
+	    CheckMailbox(mbox, TrueString(arg, gStrict), true);
+	    break;
+
+	  case kCmd_Unique:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    UniqueMailbox(mbox);
+	    break;
+
+	  case kCmd_Join:
+	    if (argi == Array_Count(args)) {
+		Error("Missing argument");
+		break;
+	    }
+	    set = NextMessageSetArgs(&argi, args, 0, -1, msgCount);
+	    if (set == NULL)
+		break;
+
+	    cur = num = MessageSet_First(set);
+	    Message *first = GetMessageByNumber(mbox, cur);
+	    if (first == NULL)
+		break;
+
+	    count = 0;
+	    while ((num = MessageSet_Next(set, num)) != -1) {
+		msg = GetMessageByNumber(mbox, num);
+		if (msg != NULL) {
+		    Message_Join(first, msg);
+		    count++;
+		}
+	    }
+	    if (count == 0) {
+		Error("Please supply multiple messages to join");
+	    } else {
+		Note("Appended %d message%s onto message %s",
+		     count, count == 1 ? "" : "s",
+		     String_CString(first->tag));
+	    }
+	    break;
+
+	  case kCmd_Split:
+	    set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
+	    if (set == NULL)
+		break;
+	    for (num = MessageSet_First(set); num != -1;
+		 num = MessageSet_Next(set, num)) {
+		msg = GetMessageByNumber(mbox, num);
+		if (msg != NULL) {
+		    Message_Split(msg, gInteractive);
+		    cur = num;
+		}
+	    }
+	    break;
+
+	  case kCmd_Edit:
+	    arg = NextArg(&argi, args, false);
+	    num = arg != NULL ? String_ToMessageNumber(arg, mbox) : cur;
+	    if (!NoNextArg(&argi, args))
+		break;
+	    msg = GetMessageByNumber(mbox, num);
+	    if (msg != NULL) {
+		EditMessage(msg);
+		cur = num;
+	    }
+	    break;
+
+	  case kCmd_Run:
+	    // Do we have a message set arg?
+	    arg = NextArg(&argi, args, true);
+	    if (Char_IsDigit(String_CharAt(arg, 0))) {
+		set = MessageSetArg(arg, msgCount);
+	    } else {
+		argi--;
+		set = MessageSet_Make(cur, cur, NULL);
+	    }
+
+	    // Run several at once?
+	    count = 1;
+	    arg = NextArg(&argi, args, true);
+	    if (String_IsEqual(arg, &Str_DashJ, true)) {
+		count = String_ToInteger(NextArg(&argi, args, true), 0);
+	    } else if (String_HasPrefix(arg, &Str_DashJ, true)) {
+		str = String_Sub(arg, String_Length(&Str_DashJ),
+				 String_Length(arg));
+		count = String_ToInteger(str, 0);
+		String_Free(str);
+	    } else if (arg != NULL) {
+		argi--;
+	    }
+	    if (count < 1 || count > kRun_MaxJobs) {
+		Error("Please give a number of jobs between 1 and %d",
+		      kRun_MaxJobs);
+		break;
+	    }
+
+	    // Make sure that we have a command
+	    if (NextArg(&argi, args, true) == NULL)
+		break;
+	    argi--;
+
+	    if (count == 1) {
+		for (num = MessageSet_First(set); num != -1;
+		     num = MessageSet_Next(set, num)) {
+		    msg = GetMessageByNumber(mbox, num);
+		    if (msg != NULL && !RunCommand(msg, argi, args))
+			break;
+		}
+	    } else {
+		Array *msgs = Array_New(0, NULL);
+
+		for (num = MessageSet_First(set); num != -1;
+		     num = MessageSet_Next(set, num)) {
+		    msg = GetMessageByNumber(mbox, num);
+		    if (msg == NULL)
+			break;
+		    Array_Append(msgs, msg);
+		}
+		if (msg != NULL)
+		    (void) RunCommandInParallel(msgs, argi, args, count);
+		Array_Free(msgs);
+	    }
+	    break;
+
+	  case kCmd_Save:
+	    set = NextMessageSetArgs(&argi, args, 1, cur, msgCount);
+	    if (set == NULL)
+		break;
+	    arg = NextArg(&argi, args, true);
+	    if (arg == NULL)
+		break;
+
+	    Mailbox *mbox2 = Mailbox_Open(arg, true, false, true);
+	    if (mbox2 == NULL)
+		break;
+
+	    count = 0;
+	    for (num = MessageSet_First(set); num != -1;
+		 num = MessageSet_Next(set, num)) {
+		msg = GetMessageByNumber(mbox, num);
+		if (msg != NULL) {
+		    Mailbox_Append(mbox2, Message_Clone(msg));
+		    cur = num;
+		    count++;
+		}
+	    }
+	    success = Mailbox_Save(mbox2, false, false);
+	    Mailbox_Free(mbox2);
+	    if (success)
+		Note("%d message%s saved to %s", count, count == 1 ? "" : "s",
+		     String_CString(arg));
+	    break;
+
+	  case kCmd_Write:
+	    arg = NextArg(&argi, args, false);
+	    if (arg == NULL)
+		Mailbox_Save(mbox, false, false);
+	    else
+		Mailbox_Write(mbox, arg, false);
+	    break;
+
+	  case kCmd_Exit:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    if (Mailbox_IsDirty(mbox))
+		Note("Leaving modified mailbox unsaved");
+	    return;
+
+	  case kCmd_WriteAndExit:
+	    if (!NoNextArg(&argi, args))
+		break;
+	    done = true;
+	    break;
+
+	  case kCmd_Help:
+	    ShowHelp(gStdOut, NextArg(&argi, args, false));
+	    break;
+	    
+	  case kCmd_None:
+	    Error("Unknown command: %s", String_CString(arg));
+	    break;
+	}
+	MessageSet_Free(set);
+	set = NULL;
+    }
+    gInterruptReentry = NULL;
+
+    // Autosave if needed
+    //
+    if (Mailbox_IsDirty(mbox)) {
+	if (gDryRun)
+	    Note("Dry run mode -- not autosaving modified mailbox");
+	else if (true || gAutoWrite ||
+		 (gInteractive &&
+		  User_AskYesOrNo("Save modified mailbox?", false)))
+	    Mailbox_Save(mbox, false, false);
+    }
+}
+
+extern bool CheckFileInWindows(const String *file);
+extern bool ShardFile(const String *file);
+extern bool ExpireFile(const String *file);
+extern bool StripFile(const String *file);
+extern bool ScrubFile(const String *file);
+extern bool BurstFile(const String *file);
+
+// Would the mailbox file take us over the memory budget to load (even
+// if mapped)?
+//
+bool File_FitsInMemory(const String *file)
+{
+    struct stat sbuf;
+
+    if (stat(String_CString(file), &sbuf) != 0 || !S_ISREG(sbuf.st_mode))
+	return true;
+
+    return Memory_Fits(sbuf.st_size * kMemory_ParseOverhead);
+}
+
+bool IsCheckOnly(Array *commands)
+{
+    int i;
+
+    for (i = 0; i < Array_Count(commands); i++) {
+	if (!String_IsEqual(Array_GetAt(commands, i), &Str_Check, false))
+	    return false;
+    }
+
+    return Array_Count(commands) > 0;
+}
+
+bool ProcessFile(String *file, Array *commands, Stream *output)
+{
+    if (gShard != kShard_None) {
+	bool success = ShardFile(file);
+	String_Free(file);
+	return success;
+    }
+
+    if (gOlderThan != 0 || gKeepLast > 0) {
+	bool success = ExpireFile(file);
+	String_Free(file);
+	return success;
+    }
+
+    if (gStripSize > 0) {
+	bool success = StripFile(file);
+	String_Free(file);
+	return success;
+    }
+
+    if (gScrub) {
+	bool success = ScrubFile(file);
+	String_Free(file);
+	return success;
+    }
+
+    if (gBurstDir != NULL) {
+	bool success = BurstFile(file);
+	String_Free(file);
+	return success;
+    }
+
+    // If it's too big to load within the memory budget, and checking it
+    // is all we'll do, then we can do that a window at a time
+    //
+    if (gMaxMemory > 0 && !gInteractive && !gSalvage && output == NULL &&
+	IsCheckOnly(commands) && !File_FitsInMemory(file)) {
+	bool success = CheckFileInWindows(file);
+	String_Free(file);
+	return success;
+    }
+
+    // Only roll back an interrupted repair if we may be changing it too
+    //
+    bool readOnly = !gInteractive &&
+	(Array_Count(commands) == 0 || IsCheckOnly(commands));
+    Mailbox *mbox = Mailbox_Open(file, false, gInteractive, !readOnly);
+    
+    if (mbox == NULL)
+	return false;
+
+    if (!gQuiet || (gQuiet && gVerbose)) {
+	bool loading = Mailbox_Sync(mbox);
+	int count = Mailbox_Count(mbox);
+	String *sizstr = String_ByteSize(String_Length(mbox->data));
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+
+	if (loading)
+	    Note("%s: %s, loading messages in the background",
+		 String_CString(file), String_CString(sizstr));
+	else
+	    Note("%s: %d message%s, %s",
+		 String_CString(file),
+		 count, count == 1 ? "" : "s", String_CString(sizstr));
+
+	String_Free(sizstr);
+	
+	gQuiet = oldQuiet;
+    }
+
+    if (gInteractive || Array_Count(commands) > 0)
+	RunLoop(mbox, commands);
+
+    if (output != NULL) {
+	(void) Mailbox_WaitFor(mbox, INT_MAX);
+	Stream_WriteMailbox(output, mbox, true);
+    }
+
+    Mailbox_Free(mbox);
+    String_Free(file);
+
+    return Mailbox_CommitSaves(false);
+}
+
+/**
+ **  Windowed Checking
+ **
+ **  A mailbox that's too big to load within the --max-memory budget can
+ **  still be checked (though not repaired) by reading it a window at a
+ **  time, forgetting about each window's messages once they've been
+ **  checked.  Windows end right before their last proper "From " line
+ **  and are made bigger when needed to hold a single big message.
+ **/
+
+// A window's worth of complete messages, starting at chars[0] (which is
+// at offset in the file) and running up to chars[end], including the
+// newlines separating them
+//
+typedef struct {
+    Mailbox *mbox;
+    int fd;
+    const char *chars;
+    int end;
+    off_t offset;
+} Window;
+
+typedef bool WindowHandler(Window *win, void *info);
+
+// Find where the last message in the chars starts (at a valid "From "
+// line after an empty line).  Returns 0 if there's only the one.
+//
+static int FindLastMessageStart(const char *chars, int length)
+{
+    int len = String_Length(&Str_FromSpace);
+    int pos;
+
+    for (pos = length - len; pos >= 2; pos--) {
+	if (chars[pos - 1] == '\n' && chars[pos - 2] == '\n' &&
+	    memcmp(chars + pos, String_Chars(&Str_FromSpace), len) == 0) {
+	    String line = {chars + pos, length - pos, kString_Shared};
+	    Parser probe;
+
+	    Parser_Set(&probe, &line);
+	    if (Parse_FromSpaceLine(&probe, NULL, NULL, NULL))
+		return pos;
+	}
+    }
+
+    return 0;
+}
+
+// Does the message's Content-Length say it goes on past the window?
+//
+static bool Message_ExtendsBeyond(Message *msg, const char *chars, int limit)
+{
+    int cllen = String_ToInteger(Header_Get(msg->headers,
+					    &Str_ContentLength), -1);
+    int bodyPos = String_Chars(msg->body) - chars;
+
+    return cllen >= 0 && cllen < (gMaxMemory > 0 ? gMaxMemory : INT_MAX) &&
+	bodyPos + cllen >= limit;
+}
+
+// The kind of the context's index'th problem
+//
+static inline ProblemKind Context_ProblemKind(const MfckContext *ctx,
+					      int index)
+{
+    return (ProblemKind) (intptr_t) Array_GetAt(ctx->kinds, index);
+}
+
+// ... and the number of the message it's about (or 0 if none)
+//
+static inline int Context_ProblemMessage(const MfckContext *ctx, int index)
+{
+    return (int) (intptr_t) Array_GetAt(ctx->messages, index);
+}
+
+// Reads a mailbox file a window at a time, starting out with size bytes
+//
+typedef struct {
+    const String *file;
+    const char *doing;		// What we're reading it for
+    int fd;
+    Mailbox *mbox;
+    char *chars;
+    size_t size;
+    int length;
+    int pos;			// Where the last window's messages ended
+    off_t offset;
+    bool eof;
+    bool done;
+    bool failed;
+} WindowReader;
+
+static void WindowReader_Init(WindowReader *reader, const String *file,
+			      int fd, size_t size, const char *doing)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->doing = doing;
+    reader->fd = fd;
+    reader->size = size;
+    reader->chars = xalloc(NULL, size);
+    reader->mbox = New(Mailbox);
+    reader->mbox->source = String_Clone(file);
+}
+
+// Returns the number of messages read
+//
+static int WindowReader_Finish(WindowReader *reader)
+{
+    int count = reader->mbox->count;
+
+    // Leave unlocking the file to whoever locked it
+    //
+    String_FreeP(&reader->mbox->source);
+
+    xfree(reader->chars);
+    Mailbox_Free(reader->mbox);
+
+    return count;
+}
+
+// Get the next window's worth of messages (forgetting about the last
+// window's).  Returns false at the end of the file or if something went
+// wrong (in which case reader->failed is set).
+//
+static bool WindowReader_Next(WindowReader *reader, Window *win)
+{
+    Mailbox *mbox = reader->mbox;
+    const String *file = reader->file;
+    String window = {NULL, 0, kString_Shared};
+
+    Message_Free(mbox->root, true);
+    mbox->root = NULL;
+
+    if (reader->pos > 0) {
+	memmove(reader->chars, reader->chars + reader->pos,
+		reader->length - reader->pos);
+	reader->length -= reader->pos;
+	reader->offset += reader->pos;
+	reader->pos = 0;
+    }
+
+    while (!reader->done) {
+	char *chars = reader->chars;
+	ssize_t count;
+
+	while (!reader->eof && reader->length < reader->size) {
+	    count = read(reader->fd, chars + reader->length,
+			 reader->size - reader->length);
+	    if (count < 0) {
+		Error("Could not read %s: %s", String_CString(file), strerror(errno));
+		reader->failed = true;
+		return false;
+	    }
+	    reader->eof = count == 0;
+	    reader->length += count;
+	}
+
+	bool eof = reader->eof;
+	int length = reader->length;
+	int limit = eof ? length : FindLastMessageStart(chars, length);
+	int pos = 0;
+
+	if (limit > 0) {
+	    MfckContext context = {0};
+	    MfckContext *outer = gContext;	// Collecting them, if anyone
+	    Message *root = NULL;
+	    Message **pMsg = &root;
+	    Parser parser;
+	    int warnings = gWarnings;
+	    int kept = 0;
+	    int i;
+
+	    // Hold on to any warnings until we know that we won't have to
+	    // parse the same messages again
+	    //
+	    context.problems = Array_New(0, (Free *) String_Free);
+	    context.kinds = Array_New(0, NULL);
+	    context.messages = Array_New(0, NULL);
+	    context.outer = outer;
+	    context.holding = true;
+	    gContext = &context;
+
+	    String_Set(&window, chars, limit);
+	    Parser_Set(&parser, &window);
+	    parser.offset = reader->offset;
+
+	    while (Parse_Message(&parser, mbox, false, pMsg)) {
+		if (!eof && Message_ExtendsBeyond(*pMsg, chars, limit) &&
+		    (pos > 0 || Memory_Fits(reader->size))) {
+		    Message_Free(*pMsg, false);
+		    *pMsg = NULL;
+		    mbox->count--;
+		    break;
+		}
+		Parse_Newline(&parser, NULL);
+		pMsg = &(*pMsg)->next;
+		pos = Parser_Position(&parser);
+		kept = Array_Count(context.problems);
+	    }
+
+	    if (eof && !Parser_AtEnd(&parser)) {
+		Parser_Warn(&parser, kProblem_TrailingGarbage,
+			    "Unparsable garbage at end of mailbox "
+			    "(@%d):\n %s", Parser_Offset(&parser),
+			    String_QuotedCString(&parser.rest, 72));
+		kept = Array_Count(context.problems);
+		pos = length;
+	    }
+
+	    int about = gProblemMessage;
+
+	    gContext = outer;
+	    gWarnings = warnings;
+	    for (i = 0; i < kept; i++) {
+		gProblemMessage = Context_ProblemMessage(&context, i);
+		Problem(Context_ProblemKind(&context, i), "%s",
+			String_CString(Array_GetAt(context.problems, i)));
+	    }
+	    gProblemMessage = about;
+	    Array_Free(context.problems);
+	    Array_Free(context.kinds);
+	    Array_Free(context.messages);
+	    String_Free(context.error);
+
+	    mbox->root = root;
+	}
+
+	reader->done = eof;
+
+	if (mbox->root != NULL) {
+	    win->mbox = mbox;
+	    win->fd = reader->fd;
+	    win->chars = chars;
+	    win->end = pos;
+	    win->offset = reader->offset;
+	    reader->pos = pos;
+	    return true;
+	}
+
+	if (eof)
+	    break;
+
+	// Need a bigger window to hold the next message
+	//
+	if (!Memory_Fits(reader->size)) {
+	    String *sizstr = String_ByteSize(gMaxMemory);
+	    Error("Message #%d {@%lld} of %s is too big for the memory "
+		  "budget of %s, not %s any further",
+		  mbox->count + 1, (long long) reader->offset,
+		  String_CString(file), String_CString(sizstr), reader->doing);
+	    String_Free(sizstr);
+	    reader->failed = true;
+	    return false;
+	}
+	reader->size *= 2;
+	reader->chars = xalloc(reader->chars, reader->size);
+    }
+
+    return false;
+}
+
+// Read the (already opened and locked) mailbox file a window at a time
+// and hand each window's messages to the handler.  Sets *pCount to the
+// number of messages read.
+//
+static bool ReadFileInWindows(const String *file, int fd, size_t size,
+			      const char *doing, WindowHandler *handler,
+			      void *info, int *pCount)
+{
+    WindowReader reader;
+    Window win;
+    bool success = true;
+
+    WindowReader_Init(&reader, file, fd, size, doing);
+
+    if (gProgress.fd != -1) {
+	struct stat sbuf;
+
+	Progress_Start(doing, String_CString(file),
+		       fstat(fd, &sbuf) == 0 ? sbuf.st_size : 0);
+    }
+
+    while (success && WindowReader_Next(&reader, &win)) {
+	success = handler(&win, info);
+	Progress_Reached(win.offset + win.end, reader.mbox->count);
+    }
+
+    Progress_Stop();
+    *pCount = WindowReader_Finish(&reader);
+
+    return success && !reader.failed;
+}
+
+// Lock and open a mailbox file for reading it a window at a time.  If
+// we're going to modify it, it must be locked all along even when late
+// locking, as we'd otherwise have nothing to tell if someone else has
+// changed what we read before we cut it out or rewrite it.
+//
+static int File_OpenForWindows(const String *file, bool modify)
+{
+    int fd;
+
+    if ((!gLateLock || modify) && !Mailbox_Lock(file, kDefaultLockTimeout)) {
+	Error("Could not lock %s: %s", String_CString(file), strerror(errno));
+	return -1;
+    }
+
+    if ((fd = open(String_CString(file), O_RDONLY)) == -1) {
+	Error("Could not open %s: %s", String_CString(file), strerror(errno));
+	Mailbox_Unlock(file);
+    }
+
+    return fd;
+}
+
+static bool CheckWindow(Window *win, void *info)
+{
+    CheckMailbox(win->mbox, gStrict, false);
+
+    return true;
+}
+
+bool CheckFileInWindows(const String *file)
+{
+    size_t size = iMin(kMemory_WindowSize, gMaxMemory / 4);
+    int count;
+    int fd;
+
+    if ((fd = File_OpenForWindows(file, false)) == -1)
+	return false;
+
+    if (!gQuiet || gVerbose) {
+	String *sizstr = String_ByteSize(gMaxMemory);
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	Note("%s: Too big for the memory budget of %s, checking it a "
+	     "window at a time", String_CString(file), String_CString(sizstr));
+	gQuiet = oldQuiet;
+	String_Free(sizstr);
+    }
+
+    bool success = ReadFileInWindows(file, fd, size, "checking",
+				     CheckWindow, NULL, &count);
+
+    if (success && (!gQuiet || gVerbose)) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	Note("%s: %d message%s checked", String_CString(file),
+	     count, count == 1 ? "" : "s");
+	gQuiet = oldQuiet;
+    }
+
+    close(fd);
+    Mailbox_Unlock(file);
+
+    return success;
+}
+
+/**
+ **  Sharding
+ **
+ **  With --shard, a mailbox is split into several smaller ones next to
+ **  it, by the year or month of each message's envelope date, or into
+ **  numbered pieces of at most so many bytes or messages.  The mailbox
+ **  is read a window at a time (see above) and each run of messages
+ **  going to the same shard is copied over in one go, letting the file
+ **  system share the data blocks if it can.  The mailbox is left as is.
+ **/
+
+typedef struct {
+    String *key;
+    String *path;
+    int fd;
+    int count;
+    off_t bytes;
+} Shard;
+
+typedef struct {
+    const String *file;
+    mode_t mode;
+    Array *shards;
+    Shard *last;
+    int number;
+} Sharding;
+
+void Shard_Free(Shard *shard)
+{
+    if (shard->fd != -1)
+	close(shard->fd);
+    String_Free(shard->key);
+    String_Free(shard->path);
+    xfree(shard);
+}
+
+static Shard *Sharding_Find(Sharding *sh, String *key)
+{
+    int i;
+
+    if (sh->last != NULL && String_IsEqual(sh->last->key, key, true))
+	return sh->last;
+
+    for (i = 0; i < Array_Count(sh->shards); i++) {
+	Shard *shard = Array_GetAt(sh->shards, i);
+
+	if (String_IsEqual(shard->key, key, true))
+	    return shard;
+    }
+
+    return NULL;
+}
+
+static Shard *Sharding_Add(Sharding *sh, String *key)
+{
+    Shard *shard = New(Shard);
+
+    shard->key = key;
+    shard->path = String_PrintF("%s.%s", String_CString(sh->file),
+				String_CString(key));
+    shard->fd = -1;
+
+    // Never overwrite anything, not even an earlier run's shards
+    //
+    if (!gDryRun &&
+	(shard->fd = open(String_CString(shard->path),
+			  O_WRONLY | O_CREAT | O_EXCL, sh->mode)) == -1) {
+	Error("Could not create %s: %s", String_CString(shard->path),
+	      strerror(errno));
+	Shard_Free(shard);
+	return NULL;
+    }
+
+    Array_Append(sh->shards, shard);
+
+    return shard;
+}
+
+// Figure out which shard a message of the given length should go to
+//
+static Shard *Sharding_Route(Sharding *sh, Message *msg, off_t length)
+{
+    const struct tm *date = &msg->envDate;
+    Shard *shard = sh->last;
+    String *key;
+
+    switch (gShard) {
+      case kShard_Year:
+      case kShard_Month:
+	if (msg->envelope == NULL || date->tm_year == 0)
+	    key = String_FromCString("undated", false);
+	else if (gShard == kShard_Year)
+	    key = String_PrintF("%04d", date->tm_year);
+	else
+	    key = String_PrintF("%04d-%02d", date->tm_year, date->tm_mon + 1);
+
+	if ((shard = Sharding_Find(sh, key)) != NULL) {
+	    String_Free(key);
+	    return shard;
+	}
+	return Sharding_Add(sh, key);
+
+      case kShard_Size:
+	if (shard != NULL &&
+	    (shard->bytes == 0 || shard->bytes + length <= gShardLimit))
+	    return shard;
+	break;
+
+      case kShard_Count:
+	if (shard != NULL && shard->count < gShardLimit)
+	    return shard;
+	break;
+
+      default:
+	break;
+    }
+
+    return Sharding_Add(sh, String_PrintF("%03d", ++sh->number));
+}
+
+// Copy length bytes at offset in the mailbox over to the shard
+//
+static bool Shard_Write(Shard *shard, Window *win, int pos, size_t length)
+{
+    if (gDryRun)
+	return true;
+
+    if (!File_AppendRange(win->fd, win->offset + pos, win->chars + pos,
+			  length, shard->fd)) {
+	Error("Could not write %s: %s", String_CString(shard->path),
+	      strerror(errno));
+	return false;
+    }
+
+    return true;
+}
+
+static bool ShardWindow(Window *win, void *info)
+{
+    Sharding *sh = info;
+    Shard *run = NULL;
+    int runStart = 0;
+    int pos = 0;
+    Message *msg;
+
+    for (msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next) {
+	int end = (msg->next != NULL ?
+		   String_Chars(msg->next->data) - win->chars : win->end);
+	Shard *shard = Sharding_Route(sh, msg, end - pos);
+
+	if (shard == NULL)
+	    return false;
+
+	// Write out the run of messages so far if this one goes elsewhere
+	//
+	if (shard != run && run != NULL &&
+	    !Shard_Write(run, win, runStart, pos - runStart))
+	    return false;
+
+	if (shard != run) {
+	    run = shard;
+	    runStart = pos;
+	}
+	sh->last = shard;
+	shard->count++;
+	shard->bytes += end - pos;
+	pos = end;
+    }
+
+    return run == NULL || Shard_Write(run, win, runStart, pos - runStart);
+}
+
+bool ShardFile(const String *file)
+{
+    Sharding sh = {file, 0600, Array_New(0, (Free *) Shard_Free), NULL, 0};
+    size_t size = kWindow_DefaultSize;
+    struct stat sbuf;
+    int count, i;
+    int fd;
+
+    if (gMaxMemory > 0)
+	size = iMin(size, gMaxMemory / 4);
+
+    if ((fd = File_OpenForWindows(file, false)) == -1)
+	return false;
+
+    // Shards are just as private as the mailbox itself
+    //
+    if (fstat(fd, &sbuf) == 0)
+	sh.mode = sbuf.st_mode & 0777;
+
+    bool success = ReadFileInWindows(file, fd, size, "sharding",
+				     ShardWindow, &sh, &count);
+
+    if (!gQuiet || gVerbose) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (gDryRun)
+	    Note("Dry run mode -- not writing any shards");
+	for (i = 0; i < Array_Count(sh.shards); i++) {
+	    Shard *shard = Array_GetAt(sh.shards, i);
+	    String *sizstr = String_ByteSize(shard->bytes);
+
+	    Note("%s: %d message%s, %s", String_CString(shard->path),
+		 shard->count, shard->count == 1 ? "" : "s",
+		 String_CString(sizstr));
+	    String_Free(sizstr);
+	}
+	gQuiet = oldQuiet;
+    }
+
+    for (i = 0; i < Array_Count(sh.shards); i++) {
+	Shard *shard = Array_GetAt(sh.shards, i);
+
+	if (shard->fd != -1 &&
+	    ((gSync != kSync_None && fsync(shard->fd) != 0) ||
+	     close(shard->fd) != 0)) {
+	    Error("Could not write %s: %s", String_CString(shard->path),
+		  strerror(errno));
+	    success = false;
+	}
+	shard->fd = -1;
+    }
+
+    Array_Free(sh.shards);
+    close(fd);
+    Mailbox_Unlock(file);
+
+    return success;
+}
+
+/**
+ **  Merging
+ **
+ **  With --merge, the mailboxes are merged into the -o file in order of
+ **  their messages' envelope dates (or Date: headers, for messages with
+ **  no envelope), rather than just concatenated.  They're all read a
+ **  window at a time (see above), side by side, with a heap keeping
+ **  track of which one has the earliest message to write next.  With
+ **  --merge=unique, we'll also remember a fingerprint of each message
+ **  written and drop any later copies of it.
+ **/
+
+typedef struct {
+    WindowReader reader;
+    Message *msg;		// Next message to write
+    int64_t time;		// ... and when it was sent
+    int index;			// Which mailbox it is, for a stable merge
+} MergeInput;
+
+// When the message was delivered, or 0 if we can't tell.  Envelope
+// dates don't have a time zone, so we'll take them as UTC.
+//
+static int64_t Message_DeliveryTime(Message *msg)
+{
+    const struct tm *env = &msg->envDate;
+
+    if (msg->envelope != NULL && env->tm_year != 0)
+	return Time_FromDate(env->tm_year, env->tm_mon + 1, env->tm_mday,
+			     env->tm_hour, env->tm_min, env->tm_sec);
+
+    return 0;
+}
+
+// When the message was sent (by its Date: header), or 0 if we can't tell
+//
+static int64_t Message_SentTime(Message *msg)
+{
+    String *date = Header_Get(msg->headers, &Str_Date);
+    struct tm tm = {0};
+
+    if (date != NULL &&
+	(Scan_RFC822Date(date, &tm) || Scan_FuzzyDate(date, &tm)))
+	return Time_FromDate(tm.tm_year, tm.tm_mon, tm.tm_mday,
+			     tm.tm_hour, tm.tm_min, tm.tm_sec) - tm.tm_gmtoff;
+
+    return 0;
+}
+
+// When the message was delivered (or sent), or 0 if we can't tell
+//
+static int64_t Message_Time(Message *msg)
+{
+    int64_t time = Message_DeliveryTime(msg);
+
+    return time != 0 ? time : Message_SentTime(msg);
+}
+
+// Identify a message by its key headers and body, but not by anything
+// that might have been changed by whatever stored it (like its envelope
+// or Status: headers)
+//
+static uint64_t Message_Fingerprint(Message *msg)
+{
+    static const String *keys[] = {
+	&Str_MessageID, &Str_Date, &Str_From, &Str_To, &Str_Cc, &Str_Subject,
+	NULL
+    };
+    md5_state_t md5state;
+    md5_byte_t md5digest[16];
+    const String **key;
+    uint64_t fingerprint = 0;
+    int i;
+
+    md5_init(&md5state);
+
+    for (key = keys; *key != NULL; key++) {
+	String *value = Header_Get(msg->headers, *key);
+
+	if (value != NULL)
+	    md5_append(&md5state, (md5_byte_t *) String_Chars(value),
+		       String_Length(value));
+	md5_append(&md5state, (md5_byte_t *) "", 1);
+    }
+
+    md5_append(&md5state, (md5_byte_t *) String_Chars(msg->body),
+	       String_Length(msg->body));
+
+    md5_finish(&md5state, md5digest);
+
+    for (i = 0; i < 8; i++)
+	fingerprint = (fingerprint << 8) | md5digest[i];
+
+    // Zero marks empty slots
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+// An open addressed hash set of fingerprints
+//
+typedef struct {
+    uint64_t *slots;
+    size_t size;
+    size_t count;
+} FingerprintSet;
+
+// Add the fingerprint to the set, unless it's already there (in which
+// case we return false)
+//
+static bool FingerprintSet_Add(FingerprintSet *set, uint64_t fingerprint)
+{
+    size_t i;
+
+    if (set->count * 2 >= set->size) {
+	FingerprintSet old = *set;
+
+	set->size = old.size > 0 ? old.size * 2 : kMerge_InitialFingerprints;
+	set->slots = xcalloc(set->size * sizeof(uint64_t));
+	set->count = 0;
+	for (i = 0; i < old.size; i++) {
+	    if (old.slots[i] != 0)
+		FingerprintSet_Add(set, old.slots[i]);
+	}
+	xfree(old.slots);
+    }
+
+    for (i = fingerprint % set->size; set->slots[i] != 0;
+	 i = (i + 1) % set->size) {
+	if (set->slots[i] == fingerprint)
+	    return false;
+    }
+
+    set->slots[i] = fingerprint;
+    set->count++;
+
+    return true;
+}
+
+// Move on to the input's next message.  Returns false if there are no
+// more.
+//
+static bool MergeInput_Advance(MergeInput *input)
+{
+    Window win;
+    int64_t time;
+
+    if (input->msg != NULL)
+	input->msg = input->msg->next;
+
+    if (input->msg == NULL) {
+	if (!WindowReader_Next(&input->reader, &win))
+	    return false;
+	input->msg = Mailbox_Root(win.mbox);
+    }
+
+    // Undated messages stay right after the ones before them
+    //
+    if ((time = Message_Time(input->msg)) != 0)
+	input->time = time;
+
+    return true;
+}
+
+static inline bool MergeInput_Before(MergeInput *a, MergeInput *b)
+{
+    return a->time < b->time || (a->time == b->time && a->index < b->index);
+}
+
+static void Merge_SiftDown(MergeInput **heap, int count, int i)
+{
+    while (true) {
+	int child = 2 * i + 1;
+	MergeInput *tmp;
+
+	if (child >= count)
+	    break;
+	if (child + 1 < count && MergeInput_Before(heap[child + 1], heap[child]))
+	    child++;
+	if (!MergeInput_Before(heap[child], heap[i]))
+	    break;
+
+	tmp = heap[i];
+	heap[i] = heap[child];
+	heap[child] = tmp;
+	i = child;
+    }
+}
+
+bool MergeFiles(Array *files, Stream *output)
+{
+    int count = Array_Count(files);
+    MergeInput *inputs = xcalloc(count * sizeof(MergeInput));
+    MergeInput **heap = xalloc(NULL, count * sizeof(MergeInput *));
+    FingerprintSet seen = {NULL, 0, 0};
+    size_t size = kMemory_WindowSize;
+    bool success = true;
+    int opened, queued = 0;
+    int written = 0, dropped = 0;
+    int i;
+
+    // Share the memory budget between the inputs
+    //
+    if (gMaxMemory > 0)
+	size = iMin(size, gMaxMemory / (4 * count));
+    if (size < kRead_InitialSize)
+	size = kRead_InitialSize;
+
+    for (opened = 0; opened < count; opened++) {
+	const String *file = Array_GetAt(files, opened);
+	int fd = File_OpenForWindows(file, false);
+
+	if (fd == -1) {
+	    success = false;
+	    goto done;
+	}
+	WindowReader_Init(&inputs[opened].reader, file, fd, size, "merging");
+	inputs[opened].index = opened;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (MergeInput_Advance(&inputs[i]))
+	    heap[queued++] = &inputs[i];
+    }
+    for (i = queued / 2 - 1; i >= 0; i--)
+	Merge_SiftDown(heap, queued, i);
+
+    while (queued > 0) {
+	MergeInput *input = heap[0];
+
+	if (gMerge == kMerge_Unique &&
+	    !FingerprintSet_Add(&seen, Message_Fingerprint(input->msg))) {
+	    dropped++;
+	} else {
+	    if (output != NULL) {
+		Stream_WriteMessage(output, input->msg);
+		Stream_WriteNewline(output);
+	    }
+	    written++;
+	}
+
+	if (!MergeInput_Advance(input))
+	    heap[0] = heap[--queued];
+	Merge_SiftDown(heap, queued, 0);
+    }
+
+    if (!gQuiet || gVerbose) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (output == NULL)
+	    Note("Dry run mode -- not writing merged mailbox");
+	if (dropped > 0)
+	    Note("%d message%s merged from %d mailbox%s, %d duplicate%s "
+		 "dropped", written, written == 1 ? "" : "s",
+		 count, count == 1 ? "" : "es",
+		 dropped, dropped == 1 ? "" : "s");
+	else
+	    Note("%d message%s merged from %d mailbox%s",
+		 written, written == 1 ? "" : "s",
+		 count, count == 1 ? "" : "es");
+	gQuiet = oldQuiet;
+    }
+
+  done:
+    for (i = 0; i < opened; i++) {
+	if (inputs[i].reader.failed)
+	    success = false;
+	close(inputs[i].reader.fd);
+	(void) WindowReader_Finish(&inputs[i].reader);
+	Mailbox_Unlock(inputs[i].reader.file);
+    }
+
+    xfree(seen.slots);
+    xfree(heap);
+    xfree(inputs);
+
+    return success;
+}
+
+/**
+ **  Expiring
+ **
+ **  With --older-than and/or --keep-last, the oldest messages are cut
+ **  from the start of each mailbox (which is where they normally are).
+ **  We only look at the "From " lines to find them, and then either
+ **  collapse them out of the file in place, if the file system can do
+ **  that at the cut point, or copy the rest of the mailbox to a new
+ **  file (sharing its blocks if possible).  Old messages that come after
+ **  newer ones are left alone.
+ **/
+
+static inline int Expire_LineLength(size_t rest)
+{
+    return rest < kExpire_MaxLineLength ? rest : kExpire_MaxLineLength;
+}
+
+// Is there a valid "From " line at pos?
+//
+static bool IsFromSpaceLineAt(const char *chars, size_t length, size_t pos)
+{
+    String line = {chars + pos, Expire_LineLength(length - pos),
+		   kString_Shared};
+    Parser probe;
+
+    Parser_Set(&probe, &line);
+    return Parse_FromSpaceLine(&probe, NULL, NULL, NULL);
+}
+
+// Find where the next message after pos starts (at a valid "From " line
+// after an empty line), or length if there are no more
+//
+static size_t FindNextMessageStart(const char *chars, size_t length, size_t pos)
+{
+    const char *sep = "\n\nFrom ";
+    const char *p;
+
+    while ((p = memmem(chars + pos, length - pos, sep, strlen(sep))) != NULL) {
+	pos = p - chars + 2;
+	if (IsFromSpaceLineAt(chars, length, pos))
+	    return pos;
+    }
+
+    return length;
+}
+
+// Does the first message carry IMAP folder data, i.e. does its header
+// block have an X-IMAP: or X-IMAPBase: header?
+//
+static bool HasIMAPFolderData(const char *chars, size_t length)
+{
+    size_t end = FindNextMessageStart(chars, length, 0);
+    const char *p = memchr(chars, '\n', end);
+
+    // Go through the header lines after the "From " line, up to the
+    // empty line that ends them
+    //
+    while (p != NULL && ++p < chars + end && *p != '\n') {
+	const char *eol = memchr(p, '\n', chars + end - p);
+	const char *colon = memchr(p, ':', (eol ? eol : chars + end) - p);
+
+	if (colon != NULL) {
+	    String key = {p, colon - p, kString_Shared};
+
+	    if (String_IsEqual(&key, &Str_XIMAP, false) ||
+		String_IsEqual(&key, &Str_XIMAPBase, false))
+		return true;
+	}
+	p = eol;
+    }
+
+    return false;
+}
+
+// Find where the count'th last message starts, or 0 if there aren't
+// that many
+//
+static size_t FindNthLastMessageStart(const char *chars, size_t length,
+				      int count)
+{
+    int len = String_Length(&Str_FromSpace);
+    size_t pos;
+
+    if (length < len)
+	return 0;
+
+    for (pos = length - len; pos >= 2; pos--) {
+	if (chars[pos - 1] == '\n' && chars[pos - 2] == '\n' &&
+	    memcmp(chars + pos, String_Chars(&Str_FromSpace), len) == 0 &&
+	    IsFromSpaceLineAt(chars, length, pos) && --count == 0)
+	    return pos;
+    }
+
+    return 0;
+}
+
+// When the message at pos was delivered, according to its envelope
+//
+static int64_t EnvelopeTimeAt(const char *chars, size_t length, size_t pos)
+{
+    String line = {chars + pos, Expire_LineLength(length - pos),
+		   kString_Shared};
+    struct tm tm = {0};
+    Parser probe;
+
+    Parser_Set(&probe, &line);
+    if (!Parse_FromSpaceLine(&probe, NULL, NULL, &tm))
+	return 0;
+
+    return Time_FromDate(tm.tm_year, tm.tm_mon + 1, tm.tm_mday,
+			 tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// Parse an --older-than age ("90d", "4w", "6m", "2y") or date
+// ("2019-01-31") into the time that messages must not be older than
+//
+bool ParseCutoffTime(const char *arg, int64_t *pTime)
+{
+    int year, mon, day;
+    char unit;
+    int count;
+
+    if (sscanf(arg, "%d-%d-%d%c", &year, &mon, &day, &unit) == 3) {
+	*pTime = Time_FromDate(year, mon, day, 0, 0, 0);
+	return true;
+    }
+
+    if (sscanf(arg, "%d%c", &count, &unit) != 2 || count < 0)
+	return false;
+
+    switch (unit) {
+      case 'd': *pTime = count * 86400LL; break;
+      case 'w': *pTime = count * 7 * 86400LL; break;
+      case 'm': *pTime = count * 30 * 86400LL; break;
+      case 'y': *pTime = count * 365 * 86400LL; break;
+      default:	return false;
+    }
+    *pTime = time(NULL) - *pTime;
+
+    return true;
+}
+
+// Cut the first cut bytes out of the mailbox file in place.  Fails
+// unless the file system supports it for this cut.
+//
+static bool File_CollapseStart(const String *file, off_t cut, off_t size)
+{
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    struct stat sbuf;
+    int fd = open(String_CString(file), O_RDWR);
+    bool success;
+
+    if (fd == -1)
+	return false;
+
+    success = fstat(fd, &sbuf) == 0 && sbuf.st_size == size &&
+	sbuf.st_blksize > 0 && cut % sbuf.st_blksize == 0 &&
+	fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, cut) == 0 &&
+	(gSync == kSync_None || fsync(fd) == 0);
+
+    close(fd);
+
+    return success;
+#else
+    return false;
+#endif
+}
+
+// Put the temp file (with the new contents of the mailbox file) in its
+// place, after carrying over anything that was delivered past size to
+// the old one (still open as fd) in the meantime.  Frees tmp.
+//
+static bool File_ReplaceWith(const String *file, Stream *tmp, int fd,
+			     off_t size)
+{
+    const char *cFile = String_CString(file);
+    struct stat sbuf;
+    bool success = false;
+    int len = String_Length(file);
+    char bakPath[len + 1 + 1];
+
+    if (fflush(tmp->file) != 0)
+	goto fail;
+
+    // Keep the mailbox just as private as it was
+    if (fstat(fd, &sbuf) == 0)
+	(void) fchmod(fileno(tmp->file), sbuf.st_mode & 07777);
+
+    if (fstat(fd, &sbuf) == 0 && sbuf.st_size > size) {
+	if (lseek(fd, size, SEEK_SET) == -1 ||
+	    fseeko(tmp->file, 0, SEEK_END) != 0)
+	    goto fail;
+	Stream_WriteFile(tmp, fd);
+	if (fflush(tmp->file) != 0)
+	    goto fail;
+    }
+
+    if (gSync != kSync_None && fsync(fileno(tmp->file)) != 0)
+	goto fail;
+
+    Stream_Close(tmp);
+    tmp->deleteFileWhenFreed = false;
+
+    memcpy(bakPath, cFile, len);
+    strcpy(&bakPath[len], "~");
+
+    if (gBackup && rename(cFile, bakPath) != 0) {
+	Error("Could not rename %s to %s: %s", cFile, bakPath,
+	      strerror(errno));
+	goto done;
+    }
+
+    if (rename(String_CString(tmp->name), cFile) != 0) {
+	Error("Could not rename %s to %s: %s", String_CString(tmp->name),
+	      cFile, strerror(errno));
+	goto done;
+    }
+
+    if (gSync != kSync_None && !SyncParentDirectory(cFile)) {
+	Error("Could not sync directory of %s: %s", cFile, strerror(errno));
+	goto done;
+    }
+
+    success = true;
+    goto done;
+
+  fail:
+    Error("Could not write %s: %s", String_CString(tmp->name),
+	  strerror(errno));
+
+  done:
+    Stream_Free(tmp, false);
+
+    return success;
+}
+
+// Replace the mailbox file with a copy of all but its first cut bytes
+//
+static bool File_CopyTail(const String *file, int fd, const char *chars,
+			  off_t cut, off_t size)
+{
+    Stream *tmp = Stream_OpenTemp(file, true, false);
+
+    if (tmp == NULL) {
+	Error("Could not create a temporary file for %s: %s",
+	      String_CString(file), strerror(errno));
+	return false;
+    }
+
+    if (!File_AppendRange(fd, cut, chars + cut, size - cut,
+			  fileno(tmp->file))) {
+	Error("Could not write %s: %s", String_CString(tmp->name),
+	      strerror(errno));
+	Stream_Free(tmp, false);
+	return false;
+    }
+
+    return File_ReplaceWith(file, tmp, fd, size);
+}
+
+bool ExpireFile(const String *file)
+{
+    const char *cFile = String_CString(file);
+    struct stat sbuf;
+    const char *chars;
+    size_t size, limit, cut = 0;
+    int count = 0;
+    bool success = true;
+    int fd;
+
+    if ((fd = File_OpenForWindows(file, !gDryRun)) == -1)
+	return false;
+
+    if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) {
+	Error("Could not expire %s: Not a regular file", cFile);
+	close(fd);
+	Mailbox_Unlock(file);
+	return false;
+    }
+
+    if ((size = sbuf.st_size) == 0 ||
+	(chars = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	if (size > 0)
+	    Error("Could not map %s: %s", cFile, strerror(errno));
+	close(fd);
+	Mailbox_Unlock(file);
+	return size == 0;
+    }
+
+    // How far we may cut without going into the messages to keep
+    //
+    limit = gKeepLast > 0 ? FindNthLastMessageStart(chars, size, gKeepLast) :
+	size;
+
+    // Find the end of the leading run of old messages
+    //
+    if (!IsFromSpaceLineAt(chars, size, 0)) {
+	Warn("%s: Doesn't start with a \"From \" line, not expiring anything",
+	     cFile);
+	limit = 0;
+    } else if (HasIMAPFolderData(chars, size)) {
+	Warn("%s: Has IMAP folder data in its first message, not expiring "
+	     "anything", cFile);
+	limit = 0;
+    }
+
+    while (cut < limit &&
+	   (gOlderThan == 0 || EnvelopeTimeAt(chars, size, cut) < gOlderThan)) {
+	cut = FindNextMessageStart(chars, size, cut);
+	count++;
+    }
+
+    if (!gQuiet || gVerbose) {
+	String *sizstr = String_ByteSize(cut);
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (count == 0)
+	    Note("%s: No messages to expire", cFile);
+	else if (gDryRun)
+	    Note("Dry run mode -- not expiring %d message%s (%s) from %s",
+		 count, count == 1 ? "" : "s", String_CString(sizstr), cFile);
+	else
+	    Note("%s: Expiring %d message%s (%s)", cFile,
+		 count, count == 1 ? "" : "s", String_CString(sizstr));
+	gQuiet = oldQuiet;
+	String_Free(sizstr);
+    }
+
+    if (count > 0 && !gDryRun) {
+	double start = Time_Now();
+	const char *how = "collapsed";
+
+	if (gBackup || cut == size || !File_CollapseStart(file, cut, size)) {
+	    how = "rewritten";
+	    success = File_CopyTail(file, fd, chars, cut, size);
+	}
+
+	if (success && gVerbose)
+	    Note("Mailbox %s %s in %.3f sec", cFile, how, Time_Now() - start);
+    }
+
+    munmap((void *) chars, size);
+    close(fd);
+    Mailbox_Unlock(file);
+
+    return success;
+}
+
+/**
+ **  Statistics
+ **
+ **  With --stats, we'll read all the mailboxes a window at a time (see
+ **  above) and tally up who sent what, which lists and content types
+ **  take up the most space, how big the messages are, and which are the
+ **  biggest, then print it all out as text or (with --stats=json) JSON.
+ **  Senders, lists and types are counted in hash tables keyed by their
+ **  (case insensitive) values, each of which is only copied once.
+ **/
+
+typedef struct {
+    String *key;
+    uint32_t hash;
+    int count;
+    int64_t bytes;
+} StatsEntry;
+
+typedef struct {
+    const char *name;
+    StatsEntry **slots;
+    int size;
+    int count;
+} StatsTable;
+
+typedef struct {
+    int64_t bytes;
+    String *file;
+    int num;
+    off_t offset;
+    String *from;
+    String *subject;
+} StatsMessage;
+
+typedef struct {
+    const String *file;
+    int mailboxes;
+    int messages;
+    int64_t bytes;
+    StatsTable senders;
+    StatsTable lists;
+    StatsTable types;
+    int sizeCounts[kStats_SizeBuckets];
+    int64_t sizeBytes[kStats_SizeBuckets];
+    StatsMessage *largest[kStats_TopCount];	// Min-heap on bytes
+    int largestCount;
+} Stats;
+
+static uint32_t Stats_Hash(const String *key)
+{
+    uint32_t hash = 2166136261u;	// FNV-1a
+    int i;
+
+    for (i = 0; i < String_Length(key); i++)
+	hash = (hash ^ tolower((unsigned char) String_Chars(key)[i])) *
+	    16777619u;
+
+    return hash;
+}
+
+static StatsEntry **StatsTable_Find(StatsTable *table, const String *key,
+				    uint32_t hash)
+{
+    int i = hash % table->size;
+
+    while (table->slots[i] != NULL &&
+	   (table->slots[i]->hash != hash ||
+	    !String_IsEqual(table->slots[i]->key, key, false)))
+	i = (i + 1) % table->size;
+
+    return &table->slots[i];
+}
+
+static void StatsTable_Add(StatsTable *table, const String *key, int64_t bytes)
+{
+    uint32_t hash = Stats_Hash(key);
+    StatsEntry **pEntry;
+    int i;
+
+    if (table->count * 2 >= table->size) {
+	StatsEntry **old = table->slots;
+	int oldSize = table->size;
+
+	table->size = oldSize > 0 ? oldSize * 2 : kStats_InitialTableSize;
+	table->slots = xcalloc(table->size * sizeof(StatsEntry *));
+	for (i = 0; i < oldSize; i++) {
+	    if (old[i] != NULL)
+		*StatsTable_Find(table, old[i]->key, old[i]->hash) = old[i];
+	}
+	xfree(old);
+    }
+
+    if (*(pEntry = StatsTable_Find(table, key, hash)) == NULL) {
+	*pEntry = New(StatsEntry);
+	(*pEntry)->key = String_Append(key, NULL);
+	(*pEntry)->hash = hash;
+	table->count++;
+    }
+
+    (*pEntry)->count++;
+    (*pEntry)->bytes += bytes;
+}
+
+static int StatsEntry_CompareBytes(const void *a, const void *b)
+{
+    const StatsEntry *x = *(StatsEntry **) a, *y = *(StatsEntry **) b;
+
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 :
+	String_Compare(x->key, y->key, false);
+}
+
+// Returns the entries sorted by size (to be freed with xfree)
+//
+static StatsEntry **StatsTable_Sorted(StatsTable *table)
+{
+    StatsEntry **entries = xalloc(NULL, (table->count + 1) *
+				  sizeof(StatsEntry *));
+    int i, n = 0;
+
+    for (i = 0; i < table->size; i++) {
+	if (table->slots[i] != NULL)
+	    entries[n++] = table->slots[i];
+    }
+    qsort(entries, n, sizeof(StatsEntry *), StatsEntry_CompareBytes);
+
+    return entries;
+}
+
+static void StatsTable_Free(StatsTable *table)
+{
+    int i;
+
+    for (i = 0; i < table->size; i++) {
+	if (table->slots[i] != NULL) {
+	    String_Free(table->slots[i]->key);
+	    xfree(table->slots[i]);
+	}
+    }
+    xfree(table->slots);
+}
+
+static void StatsMessage_Free(StatsMessage *sm)
+{
+    String_Free(sm->file);
+    String_Free(sm->from);
+    String_Free(sm->subject);
+    xfree(sm);
+}
+
+// The part of an address or List-Id header between <>, or else its
+// first word.  (Content-Type values end at a ';' too.)
+//
+static void Stats_Key(const String *value, String *key)
+{
+    const char *p = String_Chars(value);
+    const char *end = String_End(value);
+    const char *lt = memchr(p, '<', end - p);
+    const char *gt = lt != NULL ? memchr(lt, '>', end - lt) : NULL;
+
+    if (gt != NULL) {
+	String_Set(key, lt + 1, gt - lt - 1);
+	return;
+    }
+
+    while (p < end && isspace(*p))
+	p++;
+    String_Set(key, p, 0);
+    while (p < end && !isspace(*p) && *p != ';')
+	p++;
+    String_SetLength(key, p - String_Chars(key));
+}
+
+// Remember the message if it's one of the biggest so far
+//
+static void Stats_AddLargest(Stats *stats, Message *msg, off_t offset)
+{
+    StatsMessage **heap = stats->largest;
+    int64_t bytes = String_Length(msg->data);
+    int i = 0;
+
+    if (stats->largestCount == kStats_TopCount) {
+	if (bytes <= heap[0]->bytes)
+	    return;
+	StatsMessage_Free(heap[0]);
+	heap[0] = heap[--stats->largestCount];
+	for (;;) {
+	    int child = 2 * i + 1;
+	    StatsMessage *tmp;
+
+	    if (child >= stats->largestCount)
+		break;
+	    if (child + 1 < stats->largestCount &&
+		heap[child + 1]->bytes < heap[child]->bytes)
+		child++;
+	    if (heap[child]->bytes >= heap[i]->bytes)
+		break;
+	    tmp = heap[i];
+	    heap[i] = heap[child];
+	    heap[child] = tmp;
+	    i = child;
+	}
+    }
+
+    StatsMessage *sm = New(StatsMessage);
+    String *from = Header_Get(msg->headers, &Str_From);
+    String *subject = Header_Get(msg->headers, &Str_Subject);
+
+    sm->bytes = bytes;
+    sm->file = String_Append(stats->file, NULL);
+    sm->num = msg->num;
+    sm->offset = offset;
+    sm->from = from != NULL ? String_Append(from, NULL) : NULL;
+    sm->subject = subject != NULL ? String_Append(subject, NULL) : NULL;
+
+    for (i = stats->largestCount++; i > 0; i = (i - 1) / 2) {
+	if (heap[(i - 1) / 2]->bytes <= bytes)
+	    break;
+	heap[i] = heap[(i - 1) / 2];
+    }
+    heap[i] = sm;
+}
+
+static bool StatsWindow(Window *win, void *info)
+{
+    Stats *stats = info;
+    Message *msg;
+
+    for (msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next) {
+	int64_t bytes = String_Length(msg->data);
+	String *value;
+	String key;
+	int bucket;
+
+	stats->messages++;
+	stats->bytes += bytes;
+
+	if ((value = Header_Get(msg->headers, &Str_From)) == NULL)
+	    value = msg->envSender;
+	if (value != NULL)
+	    Stats_Key(value, &key);
+	if (value == NULL || String_IsEmpty(&key))
+	    String_Set(&key, "(none)", 6);
+	StatsTable_Add(&stats->senders, &key, bytes);
+
+	if ((value = Header_Get(msg->headers, &Str_ListId)) != NULL) {
+	    Stats_Key(value, &key);
+	    StatsTable_Add(&stats->lists, &key, bytes);
+	}
+
+	if ((value = Header_Get(msg->headers, &Str_ContentType)) != NULL)
+	    Stats_Key(value, &key);
+	if (value == NULL || String_IsEmpty(&key))
+	    String_Set(&key, "text/plain", 10);
+	StatsTable_Add(&stats->types, &key, bytes);
+
+	for (bucket = 0; bucket < kStats_SizeBuckets - 1 &&
+		 bytes >= (1024LL << bucket); bucket++);
+	stats->sizeCounts[bucket]++;
+	stats->sizeBytes[bucket] += bytes;
+
+	Stats_AddLargest(stats, msg,
+			 win->offset + (String_Chars(msg->data) - win->chars));
+    }
+
+    return true;
+}
+
+void Stream_WriteJSONString(Stream *output, const String *str)
+{
+    const char *p, *end;
+
+    if (str == NULL) {
+	Stream_PrintF(output, "null");
+	return;
+    }
+
+    p = String_Chars(str);
+    end = String_End(str);
+
+    Stream_WriteChar(output, '"');
+    for (; p < end; p++) {
+	unsigned char ch = *p;
+
+	if (ch == '"' || ch == '\\')
+	    Stream_PrintF(output, "\\%c", ch);
+	else if (ch == '\n')
+	    Stream_PrintF(output, "\\n");
+	else if (ch == '\t')
+	    Stream_PrintF(output, "\\t");
+	else if (ch < 0x20 || ch == 0x7F)
+	    Stream_PrintF(output, "\\u%04x", ch);
+	else
+	    Stream_WriteChar(output, ch);
+    }
+    Stream_WriteChar(output, '"');
+}
+
+static void Stats_WriteTable(Stream *output, StatsTable *table, bool json)
+{
+    StatsEntry **entries = StatsTable_Sorted(table);
+    int n = iMin(table->count, kStats_TopEntries);
+    int i;
+
+    if (json) {
+	Stream_PrintF(output, "  \"%s\": {\"distinct\": %d, \"top\": [",
+		      table->name, table->count);
+	for (i = 0; i < n; i++) {
+	    Stream_PrintF(output, "%s\n    {\"key\": ", i > 0 ? "," : "");
+	    Stream_WriteJSONString(output, entries[i]->key);
+	    Stream_PrintF(output, ", \"count\": %d, \"bytes\": %lld}",
+			  entries[i]->count, (long long) entries[i]->bytes);
+	}
+	Stream_PrintF(output, "%s]},\n", n > 0 ? "\n  " : "");
+    } else if (table->count > 0) {
+	Stream_PrintF(output, "\nTop %s by size (of %d):\n\n", table->name,
+		      table->count);
+	for (i = 0; i < n; i++) {
+	    String *sizstr = String_ByteSize(entries[i]->bytes);
+
+	    Stream_PrintF(output, "%8d %8s  %s\n", entries[i]->count,
+			  String_CString(sizstr),
+			  String_QuotedCString(entries[i]->key,
+					       gPageWidth - 20));
+	    String_Free(sizstr);
+	}
+    }
+
+    xfree(entries);
+}
+
+static void Stats_Write(Stream *output, Stats *stats, bool json)
+{
+    StatsMessage *largest[kStats_TopCount];
+    int n = stats->largestCount;
+    int i, j;
+
+    // Biggest first
+    //
+    memcpy(largest, stats->largest, n * sizeof(StatsMessage *));
+    for (i = 1; i < n; i++) {
+	StatsMessage *sm = largest[i];
+
+	for (j = i; j > 0 && largest[j - 1]->bytes < sm->bytes; j--)
+	    largest[j] = largest[j - 1];
+	largest[j] = sm;
+    }
+
+    if (json) {
+	Stream_PrintF(output, "{\n  \"mailboxes\": %d,\n  \"messages\": %d,\n"
+		      "  \"bytes\": %lld,\n", stats->mailboxes,
+		      stats->messages, (long long) stats->bytes);
+    } else {
+	String *sizstr = String_ByteSize(stats->bytes);
+
+	Stream_PrintF(output, "%d message%s, %s in %d mailbox%s\n",
+		      stats->messages, stats->messages == 1 ? "" : "s",
+		      String_CString(sizstr), stats->mailboxes,
+		      stats->mailboxes == 1 ? "" : "es");
+	String_Free(sizstr);
+    }
+
+    Stats_WriteTable(output, &stats->senders, json);
+    Stats_WriteTable(output, &stats->lists, json);
+    Stats_WriteTable(output, &stats->types, json);
+
+    if (json)
+	Stream_PrintF(output, "  \"sizes\": [");
+    else
+	Stream_PrintF(output, "\nMessage sizes:\n\n");
+    for (i = 0; i < kStats_SizeBuckets; i++) {
+	if (json) {
+	    Stream_PrintF(output, "%s\n    {\"below\": ", i > 0 ? "," : "");
+	    if (i < kStats_SizeBuckets - 1)
+		Stream_PrintF(output, "%lld", 1024LL << i);
+	    else
+		Stream_PrintF(output, "null");
+	    Stream_PrintF(output, ", \"count\": %d, \"bytes\": %lld}",
+			  stats->sizeCounts[i], (long long) stats->sizeBytes[i]);
+	} else if (stats->sizeCounts[i] > 0) {
+	    int limit = iMin(i, kStats_SizeBuckets - 2);
+	    String *sizstr = String_ByteSize(stats->sizeBytes[i]);
+
+	    Stream_PrintF(output, "%8d %8s  %s %d%s\n", stats->sizeCounts[i],
+			  String_CString(sizstr),
+			  i < kStats_SizeBuckets - 1 ? "below" : "at least",
+			  limit < 10 ? 1 << limit : 1 << (limit - 10),
+			  limit < 10 ? "KB" : "MB");
+	    String_Free(sizstr);
+	}
+    }
+
+    if (json)
+	Stream_PrintF(output, "\n  ],\n  \"largest\": [");
+    else if (n > 0)
+	Stream_PrintF(output, "\nLargest messages:\n\n");
+    for (i = 0; i < n; i++) {
+	StatsMessage *sm = largest[i];
+
+	if (json) {
+	    Stream_PrintF(output, "%s\n    {\"mailbox\": ", i > 0 ? "," : "");
+	    Stream_WriteJSONString(output, sm->file);
+	    Stream_PrintF(output, ", \"message\": %d, \"offset\": %lld, "
+			  "\"bytes\": %lld, \"from\": ", sm->num,
+			  (long long) sm->offset, (long long) sm->bytes);
+	    Stream_WriteJSONString(output, sm->from);
+	    Stream_PrintF(output, ", \"subject\": ");
+	    Stream_WriteJSONString(output, sm->subject);
+	    Stream_PrintF(output, "}");
+	} else {
+	    String *sizstr = String_ByteSize(sm->bytes);
+
+	    Stream_PrintF(output, "%8s  %s #%d {@%lld}\n\t  %s\n\t  %s\n",
+			  String_CString(sizstr), String_CString(sm->file),
+			  sm->num, (long long) sm->offset,
+			  String_QuotedCString(String_Safe(sm->from),
+					       gPageWidth - 12),
+			  String_QuotedCString(String_Safe(sm->subject),
+					       gPageWidth - 12));
+	    String_Free(sizstr);
+	}
+    }
+    if (json)
+	Stream_PrintF(output, "%s]\n}\n", n > 0 ? "\n  " : "");
+}
+
+bool StatsFiles(Array *files)
+{
+    Stats stats = {0};
+    size_t size = kWindow_DefaultSize;
+    bool success = true;
+    int i, count;
+
+    stats.senders.name = "senders";
+    stats.lists.name = "lists";
+    stats.types.name = "types";
+
+    if (gMaxMemory > 0)
+	size = iMin(size, gMaxMemory / 4);
+
+    for (i = 0; i < Array_Count(files); i++) {
+	const String *file = Array_GetAt(files, i);
+	int fd = File_OpenForWindows(file, false);
+
+	if (fd == -1) {
+	    success = false;
+	    continue;
+	}
+
+	stats.file = file;
+	if (!ReadFileInWindows(file, fd, size, "counting", StatsWindow,
+			       &stats, &count))
+	    success = false;
+	stats.mailboxes++;
+	close(fd);
+	Mailbox_Unlock(file);
+    }
+
+    Stats_Write(gStdOut, &stats, gStats == kStats_JSON);
+
+    StatsTable_Free(&stats.senders);
+    StatsTable_Free(&stats.lists);
+    StatsTable_Free(&stats.types);
+    for (i = 0; i < stats.largestCount; i++)
+	StatsMessage_Free(stats.largest[i]);
+
+    return success;
+}
+
+/**
+ **  Stripping Attachments
+ **
+ **  With --strip-attachments=SIZE, we'll go through each mailbox a window
+ **  at a time (see above), following the boundaries of any multipart
+ **  messages down to their leaf parts, and replace any non-text part
+ **  (or any part marked as an attachment) bigger than SIZE with a short
+ **  text part saying what used to be there.  The attachments are never
+ **  decoded; the rest of each changed message is pieced together from
+ **  the original, and unchanged messages are copied over as is.
+ **/
+
+typedef struct {
+    const String *file;
+    Stream *output;
+    Array *pieces;		// Of the current message's new body
+    int messages;		// Changed so far
+    int parts;			// Removed so far
+    int64_t removed;		// Bytes removed so far
+} Stripping;
+
+// Find the next "--boundary" line in [p, end), or NULL
+//
+static const char *MIME_FindDelimiter(const char *start, const char *p,
+				      const char *end, const String *delim)
+{
+    int len = String_Length(delim);
+
+    while (p < end &&
+	   (p = memmem(p, end - p, String_Chars(delim), len)) != NULL) {
+	if (p == start || p[-1] == '\n')
+	    return p;
+	p += len;
+    }
+
+    return NULL;
+}
+
+static void Strip_AddPiece(Stripping *st, const char *start, const char *end)
+{
+    if (end > start)
+	Array_Append(st->pieces, String_New(kString_Shared, start, end - start));
+}
+
+// Should a part like this be removed?
+//
+static bool Strip_IsAttachment(const String *type, const String *disposition)
+{
+    static const String Str_Text = {"text/", 5, kString_Const};
+    static const String Str_Attachment = {"attachment", 10, kString_Const};
+
+    return (type != NULL && !String_HasPrefix(type, &Str_Text, false) &&
+	    !String_HasPrefix(type, &Str_Multipart, false)) ||
+	(disposition != NULL &&
+	 String_HasPrefix(disposition, &Str_Attachment, false));
+}
+
+// Describe the removed part in a placeholder part of its own
+//
+static void Strip_AddPlaceholder(Stripping *st, const String *type,
+				 const String *disposition, int64_t size)
+{
+    String *name = NULL;
+    String key, *sizstr = String_ByteSize(size);
+
+    if (disposition != NULL)
+	name = MIME_GetParameter((String *) disposition, &Str_Filename);
+    if (name == NULL && type != NULL)
+	name = MIME_GetParameter((String *) type, &Str_Name);
+    if (name != NULL && (String_FindChar(name, '\n', true) != kString_NotFound ||
+			 String_FindChar(name, '"', true) != kString_NotFound))
+	String_FreeP(&name);
+
+    if (type != NULL)
+	Stats_Key(type, &key);
+    else
+	String_Set(&key, "application/octet-stream", 24);
+
+    Array_Append(st->pieces, String_PrintF(
+		     "Content-Type: text/plain; charset=us-ascii\n"
+		     "Content-Disposition: inline\n"
+		     "X-Mfck-Stripped: %lld bytes of %s%s%s%s\n"
+		     "\n"
+		     "[An attachment %s%s%s(%s, %s) was removed to save space]\n",
+		     (long long) size, String_CString(&key),
+		     name != NULL ? "; name=\"" : "", String_CString(name),
+		     name != NULL ? "\"" : "",
+		     name != NULL ? "\"" : "", String_CString(name),
+		     name != NULL ? "\" " : "",
+		     String_CString(&key), String_CString(sizstr)));
+
+    String_Free(name);
+    String_Free(sizstr);
+}
+
+static void Strip_Body(Stripping *st, const char *start, const char *end,
+		       const String *type, int depth);
+
+// Add the part in [start, end) to the pieces, minus any big attachments
+//
+static void Strip_Part(Stripping *st, const char *start, const char *end,
+		       int depth)
+{
+    const char *body = start;
+
+    // Find the end of the part headers
+    //
+    while (body < end && *body != '\n' && !(*body == '\r' && body[1] == '\n')) {
+	const char *eol = memchr(body, '\n', end - body);
+	body = eol != NULL ? eol + 1 : end;
+    }
+
+    String *type = MIME_GetPartHeader(start, body, &Str_ContentType);
+    String *disposition = MIME_GetPartHeader(start, body,
+					     &Str_ContentDisposition);
+
+    if (body < end)
+	body += *body == '\r' ? 2 : 1;
+
+    if (type != NULL && String_HasPrefix(type, &Str_Multipart, false)) {
+	Strip_AddPiece(st, start, body);
+	Strip_Body(st, body, end, type, depth + 1);
+    } else if (end - start > gStripSize &&
+	       Strip_IsAttachment(type, disposition)) {
+	Strip_AddPlaceholder(st, type, disposition, end - body);
+	st->parts++;
+	st->removed += end - start;
+    } else {
+	Strip_AddPiece(st, start, end);
+    }
+
+    String_Free(type);
+    String_Free(disposition);
+}
+
+// Add the body in [start, end) to the pieces, going into each of the
+// parts if it's a multipart
+//
+static void Strip_Body(Stripping *st, const char *start, const char *end,
+		       const String *type, int depth)
+{
+    String *boundary = NULL;
+    String *delim;
+    const char *d;
+
+    if (depth < kStrip_MaxDepth && type != NULL &&
+	String_HasPrefix(type, &Str_Multipart, false))
+	boundary = MIME_GetParameter((String *) type, &Str_Boundary);
+
+    if (boundary == NULL || String_IsEmpty(boundary)) {
+	Strip_AddPiece(st, start, end);
+	String_Free(boundary);
+	return;
+    }
+
+    delim = String_Append(&Str_TwoDashes, boundary, NULL);
+
+    // The preamble
+    //
+    if ((d = MIME_FindDelimiter(start, start, end, delim)) == NULL)
+	d = end;
+    Strip_AddPiece(st, start, d);
+
+    while (d < end) {
+	const char *after = d + String_Length(delim);
+	const char *part = memchr(after, '\n', end - after);
+	const char *next, *partEnd;
+
+	// The closing delimiter and the epilogue (or some garbage)
+	//
+	if (part == NULL || (end - after >= 2 && after[0] == '-' &&
+			     after[1] == '-') ||
+	    (next = MIME_FindDelimiter(start, part + 1, end, delim)) == NULL) {
+	    Strip_AddPiece(st, d, end);
+	    break;
+	}
+
+	// The newline before the next delimiter belongs to it
+	//
+	part++;
+	partEnd = next;
+	if (partEnd > part && partEnd[-1] == '\n')
+	    partEnd--;
+	if (partEnd > part && partEnd[-1] == '\r')
+	    partEnd--;
+
+	Strip_AddPiece(st, d, part);
+	Strip_Part(st, part, partEnd, depth);
+	Strip_AddPiece(st, partEnd, next);
+	d = next;
+    }
+
+    String_Free(delim);
+    String_Free(boundary);
+}
+
+// Join the pieces into a single string
+//
+static String *Strip_Join(Array *pieces)
+{
+    int i, len = 0;
+
+    for (i = 0; i < Array_Count(pieces); i++)
+	len += String_Length(Array_GetAt(pieces, i));
+
+    String *joined = String_Alloc(len);
+    char *p = (char *) String_Chars(joined);
+
+    for (i = 0; i < Array_Count(pieces); i++) {
+	String *piece = Array_GetAt(pieces, i);
+
+	memcpy(p, String_Chars(piece), String_Length(piece));
+	p += String_Length(piece);
+    }
+
+    return joined;
+}
+
+static bool StripWindow(Window *win, void *info)
+{
+    Stripping *st = info;
+    const char *pos = win->chars;
+    Message *msg;
+
+    for (msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next) {
+	const char *end = (msg->next != NULL ? String_Chars(msg->next->data) :
+			   win->chars + win->end);
+	String *type = Header_Get(msg->headers, &Str_ContentType);
+	String *body = Message_Body(msg);
+	int parts = st->parts;
+
+	if (type != NULL && String_HasPrefix(type, &Str_Multipart, false) &&
+	    String_Length(msg->data) > gStripSize) {
+	    Strip_Body(st, String_Chars(body), String_End(body), type, 0);
+	}
+
+	if (st->parts == parts) {
+	    // Nothing to strip (or nothing big enough, at least)
+	    if (st->output != NULL)
+		Stream_WriteChars(st->output, pos, end - pos);
+	} else {
+	    st->messages++;
+	    Message_SetBody(msg, Strip_Join(st->pieces));
+	    String_Free(body);
+	    if (st->output != NULL) {
+		Stream_WriteMessage(st->output, msg);
+		Stream_WriteChars(st->output, String_End(msg->data),
+				  end - String_End(msg->data));
+	    }
+	}
+
+	Array_Reset(st->pieces);
+	pos = end;
+    }
+
+    return st->output == NULL || !ferror(st->output->file);
+}
+
+bool StripFile(const String *file)
+{
+    Stripping st = {file, NULL, Array_New(0, (Free *) String_Free), 0, 0, 0};
+    const char *cFile = String_CString(file);
+    size_t size = kWindow_DefaultSize;
+    struct stat sbuf;
+    bool success;
+    int count;
+    int fd;
+
+    if (gMaxMemory > 0)
+	size = iMin(size, gMaxMemory / 4);
+
+    if ((fd = File_OpenForWindows(file, !gDryRun)) == -1)
+	return false;
+
+    if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) {
+	Error("Could not strip %s: Not a regular file", cFile);
+	success = false;
+	goto done;
+    }
+
+    if (!gDryRun && (st.output = Stream_OpenTemp(file, true, false)) == NULL) {
+	Error("Could not create a temporary file for %s: %s",
+	      cFile, strerror(errno));
+	success = false;
+	goto done;
+    }
+
+    success = ReadFileInWindows(file, fd, size, "stripping", StripWindow,
+				&st, &count);
+
+    if (success && (!gQuiet || gVerbose)) {
+	String *sizstr = String_ByteSize(st.removed);
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (st.parts == 0)
+	    Note("%s: No attachments to strip", cFile);
+	else
+	    Note("%s%s: %s %d attachment%s (%s) from %d message%s",
+		 gDryRun ? "Dry run mode -- " : "", cFile,
+		 gDryRun ? "would strip" : "Stripping",
+		 st.parts, st.parts == 1 ? "" : "s", String_CString(sizstr),
+		 st.messages, st.messages == 1 ? "" : "s");
+	gQuiet = oldQuiet;
+	String_Free(sizstr);
+    }
+
+    if (st.output != NULL) {
+	if (success && st.parts > 0)
+	    success = File_ReplaceWith(file, st.output, fd, sbuf.st_size);
+	else
+	    Stream_Free(st.output, true);
+    }
+
+  done:
+    Array_Free(st.pieces);
+    close(fd);
+    Mailbox_Unlock(file);
+
+    return success;
+}
+
+/**
+ **  Scrubbing
+ **
+ **  With --scrub, we'll compute a checksum of each message and keep them
+ **  in a small mbox.mfck-scrub file next to the mailbox.  The next scrub
+ **  compares the messages against it (by offset, or by Message-ID for
+ **  messages that have moved) and reports any that have changed, so that
+ **  silent corruption of archived mail gets noticed.  Messages going
+ **  missing just as others turn up are suspect too (they may be the same
+ **  ones with a mangled Message-ID).  Headers that mail
+ **  readers update as a matter of course (Status:, X-UID:, etc.) are
+ **  left out of the checksums.  The checksums of each window's messages
+ **  are computed in parallel, and what we've read is dropped from the
+ **  page cache as we go, to not push out everything else.
+ **
+ **  The scrub file has a 16 byte header and a 32 byte record for each
+ **  message, with all numbers in little endian order:
+ **
+ **	offset (8), length (4), flags (4), checksum (8), Message-ID hash (8)
+ **/
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint64_t checksum;
+    uint64_t idHash;
+} ScrubRecord;
+
+typedef struct {
+    const String *file;
+    ScrubRecord *old;		// From the last scrub, by offset
+    int oldCount;
+    int *oldByID;		// Open addressed index of old by idHash
+    int oldByIDSize;
+    bool *matched;		// Which old records we've seen again
+    int next;			// The old record after the last one matched
+    Stream *output;		// New scrub file, if any
+    int count;
+    int added;
+    int changed;
+} Scrubbing;
+
+static inline uint64_t Hash_Rotate(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t Hash_Read64(const unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+	(uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+	(uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline uint32_t Hash_Read32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+	(uint32_t) p[3] << 24;
+}
+
+#define kHash_Prime1	0x9E3779B185EBCA87ULL
+#define kHash_Prime2	0xC2B2AE3D27D4EB4FULL
+#define kHash_Prime3	0x165667B19E3779F9ULL
+#define kHash_Prime4	0x85EBCA77C2B2AE63ULL
+#define kHash_Prime5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t Hash_Round(uint64_t acc, uint64_t input)
+{
+    return Hash_Rotate(acc + input * kHash_Prime2, 31) * kHash_Prime1;
+}
+
+static inline uint64_t Hash_Merge(uint64_t acc, uint64_t val)
+{
+    return (acc ^ Hash_Round(0, val)) * kHash_Prime1 + kHash_Prime4;
+}
+
+// A fast 64 bit hash (xxHash64) of the chars, which may be chained by
+// passing in the hash of what came before as the seed
+//
+uint64_t Hash64(const char *chars, size_t length, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *) chars;
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+	uint64_t v1 = seed + kHash_Prime1 + kHash_Prime2;
+	uint64_t v2 = seed + kHash_Prime2;
+	uint64_t v3 = seed;
+	uint64_t v4 = seed - kHash_Prime1;
+
+	for (; p + 32 <= end; p += 32) {
+	    v1 = Hash_Round(v1, Hash_Read64(p));
+	    v2 = Hash_Round(v2, Hash_Read64(p + 8));
+	    v3 = Hash_Round(v3, Hash_Read64(p + 16));
+	    v4 = Hash_Round(v4, Hash_Read64(p + 24));
+	}
+
+	h = Hash_Rotate(v1, 1) + Hash_Rotate(v2, 7) +
+	    Hash_Rotate(v3, 12) + Hash_Rotate(v4, 18);
+	h = Hash_Merge(h, v1);
+	h = Hash_Merge(h, v2);
+	h = Hash_Merge(h, v3);
+	h = Hash_Merge(h, v4);
+    } else {
+	h = seed + kHash_Prime5;
+    }
+
+    h += length;
+
+    for (; p + 8 <= end; p += 8)
+	h = Hash_Rotate(h ^ Hash_Round(0, Hash_Read64(p)), 27) * kHash_Prime1 +
+	    kHash_Prime4;
+    if (p + 4 <= end) {
+	h = Hash_Rotate(h ^ Hash_Read32(p) * kHash_Prime1, 23) * kHash_Prime2 +
+	    kHash_Prime3;
+	p += 4;
+    }
+    for (; p < end; p++)
+	h = Hash_Rotate(h ^ *p * kHash_Prime5, 11) * kHash_Prime1;
+
+    h ^= h >> 33;
+    h *= kHash_Prime2;
+    h ^= h >> 29;
+    h *= kHash_Prime3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static inline uint64_t Hash64_String(const String *str, uint64_t seed)
+{
+    return Hash64(String_Chars(str), String_Length(str), seed);
+}
+
+// Checksum the message, except for headers that change all the time
+//
+static uint64_t Message_Checksum(Message *msg)
+{
+    static const String *volatileKeys[] = {
+	&Str_Status, &Str_XStatus, &Str_XKeywords, &Str_XUID, &Str_XIMAP,
+	&Str_XIMAPBase, NULL
+    };
+    uint64_t checksum = 0;
+    Header *head;
+
+    if (msg->envelope != NULL)
+	checksum = Hash64_String(msg->envelope, checksum);
+
+    for (head = msg->headers->root; head != NULL; head = head->next) {
+	const String **key;
+
+	for (key = volatileKeys; *key != NULL; key++) {
+	    if (String_IsEqual(head->key, *key, false))
+		break;
+	}
+	if (*key == NULL && head->line != NULL)
+	    checksum = Hash64_String(head->line, checksum);
+    }
+
+    return Hash64_String(msg->body, checksum);
+}
+
+#ifdef USE_THREADS
+typedef struct {
+    Message **msgs;
+    uint64_t *checksums;
+    int count;
+} ScrubJob;
+
+static void *ScrubJob_Run(void *arg)
+{
+    ScrubJob *job = arg;
+    int i;
+
+    for (i = 0; i < job->count; i++)
+	job->checksums[i] = Message_Checksum(job->msgs[i]);
+
+    return NULL;
+}
+#endif
+
+// Checksum all the messages, in several threads if there are enough
+//
+static void Scrub_Checksums(Message **msgs, uint64_t *checksums, int count,
+			    size_t bytes)
+{
+    int i;
+
+#ifdef USE_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = iMin(cpus > 0 ? cpus : 1, kScrub_MaxThreads);
+
+    threads = iMin(threads, bytes / kScrub_MinThreadBytes + 1);
+    threads = iMin(threads, count);
+
+    if (threads > 1) {
+	pthread_t tids[threads];
+	ScrubJob jobs[threads];
+	int started = 0;
+	int next = 0;
+
+	// Split the messages evenly by size
+	//
+	for (i = 0; i < threads; i++) {
+	    size_t share = 0, goal = bytes / threads;
+
+	    jobs[i].msgs = msgs + next;
+	    jobs[i].checksums = checksums + next;
+	    while (next < count && (i == threads - 1 || share < goal))
+		share += String_Length(msgs[next++]->data);
+	    jobs[i].count = msgs + next - jobs[i].msgs;
+	}
+
+	for (i = 1; i < threads; i++) {
+	    if (pthread_create(&tids[i], NULL, ScrubJob_Run, &jobs[i]) != 0)
+		break;
+	    started = i;
+	}
+
+	// Do the first share here (and any that didn't get a thread)
+	//
+	ScrubJob_Run(&jobs[0]);
+	for (i = started + 1; i < threads; i++)
+	    ScrubJob_Run(&jobs[i]);
+	for (i = 1; i <= started; i++)
+	    pthread_join(tids[i], NULL);
+	return;
+    }
+#endif
+
+    for (i = 0; i < count; i++)
+	checksums[i] = Message_Checksum(msgs[i]);
+}
+
+static inline void Scrub_Put(unsigned char *p, uint64_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++, value >>= 8)
+	p[i] = value & 0xFF;
+}
+
+static ScrubRecord *Scrub_FindOld(Scrubbing *sc, uint64_t offset,
+				  uint32_t length, uint64_t checksum,
+				  uint64_t idHash)
+{
+    ScrubRecord *found = NULL, *there = NULL;
+    int lo = 0, hi = sc->oldCount - 1;
+
+    // By offset first...
+    //
+    while (lo <= hi) {
+	int mid = (lo + hi) / 2;
+
+	if (sc->old[mid].offset == offset) {
+	    if (!sc->matched[mid])
+		there = &sc->old[mid];
+	    if (there != NULL && there->idHash == idHash)
+		found = there;
+	    break;
+	}
+	if (sc->old[mid].offset < offset)
+	    lo = mid + 1;
+	else
+	    hi = mid - 1;
+    }
+
+    if (found != NULL && found->checksum == checksum)
+	return found;
+
+    // ... then by Message-ID, in case it has moved.  Duplicates share
+    // their Message-ID, so skip any we've already seen and prefer one
+    // that's unchanged, or else at least of the same length...
+    //
+    if (idHash != 0 && sc->oldByIDSize > 0) {
+	int i = idHash % sc->oldByIDSize;
+
+	for (; sc->oldByID[i] != -1; i = (i + 1) % sc->oldByIDSize) {
+	    ScrubRecord *old = &sc->old[sc->oldByID[i]];
+
+	    if (old->idHash != idHash || sc->matched[sc->oldByID[i]])
+		continue;
+	    if (old->checksum == checksum)
+		return old;
+	    if (found == NULL ||
+		(found->length != length && old->length == length))
+		found = old;
+	}
+    }
+
+    if (found != NULL)
+	return found;
+
+    // ... or else as the one following the last one we found, in case
+    // it has moved and has no Message-ID...
+    //
+    if (sc->next < sc->oldCount && !sc->matched[sc->next] &&
+	sc->old[sc->next].idHash == idHash)
+	return &sc->old[sc->next];
+
+    // ... or at least as the one that was in its place, if nothing else
+    // claimed that (in which case its Message-ID must have changed)
+    //
+    return there;
+}
+
+static bool ScrubWindow(Window *win, void *info)
+{
+    Scrubbing *sc = info;
+    Message **msgs;
+    uint64_t *checksums;
+    Message *msg;
+    int count = 0;
+    int i;
+
+    for (msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next)
+	count++;
+
+    msgs = xalloc(NULL, count * sizeof(Message *));
+    checksums = xalloc(NULL, count * sizeof(uint64_t));
+
+    for (i = 0, msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next)
+	msgs[i++] = msg;
+
+    Scrub_Checksums(msgs, checksums, count, win->end);
+
+    for (i = 0; i < count; i++) {
+	msg = msgs[i];
+
+	String *id = Header_Get(msg->headers, &Str_MessageID);
+	uint64_t idHash = id != NULL ? Hash64_String(id, 0) | 1 : 0;
+	uint64_t offset = win->offset + (String_Chars(msg->data) - win->chars);
+	uint32_t length = String_Length(msg->data);
+	ScrubRecord *old = Scrub_FindOld(sc, offset, length,
+					  checksums[i], idHash);
+
+	sc->count++;
+
+	if (old == NULL) {
+	    sc->added++;
+	} else {
+	    sc->matched[old - sc->old] = true;
+	    sc->next = old - sc->old + 1;
+	    if (old->checksum != checksums[i]) {
+		Error("Message %s of %s%s%s has changed since it was last "
+		      "scrubbed", String_CString(msg->tag),
+		      String_CString(sc->file), id != NULL ? ", " : "",
+		      id != NULL ? String_CString(id) : "");
+		sc->changed++;
+	    }
+	}
+
+	if (sc->output != NULL) {
+	    unsigned char record[kScrub_RecordSize];
+
+	    Scrub_Put(record, offset, 8);
+	    Scrub_Put(record + 8, length, 4);
+	    Scrub_Put(record + 12, 0, 4);
+	    Scrub_Put(record + 16, checksums[i], 8);
+	    Scrub_Put(record + 24, idHash, 8);
+	    Stream_WriteChars(sc->output, (char *) record, sizeof(record));
+	}
+    }
+
+    xfree(msgs);
+    xfree(checksums);
+
+    // We won't be needing any of that again anytime soon
+    //
+#ifdef POSIX_FADV_DONTNEED
+    (void) posix_fadvise(win->fd, win->offset, win->end, POSIX_FADV_DONTNEED);
+#endif
+
+    return sc->output == NULL || !ferror(sc->output->file);
+}
+
+// Read the checksums from the last scrub, if there was one
+//
+static bool Scrub_ReadOld(Scrubbing *sc, const String *path)
+{
+    unsigned char header[kScrub_HeaderSize];
+    unsigned char record[kScrub_RecordSize];
+    FILE *file = fopen(String_CString(path), "r");
+    int i, size = 0;
+
+    if (file == NULL) {
+	if (errno == ENOENT)
+	    return true;
+	Error("Could not read %s: %s", String_CString(path), strerror(errno));
+	return false;
+    }
+
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+	memcmp(header, kScrub_Magic, sizeof(header)) != 0) {
+	Error("Could not read %s: Not a scrub file", String_CString(path));
+	fclose(file);
+	return false;
+    }
+
+    while (fread(record, sizeof(record), 1, file) == 1) {
+	ScrubRecord *rec;
+
+	if (sc->oldCount == size) {
+	    size = size > 0 ? size * 2 : kScrub_InitialRecords;
+	    sc->old = xalloc(sc->old, size * sizeof(ScrubRecord));
+	}
+	rec = &sc->old[sc->oldCount++];
+	rec->offset = Hash_Read64(record);
+	rec->length = Hash_Read32(record + 8);
+	rec->checksum = Hash_Read64(record + 16);
+	rec->idHash = Hash_Read64(record + 24);
+    }
+
+    fclose(file);
+
+    sc->matched = xcalloc(sc->oldCount * sizeof(bool) + 1);
+    sc->oldByIDSize = sc->oldCount * 2 + 1;
+    sc->oldByID = xalloc(NULL, sc->oldByIDSize * sizeof(int));
+    memset(sc->oldByID, -1, sc->oldByIDSize * sizeof(int));
+
+    for (i = 0; i < sc->oldCount; i++) {
+	uint64_t idHash = sc->old[i].idHash;
+	int j;
+
+	if (idHash == 0)
+	    continue;
+	for (j = idHash % sc->oldByIDSize; sc->oldByID[j] != -1;
+	     j = (j + 1) % sc->oldByIDSize);
+	sc->oldByID[j] = i;
+    }
+
+    return true;
+}
+
+bool ScrubFile(const String *file)
+{
+    String *path = String_Append(file, &Str_DotScrub, NULL);
+    Scrubbing sc = {file};
+    const char *cFile = String_CString(file);
+    size_t size = kWindow_DefaultSize;
+    bool success = true;
+    int count, i;
+    int fd = -1;
+
+    if (gMaxMemory > 0)
+	size = iMin(size, gMaxMemory / 4);
+
+    if (!Scrub_ReadOld(&sc, path) ||
+	(fd = File_OpenForWindows(file, false)) == -1) {
+	success = false;
+	goto done;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (!gDryRun) {
+	if ((sc.output = Stream_OpenTemp(path, true, false)) == NULL) {
+	    Error("Could not create a temporary file for %s: %s",
+		  String_CString(path), strerror(errno));
+	    success = false;
+	    goto done;
+	}
+	Stream_WriteChars(sc.output, kScrub_Magic, kScrub_HeaderSize);
+    }
+
+    success = ReadFileInWindows(file, fd, size, "scrubbing", ScrubWindow,
+				&sc, &count);
+
+    int gone = sc.oldCount;
+
+    for (i = 0; i < sc.oldCount; i++) {
+	if (sc.matched[i])
+	    gone--;
+    }
+
+    // Messages disappearing just as others turn up may well be the same
+    // ones, changed beyond recognition
+    //
+    bool suspect = success && sc.added > 0 && gone > 0;
+
+    if (success && (!gQuiet || gVerbose)) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (sc.old == NULL)
+	    Note("%s: %d message%s scrubbed for the first time", cFile,
+		 sc.count, sc.count == 1 ? "" : "s");
+	else
+	    Note("%s: %d message%s scrubbed, %d changed, %d new, %d gone",
+		 cFile, sc.count, sc.count == 1 ? "" : "s", sc.changed,
+		 sc.added, gone);
+	gQuiet = oldQuiet;
+    }
+
+    if (suspect)
+	Error("%s: %d message%s gone while %d turned up, keeping %s as it "
+	      "was", cFile, gone, gone == 1 ? "" : "s", sc.added,
+	      String_CString(path));
+
+    // Keep the old checksums around as evidence if anything's changed
+    //
+    if (sc.output != NULL) {
+	if (success && sc.changed == 0 && !suspect) {
+	    if (fflush(sc.output->file) != 0 ||
+		(gSync != kSync_None && fsync(fileno(sc.output->file)) != 0) ||
+		rename(String_CString(sc.output->name),
+		       String_CString(path)) != 0) {
+		Error("Could not write %s: %s", String_CString(path),
+		      strerror(errno));
+		success = false;
+	    } else {
+		sc.output->deleteFileWhenFreed = false;
+	    }
+	}
+	Stream_Free(sc.output, true);
+    }
+
+    if (sc.changed > 0 || suspect)
+	success = false;
+
+  done:
+    if (fd != -1) {
+	close(fd);
+	Mailbox_Unlock(file);
+    }
+    xfree(sc.old);
+    xfree(sc.oldByID);
+    xfree(sc.matched);
+    String_Free(path);
+
+    return success;
+}
+
+/**
+ **  Bursting
+ **
+ **  With --burst=DIR, each message of each mailbox is written to a file
+ **  of its own (without its "From " line) under DIR/<mailbox name>/.
+ **  They're numbered in order, as 0000/000001.eml, 0000/000002.eml and
+ **  so on, or with --burst-names=id named by a hash of their Message-ID
+ **  (or of the whole message, if they don't have one), as 3f/3fa4...eml,
+ **  so that no single directory gets too many of them.  With
+ **  --burst-unescape, ">From " lines are turned back into "From " lines
+ **  (and ">>From " into ">From ", etc).
+ **
+ **  The messages are found by their "From " lines only (like when
+ **  expiring), and are then written by a few threads at once, straight
+ **  from the mapped mailbox (or within the kernel if we can).  Workers
+ **  never allocate memory or print anything; the first problem is
+ **  reported once they're all done.
+ **/
+
+typedef struct {
+    const char *chars;		// The mapped mailbox
+    size_t size;
+    int fd;
+    size_t *starts;		// Where each message starts
+    uint64_t *hashes;		// Name of each message (with --burst-names=id)
+    bool *dups;			// Which hashes were already taken
+    int count;
+    int skip;			// 1 if the first one is IMAP folder data
+    const char *dir;		// DIR/<mailbox name>
+    mode_t mode;
+    int next;			// Next message to write (shared)
+#ifdef USE_THREADS
+    pthread_mutex_t lock;
+#endif
+    int failed;			// First message we couldn't write (or 0)
+    int failedErrno;
+} Bursting;
+
+// Where does the message end (not counting the empty line after it)?
+//
+static size_t Burst_MessageEnd(Bursting *b, int i)
+{
+    size_t end = i + 1 < b->count ? b->starts[i + 1] - 1 : b->size;
+
+    if (i + 1 == b->count && end >= 2 && b->chars[end - 1] == '\n' &&
+	b->chars[end - 2] == '\n')
+	end--;
+
+    return end;
+}
+
+// Where does the message start (after its "From " line)?
+//
+static const char *Burst_MessageBody(Bursting *b, int i, const char *end)
+{
+    const char *start = b->chars + b->starts[i];
+    const char *body = memchr(start, '\n', end - start);
+
+    return body != NULL ? body + 1 : end;
+}
+
+// Hash the Message-ID in the headers in [p, end), or the whole message
+// if it has none
+//
+static uint64_t Burst_NameHash(const char *p, const char *end)
+{
+    const char *start = p;
+    int len = String_Length(&Str_MessageID);
+
+    while (p < end && *p != '\n') {
+	const char *eol = memchr(p, '\n', end - p);
+
+	if (eol == NULL)
+	    eol = end;
+	if (eol - p > len && p[len] == ':' &&
+	    strncasecmp(p, String_Chars(&Str_MessageID), len) == 0) {
+	    const char *id = p + len + 1;
+
+	    // Include any continuation lines
+	    while (eol + 1 < end && (eol[1] == ' ' || eol[1] == '\t')) {
+		const char *next = memchr(eol + 1, '\n', end - eol - 1);
+		eol = next != NULL ? next : end;
+	    }
+	    while (id < eol && isspace(*id))
+		id++;
+	    while (eol > id && isspace(eol[-1]))
+		eol--;
+	    if (eol > id)
+		return Hash64(id, eol - id, 0);
+	    break;
+	}
+	p = eol + 1;
+    }
+
+    return Hash64(start, end - start, 0);
+}
+
+// Write the chars in [p, end) (which are at the same offset in the
+// mailbox) to the file, unescaping ">From " lines if asked to
+//
+static bool Burst_Write(Bursting *b, const char *p, const char *end, int fd)
+{
+    const char *q = p;
+
+    while (gBurstUnescape && q < end &&
+	   (q = memmem(q, end - q, "From ", 5)) != NULL) {
+	const char *gt = q;
+
+	// Only at the start of a line after one or more '>'
+	while (gt > p && gt[-1] == '>')
+	    gt--;
+	if (gt < q && (gt == p || gt[-1] == '\n')) {
+	    if (!File_AppendRange(b->fd, p - b->chars, p, gt - p, fd))
+		return false;
+	    p = gt + 1;
+	}
+	q += 5;
+    }
+
+    return File_AppendRange(b->fd, p - b->chars, p, end - p, fd);
+}
+
+static bool Burst_Message(Bursting *b, int i)
+{
+    const char *end = b->chars + Burst_MessageEnd(b, i);
+    const char *body = Burst_MessageBody(b, i, end);
+    int num = i + 1 - b->skip;
+    char path[PATH_MAX];
+    int dirLen, fd;
+
+    if (gBurstNames == kBurst_ID) {
+	uint64_t hash = b->hashes[i];
+
+	// Later messages with the same Message-ID get their number added
+	//
+	dirLen = snprintf(path, sizeof(path), "%s/%02x", b->dir,
+			  (unsigned int) (hash >> 56));
+	if (b->dups[i])
+	    snprintf(path + dirLen, sizeof(path) - dirLen, "/%016llx-%d.eml",
+		     (unsigned long long) hash, num);
+	else
+	    snprintf(path + dirLen, sizeof(path) - dirLen, "/%016llx.eml",
+		     (unsigned long long) hash);
+    } else {
+	dirLen = snprintf(path, sizeof(path), "%s/%04d", b->dir,
+			  (num - 1) / kBurst_FilesPerDir);
+	snprintf(path + dirLen, sizeof(path) - dirLen, "/%06d.eml", num);
+    }
+
+    while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, b->mode)) == -1) {
+	if (errno == ENOENT) {
+	    // First one in the directory
+	    path[dirLen] = '\0';
+	    if (mkdir(path, b->mode | ((b->mode & 0444) >> 2)) != 0 &&
+		errno != EEXIST)
+		return false;
+	    path[dirLen] = '/';
+	} else {
+	    return false;
+	}
+    }
+
+    bool success = Burst_Write(b, body, end, fd) &&
+	(gSync == kSync_None || fsync(fd) == 0);
+
+    if (close(fd) != 0)
+	success = false;
+
+    return success;
+}
+
+// Write messages until there are no more (or something goes wrong)
+//
+static void *Burst_Run(void *arg)
+{
+    Bursting *b = arg;
+
+    for (;;) {
+	int i, first, last;
+
+#ifdef USE_THREADS
+	pthread_mutex_lock(&b->lock);
+#endif
+	first = b->failed == 0 ? b->next : b->count;
+	last = iMin(first + kBurst_BatchSize, b->count);
+	b->next = last;
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&b->lock);
+#endif
+
+	if (first >= last)
+	    break;
+
+	for (i = first; i < last; i++) {
+	    if (!Burst_Message(b, i)) {
+		int error = errno;
+#ifdef USE_THREADS
+		pthread_mutex_lock(&b->lock);
+#endif
+		if (b->failed == 0 || i + 1 - b->skip < b->failed) {
+		    b->failed = i + 1 - b->skip;
+		    b->failedErrno = error;
 		}
+#ifdef USE_THREADS
+		pthread_mutex_unlock(&b->lock);
+#endif
+		break;
 	    }
+	}
+    }
+
+    return NULL;
+}
+
+bool BurstFile(const String *file)
+{
+    const char *cFile = String_CString(file);
+    const char *name = strrchr(cFile, '/');
+    Bursting b = {NULL};
+    String *dir = NULL;
+    struct stat sbuf;
+    size_t pos, size = 0;
+    bool success = true;
+    int fd;
+
+    if ((fd = File_OpenForWindows(file, false)) == -1)
+	return false;
+
+    if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) {
+	Error("Could not burst %s: Not a regular file", cFile);
+	success = false;
+	goto done;
+    }
+
+    if ((size = sbuf.st_size) == 0)
+	goto done;
+
+    if ((b.chars = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	MAP_FAILED) {
+	Error("Could not map %s: %s", cFile, strerror(errno));
+	b.chars = NULL;
+	success = false;
+	goto done;
+    }
+
+    if (!IsFromSpaceLineAt(b.chars, size, 0)) {
+	Error("Could not burst %s: Doesn't start with a \"From \" line", cFile);
+	success = false;
+	goto done;
+    }
+
+    b.size = size;
+    b.fd = fd;
+    b.mode = sbuf.st_mode & 0777;
+
+    // Find all the messages first
+    //
+    for (pos = 0; pos < size; pos = FindNextMessageStart(b.chars, size, pos)) {
+	if (b.count % kArray_InitialSize == 0)
+	    b.starts = xalloc(b.starts, (b.count + kArray_InitialSize) *
+			      sizeof(size_t));
+	b.starts[b.count++] = pos;
+    }
+
+    // Leave out any IMAP folder data pseudo-message
+    //
+    if (HasIMAPFolderData(b.chars, size))
+	b.skip = b.next = 1;
+
+    // Name them up front, so that it's always the first message with a
+    // given Message-ID that gets the plain name
+    //
+    if (gBurstNames == kBurst_ID) {
+	FingerprintSet seen = {NULL, 0, 0};
+	int i;
+
+	b.hashes = xalloc(NULL, b.count * sizeof(uint64_t));
+	b.dups = xcalloc(b.count * sizeof(bool));
+	for (i = b.skip; i < b.count; i++) {
+	    const char *end = b.chars + Burst_MessageEnd(&b, i);
+
+	    b.hashes[i] = Burst_NameHash(Burst_MessageBody(&b, i, end), end);
+	    b.dups[i] = !FingerprintSet_Add(&seen, b.hashes[i] | 1);
+	}
+	xfree(seen.slots);
+    }
+
+    dir = String_PrintF("%s/%s", String_CString(gBurstDir),
+			name != NULL ? name + 1 : cFile);
+    b.dir = String_CString(dir);
+
+    if (gDryRun) {
+	Note("Dry run mode -- would burst %d message%s from %s into %s/",
+	     b.count - b.skip, b.count - b.skip == 1 ? "" : "s", cFile, b.dir);
+	goto done;
+    }
+
+    if ((mkdir(String_CString(gBurstDir), 0777) != 0 && errno != EEXIST) ||
+	(mkdir(b.dir, b.mode | ((b.mode & 0444) >> 2)) != 0 &&
+	 errno != EEXIST)) {
+	Error("Could not create %s: %s", b.dir, strerror(errno));
+	success = false;
+	goto done;
+    }
+
+    double start = Time_Now();
+
+#ifdef USE_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = iMin(iMin(cpus > 0 ? cpus : 1, kBurst_MaxThreads),
+		       (b.count + kBurst_BatchSize - 1) / kBurst_BatchSize);
+    pthread_t tids[kBurst_MaxThreads];
+    int i, started = 0;
+
+    pthread_mutex_init(&b.lock, NULL);
+    for (i = 1; i < threads; i++) {
+	if (pthread_create(&tids[i], NULL, Burst_Run, &b) != 0)
+	    break;
+	started = i;
+    }
+    Burst_Run(&b);
+    for (i = 1; i <= started; i++)
+	pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&b.lock);
+#else
+    Burst_Run(&b);
+#endif
+
+    if (b.failed != 0) {
+	Error("Could not write message #%d of %s into %s: %s", b.failed,
+	      cFile, b.dir, strerror(b.failedErrno));
+	success = false;
+    } else if (!gQuiet || gVerbose) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	Note("%s: Burst %d message%s into %s/ in %.1fs", cFile,
+	     b.count - b.skip, b.count - b.skip == 1 ? "" : "s", b.dir,
+	     Time_Now() - start);
+	gQuiet = oldQuiet;
+    }
+
+  done:
+    if (b.chars != NULL)
+	munmap((void *) b.chars, size);
+    xfree(b.starts);
+    xfree(b.hashes);
+    xfree(b.dups);
+    String_Free(dir);
+    close(fd);
+    Mailbox_Unlock(file);
+
+    return success;
+}
+
+/**
+ **  Exporting
+ **
+ **  With --export=DIR, the metadata of every message of each mailbox
+ **  (where it is, how big, when it was delivered and sent, who sent it,
+ **  its Message-ID, flags and whatever checking it turned up) is written
+ **  to DIR/<mailbox name>.mfck-export for analyzing elsewhere.  Each
+ **  mailbox is read a window at a time, and a few of them at once by
+ **  threads of their own, which keep any warnings to themselves and
+ **  count them against the messages they're about instead.
+ **
+ **  The export is little-endian and columnar: a 64 byte header, giving
+ **  the magic string, the number of rows (messages) and columns, where
+ **  the string dictionary is and how many strings it holds, the size of
+ **  the mailbox and the number of problems found in all; then a 32 byte
+ **  entry for each column, giving its name, width, type and where it
+ **  starts (always at a multiple of 8); then the columns themselves,
+ **  each a plain array of one fixed-width value per message; and last
+ **  the dictionary, which is an array of count + 1 32 bit offsets into
+ **  the string bytes following it.  String columns hold indexes into
+ **  the dictionary, where 0 is the empty string (for missing values).
+ **  Dates are seconds since the epoch (UTC), or 0 if unknown.
+ **/
+
+typedef enum {
+    kExport_Unsigned = 0,
+    kExport_Signed,
+    kExport_String,		// Dictionary index
+} ExportType;
+
+typedef enum {
+    kExport_Offset = 0,
+    kExport_Length,
+    kExport_Delivered,
+    kExport_Sent,
+    kExport_Sender,
+    kExport_MessageID,
+    kExport_Flags,
+    kExport_Problems,
+    kExport_Problem,
+    kExport_ColumnCount
+} ExportColumnIndex;
+
+// What Status: and X-Status: say about the message
+//
+typedef enum {
+    kExport_Seen = 1 << 0,	// R
+    kExport_Old = 1 << 1,	// O
+    kExport_Answered = 1 << 2,	// A
+    kExport_Flagged = 1 << 3,	// F
+    kExport_Deleted = 1 << 4,	// D
+    kExport_Draft = 1 << 5,	// T
+} ExportFlag;
+
+static const struct {
+    const char *name;
+    int width;
+    ExportType type;
+} kExportColumns[kExport_ColumnCount] = {
+    {"offset", 8, kExport_Unsigned},
+    {"length", 4, kExport_Unsigned},
+    {"delivered", 8, kExport_Signed},
+    {"sent", 8, kExport_Signed},
+    {"sender", 4, kExport_String},
+    {"message_id", 4, kExport_String},
+    {"flags", 4, kExport_Unsigned},
+    {"problems", 4, kExport_Unsigned},
+    {"problem", 4, kExport_String},	// The first one's kind (kProblemNames)
+};
+
+typedef struct {
+    char *chars;		// All the strings, back to back
+    size_t length;
+    size_t size;
+    uint32_t *offsets;		// Where each one starts (and the last ends)
+    int count;
+    int capacity;
+    uint32_t *slots;		// Hash table of indexes (0 if free)
+    int slotCount;
+} ExportDictionary;
+
+typedef struct {
+    const String *file;
+    String *path;		// DIR/<mailbox name>.mfck-export
+    int fd;
+    off_t size;
+    mode_t mode;		// ... of the mailbox, for the export too
+    size_t window;
+    bool strict;
+    bool mime;
+    unsigned char *columns[kExport_ColumnCount];
+    int rows;
+    int capacity;
+    ExportDictionary dict;
+    int64_t problems;
+    MfckContext context;	// Collects the warnings
+    int count;			// Messages read
+    bool success;
+    double start;
+#ifdef USE_THREADS
+    pthread_t thread;
+    bool busy;
+    bool done;
+    pthread_mutex_t *lock;
+    pthread_cond_t *finished;
+#endif
+} Exporting;
+
+static void Dictionary_Init(ExportDictionary *dict)
+{
+    memset(dict, 0, sizeof(*dict));
+    dict->capacity = kExport_InitialStrings;
+    dict->offsets = xalloc(NULL, (dict->capacity + 1) * sizeof(uint32_t));
+    dict->offsets[0] = 0;
+    dict->slotCount = 2 * kExport_InitialStrings;
+    dict->slots = xcalloc(dict->slotCount * sizeof(uint32_t));
+
+    // Index 0 is the empty string
+    dict->offsets[++dict->count] = 0;
+}
+
+static void Dictionary_Free(ExportDictionary *dict)
+{
+    xfree(dict->chars);
+    xfree(dict->offsets);
+    xfree(dict->slots);
+}
+
+static uint32_t *Dictionary_Slot(ExportDictionary *dict, const char *chars,
+				 int len, uint64_t hash)
+{
+    int i = hash % dict->slotCount;
+
+    while (dict->slots[i] != 0) {
+	uint32_t ix = dict->slots[i];
+	uint32_t b = dict->offsets[ix], e = dict->offsets[ix + 1];
+
+	if (e - b == len && memcmp(dict->chars + b, chars, len) == 0)
+	    break;
+	i = (i + 1) % dict->slotCount;
+    }
+
+    return &dict->slots[i];
+}
+
+// Return the index of the string, adding it if it's new
+//
+static uint32_t Dictionary_FindOrAdd(ExportDictionary *dict,
+				     const char *chars, int len)
+{
+    uint64_t hash = Hash64(chars, len, 0);
+    uint32_t *pSlot;
+    int i;
+
+    if (len == 0)
+	return 0;
 
-	    if (same &&
-		!String_IsEqual(Message_Body(m), Message_Body(n), true)) {
-		Note("Messages %s and %s have the same Message-ID\n"
-		     "%s, but different bodies",
-		     String_CString(m->tag),
-		     String_CString(n->tag),
-		     String_PrettyCString(m->cachedID)); 
-		same = false;
-	    }
+    if (*(pSlot = Dictionary_Slot(dict, chars, len, hash)) != 0)
+	return *pSlot;
 
-	    if (same) {
-		Note("Messages %s and %s with Message-ID\n"
-		     " %s are the same, deleting the latter",
-		     String_CString(m->tag),
-		     String_CString(n->tag),
-		     String_PrettyCString(m->cachedID)); 
-		Message_SetDeleted(n, true);
-		allDups++;
+    if (dict->count * 2 >= dict->slotCount) {
+	uint32_t *old = dict->slots;
+	int oldCount = dict->slotCount;
 
-	    } else if (gInteractive) {
-		int dups = ChooseMessageToDelete(m, n, &autoChoice);
-		if (dups < 0)
-		    break;
-		allDups += dups;
+	dict->slotCount *= 2;
+	dict->slots = xcalloc(dict->slotCount * sizeof(uint32_t));
+	for (i = 0; i < oldCount; i++) {
+	    if (old[i] != 0) {
+		uint32_t b = dict->offsets[old[i]];
+		uint32_t e = dict->offsets[old[i] + 1];
+
+		*Dictionary_Slot(dict, dict->chars + b, e - b,
+				 Hash64(dict->chars + b, e - b, 0)) = old[i];
 	    }
 	}
+	xfree(old);
+	pSlot = Dictionary_Slot(dict, chars, len, hash);
     }
 
-    Note("%s %d duplicate%s",
-	 allDups == 0 ? "Found" : "Deleted",
-	 allDups, allDups == 1 ? "" : "s");
+    if (dict->count == dict->capacity) {
+	dict->capacity *= 2;
+	dict->offsets = xalloc(dict->offsets,
+			       (dict->capacity + 1) * sizeof(uint32_t));
+    }
+    if (dict->length + len > dict->size) {
+	dict->size = dict->size > 0 ? dict->size * 2 : kExport_InitialBytes;
+	while (dict->length + len > dict->size)
+	    dict->size *= 2;
+	dict->chars = xalloc(dict->chars, dict->size);
+    }
 
-    Array_Free(mary);
+    memcpy(dict->chars + dict->length, chars, len);
+    dict->length += len;
+    dict->offsets[dict->count + 1] = dict->length;
+    *pSlot = dict->count;
+
+    return dict->count++;
 }
 
-/**
- **  Command Processing
- **/
+static inline uint32_t Dictionary_Add(ExportDictionary *dict,
+				      const String *str)
+{
+    return str != NULL ?
+	Dictionary_FindOrAdd(dict, String_Chars(str), String_Length(str)) : 0;
+}
 
-typedef enum {
-    kCmd_None = 0,
-    kCmd_Check,
-    kCmd_Delete,
-    kCmd_DeleteAndShowNext,
-    kCmd_Diff,
-    kCmd_Edit,
-    kCmd_Exit,
-    kCmd_Find,
-    kCmd_Help,
-    kCmd_Join,
-    kCmd_List,
-    kCmd_ListNext,
-    kCmd_ListPrevious,
-    kCmd_Repair,
-    kCmd_Run,
-    kCmd_Save,
-    kCmd_Show,
-    kCmd_ShowPrevious,
-    kCmd_ShowNext,
-    kCmd_Split,
-    kCmd_Strict,
-    kCmd_Undelete,
-    kCmd_Unique,
-    kCmd_Write,
-    kCmd_WriteAndExit,
-} Command;
+static uint32_t Export_Flags(Message *msg)
+{
+    static const char letters[] = "ROAFDT";
+    const String *keys[] = {&Str_Status, &Str_XStatus};
+    uint32_t flags = 0;
+    int i, j;
 
-typedef struct {
-    const char *cname;
-    const char *cargs;
-    Command type;
-    const char *cdesc;
-    String *name;
-} CommandTable;
+    for (i = 0; i < 2; i++) {
+	String *value = Header_Get(msg->headers, keys[i]);
 
-// Command specification syntax:
+	if (value == NULL)
+	    continue;
+	for (j = 0; j < String_Length(value); j++) {
+	    const char *p = strchr(letters, String_Chars(value)[j]);
+
+	    if (p != NULL && *p != '\0')
+		flags |= 1 << (p - letters);
+	}
+    }
+
+    return flags;
+}
+
+static inline void Export_Put(Exporting *ex, ExportColumnIndex col,
+			      uint64_t value)
+{
+    int width = kExportColumns[col].width;
+
+    Scrub_Put(ex->columns[col] + (size_t) ex->rows * width, value, width);
+}
+
+static void Export_Message(Exporting *ex, Message *msg, off_t offset)
+{
+    String *value;
+    String key;
+    int i;
+
+    if (ex->rows == ex->capacity) {
+	ex->capacity = ex->capacity > 0 ? ex->capacity * 2 :
+	    kExport_InitialRows;
+	for (i = 0; i < kExport_ColumnCount; i++)
+	    ex->columns[i] = xalloc(ex->columns[i], (size_t) ex->capacity *
+				    kExportColumns[i].width);
+    }
+
+    Export_Put(ex, kExport_Offset, offset);
+    Export_Put(ex, kExport_Length, String_Length(msg->data));
+    Export_Put(ex, kExport_Delivered, Message_DeliveryTime(msg));
+    Export_Put(ex, kExport_Sent, Message_SentTime(msg));
+
+    if ((value = Header_Get(msg->headers, &Str_From)) == NULL)
+	value = msg->envSender;
+    if (value != NULL)
+	Stats_Key(value, &key);
+    Export_Put(ex, kExport_Sender,
+	       value != NULL ? Dictionary_Add(&ex->dict, &key) : 0);
+
+    if ((value = Header_Get(msg->headers, &Str_MessageID)) != NULL)
+	Stats_Key(value, &key);
+    Export_Put(ex, kExport_MessageID,
+	       value != NULL ? Dictionary_Add(&ex->dict, &key) : 0);
+
+    Export_Put(ex, kExport_Flags, Export_Flags(msg));
+    Export_Put(ex, kExport_Problems, 0);
+    Export_Put(ex, kExport_Problem, 0);
+
+    ex->rows++;
+}
+
+// Count the problem against the message num it's about (if it's one of
+// the ones read so far), remembering the kind of the first one
 //
-// <cmd> ::= <name>['|'<name>]... [<arg>...] ['#' <description>]
-// <arg> ::= 'm' | 'f'
+static void Export_Problem(Exporting *ex, ProblemKind kind, int num)
+{
+    ex->problems++;
 
-CommandTable kCommandTable[] = {
-    // Note: The order of the command table is significant.  If a prefix
-    // matches multiple commands, the first one found in this table will
-    // be selected.
+    if (num < 1 || num > ex->rows)
+	return;
+
+    unsigned char *count = ex->columns[kExport_Problems] + (num - 1) * 4;
+    uint32_t n = Hash_Read32(count);
+    const char *name = kProblemNames[kind];
+
+    Scrub_Put(count, n + 1, 4);
+    if (n == 0)
+	Scrub_Put(ex->columns[kExport_Problem] + (num - 1) * 4,
+		  Dictionary_FindOrAdd(&ex->dict, name, strlen(name)), 4);
+}
+
+static void Export_Window(Window *win, Exporting *ex)
+{
+    Array *problems = ex->context.problems;
+    Message *msg;
+    int i;
+
+    CheckMailbox(win->mbox, ex->strict, false);
+
+    for (msg = Mailbox_Root(win->mbox); msg != NULL; msg = msg->next)
+	Export_Message(ex, msg,
+		       win->offset + (String_Chars(msg->data) - win->chars));
+
+    // Messages are numbered from the start of the mailbox, so they're
+    // rows num - 1
     //
-    // Don't make help strings be longer than this --------->
+    for (i = 0; i < Array_Count(problems); i++)
+	Export_Problem(ex, Context_ProblemKind(&ex->context, i),
+		       Context_ProblemMessage(&ex->context, i));
+    Array_Reset(problems);
+    Array_Reset(ex->context.kinds);
+    Array_Reset(ex->context.messages);
+}
+
+static bool Export_WriteAll(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+	ssize_t count = write(fd, p, len);
+
+	if (count < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	p += count;
+	len -= count;
+    }
+
+    return true;
+}
+
+// Write it all out to a temporary file and then move it into place
+//
+static bool Export_Write(Exporting *ex)
+{
+    const char *cPath = String_CString(ex->path);
+    unsigned char header[kExport_HeaderSize] = {0};
+    unsigned char entries[kExport_ColumnCount][kExport_EntrySize];
+    static const unsigned char padding[8] = {0};
+    ExportDictionary *dict = &ex->dict;
+    uint64_t offset;
+    int len = String_Length(ex->path);
+    char tmpPath[len + 1 + 6 + 1];
+    int i, fd;
+
+    memcpy(tmpPath, cPath, len);
+    strcpy(tmpPath + len, "-XXXXXX");
+    if ((fd = mkstemp(tmpPath)) == -1) {
+	Error("Could not create a temporary file for %s: %s", cPath,
+	      strerror(errno));
+	return false;
+    }
+
+    // Lay out the columns
     //
-    {"+",	NULL,		kCmd_ShowNext,
-     "go to the next message and display it"},
-    {"-",	NULL,		kCmd_ShowPrevious,
-     "go to the previous message and display it"},
-    {"check",	"[strict]",	kCmd_Check,
-     "check the mailbox' internal consistency"},
-    {"delete",	"[<msgs>]",	kCmd_Delete,
-     "mark one or more messages as deleted"},
-    {"diff",	"<msg1> <msg2>", kCmd_Diff,
-     "compare two messages and show the differences"},
-    {"dp",	NULL,		kCmd_DeleteAndShowNext,
-     "delete the current message, then show the next message"},
-    {"edit",	"[<msg>]",	kCmd_Edit,
-     "edit the specified message using a file-based editor"},
-    {"exit",	NULL,		kCmd_WriteAndExit,
-     "save any changes, then leave the mailbox"},
-    {"find",	"[<header>:] <string>",	kCmd_Find,
-     "find any messages containing the given string"},
-    {"headers",	"[<msg>]",	kCmd_List,
-     "list a page full of message descriptions"},
-    {"list",	"[<msg>]",	kCmd_List,
-     "list a page full of message descriptions"},
-    {"help",	"[<cmd>]",	kCmd_Help,
-     "get help on a specific command or all commands"},
-    {"join",	"<msgs>",	kCmd_Join,
-     "join messages by replacing them with a single message"},
-    {"more",	"[<msgs>]",	kCmd_Show,
-     "display the contents of the given message(s)"},
-    {"next",	NULL,		kCmd_ShowNext,
-     "go to the next message and display it"},
-    {"previous", NULL,		kCmd_ShowPrevious,
-     "go to the previous message and display it"},
-    {"print",	"[<msgs>]",	kCmd_Show,
-     "display the contents of the given message(s)"},
-    {"quit",	NULL,		kCmd_Exit,
-     "leave the mailbox without saving any changes"},
-    {"repair",	"[strict]",	kCmd_Repair,
-     "check the mailbox' internal state and repair if needed"},
-    {"run",	"[<msgs>] <cmd> [<args>]", kCmd_Run,
-     "execute the command repeatedly with each of the messages as input"},
-    {"save",	"[<msgs>] <file>", kCmd_Save,
-     "save the messages to the given file"},
-    {"split",	"[<msgs>]",	kCmd_Split,
-     "look for 'From ' lines in the messages and split them"},
-    {"strict", "[<on/off>]", kCmd_Strict,
-     "set/show 'strict' mode when checking mailboxes"},
-    {"undelete", "[<msgs>]",	kCmd_Undelete,
-     "undelete one or more messages"},
-    {"unique",	NULL,		kCmd_Unique,
-     "unique the messages in the mailbox by removing dups"},
-#if 0
-    {"write",	"[<file>]",	kCmd_Write,
-     "write the mailbox back to its own file or the given file"},
-#endif
-    {"xit",	NULL,		kCmd_Exit,
-     "leave the mailbox without saving any changes"},
-    {"z",	NULL,		kCmd_ListNext,
-     "show the next page of message descriptions"},
-    {"z-",	NULL,		kCmd_ListPrevious,
-     "show the previous page of message descriptions"},
-    {"?",	NULL,		kCmd_Help,
-     "get help on a specific command or all commands"},
-    {NULL}
-};
+    offset = kExport_HeaderSize + sizeof(entries);
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < kExport_ColumnCount; i++) {
+	strncpy((char *) entries[i], kExportColumns[i].name, 16);
+	Scrub_Put(entries[i] + 16, kExportColumns[i].width, 4);
+	Scrub_Put(entries[i] + 20, kExportColumns[i].type, 4);
+	Scrub_Put(entries[i] + 24, offset, 8);
+	offset += ((uint64_t) ex->rows * kExportColumns[i].width + 7) & ~7;
+    }
 
-String *NextArg(int *pIndex, Array *args, bool required)
+    memcpy(header, kExport_Magic, 16);
+    Scrub_Put(header + 16, ex->rows, 8);
+    Scrub_Put(header + 24, kExport_ColumnCount, 4);
+    Scrub_Put(header + 32, offset, 8);
+    Scrub_Put(header + 40, dict->count, 8);
+    Scrub_Put(header + 48, ex->size, 8);
+    Scrub_Put(header + 56, ex->problems, 8);
+
+    for (i = 0; i <= dict->count; i++)
+	Scrub_Put((unsigned char *) &dict->offsets[i], dict->offsets[i], 4);
+
+    bool success = fchmod(fd, ex->mode) == 0 &&
+	Export_WriteAll(fd, header, sizeof(header)) &&
+	Export_WriteAll(fd, entries, sizeof(entries));
+
+    for (i = 0; success && i < kExport_ColumnCount; i++) {
+	size_t bytes = (size_t) ex->rows * kExportColumns[i].width;
+
+	success = Export_WriteAll(fd, ex->columns[i], bytes) &&
+	    Export_WriteAll(fd, padding, -bytes & 7);
+    }
+
+    success = success &&
+	Export_WriteAll(fd, dict->offsets,
+			(dict->count + 1) * sizeof(uint32_t)) &&
+	Export_WriteAll(fd, dict->chars, dict->length) &&
+	(gSync == kSync_None || fsync(fd) == 0);
+
+    if (close(fd) != 0)
+	success = false;
+    if (success && rename(tmpPath, cPath) != 0)
+	success = false;
+
+    if (!success) {
+	Error("Could not write %s: %s", cPath, strerror(errno));
+	unlink(tmpPath);
+    }
+
+    return success;
+}
+
+// Read the mailbox and write out the export (which may be done by a
+// thread of its own)
+//
+static void *Export_Run(void *arg)
 {
-    if (*pIndex < Array_Count(args))
-	return Array_GetAt(args, (*pIndex)++);
-    if (required)
-	Error("Missing argument");
+    Exporting *ex = arg;
+    jmp_buf *savedReentry = gFatalReentry;
+    jmp_buf reentry;
+    WindowReader reader;
+    Window win;
+
+    gContext = &ex->context;
+    gStrict = ex->strict;
+    gCheckMIME = ex->mime;
+
+    // Anything fatal (like running out of memory) only ends this export,
+    // and is left in ex->context.error for Export_Finish to report
+    //
+    gFatalReentry = &reentry;
+    if (setjmp(reentry) == 0) {
+	WindowReader_Init(&reader, ex->file, ex->fd, ex->window, "exporting");
+
+	while (WindowReader_Next(&reader, &win))
+	    Export_Window(&win, ex);
+
+	ex->count = WindowReader_Finish(&reader);
+	ex->success = !reader.failed && (gDryRun || Export_Write(ex));
+    } else {
+	ex->success = false;
+    }
+
+    gFatalReentry = savedReentry;
+    gContext = NULL;
+
+#ifdef USE_THREADS
+    if (ex->lock != NULL) {
+	pthread_mutex_lock(ex->lock);
+	ex->done = true;
+	pthread_cond_signal(ex->finished);
+	pthread_mutex_unlock(ex->lock);
+    }
+#endif
+
     return NULL;
 }
 
-bool NoNextArg(int *pIndex, Array *args)
+// Lock and open the mailbox, ready to export it
+//
+static bool Export_Start(Exporting *ex, const String *file, size_t window)
+{
+    const char *cFile = String_CString(file);
+    const char *name = strrchr(cFile, '/');
+    struct stat sbuf;
+
+    memset(ex, 0, sizeof(*ex));
+
+    if ((ex->fd = File_OpenForWindows(file, false)) == -1)
+	return false;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    (void) posix_fadvise(ex->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    ex->file = file;
+    ex->path = String_PrintF("%s/%s.mfck-export", String_CString(gExportDir),
+			     name != NULL ? name + 1 : cFile);
+    if (fstat(ex->fd, &sbuf) == 0) {
+	ex->size = sbuf.st_size;
+	ex->mode = sbuf.st_mode & 0666;
+    } else {
+	ex->mode = 0600;
+    }
+    ex->window = window;
+    ex->strict = gStrict;
+    ex->mime = gCheckMIME;
+    ex->context.problems = Array_New(0, (Free *) String_Free);
+    ex->context.kinds = Array_New(0, NULL);
+    ex->context.messages = Array_New(0, NULL);
+    ex->start = Time_Now();
+    Dictionary_Init(&ex->dict);
+
+    return true;
+}
+
+// Report on how it went and clean up after it (in the main thread)
+//
+static bool Export_Finish(Exporting *ex)
+{
+    const char *cFile = String_CString(ex->file);
+    int i;
+
+    close(ex->fd);
+    Mailbox_Unlock(ex->file);
+
+    if (ex->context.error != NULL) {
+	Error("%s", String_CString(ex->context.error));
+    } else if (!ex->success) {
+	Error("Could not export %s", cFile);
+    } else if (!gQuiet || gVerbose) {
+	bool oldQuiet = gQuiet;
+
+	gQuiet = false;
+	if (gDryRun)
+	    Note("Dry run mode -- not writing %s (%d message%s, %lld "
+		 "problem%s)", String_CString(ex->path), ex->count,
+		 ex->count == 1 ? "" : "s", (long long) ex->problems,
+		 ex->problems == 1 ? "" : "s");
+	else
+	    Note("%s: Exported %d message%s (%lld problem%s) to %s in %.1fs",
+		 cFile, ex->count, ex->count == 1 ? "" : "s",
+		 (long long) ex->problems, ex->problems == 1 ? "" : "s",
+		 String_CString(ex->path), Time_Now() - ex->start);
+	gQuiet = oldQuiet;
+    }
+
+    for (i = 0; i < kExport_ColumnCount; i++)
+	xfree(ex->columns[i]);
+    Dictionary_Free(&ex->dict);
+    Array_Free(ex->context.problems);
+    Array_Free(ex->context.kinds);
+    Array_Free(ex->context.messages);
+    String_Free(ex->context.error);
+    String_Free(ex->path);
+
+    return ex->success && ex->context.error == NULL;
+}
+
+bool ExportFiles(Array *files)
 {
-    if (*pIndex < Array_Count(args)) {
-	Error("Too many arguments");
+    size_t window = kWindow_DefaultSize;
+    int errors = 0;
+    int i;
+
+    if (!gDryRun && mkdir(String_CString(gExportDir), 0777) != 0 &&
+	errno != EEXIST) {
+	Error("Could not create %s: %s", String_CString(gExportDir),
+	      strerror(errno));
 	return false;
     }
 
-    return true;
-}
+#ifdef USE_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = iMin(iMin(cpus > 0 ? cpus : 1, kExport_MaxThreads),
+		       Array_Count(files));
+    Exporting jobs[kExport_MaxThreads];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+    int busy = 0;
+    int j;
 
-int String_ToMessageNumber(const String *str, Mailbox *mbox)
-{
-    if (String_IsEqual(str, &Str_Dollar, true))
-	return Mailbox_Count(mbox);
+    if (gMaxMemory > 0 && threads > 0)
+	window = iMin(window, gMaxMemory / 4 / threads);
 
-    return String_ToInteger(str, -1);
-}
+    for (j = 0; j < threads; j++)
+	jobs[j].busy = false;
 
-MessageSet *MessageSetArg(const String *arg, int last)
-{
-    Parser parser;
-    MessageSet *set = NULL;
+    // Hand each mailbox to the next free thread, catching up with those
+    // that are done whenever there's none
+    //
+    for (i = 0; i <= Array_Count(files); i++) {
+	pthread_mutex_lock(&lock);
+	while (busy == threads || (i == Array_Count(files) && busy > 0)) {
+	    for (j = 0; j < threads; j++) {
+		if (jobs[j].busy && jobs[j].done)
+		    break;
+	    }
+	    if (j == threads) {
+		pthread_cond_wait(&finished, &lock);
+		continue;
+	    }
+	    pthread_mutex_unlock(&lock);
+	    pthread_join(jobs[j].thread, NULL);
+	    if (!Export_Finish(&jobs[j]))
+		errors++;
+	    jobs[j].busy = false;
+	    busy--;
+	    pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
 
-    if (arg == NULL)
-	return NULL;
+	if (i == Array_Count(files))
+	    break;
 
-    Parser_Set(&parser, arg);
-    if (!Parse_MessageSet(&parser, &set, last) || !Parser_AtEnd(&parser)) {
-	Error("Malformed message set: %s", String_CString(arg));
-	MessageSet_Free(set);
-	return NULL;
-    }
+	for (j = 0; jobs[j].busy; j++);
 
-    return set;
-}
+	if (!Export_Start(&jobs[j], Array_GetAt(files, i), window)) {
+	    errors++;
+	    continue;
+	}
 
-MessageSet *NextMessageSetArgs(int *pIndex, Array *args, int leave,
-			       int defNum, int maxNum)
-{
-    MessageSet *set = NULL;
-    int count = Array_Count(args) - *pIndex - leave;
+	sigset_t all, saved;
+
+	jobs[j].lock = &lock;
+	jobs[j].finished = &finished;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	if (pthread_create(&jobs[j].thread, NULL, Export_Run,
+			   &jobs[j]) != 0) {
+	    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	    jobs[j].lock = NULL;
+	    Export_Run(&jobs[j]);
+	    if (!Export_Finish(&jobs[j]))
+		errors++;
+	    continue;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	jobs[j].busy = true;
+	busy++;
+    }
+#else
+    Exporting ex;
 
-    while (count-- > 0) {
-	MessageSet *set2 = MessageSetArg(NextArg(pIndex, args, true), maxNum);
-	if (set2 == NULL) {
-	    MessageSet_Free(set);
-	    return NULL;
+    if (gMaxMemory > 0)
+	window = iMin(window, gMaxMemory / 4);
+
+    for (i = 0; i < Array_Count(files); i++) {
+	if (!Export_Start(&ex, Array_GetAt(files, i), window)) {
+	    errors++;
+	    continue;
 	}
-	set = MessageSet_Append(set, set2);
+	Export_Run(&ex);
+	if (!Export_Finish(&ex))
+	    errors++;
     }
+#endif
 
-    if (set == NULL)
-	set = MessageSet_Make(defNum, defNum, NULL);
+    return errors == 0;
+}
 
-    return set;
+/**
+ **  Filtering
+ **
+ **  With --filter, we'll read a single message from stdin, tidy it up,
+ **  and write it to stdout, ready to be appended to a mailbox by whatever
+ **  comes next in the delivery chain.  Regular files are mapped rather
+ **  than read, and the body is written straight from there, but a piped
+ **  message has to be read in full to know what its Content-Length is.
+ **/
+
+// Return the start of the next line starting with "From " or NULL
+//
+static const char *FindFromSpaceLine(const char *p, const char *end)
+{
+    for (; p + 5 <= end; p++) {
+	if (memcmp(p, "From ", 5) == 0)
+	    return p;
+	if ((p = memchr(p, '\n', end - p)) == NULL)
+	    break;
+    }
+
+    return NULL;
 }
 
-#if 0
-int NextNumArg(int *pIndex, Array *args, bool required)
+// Return the length of the body once any "From " lines are escaped
+//
+int Filter_BodyLength(const String *body)
 {
-    String *arg = NextCmdArg(pIndex, args, required);
-    int num = -1;
+    const char *p = String_Chars(body);
+    const char *end = p + String_Length(body);
+    int length = String_Length(body);
 
-    if (arg != NULL) {
-	num = String_ToInteger(arg, -1);
-	if (num == -1)
-	    Error("Invalid message number");
+    while ((p = FindFromSpaceLine(p, end)) != NULL) {
+	length++;
+	p++;
     }
 
-    return num;
+    return length;
 }
-#endif
 
-bool TrueString(const String *str, bool def)
+void Filter_WriteBody(Stream *output, const String *body)
 {
-    static const char *trueStrings[] = {
-	"y", "yes", "t", "true", "on", NULL
-    };
-    const char **tsp;
-    const char *cstr = String_CString(str);
-
-    if (cstr == NULL)
-	return def;
+    const char *p = String_Chars(body);
+    const char *end = p + String_Length(body);
+    const char *from;
 
-    for (tsp = trueStrings; *tsp != NULL; tsp++) {
-	if (strcasecmp(*tsp, cstr) == 0)
-	    return true;
+    while ((from = FindFromSpaceLine(p, end)) != NULL) {
+	Stream_WriteChars(output, p, from - p);
+	Stream_WriteChar(output, '>');
+	Stream_WriteChars(output, from, 1);
+	p = from + 1;
     }
 
-    return false;
+    Stream_WriteChars(output, p, end - p);
 }
 
-Message *GetMessageByNumber(Mailbox *mbox, int cur)
+int Filter_Run(void)
 {
+    static char buf[kFilter_BufferSize];
+    Stream *input = Stream_Open(NULL, false, true);
+    Mailbox *mbox = New(Mailbox);
     Message *msg = NULL;
-    int i;
+    String *data, *value;
+    Parser parser;
 
-    if (cur > 0)
-	for (msg = Mailbox_Root(mbox), i = 1; msg != NULL && i < cur;
-	     msg = msg->next, i++);
+    // Anything but the message would be in the way on stdout
+    gQuiet = true;
+    gExpectEnvelope = false;
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
 
-    if (msg == NULL)
-	Error("Message %d does not exist", cur);
+    if (!Stream_ReadContents(input, &data))
+	Fatal(EX_IOERR, "Could not read message: %s", strerror(errno));
 
-    return msg;
-}
+    mbox->data = data;
+    Parser_Set(&parser, data);
 
-void InitCommandTable(CommandTable *table)
-{
-    CommandTable *ct;
+    // Better to deliver it as is than not at all
+    //
+    if (!Parse_Message(&parser, mbox, true, &msg)) {
+	Error("Could not parse message, passing it on unchanged");
+	Stream_WriteString(gStdOut, data);
+	Stream_Close(gStdOut);
+	return EX_OK;
+    }
 
-    // Only do this once
-    if (table->name != NULL)
-	return;
+    mbox->root = msg;
 
-    for (ct = table; ct->cname != NULL; ct++) {
-	ct->name = String_FromCString(ct->cname, false);
+    value = Header_Get(msg->headers, &Str_MessageID);
+    if (value == NULL || String_IsEmpty(value))
+	Header_Set(msg->headers, &Str_MessageID,
+		   Message_SynthesizeMessageID(msg));
+
+    if (Header_Get(msg->headers, &Str_Date) == NULL) {
+	if (msg->envSender != NULL) {
+	    value = String_RFC822Date(&msg->envDate, false);
+	} else {
+	    time_t now = time(NULL);
+	    struct tm tm = *localtime(&now);
+
+	    tm.tm_year += 1900;
+	    value = String_RFC822Date(&tm, true);
+	}
+	Header_Set(msg->headers, &Str_Date, value);
     }
+
+    Header_Set(msg->headers, &Str_ContentLength,
+	       String_PrintF("%d", Filter_BodyLength(msg->body)));
+
+    if (msg->envelope != NULL)
+	Stream_WriteString(gStdOut, msg->envelope);
+    Stream_WriteHeaders(gStdOut, msg->headers);
+    Stream_WriteNewline(gStdOut);
+    Filter_WriteBody(gStdOut, msg->body);
+    Stream_Close(gStdOut);
+
+    return EX_OK;
 }
 
-void ShowHelp(Stream *output, String *cmd)
-{
-    CommandTable *ct;
+/**
+ **  Watching
+ **
+ **  With --watch, we'll keep running and check mailboxes as they change.
+ **  Mail is normally only ever appended to a mailbox, so we remember how
+ **  far we've checked each one and only look at what's been added since.
+ **  Watches are kept on the mailboxes' directories rather than on each
+ **  mailbox (spools can be big), and checks of a mailbox are spaced out
+ **  so that a burst of deliveries will only cost one check.
+ **/
 
-    if (cmd == NULL) {
-	// Non-specific help
-	//
-	int pos = 3;
+#ifdef __linux__
 
-	Stream_PrintF(output, " Please enter one of the following commands:\n"
-		      "   ");
-	for (ct = kCommandTable; ct->name != NULL; ct++) {
-	    if (ct != kCommandTable) {
-		Stream_PrintF(output, ", ");
-		pos += 2;
-	    }
-	    if (pos + String_Length(ct->name) >= gPageWidth) {
-		Stream_PrintF(output, "\n   ");
-		pos = 3;
-	    }
-	    Stream_WriteString(output, ct->name);
-	    pos += String_Length(ct->name);
-	}
-	Stream_PrintF(output, "\n\n Enter \"help <cmd>\" for more "
-		      "information about a specific command or\n "
-		      "\"help all\" for all commands.\n");
+typedef enum {
+    kWatch_OK = 0,
+    kWatch_Problems,
+    kWatch_Missing,
+    kWatch_Error,
+} WatchState;
+
+static const char *kWatchStateNames[] = {
+    "ok", "problems", "missing", "error"
+};
 
-    } else {
-	bool isAll = String_IsEqual(cmd, &Str_All, false);
-	int leftWidth = 0;
+typedef struct {
+    String *path;
+    WatchState state;
+    bool pending;		// Changed since last checked
+    bool discovered;		// Showed up while watching
+    time_t checked;		// When last checked
+    ino_t inode;
+    off_t verified;		// How far we've checked
+    int messages;		// # messages up to there
+    int problems;		// # problems found up to there
+    off_t markOffset;		// Where & what the last bytes checked were,
+    int markLength;		// to tell if the mailbox has been rewritten
+    md5_byte_t mark[16];
+    off_t unfinished;		// Size when it last seemed mid-delivery
+} WatchedMailbox;
 
-	Stream_PrintF(output, " These commands are available:\n");
-	for (ct = kCommandTable; ct->name != NULL; ct++) {
-	    int width = 1 + String_Length(ct->name) + 1 + 1;
-	    if (ct->cargs != NULL)
-		width += strlen(ct->cargs);
-	    if (leftWidth < width)
-		leftWidth = width;
-	}
+typedef struct {
+    int wd;			// inotify watch descriptor
+    String *path;
+    bool bare;			// Mailbox paths here have no directory part
+    bool discover;		// Pick up any new mailboxes showing up here
+} WatchedDir;
 
-	for (ct = kCommandTable; ct->name != NULL; ct++) {
-	    if (isAll || String_IsEqual(cmd, ct->name, false)) {
-		int width = 1 + String_Length(ct->name) + 1 + 1;
-		if (ct->cargs != NULL)
-		    width += strlen(ct->cargs);
+static Array *gWatchedMailboxes;	// Sorted by path
+static Array *gWatchedDirs;
 
-		Stream_PrintF(output, " %s %s %*s-- %s\n",
-			      ct->cname, ct->cargs != NULL ? ct->cargs : "",
-			      leftWidth - width, "",
-			      ct->cdesc);
-	    }
+void WatchedMailbox_Free(WatchedMailbox *wm)
+{
+    String_Free(wm->path);
+    xfree(wm);
+}
+
+void WatchedDir_Free(WatchedDir *wd)
+{
+    String_Free(wd->path);
+    xfree(wd);
+}
+
+// Return the index of the mailbox with the given path, or where it
+// would go if we're not watching it
+//
+static int FindWatchedMailbox(const String *path, bool *pFound)
+{
+    int lo = 0, hi = Array_Count(gWatchedMailboxes);
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	WatchedMailbox *wm = Array_GetAt(gWatchedMailboxes, mid);
+	int cmp = String_Compare(path, wm->path, true);
+
+	if (cmp == 0) {
+	    *pFound = true;
+	    return mid;
+	} else if (cmp < 0) {
+	    hi = mid;
+	} else {
+	    lo = mid + 1;
 	}
     }
+
+    *pFound = false;
+    return lo;
 }
 
-#ifdef USE_READLINE
-char *CompleteCommand(const char *prefix, int state)
+static WatchedMailbox *Watch_AddMailbox(const String *path)
 {
-    static int curIndex;
-    int prelen = strlen(prefix);
+    bool found;
+    int ix = FindWatchedMailbox(path, &found);
 
-    if (state == 0)
-	curIndex = -1;
+    if (found)
+	return NULL;
 
-    while (kCommandTable[++curIndex].cname != NULL) {
-	if (strncmp(prefix, kCommandTable[curIndex].cname, prelen) == 0)
-	    return strdup(kCommandTable[curIndex].cname);
-    }
+    WatchedMailbox *wm = New(WatchedMailbox);
 
-    return NULL;
+    wm->path = String_FromCString(String_CString(path), true);
+    wm->pending = true;
+    Array_InsertAt(gWatchedMailboxes, ix, wm);
+
+    return wm;
 }
-#endif
 
-bool RunCommand(Message *msg, int index, Array *args)
+static void Watch_AddDir(int ifd, const String *path, bool bare,
+			 bool discover)
 {
-    // XXX: Should be more efficient
-    String *command = Array_JoinTail(args, &Str_Space, index);
+    const char *cPath = bare ? "." : String_CString(path);
+    int i, wd;
 
-    FILE *file = popen(String_CString(command), "w");
+    for (i = 0; i < Array_Count(gWatchedDirs); i++) {
+	WatchedDir *dir = Array_GetAt(gWatchedDirs, i);
 
-    if (file == NULL) {
-	perror(String_CString(command));
-	String_Free(command);
-	return false;
+	if (dir->bare == bare && String_IsEqual(dir->path, path, true)) {
+	    dir->discover |= discover;
+	    return;
+	}
     }
 
-    Stream *stream =
-	Stream_New(file, String_Clone(Array_GetAt(args, index)), false);
+    wd = inotify_add_watch(ifd, cPath, IN_MODIFY | IN_CLOSE_WRITE |
+			   IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+			   IN_DELETE);
+    if (wd == -1) {
+	Error("Could not watch %s: %s", cPath, strerror(errno));
+	return;
+    }
 
-    Stream_WriteHeaders(stream, msg->headers);
-    Stream_WriteNewline(stream);
-    Stream_WriteString(stream, Message_Body(msg));
+    WatchedDir *dir = New(WatchedDir);
 
-    Stream_Free(stream, false);
+    dir->wd = wd;
+    dir->path = String_FromCString(String_CString(path), true);
+    dir->bare = bare;
+    dir->discover = discover;
+    Array_Append(gWatchedDirs, dir);
+}
 
-    if (pclose(file) != 0) {
-	perror(String_CString(command));
-	String_Free(command);
-	return false;
-    }
+// Would a new file by this name be a mailbox (and not a lock file or
+// something else we or others leave behind)?
+//
+static bool IsMailboxName(const char *name)
+{
+    String *str = String_FromCString(name, false);
+    bool result = name[0] != '.' &&
+	!String_HasSuffix(str, &Str_DotLock, true) &&
+	!String_HasSuffix(str, &Str_UndoSuffix, true) &&
+	name[strlen(name) - 1] != '~';
 
-    String_Free(command);
-    return true;
+    String_Free(str);
+
+    return result;
 }
 
-void RunLoop(Mailbox *mbox, Array *commands)
+static bool DigestFileRange(int fd, off_t offset, int length,
+			    md5_byte_t digest[16])
 {
-    jmp_buf reentry;
-    int msgCount;
-    int cmdCount = Array_Count(commands);
-    const String *cmdLine;
-    int cur = 1;
-    int ci = 0;
-    bool done = false;
-    bool success;
+    char buf[kWatch_MarkLength];
+    md5_state_t md5state;
+
+    if (length > sizeof(buf) || pread(fd, buf, length, offset) != length)
+	return false;
+
+    md5_init(&md5state);
+    md5_append(&md5state, (md5_byte_t *) buf, length);
+    md5_finish(&md5state, digest);
+
+    return true;
+}
 
-    InitCommandTable(kCommandTable);
-#ifdef USE_READLINE
-    rl_completion_entry_function = CompleteCommand;
-#endif
+// Check whatever's been added to the mailbox since we last looked
+//
+static void Watch_Check(WatchedMailbox *wm)
+{
+    const char *cPath = String_CString(wm->path);
+    struct stat sbuf;
+    md5_byte_t digest[16];
+    int fd;
 
-    while (!done) {
-	setjmp(reentry);
-	gInterruptReentry = &reentry;
+    wm->pending = false;
+    wm->checked = time(NULL);
 
-	if (ci < cmdCount) {
-	    cmdLine = Array_GetAt(commands, ci++);
-	} else if (!gInteractive || !User_AskLine("@", &cmdLine, true)) {
-	    break;
-	}
+    if (stat(cPath, &sbuf) != 0) {
+	wm->state = kWatch_Missing;
+	return;
+    }
 
-	Array *args = String_Split(cmdLine, ' ', true);
+    // Someone's busy with it -- try again later
+    //
+    String *lockFile = String_Append(wm->path, &Str_DotLock, NULL);
+    bool locked = access(String_CString(lockFile), F_OK) == 0;
 
-	// Update message count each time around in case
-	// the mailbox has been modified
-	//
-	msgCount = Mailbox_Count(mbox);
+    String_Free(lockFile);
+    if (locked) {
+	wm->pending = true;
+	return;
+    }
 
-	// Find matching command
-	//
-	int argi = 0;
-	const String *arg;
-	String *str;
-	CommandTable *ct;
-	Command cmd = kCmd_None;
-	MessageSet *set = NULL;
-	Message *msg;
-	int count, num;
+    if ((fd = open(cPath, O_RDONLY)) == -1) {
+	Error("Could not open %s: %s", cPath, strerror(errno));
+	wm->state = kWatch_Error;
+	return;
+    }
 
-	if (Array_Count(args) == 0) {
-	    // Default to kCmd_ShowNext
-	    cmd = kCmd_ShowNext;
+    // Start over unless the mailbox has only been appended to
+    //
+    if (sbuf.st_ino != wm->inode || sbuf.st_size < wm->verified ||
+	(wm->markLength > 0 &&
+	 (!DigestFileRange(fd, wm->markOffset, wm->markLength, digest) ||
+	  memcmp(digest, wm->mark, sizeof(digest)) != 0))) {
+	if (gVerbose && wm->verified > 0)
+	    Note("Mailbox %s was rewritten, checking it all again", cPath);
+	wm->inode = sbuf.st_ino;
+	wm->verified = 0;
+	wm->messages = 0;
+	wm->problems = 0;
+	wm->markLength = 0;
+    }
 
-	} else {
-	    arg = Array_GetAt(args, argi++);
+    off_t offset = wm->verified;
 
-	    for (ct = kCommandTable; ct->name != NULL; ct++) {
-		if (String_HasPrefix(ct->name, arg, false)) {
-		    cmd = ct->type;
-		    break;
-		}
-	    }
+    if (sbuf.st_size - offset > INT_MAX) {
+	Error("Mailbox %s is too big to check", cPath);
+	wm->state = kWatch_Error;
+	goto done;
+    }
 
-	    // If we didn't find it, assume kCmd_Show if the
-	    // first arg is numeric.
-	    //
-	    if (cmd == kCmd_None) {
-		num = String_ToMessageNumber(arg, mbox);
-		if (num > 0) {
-		    cmd = kCmd_Show;
-		    argi--;
-		}
-	    }
-	}
+    int length = sbuf.st_size - offset;
 
-	switch (cmd) {
-	  case kCmd_Show:
-	    set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
-	    if (set == NULL)
-		break;
-	    for (num = MessageSet_First(set); num != -1;
-		 num = MessageSet_Next(set, num)) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg == NULL)
-		    break;
-		ShowMessage(msg);
-		cur = num;
-	    }
-	    break;
+    if (length == 0) {
+	wm->state = wm->problems > 0 ? kWatch_Problems : kWatch_OK;
+	goto done;
+    }
 
-	  case kCmd_ShowPrevious:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    if (cur <= 1) {
-		Error("No more messages");
-		break;
-	    }
-	    msg = GetMessageByNumber(mbox, --cur);
-	    if (msg != NULL)
-		ShowMessage(msg);
-	    break;
+    String *data = String_Alloc(length);
+    char *chars = (char *) String_Chars(data);
+    int count = 0, n;
 
-	  case kCmd_ShowNext:
-	  show_next:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    if (cur >= msgCount) {
-		Error("No more messages");
-		break;
-	    }
-	    msg = GetMessageByNumber(mbox, ++cur);
-	    if (msg != NULL)
-		ShowMessage(msg);
-	    break;
+    while (count < length &&
+	   (n = pread(fd, chars + count, length - count, offset + count)) > 0)
+	count += n;
 
-	  case kCmd_Delete:
-	  case kCmd_Undelete:
-	    set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
-	    if (set == NULL)
-		break;
-	    for (num = MessageSet_First(set); num != -1;
-		 num = MessageSet_Next(set, num)) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg == NULL)
-		    break;
-		Message_SetDeleted(msg, cmd == kCmd_Delete);
-		cur = num;
-	    }
-	    break;
+    // A delivery is probably still under way if it doesn't end with a
+    // newline -- leave it for later, unless it's stayed that way for a
+    // whole interval (and so probably always will)
+    //
+    if (count < length ||
+	(chars[length - 1] != '\n' && wm->unfinished != sbuf.st_size)) {
+	String_Free(data);
+	wm->unfinished = count < length ? 0 : sbuf.st_size;
+	wm->pending = true;
+	goto done;
+    }
+    wm->unfinished = 0;
 
-	  case kCmd_DeleteAndShowNext:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    msg = GetMessageByNumber(mbox, cur);
-	    if (msg != NULL) {
-		Message_SetDeleted(msg, true);
-		goto show_next;
-	    }
-	    break;
+    Mailbox *mbox = New(Mailbox);
+    Parser parser;
+    int warnings = gWarnings;
 
-	  case kCmd_Diff: {
-	      arg = NextArg(&argi, args, true);
-	      if (arg == NULL) break;
-	      Message *msg1 =
-		  GetMessageByNumber(mbox, String_ToMessageNumber(arg, mbox));
-	      if (msg1 == NULL) break;
-	      arg = NextArg(&argi, args, true);
-	      if (arg == NULL) break;
-	      Message *msg2 =
-		  GetMessageByNumber(mbox, String_ToMessageNumber(arg, mbox));
-	      if (msg2 == NULL) break;
+    mbox->source = String_Clone(wm->path);
+    mbox->data = data;
+    mbox->count = wm->messages;
 
-	      DiffMessages(msg1, msg2);
-	      break;
-	  }
+    if (gVerbose)
+	Note("Checking %s from @%lld", cPath, (long long) offset);
 
-	  case kCmd_List:
-	    arg = NextArg(&argi, args, false);
-	    if (String_IsEqual(arg, &Str_Minus, true))
-		goto list_previous;
-	    if (String_IsEqual(arg, &Str_Plus, true))
-		goto list_next;
-	    if (arg != NULL)
-		cur = String_ToMessageNumber(arg, mbox);
-	    arg = NextArg(&argi, args, false);
-	    if (arg != NULL)
-		num = iMax(1, String_ToMessageNumber(arg, mbox) - cur);
-	    else
-		num = gPageHeight - 1;
-	    if (!NoNextArg(&argi, args))
-		break;
-	    ListMailbox(gStdOut, mbox, cur, num);
-	    break;
+    Parser_Set(&parser, data);
+    parser.offset = offset;
+    Parse_Messages(&parser, mbox);
+    CheckMailbox(mbox, gStrict, false);
 
-	  case kCmd_ListNext:
-	  list_next:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    cur = iMin(iMax(1, cur) + (gPageHeight - 1), msgCount);
-	    ListMailbox(gStdOut, mbox, cur, gPageHeight - 1);
-	    break;
+    int problems = gWarnings - warnings;
 
-	  case kCmd_ListPrevious:
-	  list_previous:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    cur = iMax(cur - (gPageHeight - 1), 1);
-	    ListMailbox(gStdOut, mbox, cur, gPageHeight - 1);
-	    break;
+    if (problems > 0)
+	Warn("Mailbox %s: %d problem%s in %d new message%s",
+	     cPath, problems, problems == 1 ? "" : "s",
+	     mbox->count - wm->messages,
+	     mbox->count - wm->messages == 1 ? "" : "s");
 
-	  case kCmd_Find:
-	    // Args are [<header>':'] <string>...
-	    arg = NextArg(&argi, args, true);
-	    if (String_HasSuffix(arg, &Str_Colon, true)) {
-		arg = String_Sub(arg, 0, String_Length(arg) - 1);
-	    } else {
-		arg = NULL;
-		argi--;
-	    }
-	    str = Array_JoinTail(args, &Str_Space, argi);
-	    FindMessages(gStdOut, mbox, arg, str);
-	    String_Free((String *) arg);
-	    String_Free(str);
-	    break;
+    wm->messages = mbox->count;
+    wm->problems += problems;
+    wm->state = wm->problems > 0 ? kWatch_Problems : kWatch_OK;
+    wm->verified = sbuf.st_size;
 
-	  case kCmd_Strict:
-	    arg = NextArg(&argi, args, false);
-	    if (!NoNextArg(&argi, args))
-		break;
-	    gStrict = TrueString(arg, !gStrict);
-	    Note("Strict checking mode is turned %s",
-		 gStrict ? "on" : "off");
-	    break;
+    wm->markLength = iMin(length, kWatch_MarkLength);
+    wm->markOffset = wm->verified - wm->markLength;
+    DigestFileRange(fd, wm->markOffset, wm->markLength, wm->mark);
 
-	  case kCmd_Check:
-	    arg = NextArg(&argi, args, false);
-	    if (!NoNextArg(&argi, args))
-		break;
-	    if (arg != NULL && String_HasPrefix(&Str_Strict, arg, false))
-		arg = &Str_True;
-	    CheckMailbox(mbox, TrueString(arg, gStrict), false);
-	    break;
+    Mailbox_Free(mbox);
 
-	  case kCmd_Repair:
-	    arg = NextArg(&argi, args, false);
-	    if (!NoNextArg(&argi, args))
-		break;
-	    if (arg != NULL && String_HasPrefix(&Str_Strict, arg, false))
-		arg = &Str_True;
-	    CheckMailbox(mbox, TrueString(arg, gStrict), true);
-	    break;
+  done:
+    close(fd);
+}
 
-	  case kCmd_Unique:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    UniqueMailbox(mbox);
-	    break;
+// Check (some of) the mailboxes that have changed.  Returns the number
+// of seconds until the next one is due, or -1 if none are.
+//
+static int Watch_CheckPending(void)
+{
+    time_t now = time(NULL);
+    int checks = 0, wait = -1;
+    int i;
 
-	  case kCmd_Join:
-	    if (argi == Array_Count(args)) {
-		Error("Missing argument");
-		break;
-	    }
-	    set = NextMessageSetArgs(&argi, args, 0, -1, msgCount);
-	    if (set == NULL)
-		break;
+    for (i = 0; i < Array_Count(gWatchedMailboxes); i++) {
+	WatchedMailbox *wm = Array_GetAt(gWatchedMailboxes, i);
+	time_t due = wm->checked + gWatchInterval;
 
-	    cur = num = MessageSet_First(set);
-	    Message *first = GetMessageByNumber(mbox, cur);
-	    if (first == NULL)
-		break;
+	if (!wm->pending)
+	    continue;
 
-	    count = 0;
-	    while ((num = MessageSet_Next(set, num)) != -1) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg != NULL) {
-		    Message_Join(first, msg);
-		    count++;
-		}
-	    }
-	    if (count == 0) {
-		Error("Please supply multiple messages to join");
-	    } else {
-		Note("Appended %d message%s onto message %s",
-		     count, count == 1 ? "" : "s",
-		     String_CString(first->tag));
+	if (due <= now && checks < kWatch_MaxChecksPerRound) {
+	    Watch_Check(wm);
+	    checks++;
+
+	    // Forget about any new ones that didn't stick around
+	    if (wm->discovered && wm->state == kWatch_Missing) {
+		if (gVerbose)
+		    Note("No longer watching %s", String_CString(wm->path));
+		Array_DeleteAt(gWatchedMailboxes, i--);
+		continue;
 	    }
-	    break;
 
-	  case kCmd_Split:
-	    set = NextMessageSetArgs(&argi, args, 0, cur, msgCount);
-	    if (set == NULL)
-		break;
-	    for (num = MessageSet_First(set); num != -1;
-		 num = MessageSet_Next(set, num)) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg != NULL) {
-		    Message_Split(msg, gInteractive);
-		    cur = num;
+	    if (!wm->pending)
+		continue;
+	    due = now + gWatchInterval;
+	}
+
+	if (wait == -1 || due - now < wait)
+	    wait = iMax(0, due - now);
+    }
+
+    return wait;
+}
+
+static void Watch_HandleEvents(int ifd)
+{
+    char buf[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int i;
+
+    while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+	const struct inotify_event *ev;
+	char *p;
+
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+	    WatchedDir *dir = NULL;
+
+	    ev = (const struct inotify_event *) p;
+
+	    // Lost track -- have a look at everything
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		for (i = 0; i < Array_Count(gWatchedMailboxes); i++) {
+		    WatchedMailbox *wm = Array_GetAt(gWatchedMailboxes, i);
+		    wm->pending = true;
 		}
+		continue;
 	    }
-	    break;
 
-	  case kCmd_Edit:
-	    arg = NextArg(&argi, args, false);
-	    num = arg != NULL ? String_ToMessageNumber(arg, mbox) : cur;
-	    if (!NoNextArg(&argi, args))
-		break;
-	    msg = GetMessageByNumber(mbox, num);
-	    if (msg != NULL) {
-		EditMessage(msg);
-		cur = num;
+	    for (i = 0; i < Array_Count(gWatchedDirs); i++) {
+		dir = Array_GetAt(gWatchedDirs, i);
+		if (dir->wd == ev->wd)
+		    break;
 	    }
-	    break;
 
-	  case kCmd_Run:
-	    // Do we have a message set arg?
-	    arg = NextArg(&argi, args, true);
-	    if (Char_IsDigit(String_CharAt(arg, 0))) {
-		set = MessageSetArg(arg, msgCount);
-	    } else {
-		argi--;
-		set = MessageSet_Make(cur, cur, NULL);
+	    if (i == Array_Count(gWatchedDirs) || ev->len == 0)
+		continue;
+
+	    String *path = dir->bare ?
+		String_FromCString(ev->name, false) :
+		String_PrintF("%s/%s", String_CString(dir->path), ev->name);
+	    bool found;
+	    int ix = FindWatchedMailbox(path, &found);
+
+	    if (found) {
+		WatchedMailbox *wm = Array_GetAt(gWatchedMailboxes, ix);
+		wm->pending = true;
+	    } else if (dir->discover && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		       !(ev->mask & IN_ISDIR) && IsMailboxName(ev->name)) {
+		WatchedMailbox *wm = Watch_AddMailbox(path);
+
+		if (gVerbose)
+		    Note("Watching new mailbox %s", String_CString(path));
+		wm->discovered = true;
 	    }
 
-	    // Make sure that we have a command
-	    NextArg(&argi, args, true);
-	    argi--;
+	    String_Free(path);
+	}
+    }
+}
 
-	    for (num = MessageSet_First(set); num != -1;
-		 num = MessageSet_Next(set, num)) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg != NULL && !RunCommand(msg, argi, args))
-		    break;
-	    }
-	    break;
+static int Watch_OpenSocket(const String *path)
+{
+    const char *cPath = String_CString(path);
+    struct sockaddr_un addr;
+    struct stat sbuf;
+    int fd;
 
-	  case kCmd_Save:
-	    set = NextMessageSetArgs(&argi, args, 1, cur, msgCount);
-	    if (set == NULL)
-		break;
-	    arg = NextArg(&argi, args, true);
-	    if (arg == NULL)
-		break;
+    if (String_Length(path) >= sizeof(addr.sun_path))
+	Fatal(EX_USAGE, "Socket path too long: %s", cPath);
 
-	    Mailbox *mbox2 = Mailbox_Open(arg, true);
-	    if (mbox2 == NULL)
-		break;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, cPath);
 
-	    count = 0;
-	    for (num = MessageSet_First(set); num != -1;
-		 num = MessageSet_Next(set, num)) {
-		msg = GetMessageByNumber(mbox, num);
-		if (msg != NULL) {
-		    Mailbox_Append(mbox2, Message_Clone(msg));
-		    cur = num;
-		    count++;
-		}
-	    }
-	    success = Mailbox_Save(mbox2, false, false);
-	    Mailbox_Free(mbox2);
-	    if (success)
-		Note("%d message%s saved to %s", count, count == 1 ? "" : "s",
-		     String_CString(arg));
-	    break;
+    // Get rid of any socket left behind by an earlier run
+    if (lstat(cPath, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode))
+	(void) unlink(cPath);
 
-	  case kCmd_Write:
-	    arg = NextArg(&argi, args, false);
-	    if (arg == NULL)
-		Mailbox_Save(mbox, false, false);
-	    else
-		Mailbox_Write(mbox, arg, false);
-	    break;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	listen(fd, 16) != 0 ||
+	fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+	Fatal(EX_OSERR, "Could not open socket %s: %s",
+	      cPath, strerror(errno));
 
-	  case kCmd_Exit:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    if (Mailbox_IsDirty(mbox))
-		Note("Leaving modified mailbox unsaved");
-	    return;
+    return fd;
+}
 
-	  case kCmd_WriteAndExit:
-	    if (!NoNextArg(&argi, args))
-		break;
-	    done = true;
-	    break;
+// Tell whoever's connecting how all the mailboxes are doing, one line
+// per mailbox:
+//
+//   <path> <tab> <state> <tab> <bytes checked> <tab> <# messages> <tab>
+//   <# problems> <tab> <time last checked>
+//
+static void Watch_ReportStatus(int sfd)
+{
+    int cfd = accept(sfd, NULL, NULL);
+    char *buf = NULL;
+    size_t size = 0, written = 0;
+    FILE *file;
+    int i;
 
-	  case kCmd_Help:
-	    ShowHelp(gStdOut, NextArg(&argi, args, false));
-	    break;
-	    
-	  case kCmd_None:
-	    Error("Unknown command: %s", String_CString(arg));
-	    break;
-	}
-	MessageSet_Free(set);
-	set = NULL;
+    if (cfd == -1)
+	return;
+
+    if ((file = open_memstream(&buf, &size)) == NULL) {
+	close(cfd);
+	return;
     }
-    gInterruptReentry = NULL;
 
-    // Autosave if needed
+    for (i = 0; i < Array_Count(gWatchedMailboxes); i++) {
+	WatchedMailbox *wm = Array_GetAt(gWatchedMailboxes, i);
+
+	fprintf(file, "%s\t%s\t%lld\t%d\t%d\t%ld\n", String_CString(wm->path),
+		wm->pending ? "pending" : kWatchStateNames[wm->state],
+		(long long) wm->verified, wm->messages, wm->problems,
+		(long) wm->checked);
+    }
+    fclose(file);
+
+    // Don't let a slow reader hold everything else up for long
     //
-    if (Mailbox_IsDirty(mbox)) {
-	if (gDryRun)
-	    Note("Dry run mode -- not autosaving modified mailbox");
-	else if (true || gAutoWrite ||
-		 (gInteractive &&
-		  User_AskYesOrNo("Save modified mailbox?", false)))
-	    Mailbox_Save(mbox, false, false);
+    fcntl(cfd, F_SETFL, O_NONBLOCK);
+    while (written < size) {
+	ssize_t n = write(cfd, buf + written, size - written);
+	struct pollfd pfd = {cfd, POLLOUT, 0};
+
+	if (n > 0)
+	    written += n;
+	else if (n == -1 && errno != EAGAIN && errno != EINTR)
+	    break;
+	else if (poll(&pfd, 1, kWatch_SocketTimeout) <= 0)
+	    break;
     }
+
+    close(cfd);
+    free(buf);
 }
 
-bool ProcessFile(String *file, Array *commands, Stream *output)
+int Watch_Run(Array *files, Array *dirs, Array *commands)
 {
-    Mailbox *mbox = Mailbox_Open(file, false);
-    
-    if (mbox == NULL)
-	return false;
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int sfd = -1;
+    int i;
 
-    if (!gQuiet || (gQuiet && gVerbose)) {
-	int count = Mailbox_Count(mbox);
-	String *sizstr = String_ByteSize(String_Length(mbox->data));
-	bool oldQuiet = gQuiet;
+    if (ifd == -1)
+	Fatal(EX_OSERR, "Could not start watching: %s", strerror(errno));
 
-	gQuiet = false;
+    if (Array_Count(commands) > 0)
+	Warn("Only checking mailboxes while watching them");
 
-	Note("%s: %d message%s, %s",
-	     String_CString(file),
-	     count, count == 1 ? "" : "s", String_CString(sizstr));
+    gWatchedMailboxes = Array_New(0, (Free *) WatchedMailbox_Free);
+    gWatchedDirs = Array_New(0, (Free *) WatchedDir_Free);
 
-	String_Free(sizstr);
-	
-	gQuiet = oldQuiet;
+    for (i = 0; i < Array_Count(dirs); i++)
+	Watch_AddDir(ifd, Array_GetAt(dirs, i), false, true);
+
+    for (i = 0; i < Array_Count(files); i++) {
+	String *file = Array_GetAt(files, i);
+	int pos = String_FindLastChar(file, '/', true);
+	String *dir = pos == kString_NotFound ? String_FromCString(".", false) :
+	    String_Sub(file, 0, iMax(1, pos));
+
+	Watch_AddMailbox(file);
+	Watch_AddDir(ifd, dir, pos == kString_NotFound, false);
+	String_Free(dir);
     }
 
-    if (gInteractive || Array_Count(commands) > 0)
-	RunLoop(mbox, commands);
+    if (gWatchSocket != NULL)
+	sfd = Watch_OpenSocket(gWatchSocket);
 
-    if (output != NULL)
-	Stream_WriteMailbox(output, mbox, true);
+    if (gVerbose)
+	Note("Watching %d mailbox%s in %d director%s",
+	     Array_Count(gWatchedMailboxes),
+	     Array_Count(gWatchedMailboxes) == 1 ? "" : "es",
+	     Array_Count(gWatchedDirs),
+	     Array_Count(gWatchedDirs) == 1 ? "y" : "ies");
 
-    Mailbox_Free(mbox);
-    String_Free(file);
+    for (;;) {
+	int wait = Watch_CheckPending();
+	struct pollfd fds[2] = {{ifd, POLLIN, 0}, {sfd, POLLIN, 0}};
 
-    return true;
+	fflush(stdout);
+
+	if (poll(fds, sfd == -1 ? 1 : 2, wait < 0 ? -1 : wait * 1000) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    Fatal(EX_OSERR, "Could not wait for changes: %s",
+		  strerror(errno));
+	}
+
+	if (fds[0].revents & POLLIN)
+	    Watch_HandleEvents(ifd);
+	if (sfd != -1 && (fds[1].revents & POLLIN))
+	    Watch_ReportStatus(sfd);
+    }
+}
+
+#else
+
+int Watch_Run(Array *files, Array *dirs, Array *commands)
+{
+    Fatal(EX_UNAVAILABLE, "Watching mailboxes is only supported on Linux");
+    return EX_UNAVAILABLE;
 }
 
+#endif
+
 void Usage(const char *pname, bool help)
 {
     const char *p = strrchr(pname, '/');
     if (p != NULL)
 	pname = p + 1;
 
-    fprintf(stderr, "Usage: %s [-acdfhinopqruvxN] <mbox> ...\n", pname);
+    fprintf(stderr, "Usage: %s [-acdfhinopqruvxXN] <mbox> ...\n", pname);
 
     if (help) {
 	fprintf(stderr, "\n%s is a mailbox file checking tool.  It will allow "
@@ -5757,9 +14253,49 @@ void Usage(const char *pname, bool help)
 		"  -v \t\tbe verbose and print out more progress information\n"
 		"  -w \t\tautomatically write any changes when exiting\n"
 		"  -x \t\tlock the mbox file before opening it\n"
+		"  -X \t\tlike -x, but only hold the lock while saving changes\n"
 		"  -C \t\tshow a few lines of context around parse errors\n"
 		"  -N \t\tdon't try to mmap the mbox file\n"
-		"  -V \t\tprint out %s version information and then exit\n",
+		"  -V \t\tprint out %s version information and then exit\n"
+		"  --burst=DIR \twrite each message to a file of its own under "
+		"DIR\n"
+		"  --burst-names=number|id\n\t\tname them by number or by "
+		"Message-ID hash\n"
+		"  --burst-unescape turn \">From \" lines back into \"From \" "
+		"lines\n"
+		"  --export=DIR \twrite the metadata of all messages to "
+		"columnar files in DIR\n"
+		"  --extdiff \tuse diff(1) to compare messages\n"
+		"  --filter \ttidy up a single message from stdin to stdout\n"
+		"  --keep-last=N \tcut all but the last N messages from each "
+		"mbox\n"
+		"  --max-memory=SIZE\n\t\tkeep within SIZE bytes (or K, M, "
+		"G) of memory\n"
+		"  --merge[=unique]\n\t\tmerge the mboxes into the -o file by "
+		"date (and drop dups)\n"
+		"  --mime \tcheck that MIME messages are well formed and validly "
+		"encoded\n"
+		"  --older-than=AGE\n\t\tcut the leading messages older than "
+		"AGE (90d, 4w, 6m, 1y or\n\t\tYYYY-MM-DD) from each mbox\n"
+		"  --progress[=FILE]\n\t\tshow how far along reading and "
+		"writing each mbox is\n"
+		"  --salvage \tskip over damaged parts of the mbox and recover "
+		"the rest\n"
+		"  --scrub \tverify each mbox against checksums kept from the "
+		"last scrub\n"
+		"  --shard=year|month|size:SIZE|count:N\n\t\tsplit each mbox "
+		"into mbox.<year>, mbox.001, etc.\n"
+		"  --stats[=json]\tsummarize senders, lists, types & sizes of "
+		"all mboxes\n"
+		"  --strip-attachments=SIZE\n\t\treplace attachments bigger than "
+		"SIZE with a short note\n"
+		"  --sync \tsync each saved mbox to disk before moving on\n"
+		"  --sync=batch[:N] sync saved mboxes to disk in batches of N\n"
+		"  --watch \tkeep running and check mail as it's appended\n"
+		"  --watch-interval=SECS\n\t\tcheck a changed mbox at most every "
+		"SECS seconds\n"
+		"  --watch-socket=PATH\n\t\treport status to anyone "
+		"connecting to socket PATH\n",
 		pname);
 	fprintf(stderr, "\nIf given no options, %s will simply to try read "
 		"the given mbox files\nand then quit. ", pname);
@@ -5797,14 +14333,26 @@ String *NextMainArg(int *pAC, int argc, char **argv)
 
 void Exit(int ret)
 {
+    // Never take our caller (or the thread that's waiting for us) down
+    // with us -- give up on the call instead
+    //
+    if (gFatalReentry != NULL)
+	longjmp(*gFatalReentry, ret);
+
+#ifdef MFCK_LIBRARY
+    abort();
+#else
+    // Whatever's been saved so far should stick
+    (void) Mailbox_CommitSaves(true);
     Mailbox_UnlockAll();
     exit(ret);
+#endif
 }
 
-// Add all "unhidden" files at or below path to the given array.
-// Returns # of errors.
+// Add all "unhidden" files at or below path to the given array (and
+// any directories scanned to dirs, unless NULL).  Returns # of errors.
 //
-int AddFiles(Array *files, String *path)
+int AddFiles(Array *files, Array *dirs, String *path)
 {
     const char *cPath = String_CString(path);
     struct stat sbuf;
@@ -5830,12 +14378,15 @@ int AddFiles(Array *files, String *path)
 		continue;
 
 	    // XXX: Will leak strings here...
-	    errors +=
-		AddFiles(files, String_PrintF("%s/%s", cPath, de->d_name));
+	    errors += AddFiles(files, dirs,
+			       String_PrintF("%s/%s", cPath, de->d_name));
 	}
 
 	closedir(dir);
 
+	if (dirs != NULL)
+	    Array_Append(dirs, path);
+
     } else {
 	Array_Append(files, path);
     }
@@ -5843,6 +14394,159 @@ int AddFiles(Array *files, String *path)
     return errors;
 }
 
+/**
+ **  Library Interface
+ **
+ **  See mfck.h.  Any warnings and errors end up in the context rather
+ **  than being printed, and fatal errors make the call fail rather than
+ **  exit.  (Whatever was allocated for the call is leaked then, but
+ **  fatal errors are rare -- mostly running out of memory.)
+ **/
+
+#ifdef MFCK_LIBRARY
+
+MfckContext *Mfck_NewContext(void)
+{
+    MfckContext *ctx = New(MfckContext);
+
+    ctx->expectEnvelope = true;
+    ctx->problems = Array_New(0, (Free *) String_Free);
+
+    return ctx;
+}
+
+void Mfck_FreeContext(MfckContext *ctx)
+{
+    if (ctx != NULL) {
+	Array_Free(ctx->problems);
+	String_Free(ctx->error);
+	xfree(ctx);
+    }
+}
+
+void Mfck_SetStrict(MfckContext *ctx, int strict)
+{
+    ctx->strict = strict != 0;
+}
+
+void Mfck_SetCheckMIME(MfckContext *ctx, int check)
+{
+    ctx->checkMIME = check != 0;
+}
+
+void Mfck_SetExpectEnvelope(MfckContext *ctx, int expect)
+{
+    ctx->expectEnvelope = expect != 0;
+}
+
+static MfckResult Context_CheckMessage(MfckContext *ctx,
+				       const char *data, size_t length,
+				       char **pRepaired, size_t *pLength)
+{
+    MfckContext *savedContext = gContext;
+    jmp_buf *savedReentry = gFatalReentry;
+    jmp_buf reentry;
+    volatile MfckResult result = kMfck_Error;
+
+    Array_Reset(ctx->problems);
+    String_FreeP(&ctx->error);
+
+    if (length > INT_MAX) {
+	ctx->error = String_FromCString("Message too big", true);
+	return kMfck_Error;
+    }
+
+    gContext = ctx;
+    gFatalReentry = &reentry;
+    gStrict = ctx->strict;
+    gCheckMIME = ctx->checkMIME;
+    gExpectEnvelope = ctx->expectEnvelope;
+    gQuiet = false;
+    gWarnings = 0;
+
+    if (setjmp(reentry) == 0) {
+	String *str = String_New(kString_Shared, data, length);
+	Mailbox *mbox = New(Mailbox);
+	Message *msg = NULL;
+	Parser parser;
+
+	mbox->data = str;
+	Parser_Set(&parser, str);
+
+	if (!Parse_Message(&parser, mbox, true, &msg)) {
+	    if (ctx->error == NULL)
+		ctx->error = String_FromCString("Could not parse message",
+						 true);
+	    result = kMfck_Invalid;
+	} else {
+	    mbox->root = msg;
+	    CheckMailbox(mbox, ctx->strict, pRepaired != NULL);
+
+	    if (pRepaired != NULL) {
+		String *text = Message_Render(msg);
+		int len = String_Length(text);
+
+		if ((*pRepaired = malloc(len + 1)) == NULL)
+		    Fatal(EX_OSERR, "Out of memory");
+		memcpy(*pRepaired, String_Chars(text), len);
+		(*pRepaired)[len] = '\0';
+		*pLength = len;
+		String_Free(text);
+	    }
+
+	    result = gWarnings > 0 ? kMfck_Problems : kMfck_OK;
+	}
+
+	Mailbox_Free(mbox);
+    }
+
+    gContext = savedContext;
+    gFatalReentry = savedReentry;
+
+    return result;
+}
+
+MfckResult Mfck_ValidateMessage(MfckContext *ctx,
+				const char *data, size_t length)
+{
+    return Context_CheckMessage(ctx, data, length, NULL, NULL);
+}
+
+MfckResult Mfck_RepairMessage(MfckContext *ctx,
+			      const char *data, size_t length,
+			      char **pRepaired, size_t *pLength)
+{
+    *pRepaired = NULL;
+    *pLength = 0;
+
+    return Context_CheckMessage(ctx, data, length, pRepaired, pLength);
+}
+
+int Mfck_ProblemCount(const MfckContext *ctx)
+{
+    return Array_Count(ctx->problems);
+}
+
+const char *Mfck_Problem(const MfckContext *ctx, int index)
+{
+    if (index < 0 || index >= Array_Count(ctx->problems))
+	return NULL;
+
+    return String_CString(Array_GetAt(ctx->problems, index));
+}
+
+const char *Mfck_Error(const MfckContext *ctx)
+{
+    return String_CString(ctx->error);
+}
+
+const char *Mfck_Version(void)
+{
+    return gVersion;
+}
+
+#else
+
 int main(int argc, char **argv)
 {
     gLockedMailboxes = Array_New(0, (Free *) String_Free);
@@ -5851,6 +14555,9 @@ int main(int argc, char **argv)
     Stream *output = NULL;
     Array *commands = Array_New(0, (Free *) String_Free);
     Array *files = Array_New(0, (Free *) String_Free);
+    Array *dirs = Array_New(0, NULL);
+    const char *progressFile = NULL;	// --progress to a file rather than tty
+    bool progress = false;
     int errors = 0;
     int ac, i;
 
@@ -5892,6 +14599,94 @@ int main(int argc, char **argv)
 #endif
 	    if (strcmp(opt, "nomap") == 0) {
 		gMap = false;
+	    } else if (strcmp(opt, "noinplace") == 0) {
+		gInPlace = false;
+	    } else if (strcmp(opt, "salvage") == 0) {
+		gSalvage = true;
+	    } else if (strcmp(opt, "scrub") == 0) {
+		gScrub = true;
+	    } else if (strcmp(opt, "progress") == 0) {
+		progress = true;
+	    } else if (strncmp(opt, "progress=", 9) == 0 && opt[9] != '\0') {
+		progress = true;
+		progressFile = opt + 9;
+	    } else if (strncmp(opt, "burst=", 6) == 0 && opt[6] != '\0') {
+		gBurstDir = String_FromCString(opt + 6, false);
+	    } else if (strcmp(opt, "burst-names=number") == 0) {
+		gBurstNames = kBurst_Number;
+	    } else if (strcmp(opt, "burst-names=id") == 0) {
+		gBurstNames = kBurst_ID;
+	    } else if (strcmp(opt, "burst-unescape") == 0) {
+		gBurstUnescape = true;
+	    } else if (strncmp(opt, "export=", 7) == 0 && opt[7] != '\0') {
+		gExportDir = String_FromCString(opt + 7, false);
+	    } else if (strcmp(opt, "extdiff") == 0) {
+		gExternalDiff = true;
+	    } else if (strncmp(opt, "keep-last=", 10) == 0) {
+		gKeepLast = atoi(opt + 10);
+		if (gKeepLast < 1)
+		    Usage(argv[0], false);
+	    } else if (strncmp(opt, "older-than=", 11) == 0) {
+		if (!ParseCutoffTime(opt + 11, &gOlderThan))
+		    Usage(argv[0], false);
+	    } else if (strcmp(opt, "mime") == 0) {
+		gCheckMIME = true;
+	    } else if (strcmp(opt, "merge") == 0) {
+		gMerge = kMerge_Date;
+	    } else if (strcmp(opt, "merge=unique") == 0) {
+		gMerge = kMerge_Unique;
+	    } else if (strcmp(opt, "filter") == 0) {
+		gFilter = true;
+	    } else if (strcmp(opt, "watch") == 0) {
+		gWatch = true;
+	    } else if (strncmp(opt, "watch-interval=", 15) == 0) {
+		gWatchInterval = atoi(opt + 15);
+		if (gWatchInterval < 0)
+		    Usage(argv[0], false);
+	    } else if (strncmp(opt, "watch-socket=", 13) == 0) {
+		gWatchSocket = String_FromCString(opt + 13, false);
+	    } else if (strcmp(opt, "sync") == 0 ||
+		       strcmp(opt, "sync=each") == 0) {
+		gSync = kSync_Each;
+	    } else if (strcmp(opt, "sync=batch") == 0) {
+		gSync = kSync_Batch;
+	    } else if (strncmp(opt, "sync=batch:", 11) == 0) {
+		gSync = kSync_Batch;
+		gSyncBatchSize = atoi(opt + 11);
+		if (gSyncBatchSize < 1)
+		    Usage(argv[0], false);
+	    } else if (strncmp(opt, "max-memory=", 11) == 0) {
+		String *arg = String_FromCString(opt + 11, false);
+		gMaxMemory = String_ToByteSize(arg, 0);
+		if (gMaxMemory == 0)
+		    Usage(argv[0], false);
+		String_Free(arg);
+	    } else if (strcmp(opt, "shard=year") == 0) {
+		gShard = kShard_Year;
+	    } else if (strcmp(opt, "shard=month") == 0) {
+		gShard = kShard_Month;
+	    } else if (strncmp(opt, "shard=size:", 11) == 0) {
+		String *arg = String_FromCString(opt + 11, false);
+		gShard = kShard_Size;
+		gShardLimit = String_ToByteSize(arg, 0);
+		if (gShardLimit <= 0)
+		    Usage(argv[0], false);
+		String_Free(arg);
+	    } else if (strncmp(opt, "shard=count:", 12) == 0) {
+		gShard = kShard_Count;
+		gShardLimit = atoi(opt + 12);
+		if (gShardLimit < 1)
+		    Usage(argv[0], false);
+	    } else if (strncmp(opt, "strip-attachments=", 18) == 0) {
+		String *arg = String_FromCString(opt + 18, false);
+		gStripSize = String_ToByteSize(arg, 0);
+		if (gStripSize <= 0)
+		    Usage(argv[0], false);
+		String_Free(arg);
+	    } else if (strcmp(opt, "stats") == 0) {
+		gStats = kStats_Text;
+	    } else if (strcmp(opt, "stats=json") == 0) {
+		gStats = kStats_JSON;
 	    } else if (strcmp(opt, "verbose") == 0) {
 		gVerbose = true;
 	    } else if (strcmp(opt, "help") == 0) {
@@ -5915,7 +14710,8 @@ int main(int argc, char **argv)
 		  case 'd': gDebug = true; break;
 #endif
 		  case 'f':
-		    if (AddFiles(files, NextMainArg(&ac, argc, argv)) != 0)
+		    if (AddFiles(files, dirs,
+				 NextMainArg(&ac, argc, argv)) != 0)
 			Exit(1);
 		    break;
 		  case 'h': Usage(argv[0], true); break;
@@ -5930,6 +14726,7 @@ int main(int argc, char **argv)
 		  case 'v': gVerbose = true; break;
 		  case 'w': gAutoWrite = true; break;
 		  case 'x': gLock = true; break;
+		  case 'X': gLock = gLateLock = true; break;
 		  case 'C': gShowContext = true; break;
 		    //case 'L': gWantContentLength = true; break;
 		  case 'N': gMap = false; break;
@@ -5941,6 +14738,87 @@ int main(int argc, char **argv)
 	}
     }
 
+    // Sharding is all we'll do with the mailboxes
+    if (gShard != kShard_None &&
+	(gInteractive || gWatch || outFile != NULL ||
+	 Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--shard can't be combined with other commands, "
+	      "-i, -o or --watch");
+
+    // Stripping is all we'll do with the mailboxes
+    if (gStripSize > 0 &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || gStats != kStats_None || gOlderThan != 0 ||
+	 gKeepLast > 0 || Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--strip-attachments can't be combined with other "
+	      "commands, -i, -o, --merge, --shard, --stats, --older-than, "
+	      "--keep-last or --watch");
+
+    // Bursting is all we'll do with the mailboxes
+    if (gBurstDir != NULL &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || gStats != kStats_None || gOlderThan != 0 ||
+	 gKeepLast > 0 || gStripSize > 0 || gScrub ||
+	 Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--burst can't be combined with other commands, "
+	      "-i, -o, --merge, --shard, --stats, --older-than, --keep-last, "
+	      "--strip-attachments, --scrub or --watch");
+
+    // Exporting is all we'll do with the mailboxes
+    if (gExportDir != NULL &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || gStats != kStats_None || gOlderThan != 0 ||
+	 gKeepLast > 0 || gStripSize > 0 || gScrub || gBurstDir != NULL ||
+	 progress || Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--export can't be combined with other commands, "
+	      "-i, -o, --burst, --merge, --shard, --stats, --older-than, "
+	      "--keep-last, --strip-attachments, --scrub, --progress or "
+	      "--watch");
+
+    // Scrubbing is all we'll do with the mailboxes
+    if (gScrub &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || gStats != kStats_None || gOlderThan != 0 ||
+	 gKeepLast > 0 || gStripSize > 0 || Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--scrub can't be combined with other commands, "
+	      "-i, -o, --merge, --shard, --stats, --older-than, --keep-last, "
+	      "--strip-attachments or --watch");
+
+    // Expiring is all we'll do with the mailboxes
+    if ((gOlderThan != 0 || gKeepLast > 0) &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--older-than and --keep-last can't be combined with "
+	      "other commands, -i, -o, --merge, --shard or --watch");
+
+    // Statistics are all we'll do with the mailboxes
+    if (gStats != kStats_None &&
+	(gInteractive || gWatch || outFile != NULL || gShard != kShard_None ||
+	 gMerge != kMerge_None || gOlderThan != 0 || gKeepLast > 0 ||
+	 Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--stats can't be combined with other commands, "
+	      "-i, -o, --merge, --shard, --older-than, --keep-last or --watch");
+
+    // Merging only makes sense with somewhere to put the result
+    if (gMerge != kMerge_None &&
+	(outFile == NULL || gShard != kShard_None || gInteractive ||
+	 gWatch || Array_Count(commands) > 0))
+	Fatal(EX_USAGE, "--merge needs -o and can't be combined with other "
+	      "commands, -i, --shard or --watch");
+
+    // The interactive & watching loaders keep their own pace
+    if (progress && (gInteractive || gWatch || gFilter))
+	Fatal(EX_USAGE, "--progress can't be combined with -i, --filter "
+	      "or --watch");
+
+    // Filtering needs nothing more
+    if (gFilter)
+	return Filter_Run();
+
+    if (progress && !Progress_Init(progressFile))
+	Fatal(EX_CANTCREAT, "Could not report progress to %s: %s",
+	      progressFile, strerror(errno));
+
     /* Figure out the terminal window size
      */
     struct winsize ws;
@@ -5963,7 +14841,8 @@ int main(int argc, char **argv)
     // The rest should all be mbox files (or directories thereof)
     if (ac < argc) {
 	for (; ac < argc; ac++) {
-	    errors += AddFiles(files, String_FromCString(argv[ac], false));
+	    errors += AddFiles(files, dirs,
+			       String_FromCString(argv[ac], false));
 	}
 
 	// Default to the user's inbox if no explicit files were given
@@ -5978,29 +14857,54 @@ int main(int argc, char **argv)
 	    mailFile = String_PrintF(kDefaultInboxFormat, getenv("LOGNAME"));
 	}
 
-	errors += AddFiles(files, mailFile);
+	errors += AddFiles(files, dirs, mailFile);
     }
 
-    // Process the mbox files
-    for (i = 0; i < Array_Count(files); i++) {
-	if (!ProcessFile(Array_GetAt(files, i), commands, output))
-	    errors++;
+    // Keep an eye on them instead?
+    if (gWatch)
+	return Watch_Run(files, dirs, commands);
 
-	if (gQuiet && gVerbose && gWarnings > 0) {
-	    gQuiet = false;
-	    Warn("%d warning%s issued",
-		 gWarnings, gWarnings == 1 ? " was" : "s were");
-	    gWarnings = 0;
-	    gQuiet = true;
+    // Merge the mbox files, tally them up, or process them one by one
+    if (gMerge != kMerge_None) {
+	if (!MergeFiles(files, output))
+	    errors++;
+    } else if (gStats != kStats_None) {
+	if (!StatsFiles(files))
+	    errors++;
+    } else if (gExportDir != NULL) {
+	if (!ExportFiles(files))
+	    errors++;
+    } else {
+	for (i = 0; i < Array_Count(files); i++) {
+	    if (!ProcessFile(Array_GetAt(files, i), commands, output))
+		errors++;
+
+	    if (gQuiet && gVerbose && gWarnings > 0) {
+		gQuiet = false;
+		Warn("%d warning%s issued",
+		     gWarnings, gWarnings == 1 ? " was" : "s were");
+		gWarnings = 0;
+		gQuiet = true;
+	    }
 	}
     }
 
-    if (output != NULL)
+    if (!Mailbox_CommitSaves(true))
+	errors++;
+
+    if (output != NULL) {
+	if (gSync != kSync_None &&
+	    (fflush(output->file) != 0 || fsync(fileno(output->file)) != 0))
+	    Fatal(EX_IOERR, "Could not sync %s: %s",
+		  String_CString(output->name), strerror(errno));
 	Stream_Free(output, true);
+    }
 
     return errors;
 }
 
+#endif
+
 #ifdef DEBUG
 const char *s(String *str)
 {
@@ -0,0 +1,74 @@
+/*
+**  mfck.h -- Checking messages from within other programs
+**
+**  Copyright (c) 2008-2019 by Lennart Lovstrand <mfck@lenlolabs.com>
+**
+**  Build libmfck.a or libmfck.so with "make lib" and link against it
+**  to check (or repair) messages the same way "mfck -c" would, without
+**  having to run mfck for each one.  Contexts may be used from any
+**  number of threads, as long as each context is only used by one
+**  thread at a time.
+*/
+
+#ifndef MFCK_H
+#define MFCK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __GNUC__
+#  define MFCK_API	__attribute__ ((visibility ("default")))
+#else
+#  define MFCK_API
+#endif
+
+typedef struct _MfckContext MfckContext;
+
+typedef enum {
+    kMfck_OK = 0,		// No problems found
+    kMfck_Problems,		// Problems found (see Mfck_Problem)
+    kMfck_Invalid,		// Not a message at all
+    kMfck_Error,		// Couldn't check it (see Mfck_Error)
+} MfckResult;
+
+// Contexts hold the settings for checking messages along with the
+// results of the last check
+//
+MFCK_API MfckContext *Mfck_NewContext(void);
+MFCK_API void Mfck_FreeContext(MfckContext *ctx);
+
+// Report more indiscretions (like mfck -s)
+MFCK_API void Mfck_SetStrict(MfckContext *ctx, int strict);
+// Messages start with a "From " line (the default)
+MFCK_API void Mfck_SetExpectEnvelope(MfckContext *ctx, int expect);
+// Check that multipart messages are well formed (like mfck --mime)
+MFCK_API void Mfck_SetCheckMIME(MfckContext *ctx, int check);
+
+// Check a single message.  All of data is taken to be the message.
+//
+MFCK_API MfckResult Mfck_ValidateMessage(MfckContext *ctx,
+					 const char *data, size_t length);
+
+// Check a single message and return a repaired copy of it, which is
+// to be freed by the caller using free().
+//
+MFCK_API MfckResult Mfck_RepairMessage(MfckContext *ctx,
+				       const char *data, size_t length,
+				       char **pRepaired, size_t *pLength);
+
+// What the last check found
+//
+MFCK_API int Mfck_ProblemCount(const MfckContext *ctx);
+MFCK_API const char *Mfck_Problem(const MfckContext *ctx, int index);
+MFCK_API const char *Mfck_Error(const MfckContext *ctx);
+
+MFCK_API const char *Mfck_Version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MFCK_H */